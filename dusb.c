@@ -13,30 +13,753 @@
 #include "hw/usb.h"
 #include "../desc.h"
 #include "qapi/error.h"
+#include "qapi/visitor.h"
+#include "chardev/char-fe.h"
 #include "qemu/module.h"
 #include "hw/qdev-properties.h"
+#include "migration/vmstate.h"
 #include "qom/object.h"
 #include "qemu/log.h"
 #include "qemu/queue.h"
 #include "qemu/timer.h"
+#include "qemu/bitops.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "qemu/iov.h"
+#include "qemu/crc32c.h"
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "crypto/hash.h"
+#include <zlib.h>
 
 #define TYPE_USB_DUSB "usb-dusb"
 
+/* NCM-style NTB16 framing used by the EP3 aggregation mode */
+#define DUSB_NTH16_SIGN         0x484D434E /* "NCMH" */
+#define DUSB_NDP16_SIGN         0x304D434E /* "NCM0" */
+#define DUSB_NTH16_LEN          12
+#define DUSB_NDP16_LEN          8          /* Header only, entries follow */
+#define DUSB_NTB_ALIGN          4
+#define DUSB_AGG_MAX_NTB        65535      /* wBlockLength is 16 bits */
+#define DUSB_AGG_MAX_DATAGRAMS  256
+
+/* UVC payload header (UVC 1.5, 2.4.3.3) used by the video mode, with PTS and SCR */
+#define DUSB_UVC_HDR_LEN        12
+#define DUSB_UVC_FID            0x01       /* Frame ID, toggles at every frame */
+#define DUSB_UVC_EOF            0x02       /* Last payload of a frame */
+#define DUSB_UVC_PTS            0x04
+#define DUSB_UVC_SCR            0x08
+#define DUSB_UVC_EOH            0x80
+#define DUSB_VIDEO_QUEUE        2          /* Frames buffered: one being sent, one waiting */
+
+/* Command/response engine on EP3 OUT/IN, in alternate setting 2 of the first function */
+#define DUSB_ALT_CMD            2
+#define DUSB_CMD_NOP            0          /* Empty response */
+#define DUSB_CMD_READ           1          /* Response carries len bytes of the EP3 IN pattern */
+#define DUSB_CMD_WRITE          2          /* Command carries len bytes, response returns their CRC32C */
+#define DUSB_CMD_CRC32C         3          /* Offloaded: value is the CRC32C of the data */
+#define DUSB_CMD_SHA256         4          /* Offloaded: response carries the SHA-256 digest of the data */
+#define DUSB_CMD_COMPRESS       5          /* Offloaded: response carries the data deflated, value its length */
+#define DUSB_CMD_NUM            6
+#define DUSB_CMD_OK             0
+#define DUSB_CMD_BAD_OPCODE     1
+#define DUSB_CMD_BAD_LENGTH     2
+#define DUSB_CMD_FAILED         3          /* The computation failed or its result does not fit */
+#define DUSB_CMD_ABORTED        4          /* Result lost to a migration */
+#define DUSB_SHA256_LEN         32
+#define DUSB_CMD_MAX_DEPTH      64         /* Commands outstanding, responses not yet read included */
+#define DUSB_CMD_MAX_WORKERS    16
+
+/* Data endpoints EP1 (interrupt), EP2 (isochronous), EP3 (bulk) per direction */
+#define DUSB_NUM_EPS            3
+/* Composite mode: function f owns interface f and endpoints 3f+1 to 3f+3, same types */
+#define DUSB_MAX_FUNCS          5
+#define DUSB_MAX_EPS            (DUSB_NUM_EPS * DUSB_MAX_FUNCS)
+#define DUSB_MAX_PAYLOAD        (64 * KiB)
+
+/* Payload patterns produced by the generators and checked by the verifiers */
+#define DUSB_PATTERN_LEGACY     0 /* Original per-endpoint formulas, no header */
+#define DUSB_LEGACY_MAX_PAYLOAD 1024      /* Size of the in_data buffers behind legacy IN */
+#define DUSB_PATTERN_ZERO       1 /* Header followed by zero bytes */
+#define DUSB_PATTERN_COUNT      2 /* Header followed by (seq + i) % 256 */
+#define DUSB_PATTERN_PRBS       3 /* Header followed by a xorshift32 stream */
+#define DUSB_PATTERN_NUM        4
+#define DUSB_PATTERN_PERIOD     4096 /* Body of sequence n starts at table[n % period] */
+#define DUSB_PAYLOAD_HDR_LEN    16
+#define DUSB_INTERVAL_DEFAULT   UINT32_MAX /* IN period derived from in_interval */
+
+/* Vendor control requests, recipient device */
+#define DUSB_VREQ_SET_EP_CONFIG 0x01 /* OUT, wIndex = endpoint address */
+#define DUSB_VREQ_GET_EP_CONFIG 0x02 /* IN, wIndex = endpoint address */
+#define DUSB_VREQ_START         0x03 /* wIndex = endpoint address, 0 = all */
+#define DUSB_VREQ_STOP          0x04 /* wIndex = endpoint address, 0 = all */
+#define DUSB_VREQ_RESET_STATS   0x05
+#define DUSB_VREQ_GET_STATS     0x06 /* IN, DUSBVendorStats */
+#define DUSB_VREQ_CTRL_READ     0x07 /* IN, wValue = pattern, wIndex = chunk */
+#define DUSB_VREQ_CTRL_WRITE    0x08 /* OUT, wValue = pattern, wIndex = chunk */
+#define DUSB_VREQ_GET_CTRL_STATS 0x09 /* IN, DUSBVendorCtrlStats */
+#define DUSB_STATS_VERSION      1
+#define DUSB_CTRL_CHUNK_STRIDE  61   /* Pattern offset step between EP0 chunks */
+#define DUSB_CTRL_IDLE_NS       NANOSECONDS_PER_SECOND /* Longer gaps are not RTT samples */
+#define DUSB_HIST_BUCKETS       32
+#define DUSB_SWEEP_MAX_AXIS     16   /* Values per sweep dimension */
+#define DUSB_SWEEP_MAX_POINTS   256
+
+/* Process-wide timer wheel behind every DUSB timer, see dusb_wheel */
+#define DUSB_WHEEL_TICK_NS      1000 /* Deadlines are rounded up to whole ticks */
+#define DUSB_WHEEL_BITS         8
+#define DUSB_WHEEL_SLOTS        (1 << DUSB_WHEEL_BITS)
+#define DUSB_WHEEL_LEVELS       4    /* Covers 2^32 ticks, later deadlines are cascaded again */
+
+/* Control requests completed after ctrl_delay_us when selected in ctrl_delay_mask */
+#define DUSB_CTRL_DEFER_VENDOR          (1 << 0)
+#define DUSB_CTRL_DEFER_SET_INTERFACE   (1 << 1)
+#define DUSB_CTRL_DEFER_GET_DESCRIPTOR  (1 << 2)
+
+/* USB 3 FUNCTION_SUSPEND interface feature, options in the high byte of wIndex */
+#define DUSB_FEAT_FUNC_SUSPEND  0
+#define DUSB_FUNC_SUSPEND_LP    (1 << 0) /* Enter low-power suspend, clear to resume */
+#define DUSB_FUNC_SUSPEND_RW    (1 << 1) /* Function remote wake enabled */
+
+/* Faults injected into data transfers */
+#define DUSB_FAULT_STALL        0 /* Halt the endpoint until CLEAR_FEATURE(ENDPOINT_HALT) */
+#define DUSB_FAULT_BABBLE       1 /* USB_RET_BABBLE */
+#define DUSB_FAULT_IOERROR      2 /* USB_RET_IOERROR, a transaction error or timeout for the host */
+#define DUSB_FAULT_SHORT        3 /* IN only: complete with half of the payload */
+#define DUSB_FAULT_DROP         4 /* Isochronous only: the interval's payload is lost */
+#define DUSB_FAULT_NUM          5
+#define DUSB_FAULT_PPM          1000000 /* Probabilities are in parts per million */
+
 OBJECT_DECLARE_SIMPLE_TYPE(DUSBState, USB_DUSB)
 
+/* Header leading every patterned payload, little-endian on the wire */
+typedef struct QEMU_PACKED DUSBPayloadHdr {
+    uint8_t ep;                /* Endpoint address the payload belongs to */
+    uint8_t pattern;           /* DUSB_PATTERN_* of the body */
+    uint16_t flags;            /* Reserved, zero */
+    uint32_t seq;              /* Per-endpoint sequence number */
+    uint64_t timestamp;        /* Virtual time of generation in ns */
+} DUSBPayloadHdr;
+
+QEMU_BUILD_BUG_ON(sizeof(DUSBPayloadHdr) != DUSB_PAYLOAD_HDR_LEN);
+
+/* Header of a command on EP3 OUT, little-endian, followed by len data bytes for WRITE */
+typedef struct QEMU_PACKED DUSBCmdHdr {
+    uint8_t opcode;            /* DUSB_CMD_* */
+    uint8_t flags;             /* Reserved, zero */
+    uint16_t reserved;
+    uint32_t tag;              /* Echoed in the response */
+    uint32_t len;              /* READ: response bytes wanted, else data bytes following */
+    uint32_t param;            /* Reserved, zero */
+} DUSBCmdHdr;
+
+/* Header of a response on EP3 IN, followed by len data bytes */
+typedef struct QEMU_PACKED DUSBCmdResp {
+    uint8_t opcode;            /* Opcode of the command */
+    uint8_t status;            /* DUSB_CMD_OK or the reason the command was rejected */
+    uint16_t reserved;
+    uint32_t tag;              /* Tag of the command */
+    uint32_t len;              /* Data bytes following */
+    uint32_t value;            /* WRITE, CRC32C: CRC32C of the data, COMPRESS: data length, else 0 */
+    uint64_t queue_ns;         /* Virtual time waiting for a worker */
+    uint64_t cost_ns;          /* Virtual time being processed */
+} DUSBCmdResp;
+
+/* Endpoint configuration block for DUSB_VREQ_{SET,GET}_EP_CONFIG */
+typedef struct QEMU_PACKED DUSBVendorEpConfig {
+    uint32_t interval_us;      /* Generation (IN) or acceptance (OUT) period, 0 = unthrottled */
+    uint32_t size;             /* Payload bytes per transfer */
+    uint8_t pattern;           /* DUSB_PATTERN_* */
+    uint8_t running;           /* Non-zero when traffic is enabled */
+    uint16_t reserved;
+} DUSBVendorEpConfig;
+
+/* Per-endpoint entry of the DUSB_VREQ_GET_STATS block */
+typedef struct QEMU_PACKED DUSBVendorEpStats {
+    uint8_t ep;                /* Endpoint address */
+    uint8_t running;
+    uint16_t reserved;
+    uint32_t errors;           /* OUT payloads failing verification */
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t naks;
+    uint64_t lost;             /* IN: payloads replaced unread, OUT: sequence gaps */
+} DUSBVendorEpStats;
+
+/* Statistics block returned by DUSB_VREQ_GET_STATS */
+typedef struct QEMU_PACKED DUSBVendorStats {
+    uint16_t version;          /* DUSB_STATS_VERSION */
+    uint16_t num_eps;
+    uint32_t reserved;
+    uint64_t timestamp;        /* Virtual time of the snapshot in ns */
+    uint64_t elapsed;          /* ns since the counters were last reset */
+    DUSBVendorEpStats eps[2 * DUSB_NUM_EPS]; /* EP1-3 OUT, then EP1-3 IN */
+    uint64_t agg[8];           /* EP3 NTB counters, see DUSBAgg */
+} DUSBVendorStats;
+
+/* EP0 benchmark statistics returned by DUSB_VREQ_GET_CTRL_STATS */
+typedef struct QEMU_PACKED DUSBVendorCtrlStats {
+    uint64_t reads;            /* CTRL_READ requests served */
+    uint64_t writes;           /* CTRL_WRITE requests accepted */
+    uint64_t bytes;            /* Data stage bytes in both directions */
+    uint32_t errors;           /* CTRL_WRITE data stages failing verification */
+    uint32_t deferred;         /* Requests completed asynchronously */
+    uint64_t rtt_count;        /* Request-to-request interval samples */
+    uint64_t rtt_sum;          /* Sum of the samples in ns */
+    uint64_t rtt_min;
+    uint64_t rtt_max;
+    uint64_t rtt_hist[DUSB_HIST_BUCKETS];
+} DUSBVendorCtrlStats;
+
+/* One data transfer event folded into the run digest */
+typedef struct QEMU_PACKED DUSBTraceRec {
+    uint64_t time_ns;          /* Virtual time of the event */
+    uint32_t len;              /* Bytes transferred */
+    int32_t status;            /* USB_RET_* */
+    uint8_t ep;                /* Endpoint address */
+} DUSBTraceRec;
+
+/* Log2 latency histogram, bucket n counts samples in [2^n, 2^(n+1)) ns */
+typedef struct DUSBHist {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t buckets[DUSB_HIST_BUCKETS];
+} DUSBHist;
+
+/* EP0 throughput and latency benchmark state */
+typedef struct DUSBCtrlBench {
+    uint64_t reads;            /* CTRL_READ requests served */
+    uint64_t writes;           /* CTRL_WRITE requests accepted */
+    uint64_t bytes;            /* Data stage bytes in both directions */
+    uint32_t errors;           /* CTRL_WRITE data stages failing verification */
+    uint32_t deferred;         /* Requests completed asynchronously */
+    int64_t last_ns;           /* Arrival time of the previous benchmark request */
+    DUSBHist rtt;              /* Intervals between back-to-back requests */
+} DUSBCtrlBench;
+
+/* USB 3 function suspend state and resume latency of one function */
+typedef struct DUSBFuncSuspend {
+    bool suspended;            /* Engines paused by SET_FEATURE(FUNCTION_SUSPEND) */
+    bool remote_wake;          /* Host enabled function remote wake */
+    int64_t suspend_ns;        /* Start of the current suspend */
+    int64_t wake_ns;           /* Function wake requested in the current suspend, 0 if none */
+    uint64_t suspends;         /* Suspends entered */
+    uint64_t wakes;            /* Function wakes requested; wake.count of them were answered */
+    DUSBHist active;           /* Suspend to active again */
+    DUSBHist wake;             /* Function wake to active again */
+} DUSBFuncSuspend;
+
+/* A command accepted by the command engine, until its response is read */
+typedef struct DUSBCmdSlot {
+    uint8_t opcode;
+    uint8_t status;
+    uint32_t tag;
+    uint32_t len;              /* Response data bytes */
+    uint32_t value;
+    int64_t arrive_ns;
+    int64_t start_ns;          /* Taken by a worker */
+    int64_t done_ns;           /* Response ready, INT64_MAX while offloaded */
+    uint32_t job;              /* Offload job computing the response */
+    uint8_t *data;             /* Computed response data, NULL for the pattern */
+} DUSBCmdSlot;
+
+/* Command/response engine */
+typedef struct DUSBCmd {
+    bool enabled;
+    uint32_t depth;            /* Commands outstanding before EP3 OUT NAKs */
+    uint32_t workers;          /* Commands processed in parallel */
+    uint32_t cost_us[DUSB_CMD_NUM];         /* Fixed processing time per opcode */
+    uint32_t cost_ns_per_kib[DUSB_CMD_NUM]; /* Extra processing time per KiB of data */
+    DUSBCmdSlot slots[DUSB_CMD_MAX_DEPTH]; /* Outstanding commands, by completion time */
+    uint32_t count;
+    uint32_t pos;              /* Response bytes of slots[0] already sent */
+    uint8_t *head_data;        /* Migration only: computed data of a partly sent slots[0] */
+    uint32_t head_len;
+    int64_t worker_free_ns[DUSB_CMD_MAX_WORKERS];
+    /* Counters */
+    uint64_t commands;
+    uint64_t responses;
+    uint64_t rejected;         /* Commands answered with an error status */
+    uint64_t malformed;        /* OUT transfers too short for a command header */
+    uint64_t full;             /* EP3 OUT NAKs at full depth */
+    uint32_t max_outstanding;
+    DUSBHist rtt;              /* Command arrival to end of response */
+    DUSBHist queue;            /* Command arrival to start of processing */
+    /* Offloaded computations */
+    uint32_t gen;              /* Bumped by a reset, orphans the jobs in flight */
+    uint32_t jobs;             /* Jobs in the thread pool */
+    uint32_t next_job;
+    uint64_t offloaded;
+    uint64_t offload_bytes;
+    uint64_t offload_failed;
+    uint64_t late;             /* Results that came after the modelled completion */
+    DUSBHist host;             /* Host time of the computation */
+} DUSBCmd;
+
+/* Control request held back to model slow device firmware */
+typedef struct DUSBCtrlAsync {
+    USBPacket *packet;         /* Pending SETUP packet, NULL if none */
+    int request;
+    int value;
+    int index;
+    int length;
+    uint8_t *data;             /* USBDevice.data_buf, owned by the USB core */
+    int64_t due_ns;            /* Completion time of packet */
+    bool replay;               /* Migrated in flight: adopt the controller's resubmission */
+    bool mig_pending;          /* Migration: a request was deferred at save time */
+} DUSBCtrlAsync;
+
+/* Host cycles spent in one instrumented code path */
+typedef struct DUSBProf {
+    uint64_t calls;
+    uint64_t cycles;           /* cpu_get_host_ticks() units */
+    uint64_t bytes;            /* Payload bytes handled by the timed calls */
+} DUSBProf;
+
+/* Cycle accounting sites of each data endpoint */
+#define DUSB_PROF_DATA          0 /* dusb_handle_data */
+#define DUSB_PROF_PAYLOAD       1 /* IN payload generation or OUT verification */
+#define DUSB_PROF_EP_NUM        2
+
+/* Device-wide cycle accounting sites */
+#define DUSB_PROF_CONTROL       0 /* dusb_handle_control */
+#define DUSB_PROF_WAKEUP_TIMER  1
+#define DUSB_PROF_IN_TIMER      2
+#define DUSB_PROF_CTRL_TIMER    3
+#define DUSB_PROF_SWEEP_TIMER   4
+#define DUSB_PROF_AGG_TIMER     5
+#define DUSB_PROF_VIDEO_TIMER   6
+#define DUSB_PROF_DEV_NUM       7
+
+/* Virtual-clock timer dispatched by the shared wheel instead of its own QEMUTimer */
+typedef struct DUSBTimer {
+    QEMUTimerCB *cb;           /* NULL until dusb_timer_init */
+    void *opaque;
+    int64_t expire_ns;         /* Requested deadline, -1 when not pending */
+    uint64_t tick;             /* Deadline in wheel ticks, after slack rounding */
+    int level;                 /* Wheel level, -1 while queued for dispatch */
+    int slot;
+    DUSBProf *prof;            /* Where to account callback cycles, NULL if not profiling */
+    QLIST_ENTRY(DUSBTimer) node;
+} DUSBTimer;
+
+typedef QLIST_HEAD(, DUSBTimer) DUSBTimerList;
+
+/* Counters kept for each data endpoint */
+typedef struct DUSBEpStats {
+    uint64_t packets;          /* Completed transfers */
+    uint64_t bytes;            /* Payload bytes moved */
+    uint64_t naks;             /* Transfers answered with NAK */
+    uint64_t lost;             /* IN: payloads replaced unread, OUT: sequence gaps */
+    uint32_t errors;           /* OUT payloads failing verification */
+} DUSBEpStats;
+
+/* Fault injection settings and recovery measurements of one data endpoint */
+typedef struct DUSBFault {
+    uint32_t ppm[DUSB_FAULT_NUM]; /* Per-transfer probability of each fault */
+    uint32_t every;            /* Inject the scheduled fault every N transfers, 0 = off */
+    uint32_t kind;             /* DUSB_FAULT_* injected by the schedule */
+    uint32_t rng;              /* xorshift32 state for the fault draws */
+    uint32_t count;            /* Eligible transfers since the last scheduled fault */
+    int64_t pending_ns;        /* First fault not yet followed by a good transfer, 0 if none */
+    int64_t halt_ns;           /* Injected STALL awaiting CLEAR_FEATURE, 0 if none */
+    uint64_t injected[DUSB_FAULT_NUM];
+    DUSBHist recovery;         /* Fault to next successful transfer */
+    DUSBHist halt_clear;       /* Injected STALL to CLEAR_FEATURE(ENDPOINT_HALT) */
+} DUSBFault;
+
+/* Traffic engine state of one data endpoint */
+typedef struct DUSBEp {
+    uint8_t addr;              /* Endpoint address, USB_DIR_IN set for IN */
+    bool running;              /* Traffic enabled */
+    uint8_t pattern;           /* DUSB_PATTERN_* */
+    uint32_t size;             /* Payload bytes per transfer */
+    uint32_t interval_us;      /* Generation (IN) or acceptance (OUT) period */
+    uint32_t rate_bps;         /* Token bucket rate in bytes/s, 0 = unshaped */
+    uint32_t latency_us;       /* IN readiness / bulk OUT completion delay */
+    uint32_t jitter_us;        /* Uniform random extra delay on top of latency_us */
+    uint32_t rng;              /* xorshift32 state for latency jitter */
+    int64_t next_ns;           /* Next generation (IN) or acceptance (OUT) time */
+    int64_t gen_ns;            /* Generation time of the pending IN payload */
+    int64_t ready_ns;          /* Time the pending IN payload may be read */
+    int64_t tokens;            /* Shaper credit in bytes, negative while in debt */
+    int64_t tokens_ns;         /* Time of the last shaper refill */
+    int64_t wake_ns;           /* Retry notification for a NAKed transfer, 0 if none */
+    USBPacket *async_pkt;      /* Bulk OUT transfer waiting out its latency */
+    int64_t async_due_ns;      /* Completion time of async_pkt */
+    uint32_t async_len;        /* Length of async_pkt */
+    bool replay;               /* Migrated in flight: adopt the controller's resubmission */
+    int64_t queue_due_ns;      /* Pipelined IN: serve queued transfers at, INT64_MAX waits for data, 0 idle */
+    uint32_t seq;              /* Next sequence number to send or expect */
+    uint32_t avail;            /* IN payloads generated but not yet read */
+    int64_t last_ns;           /* Previous accepted OUT transfer, 0 if none */
+    DUSBEpStats stats;
+    DUSBHist lat;              /* IN: readiness to read, OUT: inter-arrival */
+    DUSBFault fault;
+    DUSBProf prof[DUSB_PROF_EP_NUM];
+    bool mig_halted;           /* Migration: halt state of the USBEndpoint */
+    bool mig_async;            /* Migration: a delayed OUT transfer was in flight at save time */
+} DUSBEp;
+
+/* Aggregation (datagram batching) state for bulk EP3 */
+typedef struct DUSBAgg {
+    bool enabled;              /* Frame EP3 transfers as NTB16 aggregates */
+    uint32_t max_size;         /* Maximum NTB length in bytes */
+    uint32_t max_datagrams;    /* Maximum datagrams packed into one NTB */
+    uint32_t timeout_us;       /* Flush timeout for a partially filled NTB */
+    uint32_t dgram_min;        /* Smallest generated datagram */
+    uint32_t dgram_max;        /* Largest generated datagram */
+    uint32_t dgram_interval_us; /* Datagram arrival period, 0 = on demand */
+    DUSBTimer timer;           /* Datagram source and flush timer */
+    uint8_t *build;            /* NTB currently being filled */
+    uint8_t *ready;            /* Sealed NTB waiting for an IN transfer */
+    uint32_t build_len;        /* Bytes used in build (NTH16 + datagrams) */
+    uint32_t ready_len;        /* Length of the sealed NTB, 0 if none */
+    uint16_t dgram_off[DUSB_AGG_MAX_DATAGRAMS]; /* Datagram offsets in build */
+    uint16_t dgram_len[DUSB_AGG_MAX_DATAGRAMS]; /* Datagram lengths in build */
+    uint32_t ndgrams;          /* Datagrams in build */
+    int64_t first_dgram_ns;    /* Arrival time of the oldest datagram in build */
+    int64_t next_dgram_ns;     /* Arrival time of the next datagram */
+    uint16_t in_seq;           /* wSequence for the next IN NTB */
+    uint32_t dgram_seq;        /* Sequence number stamped into each datagram */
+    uint32_t ready_ndgrams;    /* Datagrams in the ready NTB */
+    /* Counters */
+    uint64_t in_ntbs;
+    uint64_t in_datagrams;
+    uint64_t in_bytes;
+    uint64_t in_dropped;
+    uint64_t out_ntbs;
+    uint64_t out_datagrams;
+    uint64_t out_bytes;
+    uint64_t out_errors;
+} DUSBAgg;
+
+/* UVC-style framed video source on EP2 (isochronous) or EP3 (bulk) IN */
+typedef struct DUSBVideo {
+    uint8_t ep;                /* Endpoint number carrying video, 0 = off */
+    uint32_t frame_size;       /* Image bytes per frame */
+    uint32_t fps;              /* Frames captured per second */
+    DUSBTimer timer;           /* Frame capture clock */
+    int64_t next_ns;           /* Capture time of the next frame */
+    uint32_t queued;           /* Captured frames not yet fully sent */
+    int64_t pts_ns[DUSB_VIDEO_QUEUE]; /* Capture times of the queued frames, oldest first */
+    uint32_t pos;              /* Image bytes of the oldest frame already sent */
+    uint8_t fid;               /* Frame ID bit of the oldest frame */
+    /* Counters */
+    uint64_t frames;           /* Frames sent completely */
+    uint64_t late;             /* Frames finished after the next capture was due */
+    uint64_t dropped;          /* Frames captured while the queue was full */
+    uint64_t payloads;
+    uint64_t bytes;            /* Image bytes sent, headers excluded */
+    DUSBHist lat;              /* Capture to end of frame */
+} DUSBVideo;
+
+/* OpenMetrics exporter on metrics-chardev */
+typedef struct DUSBMetrics {
+    CharBackend chr;
+    GString *req;              /* Request received so far */
+    GString *out;              /* Response being sent, NULL if none */
+    size_t out_pos;            /* Bytes of out already written */
+    guint watch;               /* Writable watch while the peer is slow, 0 if none */
+} DUSBMetrics;
+
+/* One measured point of a parameter sweep */
+typedef struct DUSBSweepPoint {
+    uint8_t addr;              /* Endpoint under test */
+    uint32_t size;             /* IN payload size, 0 for OUT points */
+    uint32_t interval_us;      /* Endpoint period during the point */
+    int64_t elapsed_ns;        /* Measured duration */
+    DUSBEpStats stats;         /* Counter deltas over the point */
+    DUSBHist lat;              /* IN: generation to read, OUT: inter-arrival */
+} DUSBSweepPoint;
+
+/* Endpoint settings saved while a sweep owns the traffic engines */
+typedef struct DUSBSweepSaved {
+    uint32_t interval_us;
+    uint32_t size;
+    bool running;
+} DUSBSweepSaved;
+
+/* Automated parameter sweep, one endpoint configuration per dwell period */
+typedef struct DUSBSweep {
+    bool active;               /* Points are being measured */
+    bool aborted;              /* Last sweep was cancelled */
+    uint32_t dwell_ms;         /* Measurement time per point */
+    DUSBTimer timer;           /* Advances to the next point */
+    DUSBSweepPoint *points;    /* Planned points, results filled as they finish */
+    int npoints;
+    int cur;                   /* Point being measured */
+    int64_t point_ns;          /* Start of the current point */
+    DUSBEpStats base;          /* Counters at the start of the current point */
+    DUSBSweepSaved saved[2][DUSB_MAX_EPS];
+    char *spec;                /* Description of the current or last sweep */
+} DUSBSweep;
+
 /* Device state structure */
 typedef struct DUSBState {
     USBDevice dev;            /* Base USB device object */
-    uint8_t alt[1];           /* Alternate setting for interface 0 (0=OUT, 1=IN) */
-    QEMUTimer *wakeup_timer;  /* Timer for triggering remote wakeup */
-    QEMUTimer *in_timer;      /* Timer for updating IN endpoint data */
-    uint8_t in_data[3][1024]; /* Data buffers for EP1, EP2, EP3 IN */
+    uint8_t alt[DUSB_MAX_FUNCS]; /* Alternate setting per interface (0=OUT, 1=IN) */
+    DUSBFuncSuspend fsusp[DUSB_MAX_FUNCS]; /* Function suspend per interface */
+    uint8_t functions;        /* Interfaces with their own data engines */
+    bool bulk_pipeline;       /* Queue and combine bulk IN transfers */
+    char *speed;              /* Speed the device is locked to, NULL for any */
+    struct DUSBCompositeDesc *cdesc; /* Descriptors built per instance, else NULL */
+    DUSBTimer wakeup_timer;   /* Timer for triggering remote wakeup */
+    DUSBTimer in_timer;       /* Timer for IN data, NAK retries and delayed completions */
+    uint8_t in_data[3][DUSB_LEGACY_MAX_PAYLOAD]; /* Legacy pattern buffers for EP1, EP2, EP3 IN */
     int in_data_len[3];       /* Length of data in each IN buffer */
-    int current_in_ep;        /* Counter for cycling through IN endpoints */
     uint32_t wakeup_interval; /* Interval for remote wakeup in seconds */
     uint32_t in_interval;     /* Interval for IN data updates in seconds */
+    DUSBEp eps[2][DUSB_MAX_EPS]; /* Traffic engines, [0] = OUT, [1] = IN, first num_eps used */
+    const uint8_t *pattern_tab[DUSB_PATTERN_NUM]; /* References into dusb_pattern_pool */
+    int64_t stats_epoch_ns;   /* Virtual time of the last counter reset */
+    uint32_t seed;            /* Seed of the per-endpoint jitter generators */
+    uint32_t digest;          /* CRC32C over the data transfer timeline */
+    DUSBCtrlBench ctrl;       /* EP0 benchmark requests */
+    uint32_t ctrl_delay_us;   /* Completion delay for deferred control requests */
+    uint32_t ctrl_delay_mask; /* DUSB_CTRL_DEFER_* requests to defer */
+    DUSBTimer ctrl_timer;     /* Completes the deferred control request */
+    DUSBCtrlAsync ctrl_async; /* Deferred control request */
+    DUSBAgg agg;              /* EP3 datagram aggregation */
+    DUSBVideo video;          /* UVC-style framed video source */
+    DUSBCmd cmd;              /* Command/response engine */
+    DUSBSweep sweep;          /* Parameter sweep benchmark */
+    uint8_t *out_buf;         /* OUT payload scratch buffer */
+    size_t out_buf_size;
+    bool profile;             /* Cycle accounting enabled */
+    int64_t prof_ticks0;      /* Host ticks and clock when profiling started, to calibrate ticks */
+    int64_t prof_clock0;
+    DUSBProf prof[DUSB_PROF_DEV_NUM];
+    DUSBMetrics metrics;      /* OpenMetrics exporter */
+    QLIST_ENTRY(DUSBState) next; /* Entry in dusb_devices */
 } DUSBState;
 
+/*
+ * Timer wheel shared by every instance. All DUSB timers hang off one
+ * QEMUTimer, so the main loop sees a single deadline however many devices
+ * exist. Level L has 256 slots of 256^L ticks. A timer sits on the lowest
+ * level whose span covers its distance from base and moves down a level
+ * when its slot comes up, so inserting and removing cost O(1). Occupancy
+ * bitmaps let the next deadline be found without walking empty slots.
+ * Deadlines are rounded up to slack_ticks so that timers of different
+ * devices falling within the slack expire in the same batch.
+ */
+typedef struct DUSBWheel {
+    QEMUTimer *timer;          /* The QEMUTimer behind every DUSBTimer */
+    unsigned users;            /* Initialized DUSBTimers */
+    uint64_t base;             /* Last processed tick */
+    uint64_t armed;            /* Tick timer is set for, UINT64_MAX if idle */
+    bool dispatching;          /* Rearm once after the batch */
+    uint32_t slack_ticks;      /* Deadline coalescing granularity */
+    DUSBTimerList slots[DUSB_WHEEL_LEVELS][DUSB_WHEEL_SLOTS];
+    unsigned long occupied[DUSB_WHEEL_LEVELS][BITS_TO_LONGS(DUSB_WHEEL_SLOTS)];
+    uint64_t fires;            /* QEMUTimer expirations */
+    uint64_t dispatched;       /* DUSBTimer callbacks run */
+} DUSBWheel;
+
+static DUSBWheel dusb_wheel = { .armed = UINT64_MAX, .slack_ticks = 1 };
+
+static void dusb_wheel_unlink(DUSBWheel *w, DUSBTimer *t) {
+    QLIST_REMOVE(t, node);
+    if (t->level >= 0 && QLIST_EMPTY(&w->slots[t->level][t->slot])) {
+        clear_bit(t->slot, w->occupied[t->level]);
+    }
+}
+
+/* Queue a timer no earlier than tick @earliest, which is base + 1 unless base is being processed */
+static void dusb_wheel_insert(DUSBWheel *w, DUSBTimer *t, uint64_t earliest) {
+    uint64_t tick = MAX(t->tick, earliest);
+    uint64_t delta = tick - w->base;
+    int level = 0;
+
+    while (level < DUSB_WHEEL_LEVELS - 1 && delta >> (DUSB_WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    if (delta >> (DUSB_WHEEL_BITS * DUSB_WHEEL_LEVELS)) {
+        /* Beyond the top level: park in its last slot, placed again on the way down */
+        tick = w->base + (1ull << (DUSB_WHEEL_BITS * DUSB_WHEEL_LEVELS)) - 1;
+    }
+    t->level = level;
+    t->slot = (tick >> (DUSB_WHEEL_BITS * level)) & (DUSB_WHEEL_SLOTS - 1);
+    QLIST_INSERT_HEAD(&w->slots[level][t->slot], t, node);
+    set_bit(t->slot, w->occupied[level]);
+}
+
+/* First tick after base at which an occupied slot expires or cascades, UINT64_MAX if none */
+static uint64_t dusb_wheel_next(DUSBWheel *w) {
+    uint64_t next = UINT64_MAX;
+
+    for (int level = 0; level < DUSB_WHEEL_LEVELS; level++) {
+        int shift = DUSB_WHEEL_BITS * level;
+        uint64_t start = ((w->base >> shift) + 1) << shift;
+        unsigned long first = (start >> shift) & (DUSB_WHEEL_SLOTS - 1);
+        unsigned long k = find_next_bit(w->occupied[level], DUSB_WHEEL_SLOTS, first);
+
+        if (k >= DUSB_WHEEL_SLOTS) {
+            k = find_first_bit(w->occupied[level], DUSB_WHEEL_SLOTS);
+            if (k >= DUSB_WHEEL_SLOTS) {
+                continue;
+            }
+        }
+        next = MIN(next, start + ((uint64_t)((k - first) & (DUSB_WHEEL_SLOTS - 1)) << shift));
+    }
+    return next;
+}
+
+/* Point the QEMUTimer at the next wheel event if that is earlier than it is set for */
+static void dusb_wheel_arm(DUSBWheel *w, bool force) {
+    uint64_t next = dusb_wheel_next(w);
+
+    if (next == UINT64_MAX) {
+        if (force) {
+            timer_del(w->timer);
+            w->armed = UINT64_MAX;
+        }
+    } else if (force || next < w->armed) {
+        w->armed = next;
+        timer_mod(w->timer, MIN(next, INT64_MAX / DUSB_WHEEL_TICK_NS) * DUSB_WHEEL_TICK_NS);
+    }
+}
+
+/*
+ * Process one tick: cascade the higher levels whose slot starts here, then
+ * collect level 0. Cascaded timers always land on a lower level, and those
+ * due at this tick land in the level 0 slot collected last.
+ */
+static void dusb_wheel_tick(DUSBWheel *w, uint64_t tick, DUSBTimerList *batch) {
+    DUSBTimer *t;
+
+    w->base = tick;
+    for (int level = DUSB_WHEEL_LEVELS - 1; level > 0; level--) {
+        int shift = DUSB_WHEEL_BITS * level;
+        int slot = (tick >> shift) & (DUSB_WHEEL_SLOTS - 1);
+
+        if (tick & ((1ull << shift) - 1)) {
+            continue;
+        }
+        while ((t = QLIST_FIRST(&w->slots[level][slot]))) {
+            QLIST_REMOVE(t, node);
+            dusb_wheel_insert(w, t, tick);
+        }
+        clear_bit(slot, w->occupied[level]);
+    }
+    while ((t = QLIST_FIRST(&w->slots[0][tick & (DUSB_WHEEL_SLOTS - 1)]))) {
+        QLIST_REMOVE(t, node);
+        t->level = -1;
+        QLIST_INSERT_HEAD(batch, t, node);
+    }
+    clear_bit(tick & (DUSB_WHEEL_SLOTS - 1), w->occupied[0]);
+}
+
+/* Expire every due timer in one batch, then arm the QEMUTimer once */
+static void dusb_wheel_fire(void *opaque) {
+    DUSBWheel *w = opaque;
+    uint64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / DUSB_WHEEL_TICK_NS;
+    DUSBTimerList batch = QLIST_HEAD_INITIALIZER(batch);
+    uint64_t tick;
+    DUSBTimer *t;
+
+    w->fires++;
+    w->armed = UINT64_MAX;
+    while ((tick = dusb_wheel_next(w)) <= now) {
+        dusb_wheel_tick(w, tick, &batch);
+    }
+    w->base = MAX(w->base, now);
+
+    /* Callbacks may modify or delete timers still in the batch */
+    w->dispatching = true;
+    while ((t = QLIST_FIRST(&batch))) {
+        DUSBProf *prof = t->prof;
+        int64_t start = prof ? cpu_get_host_ticks() : 0;
+
+        QLIST_REMOVE(t, node);
+        t->expire_ns = -1;
+        w->dispatched++;
+        t->cb(t->opaque);
+        if (prof) {
+            prof->calls++;
+            prof->cycles += cpu_get_host_ticks() - start;
+        }
+    }
+    w->dispatching = false;
+    dusb_wheel_arm(w, true);
+}
+
+static void dusb_timer_init(DUSBTimer *t, QEMUTimerCB *cb, void *opaque) {
+    DUSBWheel *w = &dusb_wheel;
+
+    if (!w->users++) {
+        w->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, dusb_wheel_fire, w);
+        w->base = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / DUSB_WHEEL_TICK_NS;
+    }
+    t->cb = cb;
+    t->opaque = opaque;
+    t->expire_ns = -1;
+}
+
+static bool dusb_timer_pending(DUSBTimer *t) {
+    return t->expire_ns >= 0;
+}
+
+static void dusb_timer_del(DUSBTimer *t) {
+    if (t->cb && dusb_timer_pending(t)) {
+        dusb_wheel_unlink(&dusb_wheel, t);
+        t->expire_ns = -1;
+    }
+}
+
+/* Like timer_mod on a QEMU_CLOCK_VIRTUAL nanosecond timer */
+static void dusb_timer_mod(DUSBTimer *t, int64_t expire_ns) {
+    DUSBWheel *w = &dusb_wheel;
+    uint64_t tick = DIV_ROUND_UP(MAX(expire_ns, 0), DUSB_WHEEL_TICK_NS);
+
+    dusb_timer_del(t);
+    t->expire_ns = MAX(expire_ns, 0);
+    t->tick = QEMU_ALIGN_UP(tick, w->slack_ticks);
+    dusb_wheel_insert(w, t, w->base + 1);
+    if (!w->dispatching) {
+        dusb_wheel_arm(w, false);
+    }
+}
+
+/* Re-arm a timer whose expire_ns was just loaded by migration */
+static void dusb_timer_restore(DUSBTimer *t) {
+    int64_t expire_ns = t->expire_ns;
+
+    t->expire_ns = -1;
+    if (t->cb && expire_ns >= 0) {
+        dusb_timer_mod(t, expire_ns);
+    }
+}
+
+static void dusb_timer_deinit(DUSBTimer *t) {
+    DUSBWheel *w = &dusb_wheel;
+
+    if (!t->cb) {
+        return;
+    }
+    dusb_timer_del(t);
+    t->cb = NULL;
+    if (!--w->users) {
+        timer_free(w->timer);
+        w->timer = NULL;
+        w->armed = UINT64_MAX;
+    }
+}
+
+/* Shared pattern body, see dusb_pattern_table */
+typedef struct DUSBPatternPool {
+    uint8_t *tab;
+    unsigned refs;             /* Instances holding the table */
+} DUSBPatternPool;
+
+static DUSBPatternPool dusb_pattern_pool[DUSB_PATTERN_NUM];
+
+/* Realized instances, for contention and fairness reports across devices */
+static QLIST_HEAD(, DUSBState) dusb_devices = QLIST_HEAD_INITIALIZER(dusb_devices);
+
 /* BOS descriptor for USB 3.0 capabilities */
 static const uint8_t bos_descriptor[] = {
     0x05, USB_DT_BOS, 0x16, 0x00, 0x02,                         /* BOS header: 5 bytes, total length 22, 2 capabilities */
@@ -46,6 +769,17 @@ static const uint8_t bos_descriptor[] = {
     0x00, 0x0E, 0x00, 0x01, 0x0A, 0xFF, 0x07                /* Attributes for SuperSpeed operation */
 };
 
+/* BOS descriptor of a device locked below SuperSpeed */
+static const uint8_t bos_descriptor_usb2[] = {
+    0x05, USB_DT_BOS, 0x0C, 0x00, 0x01,                         /* BOS header: 5 bytes, total length 12, 1 capability */
+    0x07, USB_DT_DEVICE_CAPABILITY, USB_DEV_CAP_USB2_EXT, 0x02, /* USB 2.0 extension: 7 bytes, LPM support */
+    0x00, 0x00, 0x00,
+};
+
+static const char *const dusb_speed_names[] = {
+    [USB_SPEED_LOW] = "low", [USB_SPEED_FULL] = "full", [USB_SPEED_HIGH] = "high", [USB_SPEED_SUPER] = "super",
+};
+
 static const char manufacturer[] = {0x44, 0x61, 0x72, 0x73, 0x68, 0x61, 0x6e, 0x00};
 
 /* Endpoint descriptors for full-speed OUT and IN */
@@ -222,11 +956,94 @@ static const USBDesc desc = {
     .str = (const char *[]){"", manufacturer, prod_desc, serial},
 };
 
+/*
+ * Descriptors of a composite device. Function f repeats the interface of the
+ * first function as interface f, with its endpoint numbers moved up by 3f.
+ * Every function is a single interface, so no association descriptors are
+ * needed for the host to bind a driver per function. A speed-locked device
+ * also gets its own copy, with the other speeds removed, and so does a
+ * device with the command engine.
+ */
+typedef struct DUSBCompositeDesc {
+    USBDesc desc;
+    USBDescDevice dev[3];
+    USBDescConfig conf[3];
+    USBDescIface ifs[3][2 * DUSB_MAX_FUNCS + 1];
+    USBDescEndpoint eps[3][2 * DUSB_MAX_FUNCS + 1][DUSB_NUM_EPS];
+} DUSBCompositeDesc;
+
+/* With cmd, the first function gains alternate setting 2 with the bulk OUT and IN endpoints */
+static DUSBCompositeDesc *dusb_composite_desc(int nfuncs, bool cmd) {
+    static const USBDescDevice *const tmpl[3] = {&desc_device_full, &desc_device_high, &desc_device_super};
+    DUSBCompositeDesc *c = g_new0(DUSBCompositeDesc, 1);
+    const USBDescDevice **speed[3] = {&c->desc.full, &c->desc.high, &c->desc.super};
+
+    c->desc = desc;
+    for (int sp = 0; sp < 3; sp++) {
+        const USBDescConfig *conf = &tmpl[sp]->confs[0];
+
+        c->dev[sp] = *tmpl[sp];
+        c->dev[sp].confs = &c->conf[sp];
+        c->conf[sp] = *conf;
+        c->conf[sp].bNumInterfaces = nfuncs;
+        c->conf[sp].nif = conf->nif * nfuncs + cmd;
+        c->conf[sp].ifs = c->ifs[sp];
+        for (int f = 0, n = 0; f < nfuncs; f++) {
+            for (int a = 0; a < conf->nif; a++, n++) {
+                USBDescIface *ifc = &c->ifs[sp][n];
+
+                *ifc = conf->ifs[a];
+                ifc->bInterfaceNumber = f;
+                ifc->eps = c->eps[sp][n];
+                for (int i = 0; i < ifc->bNumEndpoints; i++) {
+                    ifc->eps[i] = conf->ifs[a].eps[i];
+                    ifc->eps[i].bEndpointAddress += f * DUSB_NUM_EPS;
+                }
+            }
+            if (f == 0 && cmd) {
+                USBDescIface *ifc = &c->ifs[sp][n];
+
+                *ifc = conf->ifs[0];
+                ifc->bAlternateSetting = DUSB_ALT_CMD;
+                ifc->bNumEndpoints = 2;
+                ifc->eps = c->eps[sp][n++];
+                ifc->eps[0] = conf->ifs[0].eps[2];
+                ifc->eps[1] = conf->ifs[1].eps[2];
+            }
+        }
+        *speed[sp] = &c->dev[sp];
+    }
+    return c;
+}
+
+/*
+ * Keep only the descriptors of one speed. A high-speed device keeps its
+ * full-speed set as the other-speed configuration for the device qualifier,
+ * so the caller still has to cut speedmask down after usb_desc_init.
+ */
+static void dusb_desc_lock_speed(USBDesc *d, int speed) {
+    if (speed == USB_SPEED_SUPER) {
+        d->full = d->high = NULL;
+        return;
+    }
+    d->super = NULL;
+    if (speed == USB_SPEED_FULL) {
+        d->high = NULL;
+    }
+}
+
+/* Name of the speed the device runs at, for reports */
+static const char *dusb_speed_name(DUSBState *s) {
+    return s->dev.attached ? dusb_speed_names[s->dev.speed] : "detached";
+}
+
 /* Handle BOS descriptor requests */
 static int dusb_handle_bos_descriptor(USBDevice *dev, int value, uint8_t *data, int len) {
     if ((value >> 8) == USB_DT_BOS) {
-        int copy_len = MIN(len, sizeof(bos_descriptor));
-        memcpy(data, bos_descriptor, copy_len);
+        /* Only a SuperSpeed-capable device may report the SuperSpeed capability */
+        bool super = dev->speedmask & USB_SPEED_MASK_SUPER;
+        int copy_len = MIN(len, super ? sizeof(bos_descriptor) : sizeof(bos_descriptor_usb2));
+        memcpy(data, super ? bos_descriptor : bos_descriptor_usb2, copy_len);
         qemu_log("DUSB: GET_DESCRIPTOR BOS, returning %d bytes\n", copy_len);
         return copy_len;
     }
@@ -244,324 +1061,4395 @@ static void dusb_wakeup_timer(void *opaque) {
             qemu_log("DUSB: Remote wakeup triggered on EP1 IN\n");
         }
     }
-    timer_mod(s->wakeup_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + s->wakeup_interval * 1000);
+    dusb_timer_mod(&s->wakeup_timer,
+                   qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)s->wakeup_interval * NANOSECONDS_PER_SECOND);
 }
 
-/* Callback for periodic IN data updates */
-static void dusb_in_timer(void *opaque) {
-    DUSBState *s = opaque;
-    if (s->alt[0] == 1) {
-        int ep = (s->current_in_ep % 3) + 1;
-        int data_len;
+/* Functions (interfaces) the device exposes */
+static int dusb_num_funcs(DUSBState *s) {
+    return MIN(MAX(s->functions, 1), DUSB_MAX_FUNCS);
+}
 
-        switch (ep) {
-            case 1: /* Interrupt (EP1 IN) - Small, periodic data */
-                data_len = 64; /* Smaller packet typical for interrupt */
-                s->in_data[ep - 1][0] = ep;
-                for (int i = 1; i < data_len; i++) {
-                    s->in_data[ep - 1][i] = (i + s->current_in_ep) % 256; /* Simple pattern */
-                }
-                break;
-            case 2: /* Isochronous (EP2 IN) - Continuous stream-like data */
-                data_len = 1024; /* Full packet for streaming */
-                s->in_data[ep - 1][0] = ep;
-                for (int i = 1; i < data_len; i++) {
-                    s->in_data[ep - 1][i] = (i * s->current_in_ep) % 256; /* Simulated stream */
-                }
+/* Data endpoints in use per direction, DUSB_NUM_EPS for each function */
+static int dusb_num_eps(DUSBState *s) {
+    return dusb_num_funcs(s) * DUSB_NUM_EPS;
+}
+
+/* Function (interface number) an engine belongs to */
+static int dusb_ep_func(const DUSBEp *e) {
+    return ((e->addr & 0x0f) - 1) / DUSB_NUM_EPS;
+}
+
+/* Position of an engine within its function: 0 interrupt, 1 isochronous, 2 bulk */
+static int dusb_ep_kind(const DUSBEp *e) {
+    return ((e->addr & 0x0f) - 1) % DUSB_NUM_EPS;
+}
+
+/* Traffic engine of data endpoint nr (1-15) in the given direction */
+static DUSBEp *dusb_ep(DUSBState *s, bool in, int nr) {
+    return &s->eps[in ? 1 : 0][nr - 1];
+}
+
+/* Traffic engine for an endpoint address, NULL if it is not a data endpoint */
+static DUSBEp *dusb_ep_by_addr(DUSBState *s, int addr) {
+    int nr = addr & 0x0f;
+
+    if (nr < 1 || nr > dusb_num_eps(s) || (addr & ~(USB_DIR_IN | 0x0f))) {
+        return NULL;
+    }
+    return dusb_ep(s, addr & USB_DIR_IN, nr);
+}
+
+/*
+ * Body bytes of a pattern, built on first use. The table holds one period
+ * plus a maximal payload so the body of any sequence number is contiguous.
+ * Bodies depend only on the pattern, so the tables live in a process-wide
+ * pool: the first instance to use a pattern builds it, page aligned, every
+ * instance serves IN data from it by reference, and the last one to let go
+ * frees it. Only the per-packet header is written per instance. All callers
+ * hold the BQL, so the reference counts need no locking.
+ */
+static const uint8_t *dusb_pattern_table(DUSBState *s, int pattern) {
+    DUSBPatternPool *pool = &dusb_pattern_pool[pattern];
+    size_t len = DUSB_PATTERN_PERIOD + DUSB_MAX_PAYLOAD;
+    uint8_t *tab;
+    uint32_t x = 0x2545F491;
+
+    if (s->pattern_tab[pattern]) {
+        return s->pattern_tab[pattern];
+    }
+    if (pool->tab) {
+        goto out;
+    }
+    tab = qemu_memalign(qemu_real_host_page_size(), len);
+    for (size_t i = 0; i < len; i++) {
+        switch (pattern) {
+            case DUSB_PATTERN_COUNT:
+                tab[i] = i % 256;
                 break;
-            case 3: /* Bulk (EP3 IN) - Large, non-time-sensitive data */
-                data_len = 1024; /* Full packet for bulk transfer */
-                s->in_data[ep - 1][0] = ep;
-                for (int i = 1; i < data_len; i++) {
-                    s->in_data[ep - 1][i] = i % 256; /* Sequential data */
+            case DUSB_PATTERN_PRBS:
+                if (i < DUSB_PATTERN_PERIOD) {
+                    x ^= x << 13;
+                    x ^= x >> 17;
+                    x ^= x << 5;
+                    tab[i] = x & 0xff;
+                } else {
+                    tab[i] = tab[i % DUSB_PATTERN_PERIOD];
                 }
                 break;
             default:
-                data_len = 0; /* Should not happen */
+                tab[i] = 0;
                 break;
         }
+    }
+    pool->tab = tab;
+out:
+    pool->refs++;
+    s->pattern_tab[pattern] = pool->tab;
+    return pool->tab;
+}
 
-        s->in_data_len[ep - 1] = data_len;
-        qemu_log("DUSB: Updated data for EP%d IN (%s), length=%d\n", 
-                 ep, ep == 1 ? "Interrupt" : (ep == 2 ? "Isochronous" : "Bulk"), data_len);
-        s->current_in_ep++;
+/* Drop the instance's references to the pattern pool, freeing unused tables */
+static void dusb_pattern_release(DUSBState *s) {
+    for (int i = 0; i < DUSB_PATTERN_NUM; i++) {
+        DUSBPatternPool *pool = &dusb_pattern_pool[i];
+        if (s->pattern_tab[i] && --pool->refs == 0) {
+            qemu_vfree(pool->tab);
+            pool->tab = NULL;
+        }
+        s->pattern_tab[i] = NULL;
     }
-    timer_mod(s->in_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + s->in_interval * 1000);
 }
 
-/* Handle control requests from the host */
-static void dusb_handle_control(USBDevice *dev, USBPacket *p, int request, int value, int index, int length, uint8_t *data) {
-    DUSBState *s = USB_DUSB(dev);
-    int bmRequestType = request & 0xff;
-    int bRequest = (request >> 8) & 0xff;
-    int recipient = bmRequestType & USB_RECIP_MASK;
-    int direction = bmRequestType & USB_DIR_IN;
+/* Fill the legacy buffer of an IN endpoint with the original per-endpoint data */
+static void dusb_fill_legacy(DUSBState *s, DUSBEp *e) {
+    int ep = e->addr & 0x0f;
+    int idx = ep - 1;
+    /* Value the old round-robin counter had when it refreshed this payload */
+    int tick = (e->seq - 1) * DUSB_NUM_EPS + idx;
+    int data_len = MIN(e->size, sizeof(s->in_data[idx]));
 
-    qemu_log("DUSB: Control request - bRequest: %d, bmRequestType: 0x%02x, recipient: %d, direction: %s, value: %d, index: %d, length: %d\n",
-             bRequest, bmRequestType, recipient, direction ? "IN" : "OUT", value, index, length);
+    s->in_data[idx][0] = ep;
+    for (int i = 1; i < data_len; i++) {
+        switch (ep) {
+            case 1: /* Interrupt (EP1 IN) - Simple pattern */
+                s->in_data[idx][i] = (i + tick) % 256;
+                break;
+            case 2: /* Isochronous (EP2 IN) - Simulated stream */
+                s->in_data[idx][i] = (i * tick) % 256;
+                break;
+            default: /* Bulk (EP3 IN) - Sequential data */
+                s->in_data[idx][i] = i % 256;
+                break;
+        }
+    }
+    s->in_data_len[idx] = data_len;
+    qemu_log("DUSB: Updated data for EP%d IN (%s), length=%d\n",
+             ep, ep == 1 ? "Interrupt" : (ep == 2 ? "Isochronous" : "Bulk"), data_len);
+}
 
-    /* Logging negotiated speed during descriptor requests */
-    if (bRequest == USB_REQ_GET_DESCRIPTOR) {
-        int desc_type = value >> 8;
-        const char *speed_str;
-        switch (dev->speed) {
-            case USB_SPEED_FULL: speed_str = "Full-Speed"; break;
-            case USB_SPEED_HIGH: speed_str = "High-Speed"; break;
-            case USB_SPEED_SUPER: speed_str = "SuperSpeed"; break;
-            default: speed_str = "Unknown"; break;
+/* USB core endpoint backing a traffic engine */
+static USBEndpoint *dusb_usb_ep(DUSBState *s, DUSBEp *e) {
+    return usb_ep_get(&s->dev, (e->addr & USB_DIR_IN) ? USB_TOKEN_IN : USB_TOKEN_OUT, e->addr & 0x0f);
+}
+
+/*
+ * Restart every jitter generator from the seed property. Each endpoint has
+ * its own stream, so the delays one endpoint sees do not depend on traffic
+ * on the others.
+ */
+static void dusb_seed(DUSBState *s) {
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUSB_MAX_EPS; i++) {
+            DUSBEp *e = &s->eps[d][i];
+            e->rng = crc32c(s->seed, &e->addr, 1) ?: 1;
+            e->fault.rng = crc32c(~s->seed, &e->addr, 1) ?: 1;
         }
-        qemu_log("DUSB: GET_DESCRIPTOR type %d at %s\n", desc_type, speed_str);
     }
+}
 
-    if (bRequest == USB_REQ_GET_DESCRIPTOR && (value >> 8) == USB_DT_BOS) {
-        int ret = dusb_handle_bos_descriptor(dev, value, data, length);
-        if (ret >= 0) {
-            p->actual_length = ret;
-            return;
+/* Fold one data transfer event into the run digest */
+static void dusb_trace(DUSBState *s, uint8_t addr, int64_t now, int status, uint32_t len) {
+    DUSBTraceRec rec = {
+        .time_ns = cpu_to_le64(now),
+        .len = cpu_to_le32(len),
+        .status = cpu_to_le32(status),
+        .ep = addr,
+    };
+    s->digest = crc32c(s->digest, (const uint8_t *)&rec, sizeof(rec));
+}
+
+/* Advance a xorshift32 generator */
+static uint32_t dusb_xorshift32(uint32_t *state) {
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+/* Latency model: fixed latency plus uniformly distributed jitter */
+static int64_t dusb_ep_delay_ns(DUSBState *s, DUSBEp *e) {
+    int64_t delay = (int64_t)e->latency_us * 1000;
+
+    if (e->jitter_us) {
+        delay += (int64_t)(dusb_xorshift32(&e->rng) % ((uint64_t)e->jitter_us * 1000 + 1));
+    }
+    return delay;
+}
+
+/*
+ * Token bucket shaper. Credit accrues at rate_bps up to one millisecond of
+ * traffic or one payload, whichever is larger; a transfer is admitted while
+ * the credit is not negative and may overdraw it.
+ */
+static bool dusb_shape_admit(DUSBEp *e, int64_t now) {
+    int64_t cap;
+
+    if (!e->rate_bps) {
+        return true;
+    }
+    cap = MAX((int64_t)e->size, e->rate_bps / 1000);
+    if (now > e->tokens_ns) {
+        e->tokens = MIN(cap, e->tokens + (int64_t)muldiv64(MIN(now - e->tokens_ns, NANOSECONDS_PER_SECOND),
+                                                          e->rate_bps, NANOSECONDS_PER_SECOND));
+        e->tokens_ns = now;
+    }
+    return e->tokens >= 0;
+}
+
+/* Time at which a shaper in debt admits traffic again */
+static int64_t dusb_shape_ready_ns(DUSBEp *e, int64_t now) {
+    return now + muldiv64(-e->tokens, NANOSECONDS_PER_SECOND, e->rate_bps) + 1;
+}
+
+/* Start timing a code path, if cycle accounting is enabled */
+static inline int64_t dusb_prof_start(DUSBState *s) {
+    return s->profile ? cpu_get_host_ticks() : 0;
+}
+
+static inline void dusb_prof_end(DUSBState *s, DUSBProf *prof, int64_t start, uint64_t bytes) {
+    if (s->profile) {
+        prof->calls++;
+        prof->cycles += cpu_get_host_ticks() - start;
+        prof->bytes += bytes;
+    }
+}
+
+static void dusb_prof_reset(DUSBState *s) {
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUSB_MAX_EPS; i++) {
+            memset(s->eps[d][i].prof, 0, sizeof(s->eps[d][i].prof));
         }
     }
+    memset(s->prof, 0, sizeof(s->prof));
+    s->prof_ticks0 = cpu_get_host_ticks();
+    s->prof_clock0 = get_clock();
+}
 
-    /* Pass standard requests to QEMU's USB descriptor handler */
-    int ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
-    if (ret >= 0) {
-        qemu_log("DUSB: Handled by usb_desc_handle_control, bytes: %d\n", ret);
-        return;
+/* Produce the next payload of an IN endpoint, replacing any unread one */
+static void dusb_ep_generate(DUSBState *s, DUSBEp *e, int64_t now) {
+    if (e->avail) {
+        e->stats.lost++;
     }
-    
-    /* Handle custom control requests */
-    switch (bRequest) {
-        case USB_REQ_GET_STATUS:
-            if (recipient == USB_RECIP_DEVICE) {
-                data[0] = (dev->remote_wakeup << 1) | 0;
-                data[1] = 0;
-                p->actual_length = 2;
-                qemu_log("DUSB: GET_STATUS (Device) - Remote Wakeup: %d\n", dev->remote_wakeup);
-            } else if (recipient == USB_RECIP_INTERFACE) {
-                data[0] = 0;
-                data[1] = 0;
-                p->actual_length = 2;
-                qemu_log("DUSB: GET_STATUS (Interface)\n");
-            } else if (recipient == USB_RECIP_ENDPOINT) {
-                int ep = index & 0x0f;
-                int dir = (index & 0x80) ? USB_TOKEN_IN : USB_TOKEN_OUT;
-                USBEndpoint *endpoint = usb_ep_get(dev, dir, ep);
-                if (endpoint) {
-                    data[0] = endpoint->halted ? 1 : 0;
-                    data[1] = 0;
-                    p->actual_length = 2;
-                    qemu_log("DUSB: GET_STATUS (Endpoint %d %s) - Halted: %d\n", ep, dir == USB_TOKEN_IN ? "IN" : "OUT", endpoint->halted);
-                } else {
-                    goto fail;
-                }
-            } else {
-                goto fail;
-            }
-            break;
+    e->seq++;
+    e->avail = 1;
+    e->gen_ns = now;
+    e->ready_ns = now + dusb_ep_delay_ns(s, e);
+    if (e->pattern == DUSB_PATTERN_LEGACY) {
+        dusb_fill_legacy(s, e);
+    }
+}
 
-        case USB_REQ_CLEAR_FEATURE:
-            if (recipient == USB_RECIP_DEVICE && value == USB_DEVICE_REMOTE_WAKEUP) {
-                dev->remote_wakeup = 0;
-                p->actual_length = 0;
-                qemu_log("DUSB: CLEAR_FEATURE (Device) - Remote Wakeup disabled\n");
-            } else if (recipient == USB_RECIP_ENDPOINT && value == 0) {
-                int ep = index & 0x0f;
-                int dir = (index & 0x80) ? USB_TOKEN_IN : USB_TOKEN_OUT;
-                USBEndpoint *endpoint = usb_ep_get(dev, dir, ep);
-                if (endpoint) {
-                    endpoint->halted = false;
-                    p->actual_length = 0;
-                    qemu_log("DUSB: CLEAR_FEATURE (Endpoint %d %s) - Halt cleared\n", ep, dir == USB_TOKEN_IN ? "IN" : "OUT");
-                } else {
-                    goto fail;
-                }
-            } else {
-                goto fail;
-            }
-            break;
+/*
+ * Buffer of an IN transfer. On a pipelined endpoint the core may hand over
+ * several queued packets combined into one transfer; the data then goes to
+ * the scatter/gather list spanning all of them.
+ */
+static size_t dusb_packet_size(USBPacket *p) {
+    return p->combined ? p->combined->iov.size : p->iov.size;
+}
 
-        case USB_REQ_SET_FEATURE:
-            if (recipient == USB_RECIP_DEVICE && value == USB_DEVICE_REMOTE_WAKEUP) {
-                dev->remote_wakeup = 1;
-                p->actual_length = 0;
-                qemu_log("DUSB: SET_FEATURE (Device) - Remote Wakeup enabled\n");
-            } else if (recipient == USB_RECIP_ENDPOINT && value == 0) {
-                int ep = index & 0x0f;
-                int dir = (index & 0x80) ? USB_TOKEN_IN : USB_TOKEN_OUT;
-                USBEndpoint *endpoint = usb_ep_get(dev, dir, ep);
-                if (endpoint) {
-                    endpoint->halted = true;
-                    p->actual_length = 0;
-                    qemu_log("DUSB: SET_FEATURE (Endpoint %d %s) - Halted\n", ep, dir == USB_TOKEN_IN ? "IN" : "OUT");
-                } else {
-                    goto fail;
-                }
-            } else {
-                goto fail;
-            }
-            break;
+static void dusb_packet_copy(USBPacket *p, const void *buf, size_t len) {
+    if (p->combined) {
+        iov_from_buf(p->combined->iov.iov, p->combined->iov.niov, p->actual_length, buf, len);
+        p->actual_length += len;
+    } else {
+        usb_packet_copy(p, (void *)buf, len);
+    }
+}
 
-        case USB_REQ_SET_INTERFACE:
-            if (recipient == USB_RECIP_INTERFACE && index == 0) {
-                if (value < 2) {
-                    s->alt[0] = value;
-                    p->actual_length = 0;
-                    qemu_log("DUSB: SET_INTERFACE - Interface 0 set to alt %d\n", value);
-                    if (value == 1) {
-                        timer_mod(s->in_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + s->in_interval * 1000);
-                    } else {
-                        timer_del(s->in_timer);
-                        memset(s->in_data_len, 0, sizeof(s->in_data_len));
-                    }
-                } else {
-                    goto fail;
-                }
-            } else {
-                goto fail;
-            }
-            break;
+/* Copy the pending payload of an IN endpoint into the packet, returning its length */
+static size_t dusb_ep_send(DUSBState *s, DUSBEp *e, USBPacket *p) {
+    int idx = (e->addr & 0x0f) - 1;
+    uint32_t seq = e->seq - 1;
+    DUSBPayloadHdr hdr;
+    size_t len;
 
-        case USB_REQ_SET_SEL:
-            if (recipient == USB_RECIP_DEVICE && direction == USB_DIR_OUT && length == 6) {
-                qemu_log("DUSB: SET_SEL - U1 SEL=%d, U1 PEL=%d, U2 SEL=%d, U2 PEL=%d\n",
-                         data[0], data[1], data[2] | (data[3] << 8), data[4] | (data[5] << 8));
-                p->actual_length = 0;
-            } else {
-                goto fail;
-            }
-            break;
+    if (e->pattern == DUSB_PATTERN_LEGACY) {
+        len = MIN(dusb_packet_size(p), s->in_data_len[idx]);
+        dusb_packet_copy(p, s->in_data[idx], len);
+        s->in_data_len[idx] = 0;
+        return len;
+    }
 
-        default:
-            goto fail;
+    len = MIN(dusb_packet_size(p), e->size);
+    hdr.ep = e->addr;
+    hdr.pattern = e->pattern;
+    hdr.flags = 0;
+    hdr.seq = cpu_to_le32(seq);
+    hdr.timestamp = cpu_to_le64(e->gen_ns);
+    dusb_packet_copy(p, &hdr, MIN(len, sizeof(hdr)));
+    if (len > sizeof(hdr)) {
+        dusb_packet_copy(p, dusb_pattern_table(s, e->pattern) + seq % DUSB_PATTERN_PERIOD,
+                         len - sizeof(hdr));
+    }
+    return len;
+}
+
+/* Check an OUT payload against the endpoint's pattern and expected sequence number */
+static void dusb_ep_verify(DUSBState *s, DUSBEp *e, const uint8_t *buf, size_t len) {
+    DUSBPayloadHdr hdr;
+    uint32_t seq;
+
+    if (len < sizeof(hdr) || len > DUSB_MAX_PAYLOAD) {
+        goto bad;
+    }
+    memcpy(&hdr, buf, sizeof(hdr));
+    seq = le32_to_cpu(hdr.seq);
+    if (hdr.ep != e->addr || hdr.pattern != e->pattern) {
+        goto bad;
+    }
+    if ((int32_t)(seq - e->seq) > 0) {
+        e->stats.lost += seq - e->seq;
+    }
+    e->seq = seq + 1;
+    if (memcmp(buf + sizeof(hdr), dusb_pattern_table(s, e->pattern) + seq % DUSB_PATTERN_PERIOD,
+               len - sizeof(hdr))) {
+        goto bad;
     }
     return;
 
-fail:
-    p->status = USB_RET_STALL;
-    qemu_log("DUSB: Control request failed - Stalled\n");
+bad:
+    e->stats.errors++;
+    qemu_log("DUSB: EP#%d OUT payload of %zu bytes failed verification\n", e->addr, len);
 }
 
-/* Handle data transfers on endpoints */
-static void dusb_handle_data(USBDevice *dev, USBPacket *p) {
-    DUSBState *s = USB_DUSB(dev);
-    USBEndpoint *ep = p->ep;
-    int ep_num = ep->nr;
-    bool in = (p->pid == USB_TOKEN_IN);
+/* Whether IN endpoint nr is fed by the NTB builder or the video source instead of the IN timer */
+static bool dusb_ep_framed(DUSBState *s, int nr) {
+    return (nr == 3 && s->agg.enabled) || nr == s->video.ep;
+}
 
-    /* Log stream usage for bulk endpoints */
-    if (ep_num == 3) {
-        qemu_log("DUSB: handle_data EP#%d %s, stream=%d\n", ep_num, in ? "IN" : "OUT", p->stream);
+/*
+ * Whether the IN timer has to visit a function's generators. A suspended
+ * function generates nothing; it only needs one visit to send its function
+ * wake, and none at all without remote wake.
+ */
+static bool dusb_func_generating(DUSBState *s, int f) {
+    DUSBFuncSuspend *fs = &s->fsusp[f];
+
+    return !fs->suspended || (fs->remote_wake && !fs->wake_ns);
+}
+
+/* Arm the IN data timer for the earliest generation, retry or completion */
+static void dusb_in_timer_rearm(DUSBState *s) {
+    int64_t deadline = INT64_MAX;
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            DUSBEp *e = &s->eps[d][i];
+            if (d == 1 && s->alt[dusb_ep_func(e)] == 1 && e->running && e->interval_us &&
+                !dusb_ep_framed(s, i + 1) && dusb_func_generating(s, dusb_ep_func(e))) {
+                deadline = MIN(deadline, e->next_ns);
+            }
+            if (e->wake_ns) {
+                deadline = MIN(deadline, e->wake_ns);
+            }
+            if (e->async_pkt) {
+                deadline = MIN(deadline, e->async_due_ns);
+            }
+            if (e->queue_due_ns) {
+                deadline = MIN(deadline, e->queue_due_ns);
+            }
+        }
+    }
+    if (deadline == INT64_MAX) {
+        dusb_timer_del(&s->in_timer);
     } else {
-        qemu_log("DUSB: handle_data EP#%d %s\n", ep_num, in ? "IN" : "OUT");
+        dusb_timer_mod(&s->in_timer, deadline);
     }
+}
 
-    if (ep->halted) {
-        p->status = USB_RET_STALL;
-        qemu_log("DUSB: EP#%d %s is halted - Stalled\n", ep_num, in ? "IN" : "OUT");
-        return;
+/* Ask the host controller to retry a NAKed endpoint at the given time */
+static void dusb_ep_wake_at(DUSBState *s, DUSBEp *e, int64_t when) {
+    if (!e->wake_ns || when < e->wake_ns) {
+        e->wake_ns = when;
+        dusb_in_timer_rearm(s);
     }
+}
 
-    bool ep_allowed = (in && s->alt[0] == 1) || (!in && s->alt[0] == 0);
-    if (ep_num >= 1 && ep_num <= 3 && !ep_allowed) {
-        p->status = USB_RET_STALL;
-        qemu_log("DUSB: EP#%d %s not available in alt %d - Stalled\n", ep_num, in ? "IN" : "OUT", s->alt[0]);
+/*
+ * Data arrived for a suspended function. QEMU has no device notification
+ * packets, so the Function Wake notification cannot be sent. The request
+ * goes to the port's wakeup operation instead, which only resumes a link
+ * in U3: it reaches the host when the whole device is suspended too, as
+ * Linux runtime PM does, but xHCI ignores it while function suspend alone
+ * leaves the link in U0. Requests are counted here and answered ones by
+ * the wake histogram when the host clears function suspend.
+ */
+static void dusb_func_wake(DUSBState *s, int f) {
+    DUSBFuncSuspend *fs = &s->fsusp[f];
+    USBPort *port = s->dev.port;
+
+    if (!fs->remote_wake || fs->wake_ns) {
         return;
     }
+    fs->wake_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    fs->wakes++;
+    if (port && port->ops->wakeup) {
+        port->ops->wakeup(port);
+    }
+    qemu_log("DUSB: Function wake requested for interface %d\n", f);
+}
 
-    if (!in) {
-        uint8_t *buf = g_malloc(p->iov.size);
-        usb_packet_copy(p, buf, p->iov.size);
-        char *hex = g_malloc(3 * p->iov.size + 1);
-        char *h = hex;
-        for (size_t i = 0; i < p->iov.size; i++) {
-            int n = snprintf(h, 4, "%02x ", buf[i]);
-            h += n;
-        }
-        *h = '\0';
-        qemu_log("DUSB: Received on EP#%d OUT: %s\n", ep_num, hex);
-        g_free(hex);
-        g_free(buf);
-        p->actual_length = p->iov.size;
-        p->status = USB_RET_SUCCESS;
+/*
+ * Data may be ready on an IN endpoint. Transfers held on a pipelined
+ * endpoint are retried by the IN timer, others by the host controller.
+ * A suspended function keeps the data and signals function wake instead.
+ */
+static void dusb_ep_kick(DUSBState *s, DUSBEp *e) {
+    if (s->fsusp[dusb_ep_func(e)].suspended) {
+        dusb_func_wake(s, dusb_ep_func(e));
+    } else if (e->queue_due_ns) {
+        e->queue_due_ns = MIN(e->queue_due_ns, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+        dusb_in_timer_rearm(s);
     } else {
-        int idx = ep_num - 1;
-        if (s->in_data_len[idx] > 0) {
-            size_t len = MIN(p->iov.size, s->in_data_len[idx]);
-            usb_packet_copy(p, s->in_data[idx], len);
-            p->actual_length = len;
-            p->status = USB_RET_SUCCESS;
-            s->in_data_len[idx] = 0;
-            qemu_log("DUSB: Sent %zu bytes on EP#%d IN\n", len, ep_num);
+        usb_wakeup(dusb_usb_ep(s, e), 0);
+    }
+}
+
+static void dusb_handle_data(USBDevice *dev, USBPacket *p);
+
+/*
+ * Serve the queued transfers of a pipelined IN endpoint in order. The head
+ * of the core's queue is always the oldest transfer handed to the device;
+ * one that finds no data is held there until dusb_ep_kick.
+ */
+static void dusb_ep_serve_queue(DUSBState *s, DUSBEp *e) {
+    USBEndpoint *uep = dusb_usb_ep(s, e);
+    USBPacket *p;
+
+    while ((p = QTAILQ_FIRST(&uep->queue)) && p->state == USB_PACKET_ASYNC) {
+        dusb_handle_data(&s->dev, p);
+        if (p->status == USB_RET_NAK) {
+            e->queue_due_ns = INT64_MAX;
+            return;
+        }
+        /* Splits the data over the combined packets and submits the next run */
+        usb_combined_input_packet_complete(&s->dev, p);
+    }
+    e->queue_due_ns = 0;
+}
+
+/*
+ * Mark the bulk IN endpoints pipelined. usb_desc rebuilds the endpoint table
+ * on every SET_CONFIGURATION and SET_INTERFACE, so this runs after each one,
+ * including a SET_INTERFACE to the alt that is already active.
+ * Interrupt endpoints cannot complete asynchronously in the USB core, so
+ * they never build a queue and stay unpipelined.
+ */
+static void dusb_setup_pipeline(DUSBState *s) {
+    for (int i = 0; i < dusb_num_eps(s); i++) {
+        DUSBEp *e = &s->eps[1][i];
+        if (dusb_ep_kind(e) == 2) {
+            dusb_usb_ep(s, e)->pipeline = s->bulk_pipeline;
+        }
+    }
+}
+
+/*
+ * usb_desc answers SET_CONFIGURATION and SET_INTERFACE by reinitialising the
+ * whole endpoint table, which empties every packet queue without completing
+ * the packets in it. Held transfers of functions that did not change would
+ * be orphaned, so they are moved aside for the call and put back afterwards.
+ */
+typedef typeof(((USBEndpoint *)NULL)->queue) DUSBPacketQueue;
+
+static USBEndpoint *dusb_held_ep(USBDevice *dev, int k) {
+    if (k == 0) {
+        return &dev->ep_ctl;
+    }
+    return usb_ep_get(dev, k <= USB_MAX_ENDPOINTS ? USB_TOKEN_IN : USB_TOKEN_OUT,
+                      (k - 1) % USB_MAX_ENDPOINTS + 1);
+}
+
+static void dusb_held_move(DUSBPacketQueue *from, DUSBPacketQueue *to) {
+    USBPacket *p;
+
+    while ((p = QTAILQ_FIRST(from)) != NULL) {
+        QTAILQ_REMOVE(from, p, queue);
+        QTAILQ_INSERT_TAIL(to, p, queue);
+    }
+}
+
+static int dusb_desc_control_held(USBDevice *dev, USBPacket *p, int request, int value, int index, int length,
+                                  uint8_t *data) {
+    DUSBPacketQueue held[1 + 2 * USB_MAX_ENDPOINTS];
+    int ret;
+
+    for (int k = 0; k < ARRAY_SIZE(held); k++) {
+        QTAILQ_INIT(&held[k]);
+        dusb_held_move(&dusb_held_ep(dev, k)->queue, &held[k]);
+    }
+    ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
+    for (int k = 0; k < ARRAY_SIZE(held); k++) {
+        dusb_held_move(&held[k], &dusb_held_ep(dev, k)->queue);
+    }
+    return ret;
+}
+
+/* Discard the unread payload of an IN endpoint; only EP1-EP3 have legacy buffers */
+static void dusb_ep_drop_pending(DUSBState *s, DUSBEp *e) {
+    int idx = (e->addr & 0x0f) - 1;
+
+    e->avail = 0;
+    if (idx < ARRAY_SIZE(s->in_data_len)) {
+        s->in_data_len[idx] = 0;
+    }
+}
+
+/*
+ * Schedule the first generation of an IN endpoint. Endpoints are staggered
+ * by a third of their period so the default configuration refreshes one
+ * endpoint every in_interval, as the original round-robin timer did.
+ */
+static void dusb_ep_start_in(DUSBState *s, DUSBEp *e, int64_t now) {
+    int idx = dusb_ep_kind(e);
+
+    dusb_ep_drop_pending(s, e);
+    e->next_ns = now + (int64_t)e->interval_us * 1000 * (idx + 1) / DUSB_NUM_EPS;
+}
+
+/* Callback for periodic IN data updates */
+static void dusb_in_timer(void *opaque) {
+    DUSBState *s = opaque;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    for (int i = 0; i < dusb_num_eps(s); i++) {
+        DUSBEp *e = &s->eps[1][i];
+
+        /* Framed endpoints are fed from the NTB builder or the video source */
+        if (s->alt[dusb_ep_func(e)] != 1 || !e->running || e->interval_us == 0 || e->next_ns > now ||
+            dusb_ep_framed(s, i + 1)) {
+            continue;
+        }
+        /* Data due on a suspended function stays at the source until resume */
+        if (s->fsusp[dusb_ep_func(e)].suspended) {
+            dusb_func_wake(s, dusb_ep_func(e));
+            continue;
+        }
+        dusb_ep_generate(s, e, now);
+        e->next_ns += (int64_t)e->interval_us * 1000;
+        if (e->next_ns <= now) {
+            e->next_ns = now + (int64_t)e->interval_us * 1000;
+        }
+        if (e->ready_ns > now) {
+            dusb_ep_wake_at(s, e, e->ready_ns);
         } else {
-            p->status = USB_RET_NAK;
-            qemu_log("DUSB: No data available on EP#%d IN - NAK\n", ep_num);
+            dusb_ep_kick(s, e);
+        }
+    }
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            DUSBEp *e = &s->eps[d][i];
+            if (e->async_pkt && e->async_due_ns <= now) {
+                USBPacket *p = e->async_pkt;
+                e->async_pkt = NULL;
+                p->status = USB_RET_SUCCESS;
+                dusb_trace(s, e->addr, now, p->status, p->actual_length);
+                usb_packet_complete(&s->dev, p);
+            }
+            if (e->wake_ns && e->wake_ns <= now) {
+                e->wake_ns = 0;
+                dusb_ep_kick(s, e);
+            }
+            if (e->queue_due_ns && e->queue_due_ns <= now) {
+                dusb_ep_serve_queue(s, e);
+            }
         }
     }
+    dusb_in_timer_rearm(s);
 }
 
-/* Handle device reset */
-static void dusb_handle_reset(USBDevice *dev) {
-    DUSBState *s = USB_DUSB(dev);
-    dev->addr = 0;
-    dev->configuration = 0;
-    dev->remote_wakeup = 0;
-    memset(s->alt, 0, sizeof(s->alt));
-    timer_del(s->in_timer);
-    memset(s->in_data_len, 0, sizeof(s->in_data_len));
-    qemu_log("DUSB: Device reset - addr: %d, config: %d\n", dev->addr, dev->configuration);
+/* Forget injected fault counts and recovery times, keeping the fault settings */
+static void dusb_fault_reset_stats(DUSBFault *f) {
+    f->count = 0;
+    f->pending_ns = 0;
+    memset(f->injected, 0, sizeof(f->injected));
+    memset(&f->recovery, 0, sizeof(f->recovery));
+    memset(&f->halt_clear, 0, sizeof(f->halt_clear));
 }
 
-/* Initializing the device and setting up endpoints */
-static void dusb_realize(USBDevice *dev, Error **errp) {
-    DUSBState *s = USB_DUSB(dev);
-    dev->usb_desc = &desc;
-    dev->speed = USB_SPEED_SUPER; /* Advertise SuperSpeed capability */
-    usb_desc_init(dev);
-    qemu_log("DUSB: usb_desc_init completed, dev->usb_desc: %p\n", dev->usb_desc);
-    qemu_log("DUSB: wakeup_interval (seconds) = %u, in_interval (seconds) = %u\n", s->wakeup_interval, s->in_interval);
-    usb_ep_init(dev);
+/* Zero every traffic counter, restart the statistics epoch and the digest */
+static void dusb_reset_stats(DUSBState *s) {
+    DUSBAgg *agg = &s->agg;
 
-    /* Configuring endpoint properties for SuperSpeed streams on bulk endpoints */
-    for (int i = 1; i <= 3; i++) {
-        USBEndpoint *ep_out = usb_ep_get(dev, USB_TOKEN_OUT, i);
-        USBEndpoint *ep_in = usb_ep_get(dev, USB_TOKEN_IN, i);
-        if (ep_out) {
-            ep_out->max_streams = (i == 3) ? 9 : 0; /* 9 streams for bulk EP3 OUT */
-            qemu_log("DUSB: (OUT) Max Stream for PID: %u, IFNUM: %u = %d\n", ep_out->pid, ep_out->ifnum, ep_out->max_streams);
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUSB_MAX_EPS; i++) {
+            memset(&s->eps[d][i].stats, 0, sizeof(s->eps[d][i].stats));
+            memset(&s->eps[d][i].lat, 0, sizeof(s->eps[d][i].lat));
+            s->eps[d][i].last_ns = 0;
+            dusb_fault_reset_stats(&s->eps[d][i].fault);
         }
-        if (ep_in) {
-            ep_in->max_streams = (i == 3) ? 9 : 0; /* 9 streams for bulk EP3 IN */
-            qemu_log("DUSB: (IN) Max Stream for PID: %u, IFNUM: %u = %d\n", ep_in->pid, ep_in->ifnum, ep_in->max_streams);
+    }
+    agg->in_ntbs = agg->in_datagrams = agg->in_bytes = agg->in_dropped = 0;
+    agg->out_ntbs = agg->out_datagrams = agg->out_bytes = agg->out_errors = 0;
+    s->video.frames = s->video.late = s->video.dropped = s->video.payloads = s->video.bytes = 0;
+    memset(&s->video.lat, 0, sizeof(s->video.lat));
+    memset(&s->ctrl, 0, sizeof(s->ctrl));
+    s->cmd.commands = s->cmd.responses = s->cmd.rejected = s->cmd.malformed = s->cmd.full = 0;
+    s->cmd.offloaded = s->cmd.offload_bytes = s->cmd.offload_failed = s->cmd.late = 0;
+    s->cmd.max_outstanding = s->cmd.count;
+    memset(&s->cmd.rtt, 0, sizeof(s->cmd.rtt));
+    memset(&s->cmd.queue, 0, sizeof(s->cmd.queue));
+    memset(&s->cmd.host, 0, sizeof(s->cmd.host));
+    for (int f = 0; f < DUSB_MAX_FUNCS; f++) {
+        DUSBFuncSuspend *fs = &s->fsusp[f];
+        fs->suspends = fs->wakes = 0;
+        memset(&fs->active, 0, sizeof(fs->active));
+        memset(&fs->wake, 0, sizeof(fs->wake));
+    }
+    dusb_prof_reset(s);
+    s->digest = 0;
+    dusb_seed(s);
+    s->stats_epoch_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+}
+
+/*
+ * Set up the default traffic configuration of every data endpoint. The
+ * legacy buffers only exist for the first function, so the endpoints of
+ * further composite functions default to the counting pattern.
+ */
+static void dusb_init_eps(DUSBState *s) {
+    static const uint32_t in_size[DUSB_NUM_EPS] = {64, 1024, 1024};
+
+    for (int i = 0; i < DUSB_MAX_EPS; i++) {
+        DUSBEp *out = &s->eps[0][i];
+        DUSBEp *in = &s->eps[1][i];
+        uint8_t pattern = i < DUSB_NUM_EPS ? DUSB_PATTERN_LEGACY : DUSB_PATTERN_COUNT;
+
+        memset(out, 0, sizeof(*out));
+        out->addr = USB_DIR_OUT | (i + 1);
+        out->running = true;
+        out->pattern = pattern;
+        out->size = 1024;
+
+        memset(in, 0, sizeof(*in));
+        in->addr = USB_DIR_IN | (i + 1);
+        in->running = true;
+        in->pattern = pattern;
+        in->size = in_size[i % DUSB_NUM_EPS];
+        in->interval_us = DUSB_INTERVAL_DEFAULT;
+    }
+}
+
+/* Resolve IN periods left at their default once in_interval is known */
+static void dusb_resolve_ep_defaults(DUSBState *s) {
+    /* The original timer refreshed one of the three IN endpoints per in_interval */
+    uint64_t in_period_us = (uint64_t)s->in_interval * 1000000 * DUSB_NUM_EPS;
+
+    for (int i = 0; i < DUSB_MAX_EPS; i++) {
+        DUSBEp *in = &s->eps[1][i];
+        if (in->interval_us == DUSB_INTERVAL_DEFAULT) {
+            in->interval_us = MIN(in_period_us, DUSB_INTERVAL_DEFAULT - 1);
         }
     }
+}
 
-    /* Setting up control endpoint (EP0) */
-    USBEndpoint *ep0_out = usb_ep_get(dev, USB_TOKEN_OUT, 0);
-    USBEndpoint *ep0_in = usb_ep_get(dev, USB_TOKEN_IN, 0);
-    if (!ep0_out || !ep0_in) {
-        error_setg(errp, "Failed to find control endpoint");
-        return;
+/* Deterministic datagram size for a given datagram sequence number */
+static uint32_t dusb_agg_dgram_len(DUSBAgg *agg, uint32_t seq) {
+    uint32_t h = seq * 0x9E3779B1u;
+
+    if (agg->dgram_max == agg->dgram_min) {
+        return agg->dgram_min;
     }
-    ep0_out->max_packet_size = 512;
-    ep0_in->max_packet_size = 512;
-    ep0_out->pipeline = true;
-    ep0_in->pipeline = true;
+    h ^= h >> 15;
+    h *= 0x85EBCA77u;
+    h ^= h >> 13;
+    return agg->dgram_min + h % (agg->dgram_max - agg->dgram_min + 1);
+}
 
-    /* Initializing device state */
-    memset(s->alt, 0, sizeof(s->alt));
-    memset(s->in_data, 0, sizeof(s->in_data));
-    memset(s->in_data_len, 0, sizeof(s->in_data_len));
-    s->current_in_ep = 0;
+/* Bytes taken by an NDP16 indexing n datagrams, including the null entry */
+static uint32_t dusb_agg_ndp_len(uint32_t n) {
+    return DUSB_NDP16_LEN + 4 * (n + 1);
+}
 
-    /* Setting up timers for wakeup and IN data */
-    s->wakeup_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, dusb_wakeup_timer, s);
-    timer_mod(s->wakeup_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + s->wakeup_interval * 1000);
-    s->in_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, dusb_in_timer, s);
+/* Start a fresh NTB in the build buffer */
+static void dusb_agg_reset_build(DUSBAgg *agg) {
+    agg->build_len = DUSB_NTH16_LEN;
+    agg->ndgrams = 0;
+}
+
+/*
+ * Append the next generated datagram to the build NTB. Returns false if it
+ * would push the finished NTB (datagrams plus NDP16) beyond limit bytes; the
+ * datagram is then kept for the next NTB.
+ */
+static bool dusb_agg_push_dgram(DUSBAgg *agg, uint32_t limit, int64_t now) {
+    uint32_t off = ROUND_UP(agg->build_len, DUSB_NTB_ALIGN);
+    uint32_t len = dusb_agg_dgram_len(agg, agg->dgram_seq);
+    uint8_t *d;
+
+    if (agg->ndgrams >= agg->max_datagrams ||
+        ROUND_UP(off + len, DUSB_NTB_ALIGN) + dusb_agg_ndp_len(agg->ndgrams + 1) > limit) {
+        return false;
+    }
+
+    memset(agg->build + agg->build_len, 0, off - agg->build_len); /* Alignment padding */
+    d = agg->build + off;
+    stl_le_p(d, agg->dgram_seq);
+    for (uint32_t i = 4; i < len; i++) {
+        d[i] = (agg->dgram_seq + i) % 256;
+    }
+    if (agg->ndgrams == 0) {
+        agg->first_dgram_ns = now;
+    }
+    agg->dgram_off[agg->ndgrams] = off;
+    agg->dgram_len[agg->ndgrams] = len;
+    agg->ndgrams++;
+    agg->build_len = off + len;
+    agg->dgram_seq++;
+    return true;
+}
+
+/* Close the build NTB by appending its NDP16 and make it the ready NTB */
+static void dusb_agg_seal(DUSBAgg *agg) {
+    uint8_t *b = agg->build;
+    uint32_t ndp = ROUND_UP(agg->build_len, DUSB_NTB_ALIGN);
+    uint32_t ndp_len = dusb_agg_ndp_len(agg->ndgrams);
+    uint32_t total = ndp + ndp_len;
+    uint8_t *tmp;
+
+    memset(b + agg->build_len, 0, ndp - agg->build_len);
+    stl_le_p(b + ndp, DUSB_NDP16_SIGN);
+    stw_le_p(b + ndp + 4, ndp_len);
+    stw_le_p(b + ndp + 6, 0); /* wNextNdpIndex: single NDP per NTB */
+    for (uint32_t i = 0; i < agg->ndgrams; i++) {
+        stw_le_p(b + ndp + DUSB_NDP16_LEN + 4 * i, agg->dgram_off[i]);
+        stw_le_p(b + ndp + DUSB_NDP16_LEN + 4 * i + 2, agg->dgram_len[i]);
+    }
+    stl_le_p(b + ndp + DUSB_NDP16_LEN + 4 * agg->ndgrams, 0);
+
+    stl_le_p(b, DUSB_NTH16_SIGN);
+    stw_le_p(b + 4, DUSB_NTH16_LEN);
+    stw_le_p(b + 6, agg->in_seq++);
+    stw_le_p(b + 8, total);
+    stw_le_p(b + 10, ndp);
+
+    tmp = agg->ready;
+    agg->ready = agg->build;
+    agg->build = tmp;
+    agg->ready_len = total;
+    agg->ready_ndgrams = agg->ndgrams;
+    dusb_agg_reset_build(agg);
 }
 
+/* Seal the build NTB if it is full or timed out, and re-arm the flush timer */
+static void dusb_agg_update(DUSBState *s, int64_t now) {
+    DUSBAgg *agg = &s->agg;
+    int64_t deadline;
+
+    if (agg->ready_len == 0 && agg->ndgrams > 0 &&
+        (agg->ndgrams >= agg->max_datagrams ||
+         now - agg->first_dgram_ns >= (int64_t)agg->timeout_us * 1000)) {
+        dusb_agg_seal(agg);
+        dusb_ep_kick(s, dusb_ep(s, true, 3));
+    }
+
+    if (agg->dgram_interval_us == 0) {
+        return;
+    }
+    deadline = agg->next_dgram_ns;
+    if (agg->ready_len == 0 && agg->ndgrams > 0) {
+        deadline = MIN(deadline, agg->first_dgram_ns + (int64_t)agg->timeout_us * 1000);
+    }
+    dusb_timer_mod(&agg->timer, deadline);
+}
+
+/* Callback for datagram arrivals and partial NTB flushes on EP3 IN */
+static void dusb_agg_timer(void *opaque) {
+    DUSBState *s = opaque;
+    DUSBAgg *agg = &s->agg;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    while (agg->next_dgram_ns <= now) {
+        if (!dusb_agg_push_dgram(agg, agg->max_size, now)) {
+            if (agg->ready_len == 0 && agg->ndgrams > 0) {
+                dusb_agg_seal(agg);
+                dusb_ep_kick(s, dusb_ep(s, true, 3));
+                continue;
+            }
+            /* Both NTBs are occupied: the datagram is lost */
+            agg->dgram_seq++;
+            agg->in_dropped++;
+        }
+        agg->next_dgram_ns += (int64_t)agg->dgram_interval_us * 1000;
+    }
+    dusb_agg_update(s, now);
+}
+
+/* Begin producing datagrams when the IN alternate setting is selected */
+static void dusb_agg_start(DUSBState *s) {
+    DUSBAgg *agg = &s->agg;
+
+    if (!agg->enabled) {
+        return;
+    }
+    dusb_agg_reset_build(agg);
+    agg->ready_len = 0;
+    if (agg->dgram_interval_us) {
+        agg->next_dgram_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)agg->dgram_interval_us * 1000;
+        dusb_timer_mod(&agg->timer, agg->next_dgram_ns);
+    }
+}
+
+/* Stop the datagram source and discard any pending NTBs */
+static void dusb_agg_stop(DUSBState *s) {
+    DUSBAgg *agg = &s->agg;
+
+    if (!agg->enabled) {
+        return;
+    }
+    dusb_timer_del(&agg->timer);
+    dusb_agg_reset_build(agg);
+    agg->ready_len = 0;
+}
+
+/* Serve an EP3 IN transfer from the ready NTB */
+static void dusb_agg_handle_in(DUSBState *s, USBPacket *p) {
+    DUSBAgg *agg = &s->agg;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    /* Without a datagram clock the NTB is filled to fit this transfer */
+    if (agg->ready_len == 0 && agg->dgram_interval_us == 0) {
+        uint32_t limit = MIN(agg->max_size, dusb_packet_size(p));
+        while (dusb_agg_push_dgram(agg, limit, now)) {
+            /* Keep packing */
+        }
+        if (agg->ndgrams == 0) {
+            p->status = USB_RET_BABBLE;
+            qemu_log("DUSB: EP#3 IN transfer of %zu bytes cannot hold a datagram - Babble\n", dusb_packet_size(p));
+            return;
+        }
+        dusb_agg_seal(agg);
+    }
+
+    if (agg->ready_len == 0) {
+        p->status = USB_RET_NAK;
+        qemu_log("DUSB: No NTB ready on EP#3 IN - NAK\n");
+        return;
+    }
+    if (dusb_packet_size(p) < agg->ready_len) {
+        p->status = USB_RET_BABBLE;
+        qemu_log("DUSB: EP#3 IN transfer of %zu bytes too small for %u byte NTB - Babble\n",
+                 dusb_packet_size(p), agg->ready_len);
+        return;
+    }
+
+    dusb_packet_copy(p, agg->ready, agg->ready_len);
+    p->actual_length = agg->ready_len;
+    p->status = USB_RET_SUCCESS;
+    agg->in_ntbs++;
+    agg->in_datagrams += agg->ready_ndgrams;
+    agg->in_bytes += agg->ready_len;
+    qemu_log("DUSB: Sent NTB seq %u (%u bytes) on EP#3 IN\n",
+             lduw_le_p(agg->ready + 6), agg->ready_len);
+    agg->ready_len = 0;
+    dusb_agg_update(s, now);
+}
+
+/*
+ * Unpack an aggregated EP3 OUT transfer. Every NDP16 in the chain is walked
+ * and each datagram is bounds checked against wBlockLength.
+ */
+static void dusb_agg_handle_out(DUSBState *s, const uint8_t *buf, size_t len) {
+    DUSBAgg *agg = &s->agg;
+    uint32_t block, ndp;
+    uint32_t count = 0;
+    uint64_t bytes = 0;
+    int hops = 0;
+
+    if (len < DUSB_NTH16_LEN || ldl_le_p(buf) != DUSB_NTH16_SIGN ||
+        lduw_le_p(buf + 4) != DUSB_NTH16_LEN) {
+        goto bad;
+    }
+    block = lduw_le_p(buf + 8);
+    if (block < DUSB_NTH16_LEN || block > len) {
+        goto bad;
+    }
+
+    for (ndp = lduw_le_p(buf + 10); ndp; ndp = lduw_le_p(buf + ndp + 6)) {
+        uint32_t ndp_len;
+
+        if (ndp % DUSB_NTB_ALIGN || ndp + DUSB_NDP16_LEN > block ||
+            ++hops > DUSB_AGG_MAX_DATAGRAMS || ldl_le_p(buf + ndp) != DUSB_NDP16_SIGN) {
+            goto bad;
+        }
+        ndp_len = lduw_le_p(buf + ndp + 4);
+        if (ndp_len < dusb_agg_ndp_len(0) || ndp + ndp_len > block) {
+            goto bad;
+        }
+        for (uint32_t e = ndp + DUSB_NDP16_LEN; e + 4 <= ndp + ndp_len; e += 4) {
+            uint32_t d_off = lduw_le_p(buf + e);
+            uint32_t d_len = lduw_le_p(buf + e + 2);
+            if (d_off == 0 || d_len == 0) {
+                break;
+            }
+            if (d_off + d_len > block) {
+                goto bad;
+            }
+            count++;
+            bytes += d_len;
+        }
+    }
+
+    agg->out_ntbs++;
+    agg->out_datagrams += count;
+    agg->out_bytes += bytes;
+    qemu_log("DUSB: Received NTB seq %u on EP#3 OUT: %u datagrams, %" PRIu64 " bytes\n",
+             lduw_le_p(buf + 6), count, bytes);
+    return;
+
+bad:
+    agg->out_errors++;
+    qemu_log("DUSB: Malformed NTB on EP#3 OUT (%zu bytes) - dropped\n", len);
+}
+
+/* Reject aggregation settings the NTB builder cannot work with */
+static bool dusb_agg_check(DUSBState *s, Error **errp) {
+    DUSBAgg *agg = &s->agg;
+
+    if (!agg->enabled) {
+        return true;
+    }
+    if (agg->max_size > DUSB_AGG_MAX_NTB) {
+        error_setg(errp, "agg_max_size must not exceed %d", DUSB_AGG_MAX_NTB);
+        return false;
+    }
+    if (agg->max_datagrams == 0 || agg->max_datagrams > DUSB_AGG_MAX_DATAGRAMS) {
+        error_setg(errp, "agg_max_datagrams must be between 1 and %d", DUSB_AGG_MAX_DATAGRAMS);
+        return false;
+    }
+    if (agg->dgram_min < 4 || agg->dgram_max < agg->dgram_min) {
+        error_setg(errp, "agg_dgram_min must be at least 4 and not exceed agg_dgram_max");
+        return false;
+    }
+    if (ROUND_UP(DUSB_NTH16_LEN + agg->dgram_max, DUSB_NTB_ALIGN) + dusb_agg_ndp_len(1) > agg->max_size) {
+        error_setg(errp, "agg_max_size too small for an agg_dgram_max datagram");
+        return false;
+    }
+    return true;
+}
+
+/* Allocate aggregation buffers once the properties are known */
+static void dusb_agg_realize(DUSBState *s) {
+    DUSBAgg *agg = &s->agg;
+
+    if (!agg->enabled) {
+        return;
+    }
+    agg->build = g_malloc0(agg->max_size);
+    agg->ready = g_malloc0(agg->max_size);
+    dusb_agg_reset_build(agg);
+    dusb_timer_init(&agg->timer, dusb_agg_timer, s);
+    qemu_log("DUSB: EP3 framing enabled - max NTB %u bytes, %u datagrams, timeout %u us\n",
+             agg->max_size, agg->max_datagrams, agg->timeout_us);
+}
+
+/* Record one latency sample */
+static void dusb_hist_add(DUSBHist *h, uint64_t ns) {
+    int bucket = ns ? 63 - clz64(ns) : 0;
+
+    if (h->count == 0 || ns < h->min_ns) {
+        h->min_ns = ns;
+    }
+    h->max_ns = MAX(h->max_ns, ns);
+    h->count++;
+    h->sum_ns += ns;
+    h->buckets[MIN(bucket, DUSB_HIST_BUCKETS - 1)]++;
+}
+
+/* Enter or leave function suspend for SET_FEATURE(FUNCTION_SUSPEND) */
+static void dusb_func_suspend(DUSBState *s, int f, uint8_t options) {
+    DUSBFuncSuspend *fs = &s->fsusp[f];
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    bool lp = options & DUSB_FUNC_SUSPEND_LP;
+
+    fs->remote_wake = options & DUSB_FUNC_SUSPEND_RW;
+    if (lp == fs->suspended) {
+        return;
+    }
+    fs->suspended = lp;
+    if (lp) {
+        fs->suspend_ns = now;
+        fs->wake_ns = 0;
+        fs->suspends++;
+        qemu_log("DUSB: Interface %d function suspended, remote wake %s\n", f, fs->remote_wake ? "on" : "off");
+        return;
+    }
+    dusb_hist_add(&fs->active, now - fs->suspend_ns);
+    if (fs->wake_ns) {
+        dusb_hist_add(&fs->wake, now - fs->wake_ns);
+        fs->wake_ns = 0;
+    }
+    /* Retry what the paused engines NAKed or held back */
+    for (int i = 0; i < DUSB_NUM_EPS; i++) {
+        dusb_ep_kick(s, &s->eps[1][f * DUSB_NUM_EPS + i]);
+    }
+    /* Generation resumes with the transfers that fell due while suspended */
+    dusb_in_timer_rearm(s);
+    qemu_log("DUSB: Interface %d function resumed after %" PRId64 " ns\n", f, now - fs->suspend_ns);
+}
+
+/* Reset and SET_CONFIGURATION take every function out of suspend without a latency sample */
+static void dusb_func_suspend_clear(DUSBState *s) {
+    for (int f = 0; f < DUSB_MAX_FUNCS; f++) {
+        s->fsusp[f].suspended = false;
+        s->fsusp[f].remote_wake = false;
+        s->fsusp[f].wake_ns = 0;
+    }
+}
+
+/*
+ * Account one EP0 benchmark request. A guest issuing requests back to back
+ * sees the interval between their SETUP stages as the control round trip.
+ */
+static void dusb_ctrl_sample(DUSBState *s, int64_t now) {
+    DUSBCtrlBench *c = &s->ctrl;
+
+    if (c->last_ns && now - c->last_ns < DUSB_CTRL_IDLE_NS) {
+        dusb_hist_add(&c->rtt, now - c->last_ns);
+    }
+    c->last_ns = now;
+}
+
+/*
+ * UVC-style video source. A frame of frame_size bytes is captured every
+ * 1/fps seconds of virtual time and sent as a run of payloads, each
+ * opening with a 12-byte UVC header. The header carries the frame ID
+ * toggle, end-of-frame, the capture time as PTS and the send time as SCR,
+ * both on a 1 MHz clock. On EP2 every isochronous packet is one payload;
+ * on EP3 every bulk transfer is one payload of up to the endpoint size.
+ * Up to DUSB_VIDEO_QUEUE frames are buffered, further captures are dropped.
+ */
+static int64_t dusb_video_period_ns(DUSBVideo *v) {
+    return NANOSECONDS_PER_SECOND / v->fps;
+}
+
+/* Callback capturing a frame */
+static void dusb_video_timer(void *opaque) {
+    DUSBState *s = opaque;
+    DUSBVideo *v = &s->video;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    while (v->next_ns <= now) {
+        if (v->queued < DUSB_VIDEO_QUEUE) {
+            v->pts_ns[v->queued++] = v->next_ns;
+            if (v->queued == 1) {
+                dusb_ep_kick(s, dusb_ep(s, true, v->ep));
+            }
+        } else {
+            v->dropped++;
+            qemu_log("DUSB: Video frame dropped, %u frames queued\n", v->queued);
+        }
+        v->next_ns += dusb_video_period_ns(v);
+    }
+    dusb_timer_mod(&v->timer, v->next_ns);
+}
+
+/* Start capturing when the IN alternate setting is selected */
+static void dusb_video_start(DUSBState *s) {
+    DUSBVideo *v = &s->video;
+
+    if (!v->ep) {
+        return;
+    }
+    v->queued = 0;
+    v->pos = 0;
+    v->next_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    dusb_timer_mod(&v->timer, v->next_ns);
+}
+
+/* Stop capturing and discard the queued frames */
+static void dusb_video_stop(DUSBState *s) {
+    DUSBVideo *v = &s->video;
+
+    if (!v->ep) {
+        return;
+    }
+    dusb_timer_del(&v->timer);
+    v->queued = 0;
+    v->pos = 0;
+}
+
+/* Serve a video IN transfer with the next payload of the oldest queued frame */
+static void dusb_video_handle_in(DUSBState *s, DUSBEp *e, USBPacket *p) {
+    DUSBVideo *v = &s->video;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    size_t max = MIN(dusb_packet_size(p), e->size);
+    uint8_t hdr[DUSB_UVC_HDR_LEN];
+    uint32_t chunk;
+    int pattern = e->pattern == DUSB_PATTERN_LEGACY ? DUSB_PATTERN_COUNT : e->pattern;
+
+    if (!v->queued) {
+        p->status = USB_RET_NAK;
+        e->stats.naks++;
+        qemu_log("DUSB: No video frame ready on EP#%d IN - NAK\n", v->ep);
+        return;
+    }
+    if (max <= DUSB_UVC_HDR_LEN) {
+        p->status = USB_RET_BABBLE;
+        qemu_log("DUSB: EP#%d IN transfer of %zu bytes cannot hold a video payload - Babble\n", v->ep, max);
+        return;
+    }
+
+    chunk = MIN(v->frame_size - v->pos, max - DUSB_UVC_HDR_LEN);
+    hdr[0] = DUSB_UVC_HDR_LEN;
+    hdr[1] = DUSB_UVC_EOH | DUSB_UVC_PTS | DUSB_UVC_SCR | v->fid |
+             (v->pos + chunk == v->frame_size ? DUSB_UVC_EOF : 0);
+    stl_le_p(hdr + 2, v->pts_ns[0] / 1000);
+    stl_le_p(hdr + 6, now / 1000);
+    stw_le_p(hdr + 10, (now / 1000000) & 0x7ff); /* 1 kHz SOF counter */
+    dusb_packet_copy(p, hdr, sizeof(hdr));
+    dusb_packet_copy(p, dusb_pattern_table(s, pattern) + v->pos % DUSB_PATTERN_PERIOD, chunk);
+    p->actual_length = DUSB_UVC_HDR_LEN + chunk;
+    p->status = USB_RET_SUCCESS;
+    e->stats.packets++;
+    e->stats.bytes += p->actual_length;
+    v->payloads++;
+    v->bytes += chunk;
+    v->pos += chunk;
+
+    if (v->pos == v->frame_size) {
+        int64_t lat = now - v->pts_ns[0];
+
+        dusb_hist_add(&v->lat, lat);
+        v->frames++;
+        if (lat > dusb_video_period_ns(v)) {
+            v->late++;
+        }
+        memmove(v->pts_ns, v->pts_ns + 1, sizeof(v->pts_ns) - sizeof(v->pts_ns[0]));
+        v->queued--;
+        v->pos = 0;
+        v->fid ^= DUSB_UVC_FID;
+        qemu_log("DUSB: Video frame sent on EP#%d IN after %" PRId64 " ns\n", v->ep, lat);
+    }
+}
+
+/* Reject video settings that cannot produce frames */
+static bool dusb_video_check(DUSBState *s, Error **errp) {
+    DUSBVideo *v = &s->video;
+
+    if (!v->ep) {
+        return true;
+    }
+    if (v->ep != 2 && v->ep != 3) {
+        error_setg(errp, "video_ep must be 0 (off), 2 (isochronous) or 3 (bulk)");
+        return false;
+    }
+    if (v->ep == 3 && s->agg.enabled) {
+        error_setg(errp, "video_ep=3 cannot be combined with ep3_framing");
+        return false;
+    }
+    if (v->fps == 0 || v->fps > 1000) {
+        error_setg(errp, "video_fps must be between 1 and 1000");
+        return false;
+    }
+    if (v->frame_size == 0) {
+        error_setg(errp, "video_frame_size must not be 0");
+        return false;
+    }
+    return true;
+}
+
+static void dusb_video_realize(DUSBState *s) {
+    DUSBVideo *v = &s->video;
+
+    if (!v->ep) {
+        return;
+    }
+    dusb_timer_init(&v->timer, dusb_video_timer, s);
+    qemu_log("DUSB: Video on EP%d IN - %u byte frames at %u fps\n", v->ep, v->frame_size, v->fps);
+}
+
+/*
+ * Command/response engine. In alternate setting 2 of the first function,
+ * every EP3 OUT transfer is one command: a DUSBCmdHdr followed by the
+ * command data. The command waits for the first of `workers` processing
+ * units to become free and then takes cost_us[opcode] plus
+ * cost_ns_per_kib[opcode] per KiB of data. Both are decided on arrival, so
+ * the engine needs no timer of its own: slots stays sorted by completion
+ * time, and EP3 IN is woken when the head is due. Each EP3 IN transfer
+ * carries the next finished response; one that does not fit continues in
+ * the next transfer. With workers > 1 responses can overtake each other,
+ * and the tag tells the host which command a response belongs to. EP3 OUT
+ * NAKs while depth commands are outstanding.
+ *
+ * CRC32C, SHA256 and COMPRESS make the engine an offload accelerator: the
+ * data is really processed, on the thread pool so the main loop keeps
+ * serving the bus. The slot waits at the tail with done_ns = INT64_MAX until
+ * the result is back and is then due at the later of its modelled
+ * completion and the virtual time the result arrived. Host compute speed
+ * therefore shows up in the response times once it exceeds the model.
+ */
+static void dusb_cmd_reset(DUSBCmd *c) {
+    for (int i = 0; i < c->count; i++) {
+        g_free(c->slots[i].data);
+    }
+    memset(c->slots, 0, sizeof(c->slots));
+    c->count = 0;
+    c->pos = 0;
+    memset(c->worker_free_ns, 0, sizeof(c->worker_free_ns));
+    /* Jobs still in the thread pool complete into the void */
+    c->gen++;
+}
+
+/* Queue a slot by completion time, behind responses due at the same time */
+static void dusb_cmd_insert(DUSBState *s, const DUSBCmdSlot *r) {
+    DUSBCmd *c = &s->cmd;
+    int at;
+
+    for (at = c->count; at > 0 && c->slots[at - 1].done_ns > r->done_ns; at--) {
+    }
+    memmove(&c->slots[at + 1], &c->slots[at], (c->count - at) * sizeof(*r));
+    c->slots[at] = *r;
+    c->count++;
+    if (at == 0 && r->done_ns != INT64_MAX) {
+        dusb_ep_wake_at(s, dusb_ep(s, true, 3), r->done_ns);
+    }
+}
+
+/* An offloaded command, owned by the thread pool until dusb_offload_done */
+typedef struct DUSBOffloadJob {
+    DUSBState *s;
+    uint32_t gen;
+    uint32_t id;
+    uint8_t opcode;
+    uint8_t status;
+    uint8_t *in;
+    uint32_t in_len;
+    uint8_t *out;
+    uint32_t out_len;
+    uint32_t value;
+    int64_t due_ns;            /* Modelled completion */
+    int64_t host_ns;
+} DUSBOffloadJob;
+
+/* Runs in a worker thread: only the job is touched here */
+static int dusb_offload_work(void *opaque) {
+    DUSBOffloadJob *j = opaque;
+    int64_t start = get_clock();
+    size_t len;
+
+    switch (j->opcode) {
+        case DUSB_CMD_CRC32C:
+            j->value = crc32c(0xffffffff, j->in, j->in_len);
+            break;
+        case DUSB_CMD_SHA256:
+            if (qcrypto_hash_bytes(QCRYPTO_HASH_ALGO_SHA256, (const char *)j->in, j->in_len, &j->out, &len,
+                                   NULL) < 0 || len != DUSB_SHA256_LEN) {
+                j->status = DUSB_CMD_FAILED;
+                break;
+            }
+            j->out_len = len;
+            break;
+        case DUSB_CMD_COMPRESS: {
+            uLongf out_len = compressBound(j->in_len);
+
+            j->out = g_malloc(out_len);
+            if (compress2(j->out, &out_len, j->in, j->in_len, Z_BEST_SPEED) != Z_OK ||
+                out_len > DUSB_MAX_PAYLOAD - sizeof(DUSBCmdResp)) {
+                j->status = DUSB_CMD_FAILED;
+                break;
+            }
+            j->out_len = out_len;
+            j->value = j->in_len;
+            break;
+        }
+    }
+    j->host_ns = get_clock() - start;
+    return 0;
+}
+
+static void dusb_offload_free(DUSBOffloadJob *j) {
+    g_free(j->in);
+    g_free(j->out);
+    g_free(j);
+}
+
+/* Back in the main loop: make the result the response of its slot */
+static void dusb_offload_done(void *opaque, int ret) {
+    DUSBOffloadJob *j = opaque;
+    DUSBState *s = j->s;
+    DUSBCmd *c = &s->cmd;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    DUSBCmdSlot r;
+    int i;
+
+    c->jobs--;
+    for (i = 0; j->gen == c->gen && i < c->count; i++) {
+        if (c->slots[i].done_ns == INT64_MAX && c->slots[i].job == j->id) {
+            break;
+        }
+    }
+    if (j->gen != c->gen || i == c->count) {
+        dusb_offload_free(j);
+        return;
+    }
+    r = c->slots[i];
+    memmove(&c->slots[i], &c->slots[i + 1], (c->count - i - 1) * sizeof(r));
+    c->count--;
+
+    r.status = j->status;
+    if (j->status == DUSB_CMD_OK) {
+        r.value = j->value;
+        r.len = j->out_len;
+        r.data = j->out;
+        j->out = NULL;
+    } else {
+        c->rejected++;
+        c->offload_failed++;
+    }
+    r.done_ns = MAX(j->due_ns, now);
+    c->late += now > j->due_ns;
+    c->offloaded++;
+    c->offload_bytes += j->in_len;
+    dusb_hist_add(&c->host, j->host_ns);
+    dusb_cmd_insert(s, &r);
+    dusb_offload_free(j);
+}
+
+/* Hand the data of a command to the thread pool */
+static void dusb_offload_submit(DUSBState *s, DUSBCmdSlot *r, const uint8_t *data, uint32_t len) {
+    DUSBCmd *c = &s->cmd;
+    DUSBOffloadJob *j = g_new0(DUSBOffloadJob, 1);
+
+    j->s = s;
+    j->gen = c->gen;
+    j->id = r->job = ++c->next_job;
+    j->opcode = r->opcode;
+    j->status = DUSB_CMD_OK;
+    j->in = g_memdup2(data, len);
+    j->in_len = len;
+    j->due_ns = r->done_ns;
+    r->done_ns = INT64_MAX;
+    c->jobs++;
+    thread_pool_submit_aio(dusb_offload_work, j, dusb_offload_done, j);
+}
+
+/* Accept the command in an EP3 OUT transfer and schedule its response */
+static void dusb_cmd_handle_out(DUSBState *s, const uint8_t *buf, size_t len, int64_t now) {
+    DUSBCmd *c = &s->cmd;
+    DUSBCmdHdr h;
+    DUSBCmdSlot r = { .status = DUSB_CMD_OK, .arrive_ns = now };
+    size_t data_len = len - sizeof(h);
+    uint64_t bytes = 0;
+    int64_t cost = 0;
+    int w = 0;
+
+    if (len < sizeof(h)) {
+        c->malformed++;
+        qemu_log("DUSB: EP3 OUT transfer of %zu bytes is too short for a command\n", len);
+        return;
+    }
+    memcpy(&h, buf, sizeof(h));
+    r.opcode = h.opcode;
+    r.tag = le32_to_cpu(h.tag);
+    switch (h.opcode) {
+        case DUSB_CMD_NOP:
+            r.status = data_len ? DUSB_CMD_BAD_LENGTH : DUSB_CMD_OK;
+            break;
+        case DUSB_CMD_READ:
+            bytes = le32_to_cpu(h.len);
+            if (data_len || bytes > DUSB_MAX_PAYLOAD - sizeof(DUSBCmdResp)) {
+                r.status = DUSB_CMD_BAD_LENGTH;
+            } else {
+                r.len = bytes;
+            }
+            break;
+        case DUSB_CMD_WRITE:
+            bytes = data_len;
+            if (le32_to_cpu(h.len) != data_len) {
+                r.status = DUSB_CMD_BAD_LENGTH;
+            } else {
+                r.value = crc32c(0xffffffff, buf + sizeof(h), data_len);
+            }
+            break;
+        case DUSB_CMD_CRC32C:
+        case DUSB_CMD_SHA256:
+        case DUSB_CMD_COMPRESS:
+            bytes = data_len;
+            if (le32_to_cpu(h.len) != data_len) {
+                r.status = DUSB_CMD_BAD_LENGTH;
+            }
+            break;
+        default:
+            r.status = DUSB_CMD_BAD_OPCODE;
+            break;
+    }
+    if (r.status == DUSB_CMD_OK) {
+        cost = (int64_t)c->cost_us[h.opcode] * 1000 + bytes * c->cost_ns_per_kib[h.opcode] / KiB;
+    } else {
+        c->rejected++;
+    }
+
+    /* The worker that frees up first takes the command */
+    for (int i = 1; i < c->workers; i++) {
+        if (c->worker_free_ns[i] < c->worker_free_ns[w]) {
+            w = i;
+        }
+    }
+    r.start_ns = MAX(now, c->worker_free_ns[w]);
+    r.done_ns = r.start_ns + cost;
+    c->worker_free_ns[w] = r.done_ns;
+    qemu_log("DUSB: Command %u tag %u accepted, response due in %" PRId64 " ns\n", r.opcode, r.tag,
+             r.done_ns - now);
+
+    if (r.status == DUSB_CMD_OK && r.opcode >= DUSB_CMD_CRC32C) {
+        dusb_offload_submit(s, &r, buf + sizeof(h), data_len);
+    }
+    dusb_cmd_insert(s, &r);
+    c->commands++;
+    c->max_outstanding = MAX(c->max_outstanding, c->count);
+    dusb_hist_add(&c->queue, r.start_ns - now);
+}
+
+/* Serve an EP3 IN transfer with the next finished response */
+static void dusb_cmd_handle_in(DUSBState *s, DUSBEp *e, USBPacket *p) {
+    DUSBCmd *c = &s->cmd;
+    DUSBCmdSlot *r = &c->slots[0];
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int pattern = e->pattern == DUSB_PATTERN_LEGACY ? DUSB_PATTERN_COUNT : e->pattern;
+    DUSBCmdResp resp;
+    uint32_t total, chunk, hdr_part;
+
+    if (!c->count || r->done_ns > now) {
+        p->status = USB_RET_NAK;
+        e->stats.naks++;
+        if (c->count && r->done_ns != INT64_MAX) {
+            dusb_ep_wake_at(s, e, r->done_ns);
+        }
+        return;
+    }
+
+    resp = (DUSBCmdResp) {
+        .opcode = r->opcode,
+        .status = r->status,
+        .tag = cpu_to_le32(r->tag),
+        .len = cpu_to_le32(r->len),
+        .value = cpu_to_le32(r->value),
+        .queue_ns = cpu_to_le64(r->start_ns - r->arrive_ns),
+        .cost_ns = cpu_to_le64(r->done_ns - r->start_ns),
+    };
+    total = sizeof(resp) + r->len;
+    chunk = MIN(total - c->pos, dusb_packet_size(p));
+    hdr_part = c->pos < sizeof(resp) ? MIN(chunk, sizeof(resp) - c->pos) : 0;
+    if (hdr_part) {
+        dusb_packet_copy(p, (uint8_t *)&resp + c->pos, hdr_part);
+    }
+    if (chunk > hdr_part) {
+        uint32_t off = c->pos + hdr_part - sizeof(resp);
+        const uint8_t *data = r->data ? r->data : dusb_pattern_table(s, pattern) + r->tag % DUSB_PATTERN_PERIOD;
+        dusb_packet_copy(p, data + off, chunk - hdr_part);
+    }
+    p->actual_length = chunk;
+    p->status = USB_RET_SUCCESS;
+    e->stats.packets++;
+    e->stats.bytes += chunk;
+    c->pos += chunk;
+    if (c->pos < total) {
+        return;
+    }
+
+    dusb_hist_add(&c->rtt, now - r->arrive_ns);
+    c->responses++;
+    c->pos = 0;
+    qemu_log("DUSB: Response to tag %u sent after %" PRId64 " ns\n", r->tag, now - r->arrive_ns);
+    g_free(r->data);
+    memmove(&c->slots[0], &c->slots[1], --c->count * sizeof(*r));
+    c->slots[c->count].data = NULL;
+    if (c->count == c->depth - 1) {
+        /* EP3 OUT NAKed the last command for lack of room */
+        dusb_ep_kick(s, dusb_ep(s, false, 3));
+    }
+}
+
+/* Reject command engine settings that conflict with other EP3 users or exceed the queues */
+static bool dusb_cmd_check(DUSBState *s, Error **errp) {
+    DUSBCmd *c = &s->cmd;
+
+    if (!c->enabled) {
+        return true;
+    }
+    if (s->agg.enabled || s->video.ep == 3) {
+        error_setg(errp, "cmd_engine cannot be combined with ep3_framing or video_ep=3");
+        return false;
+    }
+    if (c->depth == 0 || c->depth > DUSB_CMD_MAX_DEPTH) {
+        error_setg(errp, "cmd_depth must be between 1 and %d", DUSB_CMD_MAX_DEPTH);
+        return false;
+    }
+    if (c->workers == 0 || c->workers > DUSB_CMD_MAX_WORKERS) {
+        error_setg(errp, "cmd_workers must be between 1 and %d", DUSB_CMD_MAX_WORKERS);
+        return false;
+    }
+    return true;
+}
+
+static void dusb_cmd_realize(DUSBState *s) {
+    DUSBCmd *c = &s->cmd;
+
+    if (!c->enabled) {
+        return;
+    }
+    qemu_log("DUSB: Command engine on EP3 in alt %d - depth %u, %u workers\n", DUSB_ALT_CMD, c->depth,
+             c->workers);
+}
+
+/*
+ * Offloaded results do not travel with the migration. Commands still being
+ * computed on the source, and SHA256 or COMPRESS responses not yet started,
+ * are answered with DUSB_CMD_ABORTED right away instead. A response the
+ * host has partly read keeps its header, and its computed data comes along
+ * in head_data, so the transfer continues where it stopped.
+ */
+static void dusb_cmd_post_load(DUSBState *s) {
+    DUSBCmd *c = &s->cmd;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t n = c->count;
+    DUSBCmdSlot *loaded = g_memdup2(c->slots, n * sizeof(*loaded));
+
+    c->count = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        DUSBCmdSlot r = loaded[i];
+        if (i == 0 && c->pos) {
+            if (c->head_data && c->head_len == r.len) {
+                r.data = c->head_data;
+                c->head_data = NULL;
+            }
+        } else if (r.done_ns == INT64_MAX ||
+            (r.status == DUSB_CMD_OK && (r.opcode == DUSB_CMD_SHA256 || r.opcode == DUSB_CMD_COMPRESS))) {
+            r.status = DUSB_CMD_ABORTED;
+            r.len = r.value = 0;
+            r.done_ns = now;
+            c->rejected++;
+        }
+        dusb_cmd_insert(s, &r);
+    }
+    g_free(loaded);
+    g_free(c->head_data);
+    c->head_data = NULL;
+    c->head_len = 0;
+}
+
+/* Pattern bytes for chunk number chunk of an EP0 benchmark transfer */
+static const uint8_t *dusb_ctrl_pattern(DUSBState *s, int pattern, int chunk) {
+    return dusb_pattern_table(s, pattern) + (chunk * DUSB_CTRL_CHUNK_STRIDE) % DUSB_PATTERN_PERIOD;
+}
+
+/* Serve or check the data stage of a CTRL_READ or CTRL_WRITE request */
+static bool dusb_ctrl_transfer(DUSBState *s, USBPacket *p, bool read, int pattern,
+                               int chunk, int length, uint8_t *data) {
+    DUSBCtrlBench *c = &s->ctrl;
+
+    if (pattern == DUSB_PATTERN_LEGACY || pattern >= DUSB_PATTERN_NUM) {
+        return false;
+    }
+    dusb_ctrl_sample(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    if (read) {
+        memcpy(data, dusb_ctrl_pattern(s, pattern, chunk), length);
+        c->reads++;
+        p->actual_length = length;
+    } else {
+        if (memcmp(data, dusb_ctrl_pattern(s, pattern, chunk), length)) {
+            c->errors++;
+            qemu_log("DUSB: CTRL_WRITE chunk %d of %d bytes failed verification\n", chunk, length);
+        }
+        c->writes++;
+        p->actual_length = 0;
+    }
+    c->bytes += length;
+    return true;
+}
+
+/* Build the little-endian EP0 benchmark block for DUSB_VREQ_GET_CTRL_STATS */
+static void dusb_fill_ctrl_stats(DUSBState *s, DUSBVendorCtrlStats *st) {
+    DUSBCtrlBench *c = &s->ctrl;
+
+    memset(st, 0, sizeof(*st));
+    st->reads = cpu_to_le64(c->reads);
+    st->writes = cpu_to_le64(c->writes);
+    st->bytes = cpu_to_le64(c->bytes);
+    st->errors = cpu_to_le32(c->errors);
+    st->deferred = cpu_to_le32(c->deferred);
+    st->rtt_count = cpu_to_le64(c->rtt.count);
+    st->rtt_sum = cpu_to_le64(c->rtt.sum_ns);
+    st->rtt_min = cpu_to_le64(c->rtt.min_ns);
+    st->rtt_max = cpu_to_le64(c->rtt.max_ns);
+    for (int i = 0; i < DUSB_HIST_BUCKETS; i++) {
+        st->rtt_hist[i] = cpu_to_le64(c->rtt.buckets[i]);
+    }
+}
+
+/* Whether a pattern and payload size can be combined on an endpoint */
+static bool dusb_ep_config_valid(const DUSBEp *e, uint8_t pattern, uint32_t size) {
+    if (pattern == DUSB_PATTERN_LEGACY) {
+        /* The legacy buffers only back the endpoints of the first function, and only up to their size */
+        return dusb_ep_func(e) == 0 && size <= ((e->addr & USB_DIR_IN) ? DUSB_LEGACY_MAX_PAYLOAD : DUSB_MAX_PAYLOAD);
+    }
+    return pattern < DUSB_PATTERN_NUM && size <= DUSB_MAX_PAYLOAD && size >= DUSB_PAYLOAD_HDR_LEN;
+}
+
+/*
+ * Bring an endpoint's runtime state in line with a changed configuration.
+ * A pending IN payload was built for the old configuration and is dropped.
+ */
+static void dusb_ep_apply(DUSBState *s, DUSBEp *e) {
+    int64_t now;
+
+    if (!s->dev.qdev.realized) {
+        return;
+    }
+    now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    e->tokens = 0;
+    e->tokens_ns = now;
+    if (e->addr & USB_DIR_IN) {
+        dusb_ep_drop_pending(s, e);
+        e->next_ns = now + (int64_t)e->interval_us * 1000;
+    } else {
+        e->next_ns = now;
+    }
+    if (e->queue_due_ns) {
+        /* A transfer held for data may be served under the new settings */
+        e->queue_due_ns = now;
+    }
+    dusb_in_timer_rearm(s);
+    qemu_log("DUSB: EP 0x%02x configured - interval %u us, size %u, pattern %d, rate %u B/s, "
+             "latency %u+%u us, %s\n", e->addr, e->interval_us, e->size, e->pattern, e->rate_bps,
+             e->latency_us, e->jitter_us, e->running ? "running" : "stopped");
+}
+
+/* Apply a vendor configuration block to one endpoint */
+static void dusb_ep_configure(DUSBState *s, DUSBEp *e, const DUSBVendorEpConfig *cfg) {
+    e->interval_us = le32_to_cpu(cfg->interval_us);
+    e->size = le32_to_cpu(cfg->size);
+    e->pattern = cfg->pattern;
+    e->running = cfg->running;
+    dusb_ep_apply(s, e);
+}
+
+/* Start or stop traffic on one endpoint */
+static void dusb_ep_set_running(DUSBState *s, DUSBEp *e, bool running) {
+    if (e->running == running) {
+        return;
+    }
+    e->running = running;
+    dusb_ep_apply(s, e);
+}
+
+/* Upper bound of the log2 bucket holding the pct-th percentile sample */
+static uint64_t dusb_hist_percentile(const DUSBHist *h, int pct) {
+    uint64_t rank = (h->count * pct + 99) / 100;
+    uint64_t seen = 0;
+
+    if (!h->count) {
+        return 0;
+    }
+    for (int i = 0; i < DUSB_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen >= rank) {
+            return MIN(h->max_ns, MAX(h->min_ns, (2ull << i) - 1));
+        }
+    }
+    return h->max_ns;
+}
+
+/* Append a latency summary object for a histogram */
+static void dusb_hist_json(GString *json, const DUSBHist *h) {
+    g_string_append_printf(json,
+                           "{\"samples\": %" PRIu64 ", \"min\": %" PRIu64 ", \"mean\": %" PRIu64 ", \"p50\": %" PRIu64
+                           ", \"p90\": %" PRIu64 ", \"p99\": %" PRIu64 ", \"max\": %" PRIu64 "}",
+                           h->count, h->min_ns, h->count ? h->sum_ns / h->count : 0, dusb_hist_percentile(h, 50),
+                           dusb_hist_percentile(h, 90), dusb_hist_percentile(h, 99), h->max_ns);
+}
+
+/*
+ * Parameter sweep. Each point runs one endpoint with one size and interval
+ * for dwell_ms while every other endpoint is stopped, then the counter deltas
+ * are stored and the next point is configured. The guest keeps a source/sink
+ * tool running on the endpoints under test for the whole sweep.
+ */
+static void dusb_sweep_begin_point(DUSBState *s, int64_t now) {
+    DUSBSweep *sw = &s->sweep;
+    DUSBSweepPoint *pt = &sw->points[sw->cur];
+    DUSBEp *e = dusb_ep_by_addr(s, pt->addr);
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            if (&s->eps[d][i] != e) {
+                dusb_ep_set_running(s, &s->eps[d][i], false);
+            }
+        }
+    }
+    e->interval_us = pt->interval_us;
+    if (pt->size) {
+        e->size = pt->size;
+    }
+    e->running = true;
+    dusb_ep_apply(s, e);
+
+    sw->base = e->stats;
+    sw->point_ns = now;
+    e->last_ns = 0;
+    dusb_timer_mod(&sw->timer, now + (int64_t)sw->dwell_ms * SCALE_MS);
+    qemu_log("DUSB: Sweep point %d/%d - EP 0x%02x, size %u, interval %u us\n", sw->cur + 1, sw->npoints,
+             pt->addr, pt->size, pt->interval_us);
+}
+
+static void dusb_sweep_end_point(DUSBState *s, int64_t now) {
+    DUSBSweep *sw = &s->sweep;
+    DUSBSweepPoint *pt = &sw->points[sw->cur];
+    const DUSBEpStats *st = &dusb_ep_by_addr(s, pt->addr)->stats;
+
+    pt->elapsed_ns = now - sw->point_ns;
+    pt->stats.packets = st->packets - sw->base.packets;
+    pt->stats.bytes = st->bytes - sw->base.bytes;
+    pt->stats.naks = st->naks - sw->base.naks;
+    pt->stats.lost = st->lost - sw->base.lost;
+    pt->stats.errors = st->errors - sw->base.errors;
+}
+
+/* Put back the endpoint settings from before the sweep */
+static void dusb_sweep_finish(DUSBState *s, bool aborted) {
+    DUSBSweep *sw = &s->sweep;
+
+    dusb_timer_del(&sw->timer);
+    sw->active = false;
+    sw->aborted = aborted;
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            DUSBEp *e = &s->eps[d][i];
+            e->interval_us = sw->saved[d][i].interval_us;
+            e->size = sw->saved[d][i].size;
+            e->running = sw->saved[d][i].running;
+            dusb_ep_apply(s, e);
+        }
+    }
+    qemu_log("DUSB: Sweep %s after %d of %d points\n", aborted ? "aborted" : "finished", sw->cur, sw->npoints);
+}
+
+static void dusb_sweep_timer(void *opaque) {
+    DUSBState *s = opaque;
+    DUSBSweep *sw = &s->sweep;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    dusb_sweep_end_point(s, now);
+    if (++sw->cur < sw->npoints) {
+        dusb_sweep_begin_point(s, now);
+    } else {
+        dusb_sweep_finish(s, false);
+    }
+}
+
+/* Record the latency of one completed transfer on the endpoint under test */
+static void dusb_sweep_sample(DUSBState *s, DUSBEp *e, uint64_t lat_ns) {
+    DUSBSweep *sw = &s->sweep;
+
+    if (sw->active && sw->points[sw->cur].addr == e->addr) {
+        dusb_hist_add(&sw->points[sw->cur].lat, lat_ns);
+    }
+}
+
+/*
+ * Account the latency of a completed transfer: for IN the time the payload
+ * waited for the host after becoming readable, for OUT the interval since
+ * the previous accepted transfer. The first good transfer after an
+ * injected fault also closes its recovery time.
+ */
+static void dusb_ep_sample(DUSBState *s, DUSBEp *e, int64_t now) {
+    int64_t lat_ns;
+
+    if (e->fault.pending_ns) {
+        dusb_hist_add(&e->fault.recovery, now - e->fault.pending_ns);
+        e->fault.pending_ns = 0;
+    }
+
+    if (e->addr & USB_DIR_IN) {
+        lat_ns = now - e->ready_ns;
+    } else {
+        lat_ns = e->last_ns ? now - e->last_ns : -1;
+        e->last_ns = now;
+    }
+    if (lat_ns >= 0) {
+        dusb_hist_add(&e->lat, lat_ns);
+        dusb_sweep_sample(s, e, lat_ns);
+    }
+}
+
+/* Parse a comma separated list of unsigned values */
+static int dusb_sweep_parse_list(const char *list, uint32_t *vals, Error **errp) {
+    char **items = g_strsplit(list, ",", -1);
+    int n = 0;
+
+    for (char **it = items; *it; it++) {
+        char *end;
+        uint64_t v = g_ascii_strtoull(*it, &end, 0);
+        if (end == *it || *end || v > UINT32_MAX || n == DUSB_SWEEP_MAX_AXIS) {
+            error_setg(errp, "invalid sweep value list '%s'", list);
+            n = -1;
+            break;
+        }
+        vals[n++] = v;
+    }
+    g_strfreev(items);
+    return n;
+}
+
+/*
+ * Start a sweep described by "key=v1,v2,...;key=..." with keys ep (endpoint
+ * addresses), size (IN payload sizes), interval_us and dwell_ms. Points are
+ * the cross product of the lists; sizes only apply to IN endpoints.
+ */
+static bool dusb_sweep_start(DUSBState *s, const char *spec, Error **errp) {
+    DUSBSweep *sw = &s->sweep;
+    uint32_t eps[DUSB_SWEEP_MAX_AXIS] = {USB_DIR_IN | 3};
+    uint32_t sizes[DUSB_SWEEP_MAX_AXIS] = {1024};
+    uint32_t intervals[DUSB_SWEEP_MAX_AXIS] = {0};
+    uint32_t dwell = 1000;
+    int neps = 1, nsizes = 1, nintervals = 1, n = 0;
+    char **fields = g_strsplit(spec, ";", -1);
+    bool ok = true;
+
+    for (char **f = fields; ok && *f; f++) {
+        char *eq = strchr(*f, '=');
+        uint32_t one[DUSB_SWEEP_MAX_AXIS];
+
+        if (!eq) {
+            error_setg(errp, "sweep field '%s' is not key=value", *f);
+            ok = false;
+            break;
+        }
+        *eq++ = '\0';
+        if (!strcmp(*f, "ep")) {
+            ok = (neps = dusb_sweep_parse_list(eq, eps, errp)) > 0;
+        } else if (!strcmp(*f, "size")) {
+            ok = (nsizes = dusb_sweep_parse_list(eq, sizes, errp)) > 0;
+        } else if (!strcmp(*f, "interval_us")) {
+            ok = (nintervals = dusb_sweep_parse_list(eq, intervals, errp)) > 0;
+        } else if (!strcmp(*f, "dwell_ms")) {
+            int count = dusb_sweep_parse_list(eq, one, errp);
+            if (count < 0) {
+                ok = false;
+                break;
+            }
+            if (count != 1 || one[0] == 0) {
+                error_setg(errp, "dwell_ms must be a single non-zero value");
+                ok = false;
+                break;
+            }
+            dwell = one[0];
+        } else {
+            error_setg(errp, "unknown sweep key '%s'", *f);
+            ok = false;
+        }
+    }
+    g_strfreev(fields);
+    if (!ok) {
+        return false;
+    }
+
+    for (int i = 0; i < neps; i++) {
+        DUSBEp *e = dusb_ep_by_addr(s, eps[i]);
+        if (!e) {
+            error_setg(errp, "sweep endpoint 0x%x does not exist", eps[i]);
+            return false;
+        }
+        for (int j = 0; (e->addr & USB_DIR_IN) && j < nsizes; j++) {
+            if (!dusb_ep_config_valid(e, e->pattern, sizes[j])) {
+                error_setg(errp, "sweep size %u is not valid on EP 0x%02x", sizes[j], e->addr);
+                return false;
+            }
+        }
+        n += nintervals * ((e->addr & USB_DIR_IN) ? nsizes : 1);
+    }
+    for (int j = 0; j < nintervals; j++) {
+        if (intervals[j] == DUSB_INTERVAL_DEFAULT) {
+            error_setg(errp, "sweep interval %u is reserved", intervals[j]);
+            return false;
+        }
+    }
+    if (n > DUSB_SWEEP_MAX_POINTS) {
+        error_setg(errp, "sweep has %d points, at most %d are supported", n, DUSB_SWEEP_MAX_POINTS);
+        return false;
+    }
+
+    g_free(sw->points);
+    sw->points = g_new0(DUSBSweepPoint, n);
+    sw->npoints = 0;
+    for (int i = 0; i < neps; i++) {
+        bool in = eps[i] & USB_DIR_IN;
+        for (int j = 0; j < nintervals; j++) {
+            for (int k = 0; k < (in ? nsizes : 1); k++) {
+                DUSBSweepPoint *pt = &sw->points[sw->npoints++];
+                pt->addr = eps[i];
+                pt->size = in ? sizes[k] : 0;
+                pt->interval_us = intervals[j];
+            }
+        }
+    }
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            sw->saved[d][i].interval_us = s->eps[d][i].interval_us;
+            sw->saved[d][i].size = s->eps[d][i].size;
+            sw->saved[d][i].running = s->eps[d][i].running;
+        }
+    }
+    sw->dwell_ms = dwell;
+    sw->cur = 0;
+    sw->active = true;
+    sw->aborted = false;
+    dusb_sweep_begin_point(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    return true;
+}
+
+/* JSON report of the current or last sweep; running sweeps list finished points */
+static char *dusb_sweep_report(DUSBState *s) {
+    DUSBSweep *sw = &s->sweep;
+    const char *state = sw->active ? "running" : sw->aborted ? "aborted" : sw->points ? "done" : "idle";
+    GString *json = g_string_new(NULL);
+
+    g_string_append_printf(json, "{\"state\": \"%s\", \"dwell_ms\": %u, \"points_total\": %d, \"points\": [",
+                           state, sw->dwell_ms, sw->npoints);
+    for (int i = 0; i < sw->cur && i < sw->npoints; i++) {
+        const DUSBSweepPoint *pt = &sw->points[i];
+        uint64_t xfers = pt->stats.packets + pt->stats.naks;
+
+        g_string_append_printf(json,
+                               "%s{\"ep\": %u, \"size\": %u, \"interval_us\": %u, \"elapsed_ns\": %" PRId64
+                               ", \"packets\": %" PRIu64 ", \"bytes\": %" PRIu64 ", \"throughput_bps\": %" PRIu64
+                               ", \"naks\": %" PRIu64 ", \"nak_ratio\": %.4f, \"lost\": %" PRIu64 ", \"errors\": %u"
+                               ", \"latency_ns\": ",
+                               i ? ", " : "", pt->addr, pt->size, pt->interval_us, pt->elapsed_ns,
+                               pt->stats.packets, pt->stats.bytes,
+                               pt->elapsed_ns ? muldiv64(pt->stats.bytes, NANOSECONDS_PER_SECOND, pt->elapsed_ns) : 0,
+                               pt->stats.naks, xfers ? (double)pt->stats.naks / xfers : 0.0, pt->stats.lost,
+                               pt->stats.errors);
+        dusb_hist_json(json, &pt->lat);
+        g_string_append_c(json, '}');
+    }
+    g_string_append(json, "]}");
+    return g_string_free(json, false);
+}
+
+/*
+ * Build the little-endian statistics block for DUSB_VREQ_GET_STATS. The
+ * block covers the three endpoint pairs of one function.
+ */
+static void dusb_fill_stats(DUSBState *s, int func, DUSBVendorStats *st) {
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    DUSBAgg *agg = &s->agg;
+
+    memset(st, 0, sizeof(*st));
+    st->version = cpu_to_le16(DUSB_STATS_VERSION);
+    st->num_eps = cpu_to_le16(ARRAY_SIZE(st->eps));
+    st->timestamp = cpu_to_le64(now);
+    st->elapsed = cpu_to_le64(now - s->stats_epoch_ns);
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUSB_NUM_EPS; i++) {
+            DUSBEp *e = &s->eps[d][func * DUSB_NUM_EPS + i];
+            DUSBVendorEpStats *es = &st->eps[d * DUSB_NUM_EPS + i];
+            es->ep = e->addr;
+            es->running = e->running;
+            es->errors = cpu_to_le32(e->stats.errors);
+            es->packets = cpu_to_le64(e->stats.packets);
+            es->bytes = cpu_to_le64(e->stats.bytes);
+            es->naks = cpu_to_le64(e->stats.naks);
+            es->lost = cpu_to_le64(e->stats.lost);
+        }
+    }
+    st->agg[0] = cpu_to_le64(agg->in_ntbs);
+    st->agg[1] = cpu_to_le64(agg->in_datagrams);
+    st->agg[2] = cpu_to_le64(agg->in_bytes);
+    st->agg[3] = cpu_to_le64(agg->in_dropped);
+    st->agg[4] = cpu_to_le64(agg->out_ntbs);
+    st->agg[5] = cpu_to_le64(agg->out_datagrams);
+    st->agg[6] = cpu_to_le64(agg->out_bytes);
+    st->agg[7] = cpu_to_le64(agg->out_errors);
+}
+
+/*
+ * Handle DUSB vendor requests addressed to the device. Returns false if the
+ * request is unknown or malformed so the caller stalls it.
+ */
+static bool dusb_handle_vendor(DUSBState *s, USBPacket *p, int bRequest, int direction,
+                               int value, int index, int length, uint8_t *data) {
+    DUSBEp *e = NULL;
+
+    switch (bRequest) {
+        case DUSB_VREQ_SET_EP_CONFIG: {
+            DUSBVendorEpConfig cfg;
+            e = dusb_ep_by_addr(s, index);
+            if (!e || direction != USB_DIR_OUT || length != sizeof(cfg)) {
+                return false;
+            }
+            memcpy(&cfg, data, sizeof(cfg));
+            if (!dusb_ep_config_valid(e, cfg.pattern, le32_to_cpu(cfg.size))) {
+                qemu_log("DUSB: SET_EP_CONFIG rejected for EP 0x%02x\n", index);
+                return false;
+            }
+            dusb_ep_configure(s, e, &cfg);
+            p->actual_length = 0;
+            break;
+        }
+
+        case DUSB_VREQ_GET_EP_CONFIG: {
+            DUSBVendorEpConfig cfg;
+            e = dusb_ep_by_addr(s, index);
+            if (!e || direction != USB_DIR_IN) {
+                return false;
+            }
+            cfg.interval_us = cpu_to_le32(e->interval_us);
+            cfg.size = cpu_to_le32(e->size);
+            cfg.pattern = e->pattern;
+            cfg.running = e->running;
+            cfg.reserved = 0;
+            p->actual_length = MIN(length, sizeof(cfg));
+            memcpy(data, &cfg, p->actual_length);
+            break;
+        }
+
+        case DUSB_VREQ_START:
+        case DUSB_VREQ_STOP:
+            if (direction != USB_DIR_OUT) {
+                return false;
+            }
+            if (index == 0) {
+                for (int d = 0; d < 2; d++) {
+                    for (int i = 0; i < dusb_num_eps(s); i++) {
+                        dusb_ep_set_running(s, &s->eps[d][i], bRequest == DUSB_VREQ_START);
+                    }
+                }
+            } else {
+                e = dusb_ep_by_addr(s, index);
+                if (!e) {
+                    return false;
+                }
+                dusb_ep_set_running(s, e, bRequest == DUSB_VREQ_START);
+            }
+            p->actual_length = 0;
+            qemu_log("DUSB: Traffic %s on EP 0x%02x\n", bRequest == DUSB_VREQ_START ? "started" : "stopped", index);
+            break;
+
+        case DUSB_VREQ_RESET_STATS:
+            if (direction != USB_DIR_OUT) {
+                return false;
+            }
+            dusb_reset_stats(s);
+            p->actual_length = 0;
+            qemu_log("DUSB: Statistics reset\n");
+            break;
+
+        case DUSB_VREQ_GET_STATS: {
+            DUSBVendorStats st;
+            /* wIndex selects the function of a composite device */
+            if (direction != USB_DIR_IN || index >= dusb_num_funcs(s)) {
+                return false;
+            }
+            dusb_fill_stats(s, index, &st);
+            p->actual_length = MIN(length, sizeof(st));
+            memcpy(data, &st, p->actual_length);
+            break;
+        }
+
+        /*
+         * QEMU buffers control data stages in USBDevice.data_buf and stalls
+         * longer requests before they reach the device, so larger images are
+         * moved as consecutive chunks numbered by wIndex.
+         */
+        case DUSB_VREQ_CTRL_READ:
+            if (direction != USB_DIR_IN || length > sizeof(s->dev.data_buf)) {
+                return false;
+            }
+            return dusb_ctrl_transfer(s, p, true, value & 0xff, index, length, data);
+
+        case DUSB_VREQ_CTRL_WRITE:
+            if (direction != USB_DIR_OUT || length > sizeof(s->dev.data_buf)) {
+                return false;
+            }
+            return dusb_ctrl_transfer(s, p, false, value & 0xff, index, length, data);
+
+        case DUSB_VREQ_GET_CTRL_STATS: {
+            DUSBVendorCtrlStats st;
+            if (direction != USB_DIR_IN) {
+                return false;
+            }
+            dusb_fill_ctrl_stats(s, &st);
+            p->actual_length = MIN(length, sizeof(st));
+            memcpy(data, &st, p->actual_length);
+            break;
+        }
+
+        default:
+            return false;
+    }
+    return true;
+}
+
+/* Process a control request and set the packet status and length */
+static void dusb_process_control(USBDevice *dev, USBPacket *p, int request, int value, int index, int length, uint8_t *data) {
+    DUSBState *s = USB_DUSB(dev);
+    int bmRequestType = (request >> 8) & 0xff;
+    int bRequest = request & 0xff;
+    int recipient = bmRequestType & USB_RECIP_MASK;
+    int direction = bmRequestType & USB_DIR_IN;
+
+    qemu_log("DUSB: Control request - bRequest: %d, bmRequestType: 0x%02x, recipient: %d, direction: %s, value: %d, index: %d, length: %d\n",
+             bRequest, bmRequestType, recipient, direction ? "IN" : "OUT", value, index, length);
+
+    /* Logging negotiated speed during descriptor requests */
+    if (bRequest == USB_REQ_GET_DESCRIPTOR) {
+        int desc_type = value >> 8;
+        const char *speed_str;
+        switch (dev->speed) {
+            case USB_SPEED_FULL: speed_str = "Full-Speed"; break;
+            case USB_SPEED_HIGH: speed_str = "High-Speed"; break;
+            case USB_SPEED_SUPER: speed_str = "SuperSpeed"; break;
+            default: speed_str = "Unknown"; break;
+        }
+        qemu_log("DUSB: GET_DESCRIPTOR type %d at %s\n", desc_type, speed_str);
+    }
+
+    if (bRequest == USB_REQ_GET_DESCRIPTOR && (value >> 8) == USB_DT_BOS) {
+        int ret = dusb_handle_bos_descriptor(dev, value, data, length);
+        if (ret >= 0) {
+            p->actual_length = ret;
+            return;
+        }
+    }
+
+    /* Pass standard requests to QEMU's USB descriptor handler */
+    int ret;
+    if ((bRequest == USB_REQ_SET_CONFIGURATION && recipient == USB_RECIP_DEVICE) ||
+        (bRequest == USB_REQ_SET_INTERFACE && recipient == USB_RECIP_INTERFACE)) {
+        ret = dusb_desc_control_held(dev, p, request, value, index, length, data);
+    } else {
+        ret = usb_desc_handle_control(dev, p, request, value, index, length, data);
+    }
+    if (ret >= 0) {
+        if (bRequest == USB_REQ_SET_CONFIGURATION && recipient == USB_RECIP_DEVICE) {
+            dusb_func_suspend_clear(s);
+        }
+        /* A same-alt SET_INTERFACE skips set_interface but still resets the table */
+        if (bRequest == USB_REQ_SET_CONFIGURATION || bRequest == USB_REQ_SET_INTERFACE) {
+            dusb_setup_pipeline(s);
+        }
+        qemu_log("DUSB: Handled by usb_desc_handle_control, bytes: %d\n", ret);
+        return;
+    }
+    
+    /* Vendor requests reconfigure the traffic engines and report statistics */
+    if ((bmRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR && recipient == USB_RECIP_DEVICE) {
+        if (!dusb_handle_vendor(s, p, bRequest, direction, value, index, length, data)) {
+            goto fail;
+        }
+        return;
+    }
+    if ((bmRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+        goto fail;
+    }
+
+    /* Handle custom control requests */
+    switch (bRequest) {
+        case USB_REQ_GET_STATUS:
+            if (recipient == USB_RECIP_DEVICE) {
+                data[0] = (dev->remote_wakeup << 1) | 0;
+                data[1] = 0;
+                p->actual_length = 2;
+                qemu_log("DUSB: GET_STATUS (Device) - Remote Wakeup: %d\n", dev->remote_wakeup);
+            } else if (recipient == USB_RECIP_INTERFACE) {
+                int f = index & 0xff;
+                /* SuperSpeed: Function Remote Wake Capable and Function Remote Wakeup */
+                bool ss = dev->speed == USB_SPEED_SUPER && f < dusb_num_funcs(s);
+                data[0] = ss ? 0x01 | (s->fsusp[f].remote_wake << 1) : 0;
+                data[1] = 0;
+                p->actual_length = 2;
+                qemu_log("DUSB: GET_STATUS (Interface %d)\n", f);
+            } else if (recipient == USB_RECIP_ENDPOINT) {
+                int ep = index & 0x0f;
+                int dir = (index & 0x80) ? USB_TOKEN_IN : USB_TOKEN_OUT;
+                USBEndpoint *endpoint = usb_ep_get(dev, dir, ep);
+                if (endpoint) {
+                    data[0] = endpoint->halted ? 1 : 0;
+                    data[1] = 0;
+                    p->actual_length = 2;
+                    qemu_log("DUSB: GET_STATUS (Endpoint %d %s) - Halted: %d\n", ep, dir == USB_TOKEN_IN ? "IN" : "OUT", endpoint->halted);
+                } else {
+                    goto fail;
+                }
+            } else {
+                goto fail;
+            }
+            break;
+
+        case USB_REQ_CLEAR_FEATURE:
+            if (recipient == USB_RECIP_DEVICE && value == USB_DEVICE_REMOTE_WAKEUP) {
+                dev->remote_wakeup = 0;
+                p->actual_length = 0;
+                qemu_log("DUSB: CLEAR_FEATURE (Device) - Remote Wakeup disabled\n");
+            } else if (recipient == USB_RECIP_ENDPOINT && value == 0) {
+                int ep = index & 0x0f;
+                int dir = (index & 0x80) ? USB_TOKEN_IN : USB_TOKEN_OUT;
+                USBEndpoint *endpoint = usb_ep_get(dev, dir, ep);
+                if (endpoint) {
+                    DUSBEp *e = dusb_ep_by_addr(s, index & (USB_DIR_IN | 0x0f));
+                    if (e && e->fault.halt_ns) {
+                        /* Round trip of the host's halt recovery for an injected STALL */
+                        dusb_hist_add(&e->fault.halt_clear,
+                                      qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - e->fault.halt_ns);
+                        e->fault.halt_ns = 0;
+                    }
+                    endpoint->halted = false;
+                    p->actual_length = 0;
+                    qemu_log("DUSB: CLEAR_FEATURE (Endpoint %d %s) - Halt cleared\n", ep, dir == USB_TOKEN_IN ? "IN" : "OUT");
+                } else {
+                    goto fail;
+                }
+            } else {
+                goto fail;
+            }
+            break;
+
+        case USB_REQ_SET_FEATURE:
+            if (recipient == USB_RECIP_DEVICE && value == USB_DEVICE_REMOTE_WAKEUP) {
+                dev->remote_wakeup = 1;
+                p->actual_length = 0;
+                qemu_log("DUSB: SET_FEATURE (Device) - Remote Wakeup enabled\n");
+            } else if (recipient == USB_RECIP_INTERFACE && value == DUSB_FEAT_FUNC_SUSPEND) {
+                if (dev->speed != USB_SPEED_SUPER || (index & 0xff) >= dusb_num_funcs(s)) {
+                    goto fail;
+                }
+                dusb_func_suspend(s, index & 0xff, index >> 8);
+                p->actual_length = 0;
+            } else if (recipient == USB_RECIP_ENDPOINT && value == 0) {
+                int ep = index & 0x0f;
+                int dir = (index & 0x80) ? USB_TOKEN_IN : USB_TOKEN_OUT;
+                USBEndpoint *endpoint = usb_ep_get(dev, dir, ep);
+                if (endpoint) {
+                    endpoint->halted = true;
+                    p->actual_length = 0;
+                    qemu_log("DUSB: SET_FEATURE (Endpoint %d %s) - Halted\n", ep, dir == USB_TOKEN_IN ? "IN" : "OUT");
+                } else {
+                    goto fail;
+                }
+            } else {
+                goto fail;
+            }
+            break;
+
+        case USB_REQ_SET_SEL:
+            if (recipient == USB_RECIP_DEVICE && direction == USB_DIR_OUT && length == 6) {
+                qemu_log("DUSB: SET_SEL - U1 SEL=%d, U1 PEL=%d, U2 SEL=%d, U2 PEL=%d\n",
+                         data[0], data[1], data[2] | (data[3] << 8), data[4] | (data[5] << 8));
+                p->actual_length = 0;
+            } else {
+                goto fail;
+            }
+            break;
+
+        default:
+            goto fail;
+    }
+    return;
+
+fail:
+    p->status = USB_RET_STALL;
+    qemu_log("DUSB: Control request failed - Stalled\n");
+}
+
+/* Whether a control request is selected for asynchronous completion */
+static bool dusb_ctrl_should_defer(DUSBState *s, int request) {
+    int bmRequestType = (request >> 8) & 0xff;
+    int bRequest = request & 0xff;
+
+    if (s->ctrl_delay_us == 0 || s->ctrl_async.packet) {
+        return false;
+    }
+    if ((bmRequestType & USB_TYPE_MASK) == USB_TYPE_VENDOR) {
+        return s->ctrl_delay_mask & DUSB_CTRL_DEFER_VENDOR;
+    }
+    if ((bmRequestType & USB_TYPE_MASK) != USB_TYPE_STANDARD) {
+        return false;
+    }
+    switch (bRequest) {
+        case USB_REQ_SET_INTERFACE:
+            return s->ctrl_delay_mask & DUSB_CTRL_DEFER_SET_INTERFACE;
+        case USB_REQ_GET_DESCRIPTOR:
+            return s->ctrl_delay_mask & DUSB_CTRL_DEFER_GET_DESCRIPTOR;
+        default:
+            return false;
+    }
+}
+
+/* Callback completing the deferred control request */
+static void dusb_ctrl_timer(void *opaque) {
+    DUSBState *s = opaque;
+    DUSBCtrlAsync *a = &s->ctrl_async;
+    USBPacket *p = a->packet;
+
+    if (!p) {
+        return;
+    }
+    a->packet = NULL;
+    p->status = USB_RET_SUCCESS;
+    dusb_process_control(&s->dev, p, a->request, a->value, a->index, a->length, a->data);
+    qemu_log("DUSB: Deferred control request 0x%04x completed, status %d\n", a->request, p->status);
+    usb_generic_async_ctrl_complete(&s->dev, p);
+}
+
+/*
+ * Handle control requests from the host. Requests selected by
+ * ctrl_delay_mask return USB_RET_ASYNC and are processed when ctrl_timer
+ * fires; the USB core keeps the data stage in data_buf until then.
+ */
+static void dusb_handle_control(USBDevice *dev, USBPacket *p, int request, int value, int index, int length, uint8_t *data) {
+    DUSBState *s = USB_DUSB(dev);
+    DUSBCtrlAsync *a = &s->ctrl_async;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    /* A request deferred at migration has not run yet; keep its original completion time */
+    if (a->replay) {
+        a->replay = false;
+        if (!a->packet && request == a->request && value == a->value && index == a->index && length == a->length) {
+            a->packet = p;
+            a->data = data;
+            p->status = USB_RET_ASYNC;
+            dusb_timer_mod(&s->ctrl_timer, a->due_ns);
+            qemu_log("DUSB: Deferred control request 0x%04x requeued after migration\n", request);
+            return;
+        }
+    }
+    if (!dusb_ctrl_should_defer(s, request)) {
+        int64_t prof_start = dusb_prof_start(s);
+        dusb_process_control(dev, p, request, value, index, length, data);
+        dusb_prof_end(s, &s->prof[DUSB_PROF_CONTROL], prof_start, length);
+        return;
+    }
+
+    a->packet = p;
+    a->request = request;
+    a->value = value;
+    a->index = index;
+    a->length = length;
+    a->data = data;
+    a->due_ns = now + (int64_t)s->ctrl_delay_us * 1000;
+    s->ctrl.deferred++;
+    p->status = USB_RET_ASYNC;
+    dusb_timer_mod(&s->ctrl_timer, a->due_ns);
+    qemu_log("DUSB: Control request 0x%04x deferred by %u us\n", request, s->ctrl_delay_us);
+}
+
+/* Drop a deferred control request or delayed transfer the host has given up on */
+static void dusb_cancel_packet(USBDevice *dev, USBPacket *p) {
+    DUSBState *s = USB_DUSB(dev);
+
+    for (int i = 0; i < dusb_num_eps(s); i++) {
+        if (s->eps[0][i].async_pkt == p) {
+            s->eps[0][i].async_pkt = NULL;
+            dusb_in_timer_rearm(s);
+            qemu_log("DUSB: Delayed EP#%d OUT transfer cancelled\n", i + 1);
+            return;
+        }
+    }
+    if (s->ctrl_async.packet == p) {
+        s->ctrl_async.packet = NULL;
+        dusb_timer_del(&s->ctrl_timer);
+        qemu_log("DUSB: Deferred control request 0x%04x cancelled\n", s->ctrl_async.request);
+    }
+}
+
+static const char *const dusb_fault_names[DUSB_FAULT_NUM] = {"stall", "babble", "ioerror", "short", "drop"};
+
+/* Short packets need an IN payload to cut, dropped intervals an isochronous endpoint */
+static bool dusb_fault_applies(DUSBEp *e, USBEndpoint *uep, int kind) {
+    switch (kind) {
+        case DUSB_FAULT_SHORT:
+            return e->addr & USB_DIR_IN;
+        case DUSB_FAULT_DROP:
+            return uep->type == USB_ENDPOINT_XFER_ISOC;
+        default:
+            return true;
+    }
+}
+
+/*
+ * Pick the fault, if any, for a transfer that would otherwise complete, so
+ * NAK polling does not inflate the rate. A schedule (every N transfers)
+ * takes precedence over the probabilities. Returns DUSB_FAULT_NUM for none.
+ */
+static int dusb_fault_draw(DUSBEp *e, USBEndpoint *uep) {
+    DUSBFault *f = &e->fault;
+    uint32_t total = 0, r;
+
+    if (f->every && ++f->count >= f->every) {
+        f->count = 0;
+        if (dusb_fault_applies(e, uep, f->kind)) {
+            return f->kind;
+        }
+    }
+    for (int k = 0; k < DUSB_FAULT_NUM; k++) {
+        total += dusb_fault_applies(e, uep, k) ? f->ppm[k] : 0;
+    }
+    if (!total) {
+        return DUSB_FAULT_NUM;
+    }
+    r = dusb_xorshift32(&f->rng) % DUSB_FAULT_PPM;
+    for (int k = 0; k < DUSB_FAULT_NUM; k++) {
+        if (!dusb_fault_applies(e, uep, k)) {
+            continue;
+        }
+        if (r < f->ppm[k]) {
+            return k;
+        }
+        r -= f->ppm[k];
+    }
+    return DUSB_FAULT_NUM;
+}
+
+/* Count an injected fault and start its recovery clock */
+static void dusb_fault_note(DUSBEp *e, int kind, int64_t now) {
+    e->fault.injected[kind]++;
+    if (!e->fault.pending_ns) {
+        e->fault.pending_ns = now;
+    }
+    qemu_log("DUSB: Injected %s on EP 0x%02x\n", dusb_fault_names[kind], e->addr);
+}
+
+/* Fail a transfer with an injected STALL, babble or transaction error; the payload stays pending */
+static void dusb_fault_fail(DUSBEp *e, USBPacket *p, int kind, int64_t now) {
+    switch (kind) {
+        case DUSB_FAULT_STALL:
+            p->ep->halted = true;
+            e->fault.halt_ns = now;
+            p->status = USB_RET_STALL;
+            break;
+        case DUSB_FAULT_BABBLE:
+            p->status = USB_RET_BABBLE;
+            break;
+        default:
+            p->status = USB_RET_IOERROR;
+            break;
+    }
+    dusb_fault_note(e, kind, now);
+}
+
+/* Scratch buffer for OUT payloads, grown on demand so steady-state transfers do not allocate */
+static uint8_t *dusb_out_buf(DUSBState *s, size_t len) {
+    if (len > s->out_buf_size) {
+        g_free(s->out_buf);
+        s->out_buf_size = MAX(len, DUSB_MAX_PAYLOAD);
+        s->out_buf = g_malloc(s->out_buf_size);
+    }
+    return s->out_buf;
+}
+
+/* Handle data transfers on endpoints */
+static void dusb_process_data(USBDevice *dev, USBPacket *p) {
+    DUSBState *s = USB_DUSB(dev);
+    USBEndpoint *ep = p->ep;
+    int ep_num = ep->nr;
+    bool in = (p->pid == USB_TOKEN_IN);
+
+    /* Log stream usage for bulk endpoints */
+    if (ep_num == 3) {
+        qemu_log("DUSB: handle_data EP#%d %s, stream=%d\n", ep_num, in ? "IN" : "OUT", p->stream);
+    } else {
+        qemu_log("DUSB: handle_data EP#%d %s\n", ep_num, in ? "IN" : "OUT");
+    }
+
+    /*
+     * Pipelined bulk IN: every new transfer goes to the core's queue, and
+     * dusb_flush_ep_queue combines runs of them. A (combined) transfer handed
+     * back is completed asynchronously from the IN timer, so it can wait for
+     * data instead of NAKing and a pipelined endpoint never completes out of
+     * order. Stream transfers keep the synchronous path.
+     */
+    if (in && ep->pipeline && !p->stream && p->state != USB_PACKET_ASYNC) {
+        DUSBEp *e = dusb_ep(s, true, ep_num);
+
+        if (p->state == USB_PACKET_SETUP) {
+            p->status = USB_RET_ADD_TO_QUEUE;
+            return;
+        }
+        p->status = USB_RET_ASYNC;
+        if (!e->queue_due_ns) {
+            e->queue_due_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            dusb_in_timer_rearm(s);
+        }
+        return;
+    }
+
+    if (ep->halted) {
+        p->status = USB_RET_STALL;
+        qemu_log("DUSB: EP#%d %s is halted - Stalled\n", ep_num, in ? "IN" : "OUT");
+        return;
+    }
+
+    if (ep_num < 1 || ep_num > dusb_num_eps(s)) {
+        p->status = USB_RET_STALL;
+        qemu_log("DUSB: EP#%d %s does not exist - Stalled\n", ep_num, in ? "IN" : "OUT");
+        return;
+    }
+
+    DUSBEp *e = dusb_ep(s, in, ep_num);
+    uint8_t alt = s->alt[dusb_ep_func(e)];
+    bool cmd = ep_num == 3 && alt == DUSB_ALT_CMD;
+    if (alt != in && !cmd) {
+        p->status = USB_RET_STALL;
+        qemu_log("DUSB: EP#%d %s not available in alt %d - Stalled\n", ep_num, in ? "IN" : "OUT", alt);
+        return;
+    }
+    if (s->fsusp[dusb_ep_func(e)].suspended) {
+        p->status = USB_RET_NAK;
+        e->stats.naks++;
+        qemu_log("DUSB: EP#%d %s function suspended - NAK\n", ep_num, in ? "IN" : "OUT");
+        return;
+    }
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    /* The transfer in flight at migration was accepted on the source; it only waits out its delay here */
+    if (e->replay) {
+        e->replay = false;
+        if (!in && p->iov.size == e->async_len) {
+            e->async_pkt = p;
+            p->actual_length = p->iov.size;
+            p->status = USB_RET_ASYNC;
+            dusb_in_timer_rearm(s);
+            qemu_log("DUSB: Delayed EP#%d OUT transfer requeued after migration\n", ep_num);
+            return;
+        }
+    }
+    if (!e->running) {
+        p->status = USB_RET_NAK;
+        e->stats.naks++;
+        qemu_log("DUSB: EP#%d %s traffic stopped - NAK\n", ep_num, in ? "IN" : "OUT");
+        return;
+    }
+
+    if (!in) {
+        if (cmd && s->cmd.count >= s->cmd.depth) {
+            p->status = USB_RET_NAK;
+            e->stats.naks++;
+            s->cmd.full++;
+            return;
+        }
+        /* A throttled sink accepts one transfer per interval */
+        if (e->interval_us && now < e->next_ns) {
+            p->status = USB_RET_NAK;
+            e->stats.naks++;
+            dusb_ep_wake_at(s, e, e->next_ns);
+            return;
+        }
+        if (!dusb_shape_admit(e, now)) {
+            p->status = USB_RET_NAK;
+            e->stats.naks++;
+            dusb_ep_wake_at(s, e, dusb_shape_ready_ns(e, now));
+            return;
+        }
+        int fault = dusb_fault_draw(e, ep);
+        if (fault < DUSB_FAULT_SHORT) {
+            dusb_fault_fail(e, p, fault, now);
+            return;
+        }
+        e->next_ns = now + (int64_t)e->interval_us * 1000;
+        if (fault == DUSB_FAULT_DROP) {
+            /* The host sees the interval go out; the device never gets it */
+            p->actual_length = p->iov.size;
+            p->status = USB_RET_SUCCESS;
+            dusb_fault_note(e, fault, now);
+            return;
+        }
+
+        uint8_t *buf = dusb_out_buf(s, p->iov.size);
+        usb_packet_copy(p, buf, p->iov.size);
+        int64_t prof_start = dusb_prof_start(s);
+        if (cmd) {
+            dusb_cmd_handle_out(s, buf, p->iov.size, now);
+        } else if (ep_num == 3 && s->agg.enabled) {
+            dusb_agg_handle_out(s, buf, p->iov.size);
+        } else if (e->pattern != DUSB_PATTERN_LEGACY) {
+            dusb_ep_verify(s, e, buf, p->iov.size);
+            qemu_log("DUSB: Received %zu bytes on EP#%d OUT\n", p->iov.size, ep_num);
+        } else if (qemu_log_enabled()) {
+            char *hex = g_malloc(3 * p->iov.size + 1);
+            char *h = hex;
+            for (size_t i = 0; i < p->iov.size; i++) {
+                int n = snprintf(h, 4, "%02x ", buf[i]);
+                h += n;
+            }
+            *h = '\0';
+            qemu_log("DUSB: Received on EP#%d OUT: %s\n", ep_num, hex);
+            g_free(hex);
+        }
+        dusb_prof_end(s, &e->prof[DUSB_PROF_PAYLOAD], prof_start, p->iov.size);
+        p->actual_length = p->iov.size;
+        p->status = USB_RET_SUCCESS;
+        e->stats.packets++;
+        e->stats.bytes += p->iov.size;
+        e->tokens -= e->rate_bps ? p->iov.size : 0;
+        dusb_ep_sample(s, e, now);
+
+        /* Bulk transfers may complete late; periodic ones cannot go async */
+        if ((e->latency_us || e->jitter_us) && p->ep->type == USB_ENDPOINT_XFER_BULK) {
+            e->async_pkt = p;
+            e->async_due_ns = now + dusb_ep_delay_ns(s, e);
+            e->async_len = p->iov.size;
+            p->status = USB_RET_ASYNC;
+            dusb_in_timer_rearm(s);
+        }
+    } else if (cmd) {
+        int64_t prof_start = dusb_prof_start(s);
+        dusb_cmd_handle_in(s, e, p);
+        dusb_prof_end(s, &e->prof[DUSB_PROF_PAYLOAD], prof_start, p->actual_length);
+    } else if (ep_num == 3 && s->agg.enabled) {
+        int64_t prof_start = dusb_prof_start(s);
+        dusb_agg_handle_in(s, p);
+        dusb_prof_end(s, &e->prof[DUSB_PROF_PAYLOAD], prof_start, p->actual_length);
+    } else if (ep_num == s->video.ep) {
+        int64_t prof_start = dusb_prof_start(s);
+        dusb_video_handle_in(s, e, p);
+        dusb_prof_end(s, &e->prof[DUSB_PROF_PAYLOAD], prof_start, p->actual_length);
+    } else {
+        /* Unthrottled endpoints generate a payload for every transfer */
+        if (!e->avail && e->interval_us == 0) {
+            dusb_ep_generate(s, e, now);
+        }
+        if (e->avail && now < e->ready_ns) {
+            p->status = USB_RET_NAK;
+            e->stats.naks++;
+            dusb_ep_wake_at(s, e, e->ready_ns);
+        } else if (e->avail && !dusb_shape_admit(e, now)) {
+            p->status = USB_RET_NAK;
+            e->stats.naks++;
+            dusb_ep_wake_at(s, e, dusb_shape_ready_ns(e, now));
+        } else if (e->avail) {
+            int fault = dusb_fault_draw(e, ep);
+            if (fault < DUSB_FAULT_SHORT) {
+                dusb_fault_fail(e, p, fault, now);
+                return;
+            }
+            if (fault == DUSB_FAULT_DROP) {
+                /* The interval passes without data and the payload is lost */
+                e->avail = 0;
+                e->stats.lost++;
+                p->status = USB_RET_SUCCESS;
+                dusb_fault_note(e, fault, now);
+                return;
+            }
+            int64_t prof_start = dusb_prof_start(s);
+            size_t len = dusb_ep_send(s, e, p);
+            dusb_prof_end(s, &e->prof[DUSB_PROF_PAYLOAD], prof_start, len);
+            if (fault == DUSB_FAULT_SHORT) {
+                len /= 2;
+            }
+            p->actual_length = len;
+            p->status = USB_RET_SUCCESS;
+            e->avail = 0;
+            e->stats.packets++;
+            e->stats.bytes += len;
+            e->tokens -= e->rate_bps ? len : 0;
+            dusb_ep_sample(s, e, now);
+            if (fault == DUSB_FAULT_SHORT) {
+                dusb_fault_note(e, fault, now);
+            }
+            qemu_log("DUSB: Sent %zu bytes on EP#%d IN\n", len, ep_num);
+        } else {
+            p->status = USB_RET_NAK;
+            e->stats.naks++;
+            qemu_log("DUSB: No data available on EP#%d IN - NAK\n", ep_num);
+        }
+    }
+}
+
+/* Data transfers, with every outcome folded into the run digest */
+static void dusb_handle_data(USBDevice *dev, USBPacket *p) {
+    DUSBState *s = USB_DUSB(dev);
+    uint8_t addr = p->ep->nr | (p->pid == USB_TOKEN_IN ? USB_DIR_IN : 0);
+    int64_t prof_start = dusb_prof_start(s);
+    DUSBEp *e;
+
+    dusb_process_data(dev, p);
+    /* A delayed OUT transfer is folded in when it completes, so a replay after migration counts once */
+    if (p->status != USB_RET_ASYNC) {
+        dusb_trace(s, addr, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL), p->status, p->actual_length);
+    }
+    if (s->profile && (e = dusb_ep_by_addr(s, addr))) {
+        dusb_prof_end(s, &e->prof[DUSB_PROF_DATA], prof_start, p->actual_length);
+    }
+}
+
+/* The controller has queued what it has for a pipelined endpoint; combine and submit it */
+static void dusb_flush_ep_queue(USBDevice *dev, USBEndpoint *ep) {
+    if (ep->pipeline && ep->pid == USB_TOKEN_IN && ep->type == USB_ENDPOINT_XFER_BULK) {
+        usb_ep_combine_input_packets(ep);
+    }
+}
+
+/*
+ * Track alternate setting changes. SET_INTERFACE itself is answered by
+ * usb_desc_handle_control, which calls back here once the new alt is active.
+ */
+static void dusb_set_interface(USBDevice *dev, int interface, int alt_old, int alt_new) {
+    DUSBState *s = USB_DUSB(dev);
+    DUSBEp *in;
+
+    if (interface < 0 || interface >= dusb_num_funcs(s)) {
+        return;
+    }
+    in = &s->eps[1][interface * DUSB_NUM_EPS];
+    s->alt[interface] = alt_new;
+    dusb_setup_pipeline(s);
+    qemu_log("DUSB: SET_INTERFACE - Interface %d set to alt %d\n", interface, alt_new);
+    if (alt_new == 1) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        for (int i = 0; i < DUSB_NUM_EPS; i++) {
+            dusb_ep_start_in(s, &in[i], now);
+        }
+    } else {
+        for (int i = 0; i < DUSB_NUM_EPS; i++) {
+            dusb_ep_drop_pending(s, &in[i]);
+        }
+    }
+    /* Aggregation, video framing and the command engine belong to the first function */
+    if (interface == 0) {
+        dusb_cmd_reset(&s->cmd);
+    }
+    if (interface == 0 && alt_new == 1) {
+        dusb_agg_start(s);
+        dusb_video_start(s);
+    } else if (interface == 0) {
+        dusb_agg_stop(s);
+        dusb_video_stop(s);
+    }
+    dusb_in_timer_rearm(s);
+}
+
+/* Handle device reset */
+static void dusb_handle_reset(USBDevice *dev) {
+    DUSBState *s = USB_DUSB(dev);
+    dev->addr = 0;
+    dev->configuration = 0;
+    dev->remote_wakeup = 0;
+    memset(s->alt, 0, sizeof(s->alt));
+    dusb_func_suspend_clear(s);
+    dusb_timer_del(&s->in_timer);
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUSB_MAX_EPS; i++) {
+            DUSBEp *e = &s->eps[d][i];
+            if (d == 1) {
+                dusb_ep_drop_pending(s, e);
+            }
+            e->seq = 0;
+            e->wake_ns = 0;
+            e->async_pkt = NULL;
+            e->replay = false;
+            e->queue_due_ns = 0;
+            e->fault.halt_ns = 0;
+        }
+    }
+    dusb_agg_stop(s);
+    dusb_video_stop(s);
+    dusb_cmd_reset(&s->cmd);
+    dusb_seed(s);
+    s->ctrl_async.packet = NULL;
+    s->ctrl_async.replay = false;
+    dusb_timer_del(&s->ctrl_timer);
+    qemu_log("DUSB: Device reset - addr: %d, config: %d\n", dev->addr, dev->configuration);
+}
+
+/*
+ * OpenMetrics exporter. A client connecting to metrics-chardev sends a
+ * request ending in a blank line (an HTTP GET, or just a newline) and gets
+ * the counters of every DUSB instance in OpenMetrics text format, after
+ * which the connection is closed. The whole exposition is rendered in one
+ * go from the current state, so it is a consistent snapshot, and then
+ * drained with non-blocking writes from the main loop: a slow or stalled
+ * scraper never blocks the device.
+ */
+#define DUSB_METRICS_MAX_REQ    8192
+
+static const char *const dusb_ep_type_names[DUSB_NUM_EPS] = {"interrupt", "isoc", "bulk"};
+
+/* Per-endpoint counter families */
+static const struct {
+    const char *name;
+    const char *help;
+    size_t offset;             /* uint64_t in DUSBEp */
+} dusb_metric_counters[] = {
+    {"dusb_packets", "Completed data transfers", offsetof(DUSBEp, stats.packets)},
+    {"dusb_bytes", "Payload bytes moved", offsetof(DUSBEp, stats.bytes)},
+    {"dusb_naks", "Transfers answered with NAK", offsetof(DUSBEp, stats.naks)},
+    {"dusb_lost", "IN payloads replaced unread or OUT sequence gaps", offsetof(DUSBEp, stats.lost)},
+};
+
+static char *dusb_metrics_device_name(DUSBState *s) {
+    DeviceState *ds = DEVICE(s);
+    return ds->id ? g_strdup(ds->id) : object_get_canonical_path(OBJECT(s));
+}
+
+static void dusb_metrics_family(GString *o, const char *name, const char *type, const char *help) {
+    g_string_append_printf(o, "# TYPE %s %s\n# HELP %s %s\n", name, type, name, help);
+}
+
+static void dusb_metrics_ep_labels(GString *o, const char *dev, const DUSBEp *e) {
+    g_string_append_printf(o, "device=\"%s\",ep=\"0x%02x\",dir=\"%s\",type=\"%s\"", dev, e->addr,
+                           e->addr & USB_DIR_IN ? "in" : "out", dusb_ep_type_names[dusb_ep_kind(e)]);
+}
+
+/* Cumulative buckets of a log2 histogram, bucket n ends at 2^(n+1) ns */
+static void dusb_metrics_hist(GString *o, const char *name, const char *labels, const DUSBHist *h) {
+    uint64_t cum = 0;
+
+    for (int n = 0; n < DUSB_HIST_BUCKETS - 1; n++) {
+        cum += h->buckets[n];
+        g_string_append_printf(o, "%s_bucket{%s,le=\"%.9g\"} %" PRIu64 "\n", name, labels,
+                               (double)(2ull << n) / NANOSECONDS_PER_SECOND, cum);
+    }
+    g_string_append_printf(o, "%s_bucket{%s,le=\"+Inf\"} %" PRIu64 "\n%s_count{%s} %" PRIu64
+                           "\n%s_sum{%s} %.9f\n", name, labels, h->count, name, labels, h->count, name, labels,
+                           (double)h->sum_ns / NANOSECONDS_PER_SECOND);
+}
+
+static void dusb_metrics_render(GString *o) {
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    DUSBState *s;
+    int n;
+
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        g_ptr_array_add(names, dusb_metrics_device_name(s));
+    }
+
+    dusb_metrics_family(o, "dusb_elapsed_seconds", "gauge", "Virtual time since the counters were reset");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        g_string_append_printf(o, "dusb_elapsed_seconds{device=\"%s\"} %.9f\n", (char *)names->pdata[n++],
+                               (double)(now - s->stats_epoch_ns) / NANOSECONDS_PER_SECOND);
+    }
+    dusb_metrics_family(o, "dusb_running", "gauge", "Whether the endpoint generates or accepts traffic");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < dusb_num_eps(s); i++) {
+                g_string_append(o, "dusb_running{");
+                dusb_metrics_ep_labels(o, names->pdata[n], &s->eps[d][i]);
+                g_string_append_printf(o, "} %d\n", s->eps[d][i].running);
+            }
+        }
+        n++;
+    }
+
+    for (int f = 0; f < ARRAY_SIZE(dusb_metric_counters); f++) {
+        dusb_metrics_family(o, dusb_metric_counters[f].name, "counter", dusb_metric_counters[f].help);
+        n = 0;
+        QLIST_FOREACH(s, &dusb_devices, next) {
+            for (int d = 0; d < 2; d++) {
+                for (int i = 0; i < dusb_num_eps(s); i++) {
+                    const DUSBEp *e = &s->eps[d][i];
+                    g_string_append_printf(o, "%s_total{", dusb_metric_counters[f].name);
+                    dusb_metrics_ep_labels(o, names->pdata[n], e);
+                    g_string_append_printf(o, "} %" PRIu64 "\n",
+                                           *(const uint64_t *)((const uint8_t *)e + dusb_metric_counters[f].offset));
+                }
+            }
+            n++;
+        }
+    }
+
+    dusb_metrics_family(o, "dusb_verify_errors", "counter", "OUT payloads failing verification");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            g_string_append(o, "dusb_verify_errors_total{");
+            dusb_metrics_ep_labels(o, names->pdata[n], &s->eps[0][i]);
+            g_string_append_printf(o, "} %u\n", s->eps[0][i].stats.errors);
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_faults", "counter", "Injected faults");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < dusb_num_eps(s); i++) {
+                for (int k = 0; k < DUSB_FAULT_NUM; k++) {
+                    g_string_append(o, "dusb_faults_total{");
+                    dusb_metrics_ep_labels(o, names->pdata[n], &s->eps[d][i]);
+                    g_string_append_printf(o, ",kind=\"%s\"} %" PRIu64 "\n", dusb_fault_names[k],
+                                           s->eps[d][i].fault.injected[k]);
+                }
+            }
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_latency_seconds", "histogram",
+                        "IN: payload readiness to read, OUT: interval between accepted transfers");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < dusb_num_eps(s); i++) {
+                GString *labels = g_string_new(NULL);
+                dusb_metrics_ep_labels(labels, names->pdata[n], &s->eps[d][i]);
+                dusb_metrics_hist(o, "dusb_latency_seconds", labels->str, &s->eps[d][i].lat);
+                g_string_free(labels, true);
+            }
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_fault_recovery_seconds", "histogram",
+                        "Injected fault to the next successful transfer");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < dusb_num_eps(s); i++) {
+                GString *labels = g_string_new(NULL);
+                dusb_metrics_ep_labels(labels, names->pdata[n], &s->eps[d][i]);
+                dusb_metrics_hist(o, "dusb_fault_recovery_seconds", labels->str, &s->eps[d][i].fault.recovery);
+                g_string_free(labels, true);
+            }
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_ctrl_requests", "counter", "EP0 benchmark requests");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        g_string_append_printf(o, "dusb_ctrl_requests_total{device=\"%s\",op=\"read\"} %" PRIu64 "\n"
+                               "dusb_ctrl_requests_total{device=\"%s\",op=\"write\"} %" PRIu64 "\n",
+                               (char *)names->pdata[n], s->ctrl.reads, (char *)names->pdata[n], s->ctrl.writes);
+        n++;
+    }
+    dusb_metrics_family(o, "dusb_ctrl_bytes", "counter", "EP0 benchmark data stage bytes");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        g_string_append_printf(o, "dusb_ctrl_bytes_total{device=\"%s\"} %" PRIu64 "\n", (char *)names->pdata[n++],
+                               s->ctrl.bytes);
+    }
+
+    dusb_metrics_family(o, "dusb_agg_datagrams", "counter", "Datagrams carried in EP3 NTBs");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        if (s->agg.enabled) {
+            g_string_append_printf(o, "dusb_agg_datagrams_total{device=\"%s\",dir=\"in\"} %" PRIu64 "\n"
+                                   "dusb_agg_datagrams_total{device=\"%s\",dir=\"out\"} %" PRIu64 "\n",
+                                   (char *)names->pdata[n], s->agg.in_datagrams, (char *)names->pdata[n],
+                                   s->agg.out_datagrams);
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_video_frames", "counter", "Video frames by outcome");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        if (s->video.ep) {
+            g_string_append_printf(o, "dusb_video_frames_total{device=\"%s\",result=\"sent\"} %" PRIu64 "\n"
+                                   "dusb_video_frames_total{device=\"%s\",result=\"late\"} %" PRIu64 "\n"
+                                   "dusb_video_frames_total{device=\"%s\",result=\"dropped\"} %" PRIu64 "\n",
+                                   (char *)names->pdata[n], s->video.frames, (char *)names->pdata[n],
+                                   s->video.late, (char *)names->pdata[n], s->video.dropped);
+        }
+        n++;
+    }
+    dusb_metrics_family(o, "dusb_video_frame_latency_seconds", "histogram", "Video frame capture to end of frame");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        if (s->video.ep) {
+            g_autofree char *labels = g_strdup_printf("device=\"%s\"", (char *)names->pdata[n]);
+            dusb_metrics_hist(o, "dusb_video_frame_latency_seconds", labels, &s->video.lat);
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_cmd_responses", "counter", "Responses sent by the command engine");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        if (s->cmd.enabled) {
+            g_string_append_printf(o, "dusb_cmd_responses_total{device=\"%s\"} %" PRIu64 "\n",
+                                   (char *)names->pdata[n], s->cmd.responses);
+        }
+        n++;
+    }
+    dusb_metrics_family(o, "dusb_cmd_rtt_seconds", "histogram", "Command arrival to end of its response");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        if (s->cmd.enabled) {
+            g_autofree char *labels = g_strdup_printf("device=\"%s\"", (char *)names->pdata[n]);
+            dusb_metrics_hist(o, "dusb_cmd_rtt_seconds", labels, &s->cmd.rtt);
+        }
+        n++;
+    }
+    dusb_metrics_family(o, "dusb_cmd_offload_host_seconds", "histogram", "Host time of offloaded computations");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        if (s->cmd.enabled) {
+            g_autofree char *labels = g_strdup_printf("device=\"%s\"", (char *)names->pdata[n]);
+            dusb_metrics_hist(o, "dusb_cmd_offload_host_seconds", labels, &s->cmd.host);
+        }
+        n++;
+    }
+    dusb_metrics_family(o, "dusb_function_wake_seconds", "histogram", "Function wake to resume from function suspend");
+    n = 0;
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        for (int f = 0; f < dusb_num_funcs(s); f++) {
+            if (s->fsusp[f].suspends) {
+                g_autofree char *labels = g_strdup_printf("device=\"%s\",interface=\"%d\"",
+                                                          (char *)names->pdata[n], f);
+                dusb_metrics_hist(o, "dusb_function_wake_seconds", labels, &s->fsusp[f].wake);
+            }
+        }
+        n++;
+    }
+
+    dusb_metrics_family(o, "dusb_scheduler_timers", "gauge", "Timers on the shared timer wheel");
+    g_string_append_printf(o, "dusb_scheduler_timers %u\n", dusb_wheel.users);
+    dusb_metrics_family(o, "dusb_scheduler_fires", "counter", "Expirations of the shared QEMU timer");
+    g_string_append_printf(o, "dusb_scheduler_fires_total %" PRIu64 "\n", dusb_wheel.fires);
+    dusb_metrics_family(o, "dusb_scheduler_dispatched", "counter", "Timer callbacks run by the shared wheel");
+    g_string_append_printf(o, "dusb_scheduler_dispatched_total %" PRIu64 "\n", dusb_wheel.dispatched);
+    g_string_append(o, "# EOF\n");
+    g_ptr_array_free(names, true);
+}
+
+static void dusb_metrics_reset(DUSBMetrics *m) {
+    if (m->watch) {
+        g_source_remove(m->watch);
+        m->watch = 0;
+    }
+    if (m->out) {
+        g_string_free(m->out, true);
+        m->out = NULL;
+    }
+    if (m->req) {
+        g_string_truncate(m->req, 0);
+    }
+}
+
+static gboolean dusb_metrics_writable(void *do_not_use, GIOCondition cond, void *opaque);
+
+/* Send as much of the response as the peer takes, then wait until it is writable again */
+static void dusb_metrics_flush(DUSBMetrics *m) {
+    while (m->out_pos < m->out->len) {
+        int n = qemu_chr_fe_write(&m->chr, (uint8_t *)m->out->str + m->out_pos, m->out->len - m->out_pos);
+        if (n < 0 && errno != EAGAIN) {
+            dusb_metrics_reset(m);
+            qemu_chr_fe_disconnect(&m->chr);
+            return;
+        }
+        if (n <= 0) {
+            m->watch = qemu_chr_fe_add_watch(&m->chr, G_IO_OUT | G_IO_HUP, dusb_metrics_writable, m);
+            if (!m->watch) {
+                dusb_metrics_reset(m);
+                qemu_chr_fe_disconnect(&m->chr);
+            }
+            return;
+        }
+        m->out_pos += n;
+    }
+    dusb_metrics_reset(m);
+    qemu_chr_fe_disconnect(&m->chr);
+}
+
+static gboolean dusb_metrics_writable(void *do_not_use, GIOCondition cond, void *opaque) {
+    DUSBMetrics *m = opaque;
+
+    m->watch = 0;
+    dusb_metrics_flush(m);
+    return G_SOURCE_REMOVE;
+}
+
+/* Stop reading while a response is being sent */
+static int dusb_metrics_can_read(void *opaque) {
+    DUSBState *s = opaque;
+    return s->metrics.out ? 0 : DUSB_METRICS_MAX_REQ - s->metrics.req->len;
+}
+
+static void dusb_metrics_read(void *opaque, const uint8_t *buf, int size) {
+    DUSBState *s = opaque;
+    DUSBMetrics *m = &s->metrics;
+    GString *body;
+
+    g_string_append_len(m->req, (const char *)buf, size);
+    /* Wait for the blank line ending the request; an empty first line is a request too */
+    if (!strstr(m->req->str, "\n\r\n") && !strstr(m->req->str, "\n\n") && m->req->str[0] != '\n' &&
+        !g_str_has_prefix(m->req->str, "\r\n")) {
+        if (m->req->len >= DUSB_METRICS_MAX_REQ) {
+            dusb_metrics_reset(m);
+            qemu_chr_fe_disconnect(&m->chr);
+        }
+        return;
+    }
+
+    body = g_string_sized_new(64 * KiB);
+    dusb_metrics_render(body);
+    if (g_str_has_prefix(m->req->str, "GET ")) {
+        m->out = g_string_sized_new(body->len + 256);
+        g_string_append_printf(m->out, "HTTP/1.0 200 OK\r\nContent-Type: application/openmetrics-text; "
+                               "version=1.0.0; charset=utf-8\r\nContent-Length: %zu\r\n"
+                               "Connection: close\r\n\r\n", body->len);
+        g_string_append_len(m->out, body->str, body->len);
+        g_string_free(body, true);
+    } else {
+        m->out = body;
+    }
+    m->out_pos = 0;
+    dusb_metrics_flush(m);
+}
+
+static void dusb_metrics_event(void *opaque, QEMUChrEvent event) {
+    DUSBState *s = opaque;
+
+    if (event == CHR_EVENT_OPENED || event == CHR_EVENT_CLOSED) {
+        dusb_metrics_reset(&s->metrics);
+    }
+}
+
+/* Initializing the device and setting up endpoints */
+static void dusb_realize(USBDevice *dev, Error **errp) {
+    DUSBState *s = USB_DUSB(dev);
+    int lock = USB_SPEED_SUPER;
+
+    /* Reject bad settings before anything is allocated or registered */
+    if (s->functions < 1 || s->functions > DUSB_MAX_FUNCS) {
+        error_setg(errp, "functions must be between 1 and %d", DUSB_MAX_FUNCS);
+        return;
+    }
+    if (s->speed) {
+        for (lock = USB_SPEED_FULL; lock <= USB_SPEED_SUPER && strcmp(s->speed, dusb_speed_names[lock]); lock++) {
+        }
+        if (lock > USB_SPEED_SUPER) {
+            error_setg(errp, "speed must be full, high or super");
+            return;
+        }
+    }
+    if (!dusb_agg_check(s, errp) || !dusb_video_check(s, errp) || !dusb_cmd_check(s, errp)) {
+        return;
+    }
+    dev->usb_desc = &desc;
+    if (s->functions > 1 || s->speed || s->cmd.enabled) {
+        s->cdesc = dusb_composite_desc(s->functions, s->cmd.enabled);
+        if (s->speed) {
+            dusb_desc_lock_speed(&s->cdesc->desc, lock);
+        }
+        dev->usb_desc = &s->cdesc->desc;
+    }
+    usb_desc_create_serial(dev);  /* Unique per port unless the serial property is set */
+    usb_desc_init(dev);
+    if (s->speed) {
+        /*
+         * usb_desc_init derives speedmask from the descriptor sets and resets
+         * dev->speed, so the lock is applied here: the controller picks the
+         * speed from this mask when the device is attached.
+         */
+        dev->speedmask = 1 << lock;
+        qemu_log("DUSB: Locked to %s speed\n", s->speed);
+    }
+    qemu_log("DUSB: usb_desc_init completed, dev->usb_desc: %p\n", dev->usb_desc);
+    qemu_log("DUSB: wakeup_interval (seconds) = %u, in_interval (seconds) = %u\n", s->wakeup_interval, s->in_interval);
+    usb_ep_init(dev);
+
+    /* Configuring endpoint properties for SuperSpeed streams on bulk endpoints */
+    for (int i = 1; i <= dusb_num_eps(s); i++) {
+        USBEndpoint *ep_out = usb_ep_get(dev, USB_TOKEN_OUT, i);
+        USBEndpoint *ep_in = usb_ep_get(dev, USB_TOKEN_IN, i);
+        bool bulk = i % DUSB_NUM_EPS == 0;
+        if (ep_out) {
+            ep_out->max_streams = bulk ? 9 : 0; /* 9 streams for the bulk OUT endpoints */
+            qemu_log("DUSB: (OUT) Max Stream for PID: %u, IFNUM: %u = %d\n", ep_out->pid, ep_out->ifnum, ep_out->max_streams);
+        }
+        if (ep_in) {
+            ep_in->max_streams = bulk ? 9 : 0; /* 9 streams for the bulk IN endpoints */
+            qemu_log("DUSB: (IN) Max Stream for PID: %u, IFNUM: %u = %d\n", ep_in->pid, ep_in->ifnum, ep_in->max_streams);
+        }
+    }
+
+    /* Setting up control endpoint (EP0) */
+    USBEndpoint *ep0_out = usb_ep_get(dev, USB_TOKEN_OUT, 0);
+    USBEndpoint *ep0_in = usb_ep_get(dev, USB_TOKEN_IN, 0);
+    if (!ep0_out || !ep0_in) {
+        error_setg(errp, "Failed to find control endpoint");
+        goto fail;
+    }
+    ep0_out->max_packet_size = 512;
+    ep0_in->max_packet_size = 512;
+    ep0_out->pipeline = true;
+    ep0_in->pipeline = true;
+    dusb_setup_pipeline(s);
+
+    /* Initializing device state */
+    memset(s->alt, 0, sizeof(s->alt));
+    memset(s->in_data, 0, sizeof(s->in_data));
+    memset(s->in_data_len, 0, sizeof(s->in_data_len));
+    dusb_resolve_ep_defaults(s);
+    dusb_reset_stats(s);
+    dusb_agg_realize(s);
+    dusb_video_realize(s);
+    dusb_cmd_realize(s);
+
+    /* Setting up timers for wakeup and IN data */
+    dusb_timer_init(&s->wakeup_timer, dusb_wakeup_timer, s);
+    dusb_timer_mod(&s->wakeup_timer,
+                   qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + (int64_t)s->wakeup_interval * NANOSECONDS_PER_SECOND);
+    dusb_timer_init(&s->in_timer, dusb_in_timer, s);
+    dusb_timer_init(&s->ctrl_timer, dusb_ctrl_timer, s);
+    dusb_timer_init(&s->sweep.timer, dusb_sweep_timer, s);
+
+    if (qemu_chr_fe_backend_connected(&s->metrics.chr)) {
+        s->metrics.req = g_string_new(NULL);
+        qemu_chr_fe_set_handlers(&s->metrics.chr, dusb_metrics_can_read, dusb_metrics_read, dusb_metrics_event,
+                                 NULL, s, NULL, true);
+    }
+    QLIST_INSERT_HEAD(&dusb_devices, s, next);
+    return;
+
+fail:
+    g_free(s->cdesc);
+    s->cdesc = NULL;
+}
+
+/* Releasing timers and buffers when the device is removed */
+static void dusb_unrealize(USBDevice *dev) {
+    DUSBState *s = USB_DUSB(dev);
+
+    QLIST_REMOVE(s, next);
+    /* Offload jobs point at the device */
+    AIO_WAIT_WHILE_UNLOCKED(NULL, s->cmd.jobs > 0);
+    dusb_cmd_reset(&s->cmd);
+    dusb_timer_deinit(&s->wakeup_timer);
+    dusb_timer_deinit(&s->in_timer);
+    dusb_timer_deinit(&s->ctrl_timer);
+    dusb_timer_deinit(&s->sweep.timer);
+    g_free(s->sweep.points);
+    g_free(s->sweep.spec);
+    g_free(s->out_buf);
+    dusb_timer_deinit(&s->agg.timer);
+    dusb_timer_deinit(&s->video.timer);
+    dusb_metrics_reset(&s->metrics);
+    qemu_chr_fe_deinit(&s->metrics.chr, false);
+    if (s->metrics.req) {
+        g_string_free(s->metrics.req, true);
+    }
+    g_free(s->agg.build);
+    g_free(s->agg.ready);
+    dusb_pattern_release(s);
+    g_free(s->cdesc);
+    s->cdesc = NULL;
+}
+
+/*
+ * Runtime control plane. These QOM properties stay writable after realize, so
+ * traffic can be retuned from QMP with qom-set/qom-get while the guest runs.
+ */
+
+/* uint32_t endpoint fields exposed as ep<N>_<dir>_<field> */
+typedef struct DUSBEpProp {
+    const char *name;
+    size_t offset;
+    const char *description;
+} DUSBEpProp;
+
+static const DUSBEpProp dusb_ep_props[] = {
+    {"interval_us", offsetof(DUSBEp, interval_us), "Generation (IN) or acceptance (OUT) period in us, 0 = unthrottled"},
+    {"size", offsetof(DUSBEp, size), "Payload bytes per IN transfer"},
+    {"rate_bps", offsetof(DUSBEp, rate_bps), "Token bucket rate in bytes per second, 0 = unlimited"},
+    {"latency_us", offsetof(DUSBEp, latency_us), "Fixed completion latency in us"},
+    {"jitter_us", offsetof(DUSBEp, jitter_us), "Random extra completion latency of up to this many us"},
+    {"fault_stall_ppm", offsetof(DUSBEp, fault.ppm[DUSB_FAULT_STALL]), "Per-transfer STALL probability in ppm"},
+    {"fault_babble_ppm", offsetof(DUSBEp, fault.ppm[DUSB_FAULT_BABBLE]), "Per-transfer babble probability in ppm"},
+    {"fault_ioerror_ppm", offsetof(DUSBEp, fault.ppm[DUSB_FAULT_IOERROR]),
+     "Per-transfer I/O error probability in ppm"},
+    {"fault_short_ppm", offsetof(DUSBEp, fault.ppm[DUSB_FAULT_SHORT]),
+     "Per-transfer short packet probability in ppm (IN only)"},
+    {"fault_drop_ppm", offsetof(DUSBEp, fault.ppm[DUSB_FAULT_DROP]),
+     "Per-interval drop probability in ppm (isochronous only)"},
+    {"fault_every", offsetof(DUSBEp, fault.every), "Inject fault_kind every N transfers, 0 = off"},
+    {"fault_kind", offsetof(DUSBEp, fault.kind), "Scheduled fault: 0 stall, 1 babble, 2 ioerror, 3 short, 4 drop"},
+};
+
+/* Property opaque: endpoint slot (dir * DUSB_MAX_EPS + index) << 8 | field */
+static DUSBEp *dusb_ep_prop_ep(DUSBState *s, void *opaque) {
+    int slot = GPOINTER_TO_INT(opaque) >> 8;
+    return &s->eps[slot / DUSB_MAX_EPS][slot % DUSB_MAX_EPS];
+}
+
+/* Endpoint properties exist for every function slot; only realized functions accept writes */
+static bool dusb_ep_prop_present(DUSBState *s, DUSBEp *e, const char *name, Error **errp) {
+    if (s->dev.qdev.realized && (e->addr & 0x0f) > dusb_num_eps(s)) {
+        error_setg(errp, "%s: device has %u function(s)", name, MAX(s->functions, 1));
+        return false;
+    }
+    return true;
+}
+
+static uint32_t *dusb_ep_prop_field(DUSBState *s, void *opaque) {
+    const DUSBEpProp *prop = &dusb_ep_props[GPOINTER_TO_INT(opaque) & 0xff];
+    return (uint32_t *)((uint8_t *)dusb_ep_prop_ep(s, opaque) + prop->offset);
+}
+
+static void dusb_get_ep_u32(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    uint32_t value = *dusb_ep_prop_field(USB_DUSB(obj), opaque);
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void dusb_set_ep_u32(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+    DUSBEp *e = dusb_ep_prop_ep(s, opaque);
+    uint32_t *field = dusb_ep_prop_field(s, opaque);
+    uint32_t value;
+
+    if (!visit_type_uint32(v, name, &value, errp) || !dusb_ep_prop_present(s, e, name, errp)) {
+        return;
+    }
+    if (field == &e->size && !dusb_ep_config_valid(e, e->pattern, value)) {
+        error_setg(errp, "%s: size %u is not valid for pattern %d", name, value, e->pattern);
+        return;
+    }
+    if (field == &e->interval_us && value == DUSB_INTERVAL_DEFAULT) {
+        error_setg(errp, "%s: interval %u is reserved", name, value);
+        return;
+    }
+    if (field >= e->fault.ppm && field < e->fault.ppm + DUSB_FAULT_NUM && value > DUSB_FAULT_PPM) {
+        error_setg(errp, "%s: probability %u exceeds %u ppm", name, value, DUSB_FAULT_PPM);
+        return;
+    }
+    if (field == &e->fault.kind && value >= DUSB_FAULT_NUM) {
+        error_setg(errp, "%s: unknown fault %u", name, value);
+        return;
+    }
+    *field = value;
+    /* Fault settings apply to the next transfer without restarting the engine */
+    if ((uint8_t *)field < (uint8_t *)&e->fault || (uint8_t *)field >= (uint8_t *)(&e->fault + 1)) {
+        dusb_ep_apply(s, e);
+    }
+}
+
+static void dusb_get_ep_pattern(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    uint8_t value = dusb_ep_prop_ep(USB_DUSB(obj), opaque)->pattern;
+    visit_type_uint8(v, name, &value, errp);
+}
+
+static void dusb_set_ep_pattern(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+    DUSBEp *e = dusb_ep_prop_ep(s, opaque);
+    uint8_t value;
+
+    if (!visit_type_uint8(v, name, &value, errp) || !dusb_ep_prop_present(s, e, name, errp)) {
+        return;
+    }
+    if (!dusb_ep_config_valid(e, value, e->size)) {
+        error_setg(errp, "%s: pattern %u is not valid with size %u", name, value, e->size);
+        return;
+    }
+    e->pattern = value;
+    dusb_ep_apply(s, e);
+}
+
+static void dusb_get_ep_running(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    bool value = dusb_ep_prop_ep(USB_DUSB(obj), opaque)->running;
+    visit_type_bool(v, name, &value, errp);
+}
+
+static void dusb_set_ep_running(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+    DUSBEp *e = dusb_ep_prop_ep(s, opaque);
+    bool value;
+
+    if (visit_type_bool(v, name, &value, errp) && dusb_ep_prop_present(s, e, name, errp)) {
+        dusb_ep_set_running(s, e, value);
+    }
+}
+
+/* Device-wide start/stop, reads true while any endpoint is running */
+static bool dusb_get_running(Object *obj, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            if (s->eps[d][i].running) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static void dusb_set_running(Object *obj, bool value, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            dusb_ep_set_running(s, &s->eps[d][i], value);
+        }
+    }
+}
+
+/* Writing true clears all counters; always reads false */
+static bool dusb_get_reset_stats(Object *obj, Error **errp) {
+    return false;
+}
+
+static void dusb_set_reset_stats(Object *obj, bool value, Error **errp) {
+    if (value) {
+        dusb_reset_stats(USB_DUSB(obj));
+    }
+}
+
+/* Snapshot of every counter as a JSON object */
+static char *dusb_get_stats(Object *obj, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    int64_t elapsed = now - s->stats_epoch_ns;
+    const DUSBAgg *agg = &s->agg;
+    const DUSBCtrlBench *c = &s->ctrl;
+    GString *json = g_string_new("{");
+
+    g_string_append_printf(json, "\"timestamp_ns\": %" PRId64 ", \"elapsed_ns\": %" PRId64 ", \"digest\": \"%08x\""
+                           ", \"speed\": \"%s\", \"endpoints\": [", now, elapsed, s->digest, dusb_speed_name(s));
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            const DUSBEp *e = &s->eps[d][i];
+            g_string_append_printf(json,
+                                   "%s{\"ep\": %u, \"running\": %s, \"packets\": %" PRIu64 ", \"bytes\": %" PRIu64
+                                   ", \"naks\": %" PRIu64 ", \"lost\": %" PRIu64 ", \"errors\": %u"
+                                   ", \"packets_per_sec\": %" PRIu64 ", \"bytes_per_sec\": %" PRIu64
+                                   ", \"latency_ns\": ",
+                                   d || i ? ", " : "", e->addr, e->running ? "true" : "false", e->stats.packets,
+                                   e->stats.bytes, e->stats.naks, e->stats.lost, e->stats.errors,
+                                   elapsed > 0 ? muldiv64(e->stats.packets, NANOSECONDS_PER_SECOND, elapsed) : 0,
+                                   elapsed > 0 ? muldiv64(e->stats.bytes, NANOSECONDS_PER_SECOND, elapsed) : 0);
+            dusb_hist_json(json, &e->lat);
+            g_string_append(json, ", \"faults\": {");
+            for (int k = 0; k < DUSB_FAULT_NUM; k++) {
+                g_string_append_printf(json, "\"%s\": %" PRIu64 ", ", dusb_fault_names[k], e->fault.injected[k]);
+            }
+            g_string_append(json, "\"recovery_ns\": ");
+            dusb_hist_json(json, &e->fault.recovery);
+            g_string_append(json, ", \"halt_clear_ns\": ");
+            dusb_hist_json(json, &e->fault.halt_clear);
+            g_string_append(json, "}}");
+        }
+    }
+    g_string_append_printf(json,
+                           "], \"agg\": {\"in_ntbs\": %" PRIu64 ", \"in_datagrams\": %" PRIu64 ", \"in_bytes\": %" PRIu64
+                           ", \"in_dropped\": %" PRIu64 ", \"out_ntbs\": %" PRIu64 ", \"out_datagrams\": %" PRIu64
+                           ", \"out_bytes\": %" PRIu64 ", \"out_errors\": %" PRIu64 "}",
+                           agg->in_ntbs, agg->in_datagrams, agg->in_bytes, agg->in_dropped, agg->out_ntbs,
+                           agg->out_datagrams, agg->out_bytes, agg->out_errors);
+    if (s->video.ep) {
+        const DUSBVideo *v = &s->video;
+        g_string_append_printf(json,
+                               ", \"video\": {\"ep\": %u, \"frame_size\": %u, \"fps\": %u, \"frames\": %" PRIu64
+                               ", \"late\": %" PRIu64 ", \"dropped\": %" PRIu64 ", \"payloads\": %" PRIu64
+                               ", \"bytes\": %" PRIu64 ", \"frames_per_sec\": %.2f, \"queued\": %u, \"latency_ns\": ",
+                               0x80 | v->ep, v->frame_size, v->fps, v->frames, v->late, v->dropped, v->payloads,
+                               v->bytes, elapsed > 0 ? (double)v->frames * NANOSECONDS_PER_SECOND / elapsed : 0.0,
+                               v->queued);
+        dusb_hist_json(json, &v->lat);
+        g_string_append(json, "}");
+    }
+    g_string_append_printf(json,
+                           ", \"ctrl\": {\"reads\": %" PRIu64 ", \"writes\": %" PRIu64 ", \"bytes\": %" PRIu64
+                           ", \"errors\": %u, \"deferred\": %u, \"rtt_count\": %" PRIu64
+                           ", \"rtt_sum_ns\": %" PRIu64 ", \"rtt_min_ns\": %" PRIu64 ", \"rtt_max_ns\": %" PRIu64 "}",
+                           c->reads, c->writes, c->bytes, c->errors, c->deferred, c->rtt.count, c->rtt.sum_ns,
+                           c->rtt.count ? c->rtt.min_ns : 0, c->rtt.max_ns);
+    if (s->cmd.enabled) {
+        const DUSBCmd *cm = &s->cmd;
+        g_string_append_printf(json, ", \"cmd\": {\"depth\": %u, \"workers\": %u, \"outstanding\": %u"
+                               ", \"max_outstanding\": %u, \"commands\": %" PRIu64 ", \"responses\": %" PRIu64
+                               ", \"rejected\": %" PRIu64 ", \"malformed\": %" PRIu64 ", \"full_naks\": %" PRIu64
+                               ", \"commands_per_sec\": %.1f, \"rtt_ns\": ",
+                               cm->depth, cm->workers, cm->count, cm->max_outstanding, cm->commands, cm->responses,
+                               cm->rejected, cm->malformed, cm->full,
+                               elapsed > 0 ? (double)cm->responses * NANOSECONDS_PER_SECOND / elapsed : 0.0);
+        dusb_hist_json(json, &cm->rtt);
+        g_string_append(json, ", \"queue_ns\": ");
+        dusb_hist_json(json, &cm->queue);
+        g_string_append_printf(json, ", \"offload\": {\"in_flight\": %u, \"jobs\": %" PRIu64 ", \"bytes\": %"
+                               PRIu64 ", \"failed\": %" PRIu64 ", \"late\": %" PRIu64 "}}",
+                               cm->jobs, cm->offloaded, cm->offload_bytes, cm->offload_failed, cm->late);
+    }
+    g_string_append(json, ", \"function_suspend\": [");
+    for (int f = 0; f < dusb_num_funcs(s); f++) {
+        const DUSBFuncSuspend *fs = &s->fsusp[f];
+        g_string_append_printf(json, "%s{\"interface\": %d, \"suspended\": %s, \"remote_wake\": %s, \"suspends\": %"
+                               PRIu64 ", \"wake_requests\": %" PRIu64 ", \"wakes_answered\": %" PRIu64
+                               ", \"wake_pending\": %s, \"active_ns\": ",
+                               f ? ", " : "", f, fs->suspended ? "true" : "false",
+                               fs->remote_wake ? "true" : "false", fs->suspends, fs->wakes, fs->wake.count,
+                               fs->wake_ns ? "true" : "false");
+        dusb_hist_json(json, &fs->active);
+        g_string_append(json, ", \"wake_ns\": ");
+        dusb_hist_json(json, &fs->wake);
+        g_string_append(json, "}");
+    }
+    g_string_append(json, "]");
+    g_string_append_printf(json,
+                           ", \"scheduler\": {\"timers\": %u, \"slack_us\": %u, \"fires\": %" PRIu64
+                           ", \"dispatched\": %" PRIu64 "}}",
+                           dusb_wheel.users, dusb_wheel.slack_ticks * DUSB_WHEEL_TICK_NS / 1000, dusb_wheel.fires,
+                           dusb_wheel.dispatched);
+    return g_string_free(json, false);
+}
+
+/*
+ * Cycle accounting. While enabled, host ticks (the TSC on x86, a
+ * nanosecond clock on hosts without a cycle counter) are taken around the
+ * data and control handlers, payload generation and verification, and
+ * every timer callback. Timers are timed by the wheel dispatcher through
+ * DUSBTimer.prof. Disabled, each site costs one predictable branch.
+ */
+static void dusb_prof_enable(DUSBState *s, bool on) {
+    DUSBTimer *timers[DUSB_PROF_DEV_NUM] = {
+        [DUSB_PROF_WAKEUP_TIMER] = &s->wakeup_timer,
+        [DUSB_PROF_IN_TIMER] = &s->in_timer,
+        [DUSB_PROF_CTRL_TIMER] = &s->ctrl_timer,
+        [DUSB_PROF_SWEEP_TIMER] = &s->sweep.timer,
+        [DUSB_PROF_AGG_TIMER] = &s->agg.timer,
+        [DUSB_PROF_VIDEO_TIMER] = &s->video.timer,
+    };
+
+    if (on) {
+        dusb_prof_reset(s);
+    }
+    s->profile = on;
+    for (int i = 0; i < DUSB_PROF_DEV_NUM; i++) {
+        if (timers[i]) {
+            timers[i]->prof = on ? &s->prof[i] : NULL;
+        }
+    }
+}
+
+static void dusb_prof_json(GString *json, const char *name, const DUSBProf *p) {
+    g_string_append_printf(json, "\"%s\": {\"calls\": %" PRIu64 ", \"cycles\": %" PRIu64 ", \"bytes\": %" PRIu64
+                           ", \"cycles_per_call\": %.1f, \"cycles_per_byte\": %.3f}", name, p->calls, p->cycles,
+                           p->bytes, p->calls ? (double)p->cycles / p->calls : 0.0,
+                           p->bytes ? (double)p->cycles / p->bytes : 0.0);
+}
+
+static bool dusb_get_profile(Object *obj, Error **errp) {
+    return USB_DUSB(obj)->profile;
+}
+
+/* Writing true starts cycle accounting from zero, false stops it and keeps the counts */
+static void dusb_set_profile(Object *obj, bool value, Error **errp) {
+    dusb_prof_enable(USB_DUSB(obj), value);
+}
+
+static char *dusb_get_profile_report(Object *obj, Error **errp) {
+    static const char *const timer_names[DUSB_PROF_DEV_NUM] = {
+        [DUSB_PROF_WAKEUP_TIMER] = "wakeup_timer",
+        [DUSB_PROF_IN_TIMER] = "in_timer",
+        [DUSB_PROF_CTRL_TIMER] = "ctrl_timer",
+        [DUSB_PROF_SWEEP_TIMER] = "sweep_timer",
+        [DUSB_PROF_AGG_TIMER] = "agg_timer",
+        [DUSB_PROF_VIDEO_TIMER] = "video_timer",
+    };
+    DUSBState *s = USB_DUSB(obj);
+    int64_t elapsed = get_clock() - s->prof_clock0;
+    int64_t ticks = cpu_get_host_ticks() - s->prof_ticks0;
+    GString *json = g_string_new("{");
+
+    g_string_append_printf(json, "\"enabled\": %s, \"elapsed_ns\": %" PRId64 ", \"tick_hz\": %.0f, \"endpoints\": [",
+                           s->profile ? "true" : "false", elapsed,
+                           elapsed > 0 ? (double)ticks * NANOSECONDS_PER_SECOND / elapsed : 0.0);
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            const DUSBEp *e = &s->eps[d][i];
+            g_string_append_printf(json, "%s{\"ep\": %u, \"type\": \"%s\", ", d || i ? ", " : "", e->addr,
+                                   dusb_ep_type_names[dusb_ep_kind(e)]);
+            dusb_prof_json(json, "data", &e->prof[DUSB_PROF_DATA]);
+            g_string_append(json, ", ");
+            dusb_prof_json(json, d ? "generate" : "verify", &e->prof[DUSB_PROF_PAYLOAD]);
+            g_string_append(json, "}");
+        }
+    }
+    g_string_append(json, "], ");
+    dusb_prof_json(json, "control", &s->prof[DUSB_PROF_CONTROL]);
+    for (int i = DUSB_PROF_CONTROL + 1; i < DUSB_PROF_DEV_NUM; i++) {
+        g_string_append(json, ", ");
+        dusb_prof_json(json, timer_names[i], &s->prof[i]);
+    }
+    /* Host time, so kept out of stats, which must repeat under -icount */
+    g_string_append(json, ", \"offload_host_ns\": ");
+    dusb_hist_json(json, &s->cmd.host);
+    g_string_append(json, "}");
+    return g_string_free(json, false);
+}
+
+/* Writing a sweep description starts a sweep, writing "" aborts it */
+static char *dusb_get_sweep(Object *obj, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+    return g_strdup(s->sweep.spec ? s->sweep.spec : "");
+}
+
+static void dusb_set_sweep(Object *obj, const char *value, Error **errp) {
+    DUSBState *s = USB_DUSB(obj);
+
+    if (!DEVICE(obj)->realized) {
+        error_setg(errp, "sweep can only be started on a realized device");
+        return;
+    }
+    if (s->sweep.active) {
+        dusb_sweep_finish(s, true);
+    }
+    if (*value && dusb_sweep_start(s, value, errp)) {
+        g_free(s->sweep.spec);
+        s->sweep.spec = g_strdup(value);
+    }
+}
+
+static char *dusb_get_sweep_report(Object *obj, Error **errp) {
+    return dusb_sweep_report(USB_DUSB(obj));
+}
+
+/* Jain's fairness index of n rates: 1 when equal, 1/n when one takes all */
+static double dusb_jain_index(const double *x, int n) {
+    double sum = 0, sq = 0;
+
+    for (int i = 0; i < n; i++) {
+        sum += x[i];
+        sq += x[i] * x[i];
+    }
+    return sq > 0 ? sum * sum / (n * sq) : 1.0;
+}
+
+static void dusb_hist_merge(DUSBHist *dst, const DUSBHist *src) {
+    if (!src->count) {
+        return;
+    }
+    if (!dst->count || src->min_ns < dst->min_ns) {
+        dst->min_ns = src->min_ns;
+    }
+    dst->max_ns = MAX(dst->max_ns, src->max_ns);
+    dst->count += src->count;
+    dst->sum_ns += src->sum_ns;
+    for (int i = 0; i < DUSB_HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/*
+ * Bandwidth share of every DUSB instance in the machine, each measured since
+ * its own last counter reset. Jain's index is given across devices and, for
+ * each endpoint address, across the devices where that endpoint runs.
+ */
+static char *dusb_get_fairness(Object *obj, Error **errp) {
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    GString *json = g_string_new("{\"devices\": [");
+    g_autofree double *dev_bw = NULL;
+    g_autofree double *ep_bw = NULL;      /* [endpoint slot][device] */
+    int ep_n[2 * DUSB_MAX_EPS] = {};
+    int ndev = 0, neps = 0, n = 0;
+    DUSBState *s;
+
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        ndev++;
+        neps = MAX(neps, dusb_num_eps(s));
+    }
+    dev_bw = g_new0(double, MAX(ndev, 1));
+    ep_bw = g_new0(double, 2 * DUSB_MAX_EPS * MAX(ndev, 1));
+    QLIST_FOREACH(s, &dusb_devices, next) {
+        int64_t elapsed = now - s->stats_epoch_ns;
+        DeviceState *ds = DEVICE(s);
+        g_autofree char *path = ds->id ? NULL : object_get_canonical_path(OBJECT(s));
+        uint64_t bytes = 0, packets = 0, naks = 0;
+        DUSBHist lat = {};
+
+        for (int d = 0; d < 2; d++) {
+            for (int i = 0; i < dusb_num_eps(s); i++) {
+                const DUSBEp *e = &s->eps[d][i];
+                int slot = d * DUSB_MAX_EPS + i;
+                bytes += e->stats.bytes;
+                packets += e->stats.packets;
+                naks += e->stats.naks;
+                dusb_hist_merge(&lat, &e->lat);
+                if (e->running && elapsed > 0) {
+                    ep_bw[slot * ndev + ep_n[slot]++] = (double)e->stats.bytes * NANOSECONDS_PER_SECOND / elapsed;
+                }
+            }
+        }
+        dev_bw[n] = elapsed > 0 ? (double)bytes * NANOSECONDS_PER_SECOND / elapsed : 0;
+        g_string_append_printf(json,
+                               "%s{\"id\": \"%s\", \"elapsed_ns\": %" PRId64 ", \"bytes\": %" PRIu64
+                               ", \"packets\": %" PRIu64 ", \"naks\": %" PRIu64 ", \"bytes_per_sec\": %.0f"
+                               ", \"latency_ns\": ",
+                               n ? ", " : "", ds->id ? ds->id : path, elapsed, bytes, packets, naks, dev_bw[n]);
+        dusb_hist_json(json, &lat);
+        g_string_append_c(json, '}');
+        n++;
+    }
+    g_string_append_printf(json, "], \"jain_index\": %.4f, \"endpoints\": [", dusb_jain_index(dev_bw, n));
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < neps; i++) {
+            int slot = d * DUSB_MAX_EPS + i;
+            g_string_append_printf(json, "%s{\"ep\": %u, \"devices\": %d, \"jain_index\": %.4f}",
+                                   d || i ? ", " : "", (d ? USB_DIR_IN : USB_DIR_OUT) | (i + 1), ep_n[slot],
+                                   dusb_jain_index(ep_bw + slot * ndev, ep_n[slot]));
+        }
+    }
+    g_string_append(json, "]}");
+    return g_string_free(json, false);
+}
+
+/* Writing true resets the counters of every instance at the same virtual time */
+static void dusb_set_reset_all_stats(Object *obj, bool value, Error **errp) {
+    DUSBState *s;
+
+    if (value) {
+        QLIST_FOREACH(s, &dusb_devices, next) {
+            dusb_reset_stats(s);
+        }
+    }
+}
+
+/* Deadline coalescing of the shared timer wheel; process-wide, so every instance reports the same value */
+static void dusb_get_sched_slack(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    uint32_t value = dusb_wheel.slack_ticks * DUSB_WHEEL_TICK_NS / 1000;
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void dusb_set_sched_slack(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    uint32_t value;
+
+    if (visit_type_uint32(v, name, &value, errp)) {
+        dusb_wheel.slack_ticks = MAX(1, (uint64_t)value * 1000 / DUSB_WHEEL_TICK_NS);
+    }
+}
+
+/* uint32_t DUSBState fields that may change at runtime */
+static void dusb_get_state_u32(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    uint32_t *field = (uint32_t *)((uint8_t *)USB_DUSB(obj) + GPOINTER_TO_SIZE(opaque));
+    visit_type_uint32(v, name, field, errp);
+}
+
+static void dusb_set_state_u32(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp) {
+    uint32_t *field = (uint32_t *)((uint8_t *)USB_DUSB(obj) + GPOINTER_TO_SIZE(opaque));
+    visit_type_uint32(v, name, field, errp);
+}
+
+static void dusb_class_init_runtime(ObjectClass *klass) {
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < DUSB_MAX_EPS; i++) {
+            int slot = d * DUSB_MAX_EPS + i;
+            const char *dir = d ? "in" : "out";
+            char *name;
+
+            for (int f = 0; f < ARRAY_SIZE(dusb_ep_props); f++) {
+                name = g_strdup_printf("ep%d_%s_%s", i + 1, dir, dusb_ep_props[f].name);
+                object_class_property_add(klass, name, "uint32", dusb_get_ep_u32, dusb_set_ep_u32, NULL,
+                                          GINT_TO_POINTER(slot << 8 | f));
+                object_class_property_set_description(klass, name, dusb_ep_props[f].description);
+                g_free(name);
+            }
+            name = g_strdup_printf("ep%d_%s_pattern", i + 1, dir);
+            object_class_property_add(klass, name, "uint8", dusb_get_ep_pattern, dusb_set_ep_pattern, NULL,
+                                      GINT_TO_POINTER(slot << 8));
+            object_class_property_set_description(klass, name, "Payload pattern: 0 legacy, 1 zero, 2 count, 3 prbs");
+            g_free(name);
+            name = g_strdup_printf("ep%d_%s_running", i + 1, dir);
+            object_class_property_add(klass, name, "bool", dusb_get_ep_running, dusb_set_ep_running, NULL,
+                                      GINT_TO_POINTER(slot << 8));
+            object_class_property_set_description(klass, name, "Whether the endpoint generates or accepts traffic");
+            g_free(name);
+        }
+    }
+
+    object_class_property_add_bool(klass, "running", dusb_get_running, dusb_set_running);
+    object_class_property_set_description(klass, "running", "Start or stop traffic on every endpoint");
+    object_class_property_add_bool(klass, "reset_stats", dusb_get_reset_stats, dusb_set_reset_stats);
+    object_class_property_set_description(klass, "reset_stats", "Write true to clear all counters");
+    object_class_property_add_str(klass, "stats", dusb_get_stats, NULL);
+    object_class_property_set_description(klass, "stats", "All counters as a JSON object");
+
+    object_class_property_add_str(klass, "fairness", dusb_get_fairness, NULL);
+    object_class_property_set_description(klass, "fairness", "JSON bandwidth shares and Jain's index across "
+                                          "all DUSB instances");
+    object_class_property_add_bool(klass, "reset_all_stats", dusb_get_reset_stats, dusb_set_reset_all_stats);
+    object_class_property_set_description(klass, "reset_all_stats", "Write true to clear the counters of every "
+                                          "DUSB instance");
+    object_class_property_add_str(klass, "sweep", dusb_get_sweep, dusb_set_sweep);
+    object_class_property_set_description(klass, "sweep", "Sweep description "
+                                          "(ep=..;size=..;interval_us=..;dwell_ms=..), \"\" aborts");
+    object_class_property_add_str(klass, "sweep_report", dusb_get_sweep_report, NULL);
+    object_class_property_set_description(klass, "sweep_report", "JSON results of the current or last sweep");
+
+    object_class_property_add_bool(klass, "profile", dusb_get_profile, dusb_set_profile);
+    object_class_property_set_description(klass, "profile", "Write true to start host cycle accounting from zero, "
+                                          "false to stop it");
+    object_class_property_add_str(klass, "profile_report", dusb_get_profile_report, NULL);
+    object_class_property_set_description(klass, "profile_report", "JSON host cycles per call and per byte of "
+                                          "the device's handlers, generators, verifiers and timers");
+
+    object_class_property_add(klass, "sched_slack_us", "uint32", dusb_get_sched_slack, dusb_set_sched_slack, NULL,
+                              NULL);
+    object_class_property_set_description(klass, "sched_slack_us", "Timer deadlines of all DUSB instances are "
+                                          "rounded up to this many us so they expire together");
+    object_class_property_add(klass, "ctrl_delay_us", "uint32", dusb_get_state_u32, dusb_set_state_u32, NULL,
+                              GSIZE_TO_POINTER(offsetof(DUSBState, ctrl_delay_us)));
+    object_class_property_set_description(klass, "ctrl_delay_us", "Completion delay for deferred control requests");
+    object_class_property_add(klass, "ctrl_delay_mask", "uint32", dusb_get_state_u32, dusb_set_state_u32, NULL,
+                              GSIZE_TO_POINTER(offsetof(DUSBState, ctrl_delay_mask)));
+    object_class_property_set_description(klass, "ctrl_delay_mask", "Control requests to defer (bit 0 vendor, "
+                                          "bit 1 SET_INTERFACE, bit 2 GET_DESCRIPTOR)");
+
+    for (int op = 0; op < DUSB_CMD_NUM; op++) {
+        static const char *const ops[DUSB_CMD_NUM] = {"nop", "read", "write", "crc32c", "sha256", "compress"};
+        char *name;
+
+        name = g_strdup_printf("cmd_%s_cost_us", ops[op]);
+        object_class_property_add(klass, name, "uint32", dusb_get_state_u32, dusb_set_state_u32, NULL,
+                                  GSIZE_TO_POINTER(offsetof(DUSBState, cmd.cost_us) + op * sizeof(uint32_t)));
+        object_class_property_set_description(klass, name, "Fixed processing time of the command in us");
+        g_free(name);
+        name = g_strdup_printf("cmd_%s_cost_ns_per_kib", ops[op]);
+        object_class_property_add(klass, name, "uint32", dusb_get_state_u32, dusb_set_state_u32, NULL,
+                                  GSIZE_TO_POINTER(offsetof(DUSBState, cmd.cost_ns_per_kib) + op * sizeof(uint32_t)));
+        object_class_property_set_description(klass, name, "Processing time of the command per KiB of data in ns");
+        g_free(name);
+    }
+}
+
+/* Defaults for state that is not backed by a qdev property */
+static void dusb_instance_init(Object *obj) {
+    DUSBState *s = USB_DUSB(obj);
+
+    dusb_init_eps(s);
+    s->ctrl_delay_us = 0;
+    s->ctrl_delay_mask = DUSB_CTRL_DEFER_VENDOR | DUSB_CTRL_DEFER_SET_INTERFACE;
+    s->cmd.cost_us[DUSB_CMD_NOP] = 5;
+    s->cmd.cost_us[DUSB_CMD_READ] = 20;
+    s->cmd.cost_ns_per_kib[DUSB_CMD_READ] = 250;
+    s->cmd.cost_us[DUSB_CMD_WRITE] = 20;
+    s->cmd.cost_ns_per_kib[DUSB_CMD_WRITE] = 500;
+}
+
+/*
+ * Migration and snapshots. Nothing large crosses in stop-and-copy: pattern
+ * tables and the OUT scratch buffer are rebuilt on demand on the
+ * destination, and aggregation NTBs are sent only up to their fill level.
+ * Packets held by the device cannot be migrated, but their deadlines are.
+ * The host controller resubmits the transfers on the destination, and the
+ * device requeues each one with its original completion time: a delayed
+ * bulk OUT was already counted on the source and only waits out its delay,
+ * and a deferred control request runs when it would have on the source.
+ */
+static const VMStateDescription vmstate_dusb_hist = {
+    .name = "usb-dusb/hist",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64(count, DUSBHist),
+        VMSTATE_UINT64(sum_ns, DUSBHist),
+        VMSTATE_UINT64(min_ns, DUSBHist),
+        VMSTATE_UINT64(max_ns, DUSBHist),
+        VMSTATE_UINT64_ARRAY(buckets, DUSBHist, DUSB_HIST_BUCKETS),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_ep_stats = {
+    .name = "usb-dusb/ep-stats",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64(packets, DUSBEpStats),
+        VMSTATE_UINT64(bytes, DUSBEpStats),
+        VMSTATE_UINT64(naks, DUSBEpStats),
+        VMSTATE_UINT64(lost, DUSBEpStats),
+        VMSTATE_UINT32(errors, DUSBEpStats),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_fault = {
+    .name = "usb-dusb/fault",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(ppm, DUSBFault, DUSB_FAULT_NUM),
+        VMSTATE_UINT32(every, DUSBFault),
+        VMSTATE_UINT32(kind, DUSBFault),
+        VMSTATE_UINT32(rng, DUSBFault),
+        VMSTATE_UINT32(count, DUSBFault),
+        VMSTATE_INT64(pending_ns, DUSBFault),
+        VMSTATE_INT64(halt_ns, DUSBFault),
+        VMSTATE_UINT64_ARRAY(injected, DUSBFault, DUSB_FAULT_NUM),
+        VMSTATE_STRUCT(recovery, DUSBFault, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_STRUCT(halt_clear, DUSBFault, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_ep = {
+    .name = "usb-dusb/ep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(running, DUSBEp),
+        VMSTATE_UINT8(pattern, DUSBEp),
+        VMSTATE_UINT32(size, DUSBEp),
+        VMSTATE_UINT32(interval_us, DUSBEp),
+        VMSTATE_UINT32(rate_bps, DUSBEp),
+        VMSTATE_UINT32(latency_us, DUSBEp),
+        VMSTATE_UINT32(jitter_us, DUSBEp),
+        VMSTATE_UINT32(rng, DUSBEp),
+        VMSTATE_INT64(next_ns, DUSBEp),
+        VMSTATE_INT64(gen_ns, DUSBEp),
+        VMSTATE_INT64(ready_ns, DUSBEp),
+        VMSTATE_INT64(tokens, DUSBEp),
+        VMSTATE_INT64(tokens_ns, DUSBEp),
+        VMSTATE_INT64(wake_ns, DUSBEp),
+        VMSTATE_UINT32(seq, DUSBEp),
+        VMSTATE_UINT32(avail, DUSBEp),
+        VMSTATE_INT64(last_ns, DUSBEp),
+        VMSTATE_STRUCT(stats, DUSBEp, 1, vmstate_dusb_ep_stats, DUSBEpStats),
+        VMSTATE_STRUCT(lat, DUSBEp, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_STRUCT(fault, DUSBEp, 1, vmstate_dusb_fault, DUSBFault),
+        VMSTATE_BOOL(mig_halted, DUSBEp),
+        VMSTATE_BOOL(mig_async, DUSBEp),
+        VMSTATE_INT64(async_due_ns, DUSBEp),
+        VMSTATE_UINT32(async_len, DUSBEp),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_ctrl_bench = {
+    .name = "usb-dusb/ctrl-bench",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT64(reads, DUSBCtrlBench),
+        VMSTATE_UINT64(writes, DUSBCtrlBench),
+        VMSTATE_UINT64(bytes, DUSBCtrlBench),
+        VMSTATE_UINT32(errors, DUSBCtrlBench),
+        VMSTATE_UINT32(deferred, DUSBCtrlBench),
+        VMSTATE_INT64(last_ns, DUSBCtrlBench),
+        VMSTATE_STRUCT(rtt, DUSBCtrlBench, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_ctrl_async = {
+    .name = "usb-dusb/ctrl-async",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(mig_pending, DUSBCtrlAsync),
+        VMSTATE_INT32(request, DUSBCtrlAsync),
+        VMSTATE_INT32(value, DUSBCtrlAsync),
+        VMSTATE_INT32(index, DUSBCtrlAsync),
+        VMSTATE_INT32(length, DUSBCtrlAsync),
+        VMSTATE_INT64(due_ns, DUSBCtrlAsync),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Reject NTB lengths that would overrun the buffers before they are loaded */
+static bool dusb_agg_lens_valid(void *opaque, int version_id) {
+    DUSBAgg *agg = opaque;
+
+    return agg->enabled && agg->build_len <= agg->max_size && agg->ready_len <= agg->max_size &&
+           agg->ndgrams <= agg->max_datagrams && agg->ready_ndgrams <= agg->max_datagrams;
+}
+
+static const VMStateDescription vmstate_dusb_agg_state = {
+    .name = "usb-dusb/agg-state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(build_len, DUSBAgg),
+        VMSTATE_UINT32(ready_len, DUSBAgg),
+        VMSTATE_UINT32(ndgrams, DUSBAgg),
+        VMSTATE_UINT32(ready_ndgrams, DUSBAgg),
+        VMSTATE_VALIDATE("NTB lengths", dusb_agg_lens_valid),
+        VMSTATE_VBUFFER_UINT32(build, DUSBAgg, 1, NULL, build_len),
+        VMSTATE_VBUFFER_UINT32(ready, DUSBAgg, 1, NULL, ready_len),
+        VMSTATE_UINT16_ARRAY(dgram_off, DUSBAgg, DUSB_AGG_MAX_DATAGRAMS),
+        VMSTATE_UINT16_ARRAY(dgram_len, DUSBAgg, DUSB_AGG_MAX_DATAGRAMS),
+        VMSTATE_INT64(first_dgram_ns, DUSBAgg),
+        VMSTATE_INT64(next_dgram_ns, DUSBAgg),
+        VMSTATE_UINT16(in_seq, DUSBAgg),
+        VMSTATE_UINT32(dgram_seq, DUSBAgg),
+        VMSTATE_INT64(timer.expire_ns, DUSBAgg),
+        VMSTATE_UINT64(in_ntbs, DUSBAgg),
+        VMSTATE_UINT64(in_datagrams, DUSBAgg),
+        VMSTATE_UINT64(in_bytes, DUSBAgg),
+        VMSTATE_UINT64(in_dropped, DUSBAgg),
+        VMSTATE_UINT64(out_ntbs, DUSBAgg),
+        VMSTATE_UINT64(out_datagrams, DUSBAgg),
+        VMSTATE_UINT64(out_bytes, DUSBAgg),
+        VMSTATE_UINT64(out_errors, DUSBAgg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool dusb_agg_needed(void *opaque) {
+    DUSBState *s = opaque;
+    return s->agg.enabled;
+}
+
+static const VMStateDescription vmstate_dusb_agg = {
+    .name = "usb-dusb/agg",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = dusb_agg_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_STRUCT(agg, DUSBState, 1, vmstate_dusb_agg_state, DUSBAgg),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* Reject a frame queue or position beyond the frame before the video source uses it */
+static bool dusb_video_state_valid(void *opaque, int version_id) {
+    DUSBVideo *v = opaque;
+
+    return v->queued <= DUSB_VIDEO_QUEUE && v->pos < v->frame_size && !(v->fid & ~DUSB_UVC_FID);
+}
+
+static const VMStateDescription vmstate_dusb_video_state = {
+    .name = "usb-dusb/video-state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_INT64(next_ns, DUSBVideo),
+        VMSTATE_UINT32(queued, DUSBVideo),
+        VMSTATE_INT64_ARRAY(pts_ns, DUSBVideo, DUSB_VIDEO_QUEUE),
+        VMSTATE_UINT32(pos, DUSBVideo),
+        VMSTATE_UINT8(fid, DUSBVideo),
+        VMSTATE_VALIDATE("video frame queue", dusb_video_state_valid),
+        VMSTATE_INT64(timer.expire_ns, DUSBVideo),
+        VMSTATE_UINT64(frames, DUSBVideo),
+        VMSTATE_UINT64(late, DUSBVideo),
+        VMSTATE_UINT64(dropped, DUSBVideo),
+        VMSTATE_UINT64(payloads, DUSBVideo),
+        VMSTATE_UINT64(bytes, DUSBVideo),
+        VMSTATE_STRUCT(lat, DUSBVideo, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool dusb_video_needed(void *opaque) {
+    DUSBState *s = opaque;
+    return s->video.ep;
+}
+
+static const VMStateDescription vmstate_dusb_video = {
+    .name = "usb-dusb/video",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = dusb_video_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_STRUCT(video, DUSBState, 1, vmstate_dusb_video_state, DUSBVideo),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_cmd_slot = {
+    .name = "usb-dusb/cmd-slot",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT8(opcode, DUSBCmdSlot),
+        VMSTATE_UINT8(status, DUSBCmdSlot),
+        VMSTATE_UINT32(tag, DUSBCmdSlot),
+        VMSTATE_UINT32(len, DUSBCmdSlot),
+        VMSTATE_UINT32(value, DUSBCmdSlot),
+        VMSTATE_INT64(arrive_ns, DUSBCmdSlot),
+        VMSTATE_INT64(start_ns, DUSBCmdSlot),
+        VMSTATE_INT64(done_ns, DUSBCmdSlot),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool dusb_cmd_state_valid(void *opaque, int version_id) {
+    DUSBCmd *c = opaque;
+
+    if (c->count > c->depth) {
+        return false;
+    }
+    for (uint32_t i = 0; i < c->count; i++) {
+        if (c->slots[i].len > DUSB_MAX_PAYLOAD - sizeof(DUSBCmdResp)) {
+            return false;
+        }
+    }
+    return !c->count ? c->pos == 0 : c->pos < sizeof(DUSBCmdResp) + c->slots[0].len;
+}
+
+static bool dusb_cmd_head_needed(void *opaque) {
+    DUSBCmd *c = opaque;
+    return c->head_data != NULL;
+}
+
+static bool dusb_cmd_head_valid(void *opaque, int version_id) {
+    DUSBCmd *c = opaque;
+    return c->head_len <= DUSB_MAX_PAYLOAD;
+}
+
+static const VMStateDescription vmstate_dusb_cmd_head = {
+    .name = "usb-dusb/cmd-head",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = dusb_cmd_head_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(head_len, DUSBCmd),
+        VMSTATE_VALIDATE("command head", dusb_cmd_head_valid),
+        VMSTATE_VBUFFER_ALLOC_UINT32(head_data, DUSBCmd, 1, NULL, head_len),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_cmd_state = {
+    .name = "usb-dusb/cmd-state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32_ARRAY(cost_us, DUSBCmd, DUSB_CMD_NUM),
+        VMSTATE_UINT32_ARRAY(cost_ns_per_kib, DUSBCmd, DUSB_CMD_NUM),
+        VMSTATE_STRUCT_ARRAY(slots, DUSBCmd, DUSB_CMD_MAX_DEPTH, 1, vmstate_dusb_cmd_slot, DUSBCmdSlot),
+        VMSTATE_UINT32(count, DUSBCmd),
+        VMSTATE_UINT32(pos, DUSBCmd),
+        VMSTATE_VALIDATE("command queue", dusb_cmd_state_valid),
+        VMSTATE_INT64_ARRAY(worker_free_ns, DUSBCmd, DUSB_CMD_MAX_WORKERS),
+        VMSTATE_UINT64(commands, DUSBCmd),
+        VMSTATE_UINT64(responses, DUSBCmd),
+        VMSTATE_UINT64(rejected, DUSBCmd),
+        VMSTATE_UINT64(malformed, DUSBCmd),
+        VMSTATE_UINT64(full, DUSBCmd),
+        VMSTATE_UINT32(max_outstanding, DUSBCmd),
+        VMSTATE_STRUCT(rtt, DUSBCmd, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_STRUCT(queue, DUSBCmd, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_UINT64(offloaded, DUSBCmd),
+        VMSTATE_UINT64(offload_bytes, DUSBCmd),
+        VMSTATE_UINT64(offload_failed, DUSBCmd),
+        VMSTATE_UINT64(late, DUSBCmd),
+        VMSTATE_STRUCT(host, DUSBCmd, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_dusb_cmd_head,
+        NULL
+    }
+};
+
+static bool dusb_cmd_needed(void *opaque) {
+    DUSBState *s = opaque;
+    return s->cmd.enabled;
+}
+
+static const VMStateDescription vmstate_dusb_cmd = {
+    .name = "usb-dusb/cmd",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = dusb_cmd_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_STRUCT(cmd, DUSBState, 1, vmstate_dusb_cmd_state, DUSBCmd),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_func_suspend_state = {
+    .name = "usb-dusb/func-suspend-state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(suspended, DUSBFuncSuspend),
+        VMSTATE_BOOL(remote_wake, DUSBFuncSuspend),
+        VMSTATE_INT64(suspend_ns, DUSBFuncSuspend),
+        VMSTATE_INT64(wake_ns, DUSBFuncSuspend),
+        VMSTATE_UINT64(suspends, DUSBFuncSuspend),
+        VMSTATE_UINT64(wakes, DUSBFuncSuspend),
+        VMSTATE_STRUCT(active, DUSBFuncSuspend, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_STRUCT(wake, DUSBFuncSuspend, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool dusb_func_suspend_needed(void *opaque) {
+    DUSBState *s = opaque;
+
+    for (int f = 0; f < DUSB_MAX_FUNCS; f++) {
+        if (s->fsusp[f].suspends || s->fsusp[f].remote_wake) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static const VMStateDescription vmstate_dusb_func_suspend = {
+    .name = "usb-dusb/func-suspend",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = dusb_func_suspend_needed,
+    .fields = (const VMStateField[]) {
+        VMSTATE_STRUCT_ARRAY(fsusp, DUSBState, DUSB_MAX_FUNCS, 1, vmstate_dusb_func_suspend_state, DUSBFuncSuspend),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_sweep_point = {
+    .name = "usb-dusb/sweep-point",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT8(addr, DUSBSweepPoint),
+        VMSTATE_UINT32(size, DUSBSweepPoint),
+        VMSTATE_UINT32(interval_us, DUSBSweepPoint),
+        VMSTATE_INT64(elapsed_ns, DUSBSweepPoint),
+        VMSTATE_STRUCT(stats, DUSBSweepPoint, 1, vmstate_dusb_ep_stats, DUSBEpStats),
+        VMSTATE_STRUCT(lat, DUSBSweepPoint, 1, vmstate_dusb_hist, DUSBHist),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_dusb_sweep_saved = {
+    .name = "usb-dusb/sweep-saved",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT32(interval_us, DUSBSweepSaved),
+        VMSTATE_UINT32(size, DUSBSweepSaved),
+        VMSTATE_BOOL(running, DUSBSweepSaved),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* A running sweep owns the endpoint settings, so it moves with them */
+static bool dusb_sweep_needed(void *opaque) {
+    DUSBState *s = opaque;
+    return s->sweep.active;
+}
+
+static int dusb_sweep_pre_load(void *opaque) {
+    DUSBState *s = opaque;
+
+    g_free(s->sweep.points);
+    s->sweep.points = NULL;
+    return 0;
+}
+
+static int dusb_sweep_post_load(void *opaque, int version_id) {
+    DUSBState *s = opaque;
+
+    if (s->sweep.npoints < 1 || s->sweep.npoints > DUSB_SWEEP_MAX_POINTS ||
+        s->sweep.cur < 0 || s->sweep.cur >= s->sweep.npoints) {
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_dusb_sweep = {
+    .name = "usb-dusb/sweep",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = dusb_sweep_needed,
+    .pre_load = dusb_sweep_pre_load,
+    .post_load = dusb_sweep_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_BOOL(sweep.active, DUSBState),
+        VMSTATE_UINT32(sweep.dwell_ms, DUSBState),
+        VMSTATE_INT32(sweep.npoints, DUSBState),
+        VMSTATE_INT32(sweep.cur, DUSBState),
+        VMSTATE_INT64(sweep.point_ns, DUSBState),
+        VMSTATE_STRUCT(sweep.base, DUSBState, 1, vmstate_dusb_ep_stats, DUSBEpStats),
+        VMSTATE_STRUCT_2DARRAY(sweep.saved, DUSBState, 2, DUSB_MAX_EPS, 1, vmstate_dusb_sweep_saved,
+                               DUSBSweepSaved),
+        VMSTATE_STRUCT_VARRAY_ALLOC(sweep.points, DUSBState, sweep.npoints, 1, vmstate_dusb_sweep_point,
+                                    DUSBSweepPoint),
+        VMSTATE_INT64(sweep.timer.expire_ns, DUSBState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static int dusb_pre_save(void *opaque) {
+    DUSBState *s = opaque;
+
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            DUSBEp *e = &s->eps[d][i];
+            e->mig_halted = dusb_usb_ep(s, e)->halted;
+            e->mig_async = e->async_pkt != NULL;
+        }
+    }
+    s->ctrl_async.mig_pending = s->ctrl_async.packet != NULL;
+    /* Borrowed for the save only; dusb_pre_load drops the alias */
+    s->cmd.head_data = s->cmd.count && s->cmd.pos ? s->cmd.slots[0].data : NULL;
+    s->cmd.head_len = s->cmd.head_data ? s->cmd.slots[0].len : 0;
+    return 0;
+}
+
+/* Unlink the timers before their deadlines are overwritten by the incoming state */
+static int dusb_pre_load(void *opaque) {
+    DUSBState *s = opaque;
+
+    dusb_timer_del(&s->wakeup_timer);
+    dusb_timer_del(&s->in_timer);
+    dusb_timer_del(&s->ctrl_timer);
+    dusb_timer_del(&s->sweep.timer);
+    dusb_timer_del(&s->agg.timer);
+    dusb_timer_del(&s->video.timer);
+    dusb_cmd_reset(&s->cmd);
+    s->cmd.head_data = NULL;
+    s->cmd.head_len = 0;
+    return 0;
+}
+
+static int dusb_post_load(void *opaque, int version_id) {
+    DUSBState *s = opaque;
+
+    for (int f = 0; f < DUSB_MAX_FUNCS; f++) {
+        if (s->alt[f] > (f == 0 && s->cmd.enabled ? DUSB_ALT_CMD : 1)) {
+            return -EINVAL;
+        }
+    }
+    for (int i = 0; i < DUSB_NUM_EPS; i++) {
+        if (s->in_data_len[i] < 0 || s->in_data_len[i] > sizeof(s->in_data[i])) {
+            return -EINVAL;
+        }
+    }
+    for (int d = 0; d < 2; d++) {
+        for (int i = 0; i < dusb_num_eps(s); i++) {
+            DUSBEp *e = &s->eps[d][i];
+            if (!dusb_ep_config_valid(e, e->pattern, e->size) || e->fault.kind >= DUSB_FAULT_NUM) {
+                return -EINVAL;
+            }
+            dusb_usb_ep(s, e)->halted = e->mig_halted;
+            /* The controller resubmits the delayed transfer here; dusb_process_data picks it up */
+            e->replay = e->mig_async;
+            e->mig_async = false;
+            e->async_pkt = NULL;
+        }
+    }
+    s->ctrl_async.replay = s->ctrl_async.mig_pending;
+    s->ctrl_async.mig_pending = false;
+    s->ctrl_async.packet = NULL;
+    dusb_cmd_post_load(s);
+    dusb_setup_pipeline(s);
+    dusb_timer_restore(&s->wakeup_timer);
+    dusb_timer_restore(&s->sweep.timer);
+    dusb_timer_restore(&s->agg.timer);
+    dusb_timer_restore(&s->video.timer);
+    dusb_in_timer_rearm(s);
+    return 0;
+}
+
+static const VMStateDescription vmstate_dusb = {
+    .name = "usb-dusb",
+    .version_id = 2,
+    .minimum_version_id = 2,
+    .pre_save = dusb_pre_save,
+    .pre_load = dusb_pre_load,
+    .post_load = dusb_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_USB_DEVICE(dev, DUSBState),
+        VMSTATE_UINT8_ARRAY(alt, DUSBState, DUSB_MAX_FUNCS),
+        VMSTATE_INT64(wakeup_timer.expire_ns, DUSBState),
+        VMSTATE_UINT8_2DARRAY(in_data, DUSBState, 3, DUSB_LEGACY_MAX_PAYLOAD),
+        VMSTATE_INT32_ARRAY(in_data_len, DUSBState, 3),
+        VMSTATE_STRUCT_2DARRAY(eps, DUSBState, 2, DUSB_MAX_EPS, 1, vmstate_dusb_ep, DUSBEp),
+        VMSTATE_INT64(stats_epoch_ns, DUSBState),
+        VMSTATE_UINT32(digest, DUSBState),
+        VMSTATE_STRUCT(ctrl, DUSBState, 1, vmstate_dusb_ctrl_bench, DUSBCtrlBench),
+        VMSTATE_STRUCT(ctrl_async, DUSBState, 1, vmstate_dusb_ctrl_async, DUSBCtrlAsync),
+        VMSTATE_UINT32(ctrl_delay_us, DUSBState),
+        VMSTATE_UINT32(ctrl_delay_mask, DUSBState),
+        VMSTATE_END_OF_LIST()
+    },
+    .subsections = (const VMStateDescription * const []) {
+        &vmstate_dusb_agg,
+        &vmstate_dusb_video,
+        &vmstate_dusb_sweep,
+        &vmstate_dusb_func_suspend,
+        &vmstate_dusb_cmd,
+        NULL
+    }
+};
+
 /* Device properties for configuration */
 static Property dusb_properties[] = {
     DEFINE_PROP_UINT32("wakeup_interval", DUSBState, wakeup_interval, 10),
     DEFINE_PROP_UINT32("in_interval", DUSBState, in_interval, 25),
+    DEFINE_PROP_UINT32("seed", DUSBState, seed, 1),
+    DEFINE_PROP_UINT8("functions", DUSBState, functions, 1),
+    DEFINE_PROP_BOOL("bulk_pipeline", DUSBState, bulk_pipeline, true),
+    DEFINE_PROP_STRING("speed", DUSBState, speed),
+    DEFINE_PROP_CHR("metrics-chardev", DUSBState, metrics.chr),
+    DEFINE_PROP_BOOL("ep3_framing", DUSBState, agg.enabled, false),
+    DEFINE_PROP_UINT32("agg_max_size", DUSBState, agg.max_size, 16384),
+    DEFINE_PROP_UINT32("agg_max_datagrams", DUSBState, agg.max_datagrams, 32),
+    DEFINE_PROP_UINT32("agg_timeout_us", DUSBState, agg.timeout_us, 1000),
+    DEFINE_PROP_UINT32("agg_dgram_min", DUSBState, agg.dgram_min, 64),
+    DEFINE_PROP_UINT32("agg_dgram_max", DUSBState, agg.dgram_max, 1514),
+    DEFINE_PROP_UINT32("agg_dgram_interval_us", DUSBState, agg.dgram_interval_us, 0),
+    DEFINE_PROP_UINT8("video_ep", DUSBState, video.ep, 0),
+    DEFINE_PROP_UINT32("video_frame_size", DUSBState, video.frame_size, 614400),
+    DEFINE_PROP_UINT32("video_fps", DUSBState, video.fps, 30),
+    DEFINE_PROP_BOOL("cmd_engine", DUSBState, cmd.enabled, false),
+    DEFINE_PROP_UINT32("cmd_depth", DUSBState, cmd.depth, 32),
+    DEFINE_PROP_UINT32("cmd_workers", DUSBState, cmd.workers, 1),
 };
 
 /* Initializing USB device class */
@@ -573,11 +5461,17 @@ static void dusb_class_init(ObjectClass *klass, void *data) {
     uc->usb_desc = &desc;
     uc->handle_control = dusb_handle_control;
     uc->handle_data = dusb_handle_data;
+    uc->cancel_packet = dusb_cancel_packet;
+    uc->flush_ep_queue = dusb_flush_ep_queue;
     uc->realize = dusb_realize;
+    uc->unrealize = dusb_unrealize;
     uc->handle_attach = usb_desc_attach;
     uc->handle_reset = dusb_handle_reset;
+    uc->set_interface = dusb_set_interface;
 
+    dc->vmsd = &vmstate_dusb;
     device_class_set_props(dc, dusb_properties);
+    dusb_class_init_runtime(klass);
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
 }
 
@@ -586,6 +5480,7 @@ static const TypeInfo dusb_info = {
     .name = TYPE_USB_DUSB,
     .parent = TYPE_USB_DEVICE,
     .instance_size = sizeof(DUSBState),
+    .instance_init = dusb_instance_init,
     .class_init = dusb_class_init,
 };
 
@@ -0,0 +1,783 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * DUSB guest driver
+ *
+ * Binds to the DUSB custom QEMU device (VID 0x0069, PID 0x0420) and exposes
+ * each data endpoint as /dev/dusb<N>-ep<addr>. Data moves through an mmap'd
+ * ring of slots with a queue of pre-submitted URBs, so benchmarks see the
+ * device and host controller limits rather than per-transfer syscalls and
+ * copies. See dusb_uapi.h for the ring protocol.
+ *
+ * A composite DUSB (functions=N) exposes N copies of the endpoint set, one
+ * per interface. Each interface binds as its own device index with its own
+ * alt setting, so /dev/dusb1-ep04 is EP4 OUT of the second function when a
+ * single composite device is attached.
+ *
+ * Bulk slots are handed to the controller as scatter-gather lists over the
+ * mapped pages (zero copy) when the host controller supports SG. Interrupt
+ * and isochronous slots go through a per-slot bounce buffer.
+ */
+
+#include <linux/cdev.h>
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/kernel.h>
+#include <linux/kref.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/scatterlist.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/uaccess.h>
+#include <linux/usb.h>
+#include <linux/version.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+
+#include "dusb_uapi.h"
+
+#define DUSB_NUM_EPS     3
+#define DUSB_CHANS       (2 * DUSB_NUM_EPS)  /* Interrupt, isoc, bulk OUT, then IN */
+#define DUSB_MAX_DEVICES 32
+#define DUSB_ALT_OUT     0                   /* Alt setting with the OUT endpoints */
+#define DUSB_ALT_IN      1                   /* Alt setting with the IN endpoints */
+
+/* class_create() lost its owner argument in 6.4 */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6, 4, 0)
+#define dusb_class_create(name) class_create(THIS_MODULE, name)
+#else
+#define dusb_class_create(name) class_create(name)
+#endif
+
+struct dusb_dev;
+struct dusb_chan;
+
+/* URB context: which slot of which channel */
+struct dusb_xfer {
+	struct dusb_chan *chan;
+	u32 idx;
+};
+
+/* One endpoint character device and its ring */
+struct dusb_chan {
+	struct dusb_dev *dev;
+	u8 addr;
+	bool in;
+	bool open;
+	struct mutex lock;            /* Serialises ioctl, mmap and release */
+	spinlock_t slock;             /* Ring indices and slot state */
+	wait_queue_head_t wait;
+	struct usb_host_endpoint *hep;
+
+	/* Ring, valid after DUSB_IOC_SETUP */
+	void *ring;                   /* vmalloc_user area mapped by user space */
+	size_t ring_size;
+	struct dusb_ring_hdr *hdr;
+	u8 *data;
+	u32 nslots, slot_size, depth;
+	u32 head;                     /* Slots completed */
+	u32 tail;                     /* IN: slots released, OUT: slots queued */
+	u32 submitted;                /* Slots handed to URBs */
+	bool running;
+	bool zero_copy;
+	unsigned int streams;
+	unsigned int iso_psize;       /* Bytes per isochronous service interval */
+	unsigned int iso_packets;     /* Isochronous packets per slot */
+	u8 *done;                     /* Completed but not yet folded into head */
+	struct dusb_xfer *xfers;
+	struct urb **urbs;
+	struct sg_table *sgt;
+	void **bounce;
+	struct usb_anchor anchor;
+};
+
+struct dusb_dev {
+	struct kref kref;
+	struct usb_device *udev;
+	struct usb_interface *intf;
+	struct mutex lock;            /* Alt setting, open counts and disconnect */
+	int index;
+	u8 ifnum;                     /* Function of a composite device */
+	int open_dir[2];              /* Open channels per direction */
+	bool gone;
+	struct dusb_chan chans[DUSB_CHANS];
+};
+
+static const struct usb_device_id dusb_ids[] = {
+	{ USB_DEVICE(DUSB_VENDOR_ID, DUSB_PRODUCT_ID) },
+	{ }
+};
+MODULE_DEVICE_TABLE(usb, dusb_ids);
+
+static dev_t dusb_devt;
+static struct cdev dusb_cdev;
+static struct class *dusb_class;
+static struct dusb_dev *dusb_table[DUSB_MAX_DEVICES];
+static DEFINE_MUTEX(dusb_table_lock);
+
+static void dusb_dev_free(struct kref *kref)
+{
+	struct dusb_dev *dev = container_of(kref, struct dusb_dev, kref);
+
+	usb_put_dev(dev->udev);
+	kfree(dev);
+}
+
+static u8 *dusb_slot_data(struct dusb_chan *c, u32 idx)
+{
+	return c->data + (size_t)idx * c->slot_size;
+}
+
+/* Fold completed slots into head, in ring order */
+static void dusb_advance_head(struct dusb_chan *c)
+{
+	while (c->head != c->submitted && c->done[c->head % c->nslots]) {
+		c->done[c->head % c->nslots] = 0;
+		c->head++;
+	}
+	smp_store_release(&c->hdr->head, c->head);
+}
+
+static void dusb_complete(struct urb *urb);
+
+/* Prepare and submit the URB of one slot; called with slock held */
+static int dusb_submit_slot(struct dusb_chan *c, u32 idx, u32 len)
+{
+	struct usb_device *udev = c->dev->udev;
+	struct usb_endpoint_descriptor *desc = &c->hep->desc;
+	struct urb *urb = c->urbs[idx];
+	void *buf = c->zero_copy ? NULL : c->bounce[idx];
+	unsigned int pipe;
+	int ret;
+
+	if (!c->in && !c->zero_copy)
+		memcpy(buf, dusb_slot_data(c, idx), len);
+
+	switch (usb_endpoint_type(desc)) {
+	case USB_ENDPOINT_XFER_BULK:
+		pipe = c->in ? usb_rcvbulkpipe(udev, c->addr) : usb_sndbulkpipe(udev, c->addr);
+		usb_fill_bulk_urb(urb, udev, pipe, buf, len, dusb_complete, &c->xfers[idx]);
+		if (c->streams)
+			urb->stream_id = 1 + idx % c->streams;
+		break;
+	case USB_ENDPOINT_XFER_INT:
+		pipe = c->in ? usb_rcvintpipe(udev, c->addr) : usb_sndintpipe(udev, c->addr);
+		usb_fill_int_urb(urb, udev, pipe, buf, len, dusb_complete, &c->xfers[idx], desc->bInterval);
+		break;
+	default: {
+		unsigned int n = min(DIV_ROUND_UP(len, c->iso_psize), c->iso_packets);
+		unsigned int i;
+
+		urb->dev = udev;
+		urb->pipe = c->in ? usb_rcvisocpipe(udev, c->addr) : usb_sndisocpipe(udev, c->addr);
+		urb->transfer_flags = URB_ISO_ASAP;
+		urb->transfer_buffer = buf;
+		urb->transfer_buffer_length = min(len, n * c->iso_psize);
+		urb->number_of_packets = n;
+		urb->interval = udev->speed >= USB_SPEED_HIGH ? 1 << (desc->bInterval - 1) : desc->bInterval;
+		urb->complete = dusb_complete;
+		urb->context = &c->xfers[idx];
+		for (i = 0; i < n; i++) {
+			urb->iso_frame_desc[i].offset = i * c->iso_psize;
+			urb->iso_frame_desc[i].length = min(c->iso_psize, len - i * c->iso_psize);
+		}
+		break;
+	}
+	}
+	if (c->zero_copy) {
+		urb->sg = c->sgt[idx].sgl;
+		urb->num_sgs = c->sgt[idx].orig_nents;
+	}
+
+	usb_anchor_urb(urb, &c->anchor);
+	ret = usb_submit_urb(urb, GFP_ATOMIC);
+	if (ret)
+		usb_unanchor_urb(urb);
+	return ret;
+}
+
+/* Record a slot that could not be submitted as completed with an error */
+static void dusb_fail_slot(struct dusb_chan *c, u32 idx, int err)
+{
+	c->hdr->slots[idx].len = 0;
+	c->hdr->slots[idx].status = err;
+	c->hdr->slots[idx].time_ns = ktime_get_ns();
+	c->done[idx] = 1;
+}
+
+/* Keep up to depth IN URBs in flight on slots not held by user space */
+static void dusb_in_refill(struct dusb_chan *c)
+{
+	while (c->running && c->submitted - c->head < c->depth && c->submitted - c->tail < c->nslots) {
+		u32 idx = c->submitted % c->nslots;
+		int ret;
+
+		c->submitted++;
+		ret = dusb_submit_slot(c, idx, c->slot_size);
+		if (ret) {
+			dev_warn(&c->dev->intf->dev, "ep 0x%02x: submit failed: %d\n", c->addr, ret);
+			dusb_fail_slot(c, idx, ret);
+			c->running = false;
+		}
+	}
+	dusb_advance_head(c);
+}
+
+static void dusb_complete(struct urb *urb)
+{
+	struct dusb_xfer *x = urb->context;
+	struct dusb_chan *c = x->chan;
+	struct dusb_slot *slot = &c->hdr->slots[x->idx];
+	int status = urb->status;
+	u32 len = urb->actual_length;
+	unsigned long flags;
+
+	if (usb_pipeisoc(urb->pipe)) {
+		u8 *dst = dusb_slot_data(c, x->idx);
+		int i;
+
+		/* Packets land at fixed offsets; pack them back to back in the slot */
+		len = 0;
+		for (i = 0; i < urb->number_of_packets; i++) {
+			struct usb_iso_packet_descriptor *fd = &urb->iso_frame_desc[i];
+
+			if (!status && fd->status)
+				status = fd->status;
+			if (c->in)
+				memcpy(dst + len, (u8 *)urb->transfer_buffer + fd->offset, fd->actual_length);
+			len += fd->actual_length;
+		}
+	} else if (c->in && !c->zero_copy) {
+		memcpy(dusb_slot_data(c, x->idx), urb->transfer_buffer, len);
+	}
+
+	slot->len = len;
+	slot->status = status;
+	slot->time_ns = ktime_get_ns();
+
+	spin_lock_irqsave(&c->slock, flags);
+	c->done[x->idx] = 1;
+	if (status == -ENOENT || status == -ECONNRESET || status == -ESHUTDOWN)
+		c->running = false;
+	if (c->in)
+		dusb_in_refill(c);
+	else
+		dusb_advance_head(c);
+	spin_unlock_irqrestore(&c->slock, flags);
+	wake_up_interruptible(&c->wait);
+}
+
+static void dusb_stop(struct dusb_chan *c)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&c->slock, flags);
+	c->running = false;
+	spin_unlock_irqrestore(&c->slock, flags);
+	usb_kill_anchored_urbs(&c->anchor);
+}
+
+static void dusb_ring_free(struct dusb_chan *c)
+{
+	u32 i;
+
+	if (!c->ring)
+		return;
+	dusb_stop(c);
+	if (c->streams && !c->dev->gone)
+		usb_free_streams(c->dev->intf, &c->hep, 1, GFP_KERNEL);
+	for (i = 0; i < c->nslots; i++) {
+		if (c->urbs)
+			usb_free_urb(c->urbs[i]);
+		if (c->sgt)
+			sg_free_table(&c->sgt[i]);
+		if (c->bounce)
+			kfree(c->bounce[i]);
+	}
+	kfree(c->urbs);
+	kfree(c->sgt);
+	kfree(c->bounce);
+	kfree(c->xfers);
+	kfree(c->done);
+	vfree(c->ring);
+	c->urbs = NULL;
+	c->sgt = NULL;
+	c->bounce = NULL;
+	c->xfers = NULL;
+	c->done = NULL;
+	c->ring = NULL;
+	c->hdr = NULL;
+	c->streams = 0;
+}
+
+/* Build the scatter-gather list describing one slot's pages */
+static int dusb_slot_sg(struct dusb_chan *c, u32 idx)
+{
+	unsigned int npages = c->slot_size >> PAGE_SHIFT;
+	struct page **pages;
+	unsigned int i;
+	int ret;
+
+	pages = kmalloc_array(npages, sizeof(*pages), GFP_KERNEL);
+	if (!pages)
+		return -ENOMEM;
+	for (i = 0; i < npages; i++)
+		pages[i] = vmalloc_to_page(dusb_slot_data(c, idx) + i * PAGE_SIZE);
+	ret = sg_alloc_table_from_pages(&c->sgt[idx], pages, npages, 0, c->slot_size, GFP_KERNEL);
+	kfree(pages);
+	return ret;
+}
+
+static int dusb_ring_setup(struct dusb_chan *c, struct dusb_ring_setup *rs)
+{
+	struct usb_device *udev = c->dev->udev;
+	struct usb_endpoint_descriptor *desc = &c->hep->desc;
+	int type = usb_endpoint_type(desc);
+	size_t hdr_size;
+	u32 i;
+	int ret = -ENOMEM;
+
+	if (c->ring)
+		return -EBUSY;
+	if (!rs->nslots || rs->nslots > DUSB_RING_MAX_SLOTS || !rs->slot_size || rs->slot_size > SZ_16M)
+		return -EINVAL;
+
+	c->nslots = rs->nslots;
+	c->slot_size = PAGE_ALIGN(rs->slot_size);
+	c->depth = clamp(rs->queue_depth, 1U, c->nslots);
+	c->head = c->tail = c->submitted = 0;
+	c->zero_copy = type == USB_ENDPOINT_XFER_BULK && udev->bus->sg_tablesize > 0;
+
+	hdr_size = PAGE_ALIGN(struct_size(c->hdr, slots, c->nslots));
+	c->ring_size = hdr_size + (size_t)c->nslots * c->slot_size;
+	c->ring = vmalloc_user(c->ring_size);
+	if (!c->ring)
+		return -ENOMEM;
+	c->hdr = c->ring;
+	c->data = (u8 *)c->ring + hdr_size;
+	c->hdr->version = DUSB_RING_VERSION;
+	c->hdr->nslots = c->nslots;
+	c->hdr->slot_size = c->slot_size;
+	c->hdr->data_offset = hdr_size;
+
+	if (type == USB_ENDPOINT_XFER_ISOC) {
+		c->iso_psize = usb_endpoint_maxp(desc) * usb_endpoint_maxp_mult(desc);
+		if (udev->speed >= USB_SPEED_SUPER && c->hep->ss_ep_comp.wBytesPerInterval)
+			c->iso_psize = le16_to_cpu(c->hep->ss_ep_comp.wBytesPerInterval);
+		c->iso_packets = DIV_ROUND_UP(c->slot_size, c->iso_psize);
+	}
+
+	c->urbs = kcalloc(c->nslots, sizeof(*c->urbs), GFP_KERNEL);
+	c->xfers = kcalloc(c->nslots, sizeof(*c->xfers), GFP_KERNEL);
+	c->done = kcalloc(c->nslots, 1, GFP_KERNEL);
+	if (c->zero_copy)
+		c->sgt = kcalloc(c->nslots, sizeof(*c->sgt), GFP_KERNEL);
+	else
+		c->bounce = kcalloc(c->nslots, sizeof(*c->bounce), GFP_KERNEL);
+	if (!c->urbs || !c->xfers || !c->done || (!c->sgt && !c->bounce))
+		goto fail;
+
+	for (i = 0; i < c->nslots; i++) {
+		c->xfers[i].chan = c;
+		c->xfers[i].idx = i;
+		c->urbs[i] = usb_alloc_urb(type == USB_ENDPOINT_XFER_ISOC ? c->iso_packets : 0, GFP_KERNEL);
+		if (!c->urbs[i])
+			goto fail;
+		if (c->zero_copy) {
+			ret = dusb_slot_sg(c, i);
+			if (ret)
+				goto fail;
+		} else {
+			c->bounce[i] = kmalloc(c->slot_size, GFP_KERNEL);
+			if (!c->bounce[i])
+				goto fail;
+		}
+	}
+
+	if (rs->streams && type == USB_ENDPOINT_XFER_BULK && udev->speed >= USB_SPEED_SUPER) {
+		ret = usb_alloc_streams(c->dev->intf, &c->hep, 1, rs->streams, GFP_KERNEL);
+		if (ret < 0)
+			dev_info(&c->dev->intf->dev, "ep 0x%02x: no bulk streams: %d\n", c->addr, ret);
+		c->streams = max(ret, 0);
+	}
+	c->hdr->streams = c->streams;
+	rs->streams = c->streams;
+	rs->map_size = c->ring_size;
+	return 0;
+
+fail:
+	dusb_ring_free(c);
+	return ret ? ret : -ENOMEM;
+}
+
+/* OUT: queue count filled slots starting at tail */
+static int dusb_out_submit(struct dusb_chan *c, u32 count)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&c->slock, flags);
+	if (c->tail + count - c->head > c->nslots) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	c->running = true;
+	while (count--) {
+		u32 idx = c->tail % c->nslots;
+		u32 len = min(READ_ONCE(c->hdr->slots[idx].len), c->slot_size);
+		int err;
+
+		c->tail++;
+		c->submitted = c->tail;
+		err = dusb_submit_slot(c, idx, len);
+		if (err) {
+			dusb_fail_slot(c, idx, err);
+			ret = err;
+		}
+	}
+	dusb_advance_head(c);
+out:
+	WRITE_ONCE(c->hdr->tail, c->tail);
+	spin_unlock_irqrestore(&c->slock, flags);
+	return ret;
+}
+
+/* IN: hand count consumed slots back for refilling */
+static int dusb_in_release(struct dusb_chan *c, u32 count)
+{
+	unsigned long flags;
+	int ret = 0;
+
+	spin_lock_irqsave(&c->slock, flags);
+	if (count > c->head - c->tail) {
+		ret = -EINVAL;
+	} else {
+		c->tail += count;
+		WRITE_ONCE(c->hdr->tail, c->tail);
+		dusb_in_refill(c);
+	}
+	spin_unlock_irqrestore(&c->slock, flags);
+	return ret;
+}
+
+static long dusb_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct dusb_chan *c = file->private_data;
+	void __user *uarg = (void __user *)arg;
+	struct dusb_ring_setup rs;
+	struct dusb_ep_info info;
+	unsigned long flags;
+	u32 count;
+	long ret = 0;
+
+	mutex_lock(&c->lock);
+	if (c->dev->gone) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (cmd != DUSB_IOC_INFO && cmd != DUSB_IOC_SETUP && !c->ring) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	switch (cmd) {
+	case DUSB_IOC_INFO:
+		memset(&info, 0, sizeof(info));
+		info.addr = c->addr;
+		info.type = usb_endpoint_type(&c->hep->desc);
+		info.maxp = le16_to_cpu(c->hep->desc.wMaxPacketSize);
+		info.speed = c->dev->udev->speed;
+		info.zero_copy = usb_endpoint_xfer_bulk(&c->hep->desc) && c->dev->udev->bus->sg_tablesize > 0;
+		if (copy_to_user(uarg, &info, sizeof(info)))
+			ret = -EFAULT;
+		break;
+	case DUSB_IOC_SETUP:
+		if (copy_from_user(&rs, uarg, sizeof(rs))) {
+			ret = -EFAULT;
+			break;
+		}
+		ret = dusb_ring_setup(c, &rs);
+		if (!ret && copy_to_user(uarg, &rs, sizeof(rs)))
+			ret = -EFAULT;
+		break;
+	case DUSB_IOC_START:
+		if (!c->in) {
+			ret = -EINVAL;
+			break;
+		}
+		spin_lock_irqsave(&c->slock, flags);
+		c->running = true;
+		dusb_in_refill(c);
+		spin_unlock_irqrestore(&c->slock, flags);
+		break;
+	case DUSB_IOC_STOP:
+		dusb_stop(c);
+		break;
+	case DUSB_IOC_RELEASE:
+	case DUSB_IOC_SUBMIT:
+		if (get_user(count, (u32 __user *)uarg)) {
+			ret = -EFAULT;
+			break;
+		}
+		if (c->in != (cmd == DUSB_IOC_RELEASE)) {
+			ret = -EINVAL;
+			break;
+		}
+		ret = c->in ? dusb_in_release(c, count) : dusb_out_submit(c, count);
+		break;
+	default:
+		ret = -ENOTTY;
+		break;
+	}
+out:
+	mutex_unlock(&c->lock);
+	return ret;
+}
+
+static int dusb_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct dusb_chan *c = file->private_data;
+	int ret;
+
+	mutex_lock(&c->lock);
+	if (!c->ring)
+		ret = -EINVAL;
+	else
+		ret = remap_vmalloc_range(vma, c->ring, vma->vm_pgoff);
+	mutex_unlock(&c->lock);
+	return ret;
+}
+
+static __poll_t dusb_poll(struct file *file, poll_table *wait)
+{
+	struct dusb_chan *c = file->private_data;
+	__poll_t mask = 0;
+	unsigned long flags;
+
+	poll_wait(file, &c->wait, wait);
+	if (c->dev->gone)
+		return EPOLLERR | EPOLLHUP;
+	spin_lock_irqsave(&c->slock, flags);
+	if (c->ring) {
+		if (c->in && c->head != c->tail)
+			mask |= EPOLLIN | EPOLLRDNORM;
+		if (!c->in && c->tail - c->head < c->nslots)
+			mask |= EPOLLOUT | EPOLLWRNORM;
+	}
+	spin_unlock_irqrestore(&c->slock, flags);
+	return mask;
+}
+
+/* Select the alternate setting carrying the endpoint and look it up */
+static int dusb_chan_claim(struct dusb_chan *c)
+{
+	struct dusb_dev *dev = c->dev;
+	struct usb_host_interface *alt;
+	int ret = 0;
+	int i;
+
+	mutex_lock(&dev->lock);
+	if (dev->gone) {
+		ret = -ENODEV;
+		goto out;
+	}
+	if (c->open || dev->open_dir[!c->in]) {
+		ret = -EBUSY;
+		goto out;
+	}
+	if (!dev->open_dir[c->in]) {
+		ret = usb_set_interface(dev->udev, dev->ifnum, c->in ? DUSB_ALT_IN : DUSB_ALT_OUT);
+		if (ret)
+			goto out;
+	}
+	alt = dev->intf->cur_altsetting;
+	c->hep = NULL;
+	for (i = 0; i < alt->desc.bNumEndpoints; i++) {
+		if (alt->endpoint[i].desc.bEndpointAddress == c->addr)
+			c->hep = &alt->endpoint[i];
+	}
+	if (!c->hep) {
+		ret = -ENODEV;
+		goto out;
+	}
+	c->open = true;
+	dev->open_dir[c->in]++;
+out:
+	mutex_unlock(&dev->lock);
+	return ret;
+}
+
+static int dusb_open(struct inode *inode, struct file *file)
+{
+	unsigned int minor = iminor(inode);
+	struct dusb_dev *dev;
+	struct dusb_chan *c;
+	int ret;
+
+	mutex_lock(&dusb_table_lock);
+	dev = dusb_table[minor / DUSB_CHANS];
+	if (dev)
+		kref_get(&dev->kref);
+	mutex_unlock(&dusb_table_lock);
+	if (!dev)
+		return -ENODEV;
+
+	c = &dev->chans[minor % DUSB_CHANS];
+	ret = dusb_chan_claim(c);
+	if (ret) {
+		kref_put(&dev->kref, dusb_dev_free);
+		return ret;
+	}
+	file->private_data = c;
+	return nonseekable_open(inode, file);
+}
+
+static int dusb_release(struct inode *inode, struct file *file)
+{
+	struct dusb_chan *c = file->private_data;
+	struct dusb_dev *dev = c->dev;
+
+	mutex_lock(&c->lock);
+	dusb_ring_free(c);
+	mutex_unlock(&c->lock);
+
+	mutex_lock(&dev->lock);
+	c->open = false;
+	dev->open_dir[c->in]--;
+	mutex_unlock(&dev->lock);
+	kref_put(&dev->kref, dusb_dev_free);
+	return 0;
+}
+
+static const struct file_operations dusb_fops = {
+	.owner = THIS_MODULE,
+	.open = dusb_open,
+	.release = dusb_release,
+	.unlocked_ioctl = dusb_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.mmap = dusb_mmap,
+	.poll = dusb_poll,
+};
+
+static int dusb_probe(struct usb_interface *intf, const struct usb_device_id *id)
+{
+	struct dusb_dev *dev;
+	int index, i;
+
+	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return -ENOMEM;
+	kref_init(&dev->kref);
+	mutex_init(&dev->lock);
+	dev->udev = usb_get_dev(interface_to_usbdev(intf));
+	dev->intf = intf;
+	dev->ifnum = intf->cur_altsetting->desc.bInterfaceNumber;
+
+	mutex_lock(&dusb_table_lock);
+	for (index = 0; index < DUSB_MAX_DEVICES && dusb_table[index]; index++)
+		;
+	if (index == DUSB_MAX_DEVICES) {
+		mutex_unlock(&dusb_table_lock);
+		kref_put(&dev->kref, dusb_dev_free);
+		return -ENOSPC;
+	}
+	dev->index = index;
+	dusb_table[index] = dev;
+	mutex_unlock(&dusb_table_lock);
+
+	for (i = 0; i < DUSB_CHANS; i++) {
+		struct dusb_chan *c = &dev->chans[i];
+
+		c->dev = dev;
+		c->in = i >= DUSB_NUM_EPS;
+		c->addr = (c->in ? USB_DIR_IN : USB_DIR_OUT) | (dev->ifnum * DUSB_NUM_EPS + i % DUSB_NUM_EPS + 1);
+		mutex_init(&c->lock);
+		spin_lock_init(&c->slock);
+		init_waitqueue_head(&c->wait);
+		init_usb_anchor(&c->anchor);
+		device_create(dusb_class, &intf->dev, MKDEV(MAJOR(dusb_devt), index * DUSB_CHANS + i), NULL,
+			      "dusb%d-ep%02x", index, c->addr);
+	}
+	usb_set_intfdata(intf, dev);
+	dev_info(&intf->dev, "DUSB device %d attached (interface %u)\n", index, dev->ifnum);
+	return 0;
+}
+
+static void dusb_disconnect(struct usb_interface *intf)
+{
+	struct dusb_dev *dev = usb_get_intfdata(intf);
+	int i;
+
+	mutex_lock(&dusb_table_lock);
+	dusb_table[dev->index] = NULL;
+	mutex_unlock(&dusb_table_lock);
+
+	mutex_lock(&dev->lock);
+	dev->gone = true;
+	mutex_unlock(&dev->lock);
+	for (i = 0; i < DUSB_CHANS; i++) {
+		struct dusb_chan *c = &dev->chans[i];
+
+		device_destroy(dusb_class, MKDEV(MAJOR(dusb_devt), dev->index * DUSB_CHANS + i));
+		mutex_lock(&c->lock);
+		dusb_stop(c);
+		mutex_unlock(&c->lock);
+		wake_up_interruptible(&c->wait);
+	}
+	usb_set_intfdata(intf, NULL);
+	kref_put(&dev->kref, dusb_dev_free);
+}
+
+static struct usb_driver dusb_driver = {
+	.name = "dusb",
+	.id_table = dusb_ids,
+	.probe = dusb_probe,
+	.disconnect = dusb_disconnect,
+};
+
+static int __init dusb_init(void)
+{
+	int ret;
+
+	ret = alloc_chrdev_region(&dusb_devt, 0, DUSB_MAX_DEVICES * DUSB_CHANS, "dusb");
+	if (ret)
+		return ret;
+	cdev_init(&dusb_cdev, &dusb_fops);
+	ret = cdev_add(&dusb_cdev, dusb_devt, DUSB_MAX_DEVICES * DUSB_CHANS);
+	if (ret)
+		goto unregister_region;
+	dusb_class = dusb_class_create("dusb");
+	if (IS_ERR(dusb_class)) {
+		ret = PTR_ERR(dusb_class);
+		goto del_cdev;
+	}
+	ret = usb_register(&dusb_driver);
+	if (ret)
+		goto destroy_class;
+	return 0;
+
+destroy_class:
+	class_destroy(dusb_class);
+del_cdev:
+	cdev_del(&dusb_cdev);
+unregister_region:
+	unregister_chrdev_region(dusb_devt, DUSB_MAX_DEVICES * DUSB_CHANS);
+	return ret;
+}
+
+static void __exit dusb_exit(void)
+{
+	usb_deregister(&dusb_driver);
+	class_destroy(dusb_class);
+	cdev_del(&dusb_cdev);
+	unregister_chrdev_region(dusb_devt, DUSB_MAX_DEVICES * DUSB_CHANS);
+}
+
+module_init(dusb_init);
+module_exit(dusb_exit);
+
+MODULE_DESCRIPTION("Driver for the DUSB custom QEMU USB device");
+MODULE_LICENSE("GPL");
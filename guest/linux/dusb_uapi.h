@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * DUSB guest driver - user space interface
+ *
+ * Every data endpoint of a DUSB device is a character device
+ * (/dev/dusb<N>-ep<addr>). A process configures a ring with
+ * DUSB_IOC_SETUP, maps it with mmap() and then moves data through the
+ * slots of the ring without read()/write() copies:
+ *
+ *  IN endpoints:  the driver keeps up to queue_depth URBs in flight on free
+ *                 slots. Completed slots are published by advancing head.
+ *                 The process consumes slots [tail, head) and hands them back
+ *                 with DUSB_IOC_RELEASE.
+ *  OUT endpoints: the process fills slots [tail, head + nslots), sets their
+ *                 len and queues them with DUSB_IOC_SUBMIT. head advances as
+ *                 the transfers complete.
+ *
+ * head and tail are free-running counters; slot i lives at
+ * data_offset + (i % nslots) * slot_size.
+ */
+
+#ifndef DUSB_UAPI_H
+#define DUSB_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define DUSB_VENDOR_ID      0x0069
+#define DUSB_PRODUCT_ID     0x0420
+
+#define DUSB_RING_VERSION   1
+#define DUSB_RING_MAX_SLOTS 1024
+
+/* Per-slot completion record, written by the driver */
+struct dusb_slot {
+    __u32 len;        /* OUT: bytes to send (set by user), IN/OUT: bytes transferred */
+    __s32 status;     /* 0 or a negative errno from the URB */
+    __u64 time_ns;    /* CLOCK_MONOTONIC completion time */
+};
+
+/* Start of the mapping, followed by the slot records and the data area */
+struct dusb_ring_hdr {
+    __u32 version;
+    __u32 nslots;
+    __u32 slot_size;
+    __u32 data_offset;
+    __u32 head;       /* Written by the driver */
+    __u32 tail;       /* Mirrors the count passed to RELEASE / SUBMIT */
+    __u32 streams;    /* Bulk streams in use, 0 if none */
+    __u32 reserved;
+    struct dusb_slot slots[];
+};
+
+struct dusb_ring_setup {
+    __u32 nslots;      /* Slots in the ring, up to DUSB_RING_MAX_SLOTS */
+    __u32 slot_size;   /* Bytes per slot, rounded up to a page */
+    __u32 queue_depth; /* IN: URBs kept in flight, at most nslots */
+    __u32 streams;     /* Bulk streams to allocate on SuperSpeed, 0 for none */
+    __u32 map_size;    /* Returned: length to pass to mmap() */
+    __u32 reserved;
+};
+
+struct dusb_ep_info {
+    __u8 addr;         /* Endpoint address */
+    __u8 type;         /* USB_ENDPOINT_XFER_* */
+    __u16 maxp;        /* wMaxPacketSize including the multiplier bits */
+    __u32 speed;       /* enum usb_device_speed of the device */
+    __u32 zero_copy;   /* Slots are handed to the controller without a bounce buffer */
+    __u32 reserved;
+};
+
+#define DUSB_IOC_MAGIC   'D'
+#define DUSB_IOC_INFO    _IOR(DUSB_IOC_MAGIC, 0, struct dusb_ep_info)
+#define DUSB_IOC_SETUP   _IOWR(DUSB_IOC_MAGIC, 1, struct dusb_ring_setup)
+#define DUSB_IOC_START   _IO(DUSB_IOC_MAGIC, 2)        /* IN: begin submitting URBs */
+#define DUSB_IOC_STOP    _IO(DUSB_IOC_MAGIC, 3)        /* Cancel everything in flight */
+#define DUSB_IOC_RELEASE _IOW(DUSB_IOC_MAGIC, 4, __u32) /* IN: slots handed back */
+#define DUSB_IOC_SUBMIT  _IOW(DUSB_IOC_MAGIC, 5, __u32) /* OUT: slots queued */
+
+#endif /* DUSB_UAPI_H */
@@ -0,0 +1,869 @@
+/*
+ * dusb_bench - guest-side traffic generator and checker for the DUSB device
+ *
+ * Keeps a configurable number of asynchronous libusb transfers in flight on
+ * the selected endpoints, verifies the DUSB payload header and pattern of
+ * every IN payload (or generates them for OUT), and reports throughput,
+ * per-transfer latency percentiles and loss next to the device's own
+ * counters read with DUSB_VREQ_GET_STATS. With -C it drives the device's
+ * command/response engine instead and measures command round trips.
+ *
+ * Build: make (needs libusb-1.0 and zlib development files)
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libusb.h>
+#include <zlib.h>
+
+#define DUSB_VID                0x0069
+#define DUSB_PID                0x0420
+#define DUSB_NUM_EPS            3
+#define DUSB_MAX_FUNCS          5
+
+/* Must match dusb.c */
+#define DUSB_PATTERN_LEGACY     0
+#define DUSB_PATTERN_ZERO       1
+#define DUSB_PATTERN_COUNT      2
+#define DUSB_PATTERN_PRBS       3
+#define DUSB_PATTERN_NUM        4
+#define DUSB_PATTERN_PERIOD     4096
+#define DUSB_MAX_PAYLOAD        (64 * 1024)
+#define DUSB_PAYLOAD_HDR_LEN    16
+
+#define DUSB_VREQ_SET_EP_CONFIG 0x01
+#define DUSB_VREQ_START         0x03
+#define DUSB_VREQ_STOP          0x04
+#define DUSB_VREQ_RESET_STATS   0x05
+#define DUSB_VREQ_GET_STATS     0x06
+
+#define DUSB_ALT_CMD            2
+#define DUSB_CMD_NOP            0
+#define DUSB_CMD_READ           1
+#define DUSB_CMD_WRITE          2
+#define DUSB_CMD_CRC32C         3
+#define DUSB_CMD_SHA256         4
+#define DUSB_CMD_COMPRESS       5
+#define DUSB_CMD_NUM            6
+#define DUSB_SHA256_LEN         32
+#define DUSB_CMD_HDR_LEN        16
+#define DUSB_CMD_RESP_LEN       32
+
+#define MAX_LAT_SAMPLES         (1u << 22)
+#define CTRL_TIMEOUT_MS         1000
+
+/* Per-endpoint run state */
+typedef struct EpRun {
+    uint8_t addr;
+    int type;                  /* LIBUSB_TRANSFER_TYPE_* */
+    int pkt_size;              /* Isochronous packet size */
+    int streams;               /* Bulk streams allocated, 0 if none */
+    struct libusb_transfer **xfers;
+    struct timespec *t_submit;
+    int inflight;
+    uint32_t seq;              /* OUT: next to send, IN: next expected */
+    bool seq_valid;
+    uint64_t transfers;
+    uint64_t bytes;
+    uint64_t lost;             /* IN sequence gaps */
+    uint64_t bad;              /* IN payloads failing verification */
+    uint64_t errors;           /* Transfers completing with an error status */
+    double *lat_us;            /* Submit-to-completion times */
+    size_t nlat;
+} EpRun;
+
+static struct {
+    libusb_context *ctx;
+    libusb_device_handle *h;
+    EpRun eps[DUSB_NUM_EPS];
+    int neps;
+    bool in;
+    int depth;
+    int size;
+    int pattern;
+    uint32_t interval_us;
+    int streams;
+    int iso_packets;
+    int iface;                 /* Function of a composite device */
+    int cmd;                   /* DUSB_CMD_* for command mode, -1 for streaming */
+    uint32_t *cmd_tag;         /* Tag of the command outstanding in each slot */
+    uint32_t *cmd_crc;         /* Expected CRC32C of each WRITE or CRC32C */
+    volatile sig_atomic_t stop;
+    uint8_t table[DUSB_PATTERN_PERIOD + DUSB_MAX_PAYLOAD];
+} g = {
+    .in = true,
+    .depth = 32,
+    .size = 1024,
+    .pattern = DUSB_PATTERN_COUNT,
+    .iso_packets = 8,
+    .cmd = -1,
+};
+
+static double ts_diff_us(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1e6 + (b->tv_nsec - a->tv_nsec) / 1e3;
+}
+
+/* Same pattern bodies as dusb_pattern_table() on the device */
+static void build_table(int pattern) {
+    uint32_t x = 0x2545F491;
+
+    for (size_t i = 0; i < sizeof(g.table); i++) {
+        switch (pattern) {
+            case DUSB_PATTERN_COUNT:
+                g.table[i] = i % 256;
+                break;
+            case DUSB_PATTERN_PRBS:
+                if (i < DUSB_PATTERN_PERIOD) {
+                    x ^= x << 13;
+                    x ^= x >> 17;
+                    x ^= x << 5;
+                    g.table[i] = x & 0xff;
+                } else {
+                    g.table[i] = g.table[i % DUSB_PATTERN_PERIOD];
+                }
+                break;
+            default:
+                g.table[i] = 0;
+                break;
+        }
+    }
+}
+
+static void put_le16(uint8_t *p, uint16_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v) {
+    put_le16(p, v);
+    put_le16(p + 2, v >> 16);
+}
+
+static uint32_t get_le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_le64(const uint8_t *p) {
+    return get_le32(p) | (uint64_t)get_le32(p + 4) << 32;
+}
+
+static void put_be32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t get_be32(const uint8_t *p) {
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Write an OUT payload: 16-byte DUSBPayloadHdr followed by the pattern body */
+static void fill_payload(EpRun *e, uint8_t *buf, int len) {
+    uint32_t seq = e->seq++;
+
+    if (g.pattern == DUSB_PATTERN_LEGACY || len < DUSB_PAYLOAD_HDR_LEN) {
+        memset(buf, 0, len);
+        return;
+    }
+    buf[0] = e->addr;
+    buf[1] = g.pattern;
+    put_le16(buf + 2, 0);
+    put_le32(buf + 4, seq);
+    memset(buf + 8, 0, 8);
+    memcpy(buf + DUSB_PAYLOAD_HDR_LEN, g.table + seq % DUSB_PATTERN_PERIOD, len - DUSB_PAYLOAD_HDR_LEN);
+}
+
+/* Check one IN payload against the header, sequence and pattern */
+static void verify_payload(EpRun *e, const uint8_t *buf, int len) {
+    uint32_t seq;
+
+    if (g.pattern == DUSB_PATTERN_LEGACY || len == 0) {
+        return;
+    }
+    if (len < DUSB_PAYLOAD_HDR_LEN || buf[0] != e->addr || buf[1] != g.pattern) {
+        e->bad++;
+        return;
+    }
+    seq = get_le32(buf + 4);
+    if (e->seq_valid && (int32_t)(seq - e->seq) > 0) {
+        e->lost += seq - e->seq;
+    }
+    e->seq = seq + 1;
+    e->seq_valid = true;
+    if (memcmp(buf + DUSB_PAYLOAD_HDR_LEN, g.table + seq % DUSB_PATTERN_PERIOD, len - DUSB_PAYLOAD_HDR_LEN)) {
+        e->bad++;
+    }
+}
+
+static int submit(EpRun *e, int i) {
+    struct libusb_transfer *t = e->xfers[i];
+    int ret;
+
+    if (!g.in) {
+        if (e->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+            for (int p = 0; p < t->num_iso_packets; p++) {
+                fill_payload(e, libusb_get_iso_packet_buffer_simple(t, p), e->pkt_size);
+            }
+        } else {
+            fill_payload(e, t->buffer, t->length);
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &e->t_submit[i]);
+    ret = libusb_submit_transfer(t);
+    if (ret == 0) {
+        e->inflight++;
+    }
+    return ret;
+}
+
+static void LIBUSB_CALL transfer_done(struct libusb_transfer *t) {
+    EpRun *e = t->user_data;
+    int i = 0;
+    struct timespec now;
+
+    while (e->xfers[i] != t) {
+        i++;
+    }
+    e->inflight--;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (t->status == LIBUSB_TRANSFER_CANCELLED) {
+        return;
+    }
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        e->errors++;
+    } else {
+        e->transfers++;
+        if (e->nlat < MAX_LAT_SAMPLES) {
+            e->lat_us[e->nlat++] = ts_diff_us(&e->t_submit[i], &now);
+        }
+        if (e->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+            for (int p = 0; p < t->num_iso_packets; p++) {
+                struct libusb_iso_packet_descriptor *d = &t->iso_packet_desc[p];
+                if (d->status == LIBUSB_TRANSFER_COMPLETED) {
+                    e->bytes += d->actual_length;
+                    if (g.in) {
+                        verify_payload(e, libusb_get_iso_packet_buffer_simple(t, p), d->actual_length);
+                    }
+                }
+            }
+        } else {
+            e->bytes += t->actual_length;
+            if (g.in) {
+                verify_payload(e, t->buffer, t->actual_length);
+            }
+        }
+    }
+    if (!g.stop && submit(e, i) != 0) {
+        e->errors++;
+    }
+}
+
+static int vendor_out(uint8_t req, uint16_t index, uint8_t *data, uint16_t len) {
+    return libusb_control_transfer(g.h, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                                   req, 0, index, data, len, CTRL_TIMEOUT_MS);
+}
+
+/* Program the device's traffic engine for one endpoint (DUSBVendorEpConfig) */
+static int configure_ep(EpRun *e, uint32_t size) {
+    uint8_t cfg[12];
+
+    put_le32(cfg, g.interval_us);
+    put_le32(cfg + 4, size);
+    cfg[8] = g.pattern;
+    cfg[9] = 1;
+    put_le16(cfg + 10, 0);
+    return vendor_out(DUSB_VREQ_SET_EP_CONFIG, e->addr, cfg, sizeof(cfg));
+}
+
+/* CRC32C as the device computes it: seed ~0, no final inversion */
+static uint32_t crc32c(uint32_t crc, const uint8_t *p, size_t len) {
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++) {
+            crc = crc >> 1 ^ (0x82F63B78 & -(crc & 1));
+        }
+    }
+    return crc;
+}
+
+#define ROR32(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+/* One SHA-256 (FIPS 180-4) compression round over a 64-byte block */
+static void sha256_block(uint32_t h[8], const uint8_t *b) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t w[64], v[8];
+
+    for (int j = 0; j < 16; j++) {
+        w[j] = get_be32(b + 4 * j);
+    }
+    for (int j = 16; j < 64; j++) {
+        w[j] = w[j - 16] + (ROR32(w[j - 15], 7) ^ ROR32(w[j - 15], 18) ^ w[j - 15] >> 3) + w[j - 7] +
+               (ROR32(w[j - 2], 17) ^ ROR32(w[j - 2], 19) ^ w[j - 2] >> 10);
+    }
+    memcpy(v, h, sizeof(v));
+    for (int j = 0; j < 64; j++) {
+        uint32_t t1 = v[7] + (ROR32(v[4], 6) ^ ROR32(v[4], 11) ^ ROR32(v[4], 25)) +
+                      ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[j] + w[j];
+        uint32_t t2 = (ROR32(v[0], 2) ^ ROR32(v[0], 13) ^ ROR32(v[0], 22)) +
+                      ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+
+        memmove(v + 1, v, 7 * sizeof(*v));
+        v[4] += t1;
+        v[0] = t1 + t2;
+    }
+    for (int j = 0; j < 8; j++) {
+        h[j] += v[j];
+    }
+}
+
+/* SHA-256 of a buffer, to check the digests the device returns */
+static void sha256(const uint8_t *p, size_t len, uint8_t md[DUSB_SHA256_LEN]) {
+    uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    uint8_t tail[128] = {0};
+    size_t rest = len % 64, n = rest < 56 ? 64 : 128;
+
+    for (size_t off = 0; off + 64 <= len; off += 64) {
+        sha256_block(h, p + off);
+    }
+    memcpy(tail, p + len - rest, rest);
+    tail[rest] = 0x80;
+    put_be32(tail + n - 8, (uint64_t)len >> 29);
+    put_be32(tail + n - 4, (uint32_t)len << 3);
+    for (size_t off = 0; off < n; off += 64) {
+        sha256_block(h, tail + off);
+    }
+    for (int j = 0; j < 8; j++) {
+        put_be32(md + 4 * j, h[j]);
+    }
+}
+
+/* Check a SHA256 or COMPRESS result against the data the command carried */
+static bool cmd_result_ok(const uint8_t *res, uint32_t len, uint32_t tag) {
+    const uint8_t *in = g.table + tag % DUSB_PATTERN_PERIOD;
+
+    if (g.cmd == DUSB_CMD_SHA256) {
+        uint8_t md[DUSB_SHA256_LEN];
+
+        sha256(in, g.size, md);
+        return len == DUSB_SHA256_LEN && !memcmp(res, md, sizeof(md));
+    } else {
+        static uint8_t buf[DUSB_MAX_PAYLOAD];
+        uLongf n = sizeof(buf);
+
+        return uncompress(buf, &n, res, len) == Z_OK && n == g.size && !memcmp(buf, in, n);
+    }
+}
+
+/* Send the command of slot i; its submit time starts the round trip */
+static int cmd_submit(int i) {
+    EpRun *e = &g.eps[0];
+    struct libusb_transfer *t = e->xfers[i];
+    uint32_t tag = g.cmd_tag[i];
+    uint32_t data = g.cmd >= DUSB_CMD_WRITE ? g.size : 0;
+    int ret;
+
+    memset(t->buffer, 0, DUSB_CMD_HDR_LEN);
+    t->buffer[0] = g.cmd;
+    put_le32(t->buffer + 4, tag);
+    put_le32(t->buffer + 8, g.cmd == DUSB_CMD_NOP ? 0 : g.size);
+    if (data) {
+        memcpy(t->buffer + DUSB_CMD_HDR_LEN, g.table + tag % DUSB_PATTERN_PERIOD, data);
+        g.cmd_crc[i] = crc32c(0xffffffff, t->buffer + DUSB_CMD_HDR_LEN, data);
+    }
+    t->length = DUSB_CMD_HDR_LEN + data;
+    clock_gettime(CLOCK_MONOTONIC, &e->t_submit[i]);
+    ret = libusb_submit_transfer(t);
+    if (ret == 0) {
+        e->inflight++;
+    }
+    return ret;
+}
+
+static void LIBUSB_CALL cmd_out_done(struct libusb_transfer *t) {
+    EpRun *e = t->user_data;
+
+    e->inflight--;
+    if (t->status == LIBUSB_TRANSFER_CANCELLED) {
+        return;
+    }
+    if (t->status != LIBUSB_TRANSFER_COMPLETED) {
+        e->errors++;
+    } else {
+        e->transfers++;
+        e->bytes += t->actual_length;
+    }
+}
+
+/* Match a response to its command by tag, check it and send the slot's next command */
+static void LIBUSB_CALL cmd_in_done(struct libusb_transfer *t) {
+    EpRun *e = t->user_data;
+    EpRun *out = &g.eps[0];
+    const uint8_t *r = t->buffer;
+    struct timespec now;
+    uint32_t tag, len;
+    int i;
+
+    e->inflight--;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (t->status == LIBUSB_TRANSFER_CANCELLED) {
+        return;
+    }
+    if (t->status != LIBUSB_TRANSFER_COMPLETED || t->actual_length < DUSB_CMD_RESP_LEN) {
+        e->errors++;
+        goto resubmit;
+    }
+    tag = get_le32(r + 4);
+    len = get_le32(r + 8);
+    i = tag % g.depth;
+    if (g.cmd_tag[i] != tag) {
+        e->lost++;
+        goto resubmit;
+    }
+    e->transfers++;
+    e->bytes += t->actual_length;
+    if (e->nlat < MAX_LAT_SAMPLES) {
+        e->lat_us[e->nlat++] = ts_diff_us(&out->t_submit[i], &now);
+    }
+    if (r[0] != g.cmd || r[1] != 0 || t->actual_length != DUSB_CMD_RESP_LEN + len ||
+        (g.cmd == DUSB_CMD_READ && memcmp(r + DUSB_CMD_RESP_LEN, g.table + tag % DUSB_PATTERN_PERIOD, len)) ||
+        ((g.cmd == DUSB_CMD_WRITE || g.cmd == DUSB_CMD_CRC32C) && get_le32(r + 12) != g.cmd_crc[i]) ||
+        (g.cmd == DUSB_CMD_COMPRESS && get_le32(r + 12) != g.size) ||
+        (g.cmd >= DUSB_CMD_SHA256 && !cmd_result_ok(r + DUSB_CMD_RESP_LEN, len, tag))) {
+        e->bad++;
+    }
+    g.cmd_tag[i] += g.depth;
+    if (!g.stop && cmd_submit(i) != 0) {
+        out->errors++;
+    }
+resubmit:
+    if (!g.stop) {
+        if (libusb_submit_transfer(t) == 0) {
+            e->inflight++;
+        } else {
+            e->errors++;
+        }
+    }
+}
+
+/* Command mode: EP3 OUT carries commands and EP3 IN their responses, depth of each in flight */
+static int cmd_setup(void) {
+    int lens[2] = {DUSB_CMD_HDR_LEN + (g.cmd >= DUSB_CMD_WRITE ? g.size : 0),
+                   DUSB_CMD_RESP_LEN + (g.cmd == DUSB_CMD_READ ? g.size : 0)};
+
+    if (g.cmd == DUSB_CMD_SHA256) {
+        lens[1] += DUSB_SHA256_LEN;
+    } else if (g.cmd == DUSB_CMD_COMPRESS) {
+        /* Incompressible data deflates to slightly more than it was */
+        lens[1] = DUSB_MAX_PAYLOAD;
+    }
+
+    g.cmd_tag = calloc(g.depth, sizeof(*g.cmd_tag));
+    g.cmd_crc = calloc(g.depth, sizeof(*g.cmd_crc));
+    if (!g.cmd_tag || !g.cmd_crc) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (int i = 0; i < g.depth; i++) {
+        g.cmd_tag[i] = i;
+    }
+    g.neps = 2;
+    for (int d = 0; d < 2; d++) {
+        EpRun *e = &g.eps[d];
+
+        e->addr = 3 | (d ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT);
+        e->type = LIBUSB_TRANSFER_TYPE_BULK;
+        if (configure_ep(e, g.size < DUSB_PAYLOAD_HDR_LEN ? DUSB_PAYLOAD_HDR_LEN : g.size) < 0) {
+            fprintf(stderr, "EP 0x%02x: SET_EP_CONFIG failed\n", e->addr);
+        }
+        e->xfers = calloc(g.depth, sizeof(*e->xfers));
+        e->t_submit = calloc(g.depth, sizeof(*e->t_submit));
+        e->lat_us = malloc(MAX_LAT_SAMPLES * sizeof(*e->lat_us));
+        if (!e->xfers || !e->t_submit || !e->lat_us) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        for (int i = 0; i < g.depth; i++) {
+            struct libusb_transfer *t = libusb_alloc_transfer(0);
+            uint8_t *buf = malloc(lens[d]);
+
+            if (!t || !buf) {
+                return LIBUSB_ERROR_NO_MEM;
+            }
+            libusb_fill_bulk_transfer(t, g.h, e->addr, buf, lens[d], d ? cmd_in_done : cmd_out_done, e, 0);
+            t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+            e->xfers[i] = t;
+        }
+    }
+    return 0;
+}
+
+static int setup_ep(EpRun *e) {
+    libusb_device *dev = libusb_get_device(g.h);
+    int maxp = libusb_get_max_packet_size(dev, e->addr);
+    uint32_t dev_size = g.size;
+    int len = g.size;
+    int npkts = 0;
+
+    switch (((e->addr & 0x0f) - 1) % DUSB_NUM_EPS) {
+        case 0:
+            e->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
+            len = dev_size = g.size < maxp ? g.size : maxp;
+            break;
+        case 1:
+            e->type = LIBUSB_TRANSFER_TYPE_ISOCHRONOUS;
+            e->pkt_size = libusb_get_max_iso_packet_size(dev, e->addr);
+            if (e->pkt_size <= 0) {
+                return e->pkt_size ? e->pkt_size : LIBUSB_ERROR_OTHER;
+            }
+            dev_size = g.size < e->pkt_size ? g.size : e->pkt_size;
+            npkts = g.iso_packets;
+            len = npkts * e->pkt_size;
+            break;
+        default:
+            e->type = LIBUSB_TRANSFER_TYPE_BULK;
+            break;
+    }
+    if (g.pattern != DUSB_PATTERN_LEGACY && dev_size < DUSB_PAYLOAD_HDR_LEN) {
+        fprintf(stderr, "EP 0x%02x: size %u is too small for the payload header\n", e->addr, dev_size);
+        return LIBUSB_ERROR_INVALID_PARAM;
+    }
+    if (configure_ep(e, dev_size) < 0) {
+        fprintf(stderr, "EP 0x%02x: SET_EP_CONFIG failed\n", e->addr);
+    }
+
+    if (e->type == LIBUSB_TRANSFER_TYPE_BULK && g.streams) {
+        int n = libusb_alloc_streams(g.h, g.streams, &e->addr, 1);
+        if (n < 0) {
+            fprintf(stderr, "EP 0x%02x: no bulk streams: %s\n", e->addr, libusb_error_name(n));
+        }
+        e->streams = n > 0 ? n : 0;
+    }
+
+    e->xfers = calloc(g.depth, sizeof(*e->xfers));
+    e->t_submit = calloc(g.depth, sizeof(*e->t_submit));
+    e->lat_us = malloc(MAX_LAT_SAMPLES * sizeof(*e->lat_us));
+    if (!e->xfers || !e->t_submit || !e->lat_us) {
+        return LIBUSB_ERROR_NO_MEM;
+    }
+    for (int i = 0; i < g.depth; i++) {
+        struct libusb_transfer *t = libusb_alloc_transfer(npkts);
+        uint8_t *buf = malloc(len);
+
+        if (!t || !buf) {
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        switch (e->type) {
+            case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+                libusb_fill_interrupt_transfer(t, g.h, e->addr, buf, len, transfer_done, e, 0);
+                break;
+            case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+                libusb_fill_iso_transfer(t, g.h, e->addr, buf, len, npkts, transfer_done, e, 0);
+                libusb_set_iso_packet_lengths(t, e->pkt_size);
+                break;
+            default:
+                if (e->streams) {
+                    libusb_fill_bulk_stream_transfer(t, g.h, e->addr, 1 + i % e->streams, buf, len,
+                                                     transfer_done, e, 0);
+                } else {
+                    libusb_fill_bulk_transfer(t, g.h, e->addr, buf, len, transfer_done, e, 0);
+                }
+                break;
+        }
+        t->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+        e->xfers[i] = t;
+    }
+    return 0;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile(const EpRun *e, double pct) {
+    size_t i;
+
+    if (!e->nlat) {
+        return 0;
+    }
+    i = (size_t)(pct / 100 * (e->nlat - 1) + 0.5);
+    return e->lat_us[i];
+}
+
+static void report(double secs) {
+    static const char *const speeds[] = {"unknown", "low", "full", "high", "super", "super+"};
+    int speed = libusb_get_device_speed(libusb_get_device(g.h));
+    uint8_t st[328];
+    int len;
+
+    /* Results differ per negotiated speed, so label every run with it */
+    printf("speed: %s, interface %d, %s\n\n", speed >= 0 && speed < 6 ? speeds[speed] : "unknown", g.iface,
+           g.cmd >= 0 ? "commands (EP3 IN latency is the command round trip)" : g.in ? "IN" : "OUT");
+    printf("%-6s %-5s %12s %12s %10s %10s %10s %10s %10s %8s %8s %8s\n", "ep", "type", "transfers", "MB/s",
+           "xfers/s", "p50 us", "p90 us", "p99 us", "max us", "lost", "bad", "errors");
+    for (int i = 0; i < g.neps; i++) {
+        EpRun *e = &g.eps[i];
+        static const char *const types[] = {"ctrl", "isoc", "bulk", "int"};
+
+        qsort(e->lat_us, e->nlat, sizeof(*e->lat_us), cmp_double);
+        printf("0x%02x   %-5s %12" PRIu64 " %12.2f %10.0f %10.1f %10.1f %10.1f %10.1f %8" PRIu64 " %8" PRIu64
+               " %8" PRIu64 "\n",
+               e->addr, types[e->type & 3], e->transfers, e->bytes / secs / 1e6, e->transfers / secs,
+               percentile(e, 50), percentile(e, 90), percentile(e, 99), percentile(e, 100), e->lost, e->bad,
+               e->errors);
+    }
+
+    len = libusb_control_transfer(g.h, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+                                  DUSB_VREQ_GET_STATS, 0, g.iface, st, sizeof(st), CTRL_TIMEOUT_MS);
+    if (len < 24 + 6 * 40) {
+        fprintf(stderr, "GET_STATS failed: %s\n", len < 0 ? libusb_error_name(len) : "short");
+        return;
+    }
+    printf("\ndevice counters over %.3f s of virtual time:\n", get_le64(st + 16) / 1e9);
+    printf("%-6s %12s %14s %10s %8s %8s\n", "ep", "packets", "bytes", "naks", "lost", "errors");
+    for (int i = 0; i < 6; i++) {
+        const uint8_t *ep = st + 24 + i * 40;
+        for (int j = 0; j < g.neps; j++) {
+            if (g.eps[j].addr == ep[0]) {
+                printf("0x%02x   %12" PRIu64 " %14" PRIu64 " %10" PRIu64 " %8" PRIu64 " %8u\n", ep[0],
+                       get_le64(ep + 8), get_le64(ep + 16), get_le64(ep + 24), get_le64(ep + 32), get_le32(ep + 4));
+            }
+        }
+    }
+}
+
+static void on_signal(int sig) {
+    g.stop = 1;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "usage: %s [options]\n"
+            "  -D in|out   direction to test (default in)\n"
+            "  -e ADDR     endpoint number or address within the function, repeatable (default all three)\n"
+            "  -q DEPTH    transfers kept in flight per endpoint (default 32)\n"
+            "  -s BYTES    transfer size; payload size for interrupt/isoc packets (default 1024)\n"
+            "  -n PACKETS  isochronous packets per transfer (default 8)\n"
+            "  -p PATTERN  0 legacy, 1 zero, 2 count, 3 prbs (default 2)\n"
+            "  -i USEC     device generation / acceptance interval (default 0, unthrottled)\n"
+            "  -S STREAMS  bulk streams to allocate on the bulk endpoint (SuperSpeed only)\n"
+            "  -I IFACE    function of a composite device to test (default 0)\n"
+            "  -C OP       command mode on EP3 with cmd_engine=on: nop, read, write, or the offloaded\n"
+            "              crc32c, sha256 and compress; -q commands outstanding, -s data bytes each\n"
+            "  -t SECONDS  run time (default 10)\n"
+            "  -d INDEX    which DUSB device to use when several are present (default 0)\n",
+            prog);
+}
+
+int main(int argc, char **argv) {
+    libusb_device **list;
+    int seconds = 10, index = 0, opt, ret, found = 0;
+    struct timespec t0, t1, deadline;
+    uint8_t addrs[DUSB_NUM_EPS];
+    int naddrs = 0;
+
+    while ((opt = getopt(argc, argv, "D:e:q:s:n:p:i:S:I:C:t:d:h")) != -1) {
+        switch (opt) {
+            case 'D':
+                g.in = strcmp(optarg, "out") != 0;
+                break;
+            case 'e':
+                if (naddrs < DUSB_NUM_EPS) {
+                    addrs[naddrs++] = strtoul(optarg, NULL, 0) & 0x0f;
+                }
+                break;
+            case 'q':
+                g.depth = atoi(optarg);
+                break;
+            case 's':
+                g.size = atoi(optarg);
+                break;
+            case 'n':
+                g.iso_packets = atoi(optarg);
+                break;
+            case 'p':
+                g.pattern = atoi(optarg);
+                break;
+            case 'i':
+                g.interval_us = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                g.streams = atoi(optarg);
+                break;
+            case 'I':
+                g.iface = atoi(optarg);
+                break;
+            case 'C': {
+                static const char *const ops[DUSB_CMD_NUM] = {"nop", "read", "write", "crc32c", "sha256",
+                                                              "compress"};
+                g.cmd = -2;
+                for (int op = 0; op < DUSB_CMD_NUM; op++) {
+                    if (!strcmp(optarg, ops[op])) {
+                        g.cmd = op;
+                    }
+                }
+                break;
+            }
+            case 't':
+                seconds = atoi(optarg);
+                break;
+            case 'd':
+                index = atoi(optarg);
+                break;
+            default:
+                usage(argv[0]);
+                return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (g.depth < 1 || g.size < 1 || g.size > DUSB_MAX_PAYLOAD || g.iso_packets < 1 ||
+        g.pattern < 0 || g.pattern >= DUSB_PATTERN_NUM || g.iface < 0 || g.iface >= DUSB_MAX_FUNCS ||
+        g.cmd < -1 || (g.cmd >= 0 && (g.iface != 0 || g.size > DUSB_MAX_PAYLOAD - DUSB_CMD_RESP_LEN))) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!naddrs) {
+        for (int i = 0; i < DUSB_NUM_EPS; i++) {
+            addrs[naddrs++] = i + 1;
+        }
+    }
+    /* Function f owns endpoints 3f+1 to 3f+3 */
+    for (int i = 0; i < naddrs; i++) {
+        addrs[i] = ((addrs[i] - 1) % DUSB_NUM_EPS) + 1 + g.iface * DUSB_NUM_EPS;
+    }
+    /* Responses to READ carry the EP3 IN pattern, legacy falls back to counting on the device */
+    build_table(g.cmd >= 0 && g.pattern == DUSB_PATTERN_LEGACY ? DUSB_PATTERN_COUNT : g.pattern);
+
+    ret = libusb_init(&g.ctx);
+    if (ret) {
+        fprintf(stderr, "libusb_init: %s\n", libusb_error_name(ret));
+        return 1;
+    }
+    if (libusb_get_device_list(g.ctx, &list) < 0) {
+        return 1;
+    }
+    for (libusb_device **d = list; *d && !g.h; d++) {
+        struct libusb_device_descriptor dd;
+        if (libusb_get_device_descriptor(*d, &dd) == 0 && dd.idVendor == DUSB_VID && dd.idProduct == DUSB_PID &&
+            found++ == index) {
+            ret = libusb_open(*d, &g.h);
+            if (ret) {
+                fprintf(stderr, "libusb_open: %s\n", libusb_error_name(ret));
+            }
+        }
+    }
+    libusb_free_device_list(list, 1);
+    if (!g.h) {
+        fprintf(stderr, "DUSB device %d not found\n", index);
+        return 1;
+    }
+    libusb_set_auto_detach_kernel_driver(g.h, 1);
+    ret = libusb_claim_interface(g.h, g.iface);
+    if (!ret) {
+        /* Alt 0 carries the OUT endpoints, alt 1 the IN endpoints, alt 2 the command engine */
+        ret = libusb_set_interface_alt_setting(g.h, g.iface, g.cmd >= 0 ? DUSB_ALT_CMD : g.in ? 1 : 0);
+    }
+    if (ret) {
+        fprintf(stderr, "selecting interface: %s\n", libusb_error_name(ret));
+        return 1;
+    }
+
+    if (g.cmd >= 0) {
+        ret = cmd_setup();
+        if (ret) {
+            fprintf(stderr, "command mode setup failed: %s\n", libusb_error_name(ret));
+            return 1;
+        }
+        naddrs = 0;
+    }
+    for (int i = 0; i < naddrs; i++) {
+        EpRun *e = &g.eps[g.neps++];
+        e->addr = addrs[i] | (g.in ? LIBUSB_ENDPOINT_IN : LIBUSB_ENDPOINT_OUT);
+        ret = setup_ep(e);
+        if (ret) {
+            fprintf(stderr, "EP 0x%02x: setup failed: %s\n", e->addr, libusb_error_name(ret));
+            return 1;
+        }
+    }
+    vendor_out(DUSB_VREQ_RESET_STATS, 0, NULL, 0);
+
+    signal(SIGINT, on_signal);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int i = 0; i < g.neps; i++) {
+        for (int j = 0; j < g.depth; j++) {
+            if (g.cmd >= 0) {
+                ret = i ? libusb_submit_transfer(g.eps[i].xfers[j]) : cmd_submit(j);
+                g.eps[i].inflight += i && !ret;
+            } else {
+                ret = submit(&g.eps[i], j);
+            }
+            if (ret) {
+                fprintf(stderr, "EP 0x%02x: submit: %s\n", g.eps[i].addr, libusb_error_name(ret));
+                g.stop = 1;
+            }
+        }
+    }
+    deadline = t0;
+    deadline.tv_sec += seconds;
+    while (!g.stop) {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(g.ctx, &tv, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        if (ts_diff_us(&deadline, &t1) >= 0) {
+            g.stop = 1;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    /* Drain: cancel what is still queued and wait for the callbacks */
+    for (int i = 0; i < g.neps; i++) {
+        for (int j = 0; j < g.depth; j++) {
+            libusb_cancel_transfer(g.eps[i].xfers[j]);
+        }
+    }
+    for (bool busy = true; busy;) {
+        struct timeval tv = {0, 100000};
+        busy = false;
+        for (int i = 0; i < g.neps; i++) {
+            busy |= g.eps[i].inflight > 0;
+        }
+        if (busy) {
+            libusb_handle_events_timeout_completed(g.ctx, &tv, NULL);
+        }
+    }
+
+    report(ts_diff_us(&t0, &t1) / 1e6);
+
+    for (int i = 0; i < g.neps; i++) {
+        EpRun *e = &g.eps[i];
+        if (e->streams) {
+            libusb_free_streams(g.h, &e->addr, 1);
+        }
+        for (int j = 0; j < g.depth; j++) {
+            libusb_free_transfer(e->xfers[j]);
+        }
+        free(e->xfers);
+        free(e->t_submit);
+        free(e->lat_us);
+    }
+    libusb_release_interface(g.h, g.iface);
+    libusb_close(g.h);
+    libusb_exit(g.ctx);
+    return 0;
+}
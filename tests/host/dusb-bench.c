@@ -0,0 +1,409 @@
+/*
+ * dusb-bench - host-side microbenchmark of the DUSB device's data path
+ *
+ * Links dusb.c against the mock USB core in mock.c and pushes packets
+ * through handle_data one at a time, as a controller would, with the
+ * endpoint unthrottled so no packet waits on the fake clock. Endpoint 0x00
+ * stands for EP0, driven through handle_control with the CTRL_READ and
+ * CTRL_WRITE vendor requests. For each
+ * endpoint and payload size it reports host time, device allocations and
+ * last-level cache misses per packet. The times include the mock core's
+ * own packet handling (queueing, completion), which is small next to the
+ * device's; for OUT, the cost of building payloads is measured on its own
+ * and subtracted.
+ *
+ * With -S the whole matrix is repeated once per speed= setting, so the
+ * full-, high- and SuperSpeed descriptor sets and packet sizes are each
+ * measured on their own; the speed column is the one the device attached at.
+ *
+ * Cache misses come from perf_event_open and read "n/a" where the kernel
+ * or container does not allow it (see perf_event_paranoid).
+ */
+#include "mock.h"
+
+#include <getopt.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "qemu/bswap.h"
+#include "qemu/timer.h"
+
+/* Must match dusb.c */
+#define DUSB_PATTERN_LEGACY     0
+#define DUSB_PATTERN_COUNT      2
+#define DUSB_PATTERN_PRBS       3
+#define DUSB_PATTERN_PERIOD     4096
+#define DUSB_MAX_PAYLOAD        (64 * 1024)
+#define DUSB_PAYLOAD_HDR_LEN    16
+#define DUSB_VREQ_CTRL_READ     0x07
+#define DUSB_VREQ_CTRL_WRITE    0x08
+#define DUSB_CTRL_CHUNK_STRIDE  61
+#define DUSB_CTRL_MAX_PAYLOAD   4096
+
+#define WARMUP_PACKETS          1000
+#define PACKET_TIMEOUT_NS       (100 * SCALE_MS)
+
+static const char *const type_names[] = { "ctrl", "iso", "bulk", "int" };
+static const char *const speed_names[] = { "low", "full", "high", "super" };
+
+static struct {
+    uint64_t packets;
+    int pattern;
+    int sizes[16];
+    int nsizes;
+    int eps[32];
+    int neps;
+    const char *speeds[4];
+    int nspeeds;
+    const char *speed;         /* speed= of the devices being created, NULL for the default */
+    int perf_fd;
+    uint8_t table[DUSB_PATTERN_PERIOD + DUSB_MAX_PAYLOAD];
+} g = {
+    .packets = 1000000,
+    .pattern = DUSB_PATTERN_COUNT,
+    .perf_fd = -1,
+};
+
+/* One measured run of a loop */
+typedef struct Sample {
+    int64_t ns;
+    uint64_t allocs;
+    uint64_t misses;
+} Sample;
+
+/* Same pattern bodies as dusb_pattern_table() on the device */
+static void build_table(int pattern) {
+    uint32_t x = 0x2545F491;
+
+    for (size_t i = 0; i < sizeof(g.table); i++) {
+        switch (pattern) {
+            case DUSB_PATTERN_COUNT:
+                g.table[i] = i % 256;
+                break;
+            case DUSB_PATTERN_PRBS:
+                if (i < DUSB_PATTERN_PERIOD) {
+                    x ^= x << 13;
+                    x ^= x >> 17;
+                    x ^= x << 5;
+                    g.table[i] = x & 0xff;
+                } else {
+                    g.table[i] = g.table[i % DUSB_PATTERN_PERIOD];
+                }
+                break;
+            default:
+                g.table[i] = 0;
+                break;
+        }
+    }
+}
+
+/* An OUT payload the device accepts, as the guest tool builds them */
+static void fill_payload(uint8_t addr, uint32_t seq, uint8_t *buf, int len) {
+    if (g.pattern == DUSB_PATTERN_LEGACY || len < DUSB_PAYLOAD_HDR_LEN) {
+        return;
+    }
+    buf[0] = addr;
+    buf[1] = g.pattern;
+    stw_le_p(buf + 2, 0);
+    stl_le_p(buf + 4, seq);
+    memset(buf + 8, 0, 8);
+    memcpy(buf + DUSB_PAYLOAD_HDR_LEN, g.table + seq % DUSB_PATTERN_PERIOD, len - DUSB_PAYLOAD_HDR_LEN);
+}
+
+static void perf_open(void) {
+    struct perf_event_attr pe = {
+        .type = PERF_TYPE_HARDWARE,
+        .size = sizeof(pe),
+        .config = PERF_COUNT_HW_CACHE_MISSES,
+        .disabled = 1,
+        .exclude_kernel = 1,
+        .exclude_hv = 1,
+    };
+
+    g.perf_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+}
+
+static void sample_start(Sample *s) {
+    if (g.perf_fd >= 0) {
+        ioctl(g.perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(g.perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    s->allocs = mock_allocs;
+    s->ns = get_clock();
+}
+
+static void sample_stop(Sample *s) {
+    s->ns = get_clock() - s->ns;
+    s->allocs = mock_allocs - s->allocs;
+    s->misses = 0;
+    if (g.perf_fd >= 0) {
+        ioctl(g.perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(g.perf_fd, &s->misses, sizeof(s->misses)) != sizeof(s->misses)) {
+            s->misses = 0;
+        }
+    }
+}
+
+static USBDevice *bench_device(int addr, int size) {
+    const char *dir = addr & USB_DIR_IN ? "in" : "out";
+    int nr = addr & 0x0f;
+    char props[4][64];
+    const char *const list[] = { props[0], props[1], props[2], g.speed ? props[3] : NULL, NULL };
+    Error *err = NULL;
+    USBDevice *dev;
+
+    snprintf(props[0], sizeof(props[0]), "ep%d_%s_interval_us=0", nr, dir);
+    snprintf(props[1], sizeof(props[1]), "ep%d_%s_pattern=%d", nr, dir, g.pattern);
+    snprintf(props[2], sizeof(props[2]), "ep%d_%s_size=%d", nr, dir, size);
+    snprintf(props[3], sizeof(props[3]), "speed=%s", g.speed);
+    dev = mock_device_new("usb-dusb", list, &err);
+    if (!dev) {
+        /* Not every size is valid for every pattern and endpoint; skip the point */
+        printf("%-5s  0x%02x  %6d  skipped: %s\n", g.speed ? g.speed : "-", addr, size, error_get_pretty(err));
+        error_free(err);
+        return NULL;
+    }
+    /* Alt 0 carries the OUT endpoints, alt 1 the IN endpoints */
+    if (mock_set_configuration(dev, 1) < 0 || mock_set_interface(dev, 0, addr & USB_DIR_IN ? 1 : 0) < 0) {
+        fprintf(stderr, "dusb-bench: cannot select the interface for endpoint 0x%02x\n", addr);
+        exit(1);
+    }
+    return dev;
+}
+
+/* Run n packets; NAKed ones are retried once the clock has moved on */
+static void bench_loop(USBDevice *dev, USBPacket *p, uint8_t *buf, int size, uint64_t n, uint32_t *seq,
+                       uint64_t *naks, uint64_t *errors, uint64_t *bytes) {
+    uint8_t addr = p->ep->nr | (p->pid == USB_TOKEN_IN ? USB_DIR_IN : 0);
+
+    for (uint64_t i = 0; i < n; i++) {
+        int ret;
+
+        if (p->pid == USB_TOKEN_OUT) {
+            fill_payload(addr, (*seq)++, buf, size);
+        }
+        while ((ret = mock_packet_run(dev, p, PACKET_TIMEOUT_NS)) == USB_RET_NAK) {
+            (*naks)++;
+            if (!mock_clock_step(mock_clock_ns() + PACKET_TIMEOUT_NS)) {
+                break;
+            }
+        }
+        if (ret != USB_RET_SUCCESS) {
+            (*errors)++;
+        }
+        *bytes += p->actual_length;
+    }
+}
+
+/* Run n EP0 transfers of one direction, chunk numbers counting up as the guest tool does */
+static void bench_control_loop(USBDevice *dev, int request, uint8_t *buf, int size, uint64_t n, uint32_t *chunk,
+                               uint64_t *errors, uint64_t *bytes) {
+    for (uint64_t i = 0; i < n; i++) {
+        int c = (*chunk)++ & 0xffff;
+        int ret;
+
+        if (request == DUSB_VREQ_CTRL_WRITE) {
+            memcpy(buf, g.table + (c * DUSB_CTRL_CHUNK_STRIDE) % DUSB_PATTERN_PERIOD, size);
+        }
+        ret = mock_control(dev, (request == DUSB_VREQ_CTRL_READ ? VendorDeviceRequest : VendorDeviceOutRequest) |
+                           request, g.pattern, c, size, buf);
+        if (ret < 0) {
+            (*errors)++;
+        } else {
+            *bytes += size;
+        }
+    }
+}
+
+static void bench_control(int size, bool in) {
+    int request = in ? DUSB_VREQ_CTRL_READ : DUSB_VREQ_CTRL_WRITE;
+    uint64_t errors = 0, bytes = 0;
+    uint32_t chunk = 0;
+    Sample run;
+    char misses[32];
+    char speed[64];
+    Error *err = NULL;
+    USBDevice *dev;
+    uint8_t *buf;
+
+    if (g.pattern == DUSB_PATTERN_LEGACY || size > DUSB_CTRL_MAX_PAYLOAD) {
+        printf("%-5s  0x00  ctrl  %-3s  %6d  skipped: needs a non-legacy pattern and at most %d bytes\n",
+               g.speed ? g.speed : "-", in ? "in" : "out", size, DUSB_CTRL_MAX_PAYLOAD);
+        return;
+    }
+    snprintf(speed, sizeof(speed), "speed=%s", g.speed);
+    dev = mock_device_new("usb-dusb", (const char *const[]){ g.speed ? speed : NULL, NULL }, &err);
+    if (!dev || mock_set_configuration(dev, 1) < 0) {
+        fprintf(stderr, "dusb-bench: cannot create the device: %s\n", err ? error_get_pretty(err) : "SET_CONFIGURATION");
+        exit(1);
+    }
+    buf = calloc(1, size);
+    bench_control_loop(dev, request, buf, size, WARMUP_PACKETS, &chunk, &errors, &bytes);
+    errors = bytes = 0;
+    sample_start(&run);
+    bench_control_loop(dev, request, buf, size, g.packets, &chunk, &errors, &bytes);
+    sample_stop(&run);
+
+    if (g.perf_fd >= 0) {
+        snprintf(misses, sizeof(misses), "%.3f", (double)run.misses / g.packets);
+    } else {
+        snprintf(misses, sizeof(misses), "n/a");
+    }
+    printf("%-5s  0x00  ctrl  %-3s  %6d  %9.1f  %10.3f  %10s  %7.3f  %8.1f  %" PRIu64 "\n",
+           speed_names[dev->speed], in ? "in" : "out", size, (double)run.ns / g.packets, (double)run.allocs / g.packets, misses, 0.0,
+           (double)bytes / g.packets, errors);
+    fflush(stdout);
+
+    mock_device_free(dev);
+    free(buf);
+}
+
+static void bench_point(int addr, int size) {
+    USBDevice *dev;
+    int pid = addr & USB_DIR_IN ? USB_TOKEN_IN : USB_TOKEN_OUT;
+    uint64_t naks = 0, errors = 0, bytes = 0;
+    uint32_t seq = 0;
+    Sample run, fill = { 0 };
+    char misses[32];
+    uint8_t *buf;
+    USBPacket *p;
+
+    if (!(addr & 0x0f)) {
+        /* EP0 has no direction of its own; time both data stages */
+        bench_control(size, true);
+        bench_control(size, false);
+        return;
+    }
+    dev = bench_device(addr, size);
+    if (!dev) {
+        return;
+    }
+    buf = calloc(1, size);
+    p = mock_packet_new(dev, pid, addr & 0x0f, buf, size);
+    bench_loop(dev, p, buf, size, WARMUP_PACKETS, &seq, &naks, &errors, &bytes);
+    naks = errors = bytes = 0;
+    sample_start(&run);
+    bench_loop(dev, p, buf, size, g.packets, &seq, &naks, &errors, &bytes);
+    sample_stop(&run);
+
+    if (pid == USB_TOKEN_OUT) {
+        sample_start(&fill);
+        for (uint64_t i = 0; i < g.packets; i++) {
+            fill_payload(addr, seq++, buf, size);
+            __asm__ __volatile__("" : : "r"(buf) : "memory");
+        }
+        sample_stop(&fill);
+    }
+    if (g.perf_fd >= 0) {
+        snprintf(misses, sizeof(misses), "%.3f",
+                 (double)(run.misses - MIN(run.misses, fill.misses)) / g.packets);
+    } else {
+        snprintf(misses, sizeof(misses), "n/a");
+    }
+    printf("%-5s  0x%02x  %-4s  %-3s  %6d  %9.1f  %10.3f  %10s  %7.3f  %8.1f  %" PRIu64 "\n",
+           speed_names[dev->speed], addr, type_names[p->ep->type & 3], pid == USB_TOKEN_IN ? "in" : "out", size,
+           (double)(run.ns - fill.ns) / g.packets, (double)run.allocs / g.packets, misses,
+           (double)naks / g.packets, (double)bytes / g.packets, errors);
+    fflush(stdout);
+
+    mock_packet_free(p);
+    mock_device_free(dev);
+    free(buf);
+}
+
+static int parse_list(const char *arg, int *out, int max) {
+    char *end;
+    int n = 0;
+
+    while (*arg && n < max) {
+        long v = strtol(arg, &end, 0);
+
+        if (end == arg || (*end && *end != ',')) {
+            return -1;
+        }
+        out[n++] = v;
+        arg = *end ? end + 1 : end;
+    }
+    return n;
+}
+
+/* Comma-separated speed= values; only the names dusb.c accepts */
+static int parse_speeds(char *arg, const char **out, int max) {
+    int n = 0;
+
+    for (char *tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+        if (n == max || (strcmp(tok, "full") && strcmp(tok, "high") && strcmp(tok, "super"))) {
+            return -1;
+        }
+        out[n++] = tok;
+    }
+    return n;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "usage: dusb-bench [-n packets] [-e ep,...] [-s size,...] [-p pattern] [-S speed,...]\n"
+            "  -n  packets per endpoint and size (default 1000000)\n"
+            "  -e  endpoint addresses, 0x00 for EP0 (default 0x00,0x81,0x82,0x83,0x01,0x02,0x03)\n"
+            "  -s  payload sizes in bytes (default 64,1024,16384)\n"
+            "  -p  payload pattern: 0 legacy, 1 zero, 2 count, 3 prbs (default 2)\n"
+            "  -S  repeat the matrix with speed=full, high or super (default: unlocked, SuperSpeed)\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static const int default_eps[] = { 0x00, 0x81, 0x82, 0x83, 0x01, 0x02, 0x03 };
+    static const int default_sizes[] = { 64, 1024, 16384 };
+    int c;
+
+    memcpy(g.eps, default_eps, sizeof(default_eps));
+    g.neps = ARRAY_SIZE(default_eps);
+    memcpy(g.sizes, default_sizes, sizeof(default_sizes));
+    g.nsizes = ARRAY_SIZE(default_sizes);
+    while ((c = getopt(argc, argv, "n:e:s:p:S:h")) != -1) {
+        switch (c) {
+            case 'n':
+                g.packets = strtoull(optarg, NULL, 0);
+                break;
+            case 'e':
+                g.neps = parse_list(optarg, g.eps, ARRAY_SIZE(g.eps));
+                break;
+            case 's':
+                g.nsizes = parse_list(optarg, g.sizes, ARRAY_SIZE(g.sizes));
+                break;
+            case 'p':
+                g.pattern = atoi(optarg);
+                break;
+            case 'S':
+                g.nspeeds = parse_speeds(optarg, g.speeds, ARRAY_SIZE(g.speeds));
+                break;
+            default:
+                usage();
+        }
+    }
+    if (!g.packets || g.neps <= 0 || g.nsizes <= 0 || g.nspeeds < 0 || g.pattern < 0 || g.pattern > DUSB_PATTERN_PRBS) {
+        usage();
+    }
+    for (int i = 0; i < g.nsizes; i++) {
+        if (g.sizes[i] <= 0 || g.sizes[i] > DUSB_MAX_PAYLOAD) {
+            usage();
+        }
+    }
+
+    build_table(g.pattern);
+    perf_open();
+    printf("# dusb-bench: %" PRIu64 " packets per point, pattern %d, cache misses %s\n", g.packets, g.pattern,
+           g.perf_fd >= 0 ? "from perf" : "unavailable");
+    printf("speed  ep    type  dir    size     ns/pkt  allocs/pkt  misses/pkt  naks/pkt  bytes/pkt  errors\n");
+    for (int sp = 0; sp < MAX(g.nspeeds, 1); sp++) {
+        g.speed = g.nspeeds ? g.speeds[sp] : NULL;
+        for (int e = 0; e < g.neps; e++) {
+            for (int s = 0; s < g.nsizes; s++) {
+                bench_point(g.eps[e], g.sizes[s]);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,597 @@
+/*
+ * dusb-stats-test - regression test for the per-endpoint rate and latency
+ * counters in the stats property, and for the seeded run digest
+ *
+ * Traffic is driven on the fake virtual clock with exactly known timing,
+ * so packets_per_sec, bytes_per_sec and the latency_ns summary each have
+ * one correct value. Latency percentiles are the upper bound of their log2
+ * bucket, clamped to the observed min and max.
+ */
+#include "mock.h"
+
+#include <zlib.h>
+
+#include "qemu/bswap.h"
+#include "qemu/crc32c.h"
+#include "qemu/timer.h"
+
+static int checks, failures;
+
+#define CHECK_EQ(actual, expected) check_eq(__LINE__, #actual, (actual), (expected))
+
+static void check_eq(int line, const char *what, int64_t actual, int64_t expected) {
+    checks++;
+    if (actual != expected) {
+        failures++;
+        fprintf(stderr, "dusb-stats-test.c:%d: %s is %" PRId64 ", expected %" PRId64 "\n", line, what, actual,
+                expected);
+    }
+}
+
+/*
+ * Numeric field of one endpoint's object in the stats JSON, -1 if absent.
+ * A dotted path descends into nested objects: "latency_ns.p99".
+ */
+static int64_t ep_stat(const char *json, int addr, const char *path) {
+    char key[64], *end;
+    const char *p, *next;
+    const char *name = path;
+
+    snprintf(key, sizeof(key), "{\"ep\": %d,", addr);
+    p = strstr(json, key);
+    if (!p) {
+        return -1;
+    }
+    next = strstr(p + 1, "{\"ep\": ");
+    while (name) {
+        const char *dot = strchr(name, '.');
+        int len = dot ? dot - name : (int)strlen(name);
+
+        snprintf(key, sizeof(key), "\"%.*s\": ", len, name);
+        p = strstr(p, key);
+        if (!p || (next && p > next)) {
+            return -1;
+        }
+        p += strlen(key);
+        name = dot ? dot + 1 : NULL;
+    }
+    return strtoll(p, &end, 10);
+}
+
+static char *stats(USBDevice *dev) {
+    char *json = mock_prop_get(dev, "stats", NULL);
+
+    assert(json);
+    return json;
+}
+
+static USBDevice *stats_device(const char *const *props) {
+    Error *err = NULL;
+    USBDevice *dev = mock_device_new("usb-dusb", props, &err);
+
+    if (!dev) {
+        fprintf(stderr, "dusb-stats-test: %s\n", error_get_pretty(err));
+        exit(1);
+    }
+    CHECK_EQ(mock_set_configuration(dev, 1), 0);
+    return dev;
+}
+
+/* A throttled sink: OUT latency is the interval between accepted transfers */
+static void test_out_rate(void) {
+    static const char *const props[] = { "ep3_out_interval_us=1000", "ep3_out_pattern=1", NULL };
+    USBDevice *dev = stats_device(props);
+    uint8_t buf[512] = { 0x03, 1 };
+    USBPacket *p = mock_packet_new(dev, USB_TOKEN_OUT, 3, buf, sizeof(buf));
+    char *json;
+
+    CHECK_EQ(mock_set_interface(dev, 0, 0), 0);
+    CHECK_EQ(mock_prop_set(dev, "reset_stats", "true", NULL), true);
+    for (int i = 0; i < 100; i++) {
+        stl_le_p(buf + 4, i);
+        CHECK_EQ(mock_packet_run(dev, p, 0), USB_RET_SUCCESS);
+        /* Early by 1 us: the sink is still closed */
+        mock_clock_advance(999 * SCALE_US);
+        CHECK_EQ(mock_packet_run(dev, p, 0), USB_RET_NAK);
+        mock_clock_advance(1 * SCALE_US);
+    }
+
+    json = stats(dev);
+    CHECK_EQ(ep_stat(json, 0x03, "packets"), 100);
+    CHECK_EQ(ep_stat(json, 0x03, "bytes"), 100 * 512);
+    CHECK_EQ(ep_stat(json, 0x03, "naks"), 100);
+    CHECK_EQ(ep_stat(json, 0x03, "errors"), 0);
+    CHECK_EQ(ep_stat(json, 0x03, "packets_per_sec"), 1000);
+    CHECK_EQ(ep_stat(json, 0x03, "bytes_per_sec"), 512000);
+    CHECK_EQ(ep_stat(json, 0x03, "latency_ns.samples"), 99);
+    CHECK_EQ(ep_stat(json, 0x03, "latency_ns.min"), 1000000);
+    CHECK_EQ(ep_stat(json, 0x03, "latency_ns.p50"), 1000000);
+    CHECK_EQ(ep_stat(json, 0x03, "latency_ns.p99"), 1000000);
+    CHECK_EQ(ep_stat(json, 0x03, "latency_ns.max"), 1000000);
+    g_free(json);
+
+    mock_packet_free(p);
+    mock_device_free(dev);
+}
+
+/*
+ * Interrupt IN: the host reads each payload a chosen time after the device
+ * signals it (usb_wakeup), so every latency sample is known.
+ */
+static void test_in_latency(void) {
+    static const char *const props[] = { "ep1_in_interval_us=10000", "ep1_in_pattern=2", "ep1_in_size=64",
+                                         "wakeup_interval=3600", NULL };
+    USBDevice *dev = stats_device(props);
+    uint8_t buf[64];
+    USBPacket *p = mock_packet_new(dev, USB_TOKEN_IN, 1, buf, sizeof(buf));
+    int64_t start;
+    char *json;
+
+    CHECK_EQ(mock_set_interface(dev, 0, 1), 0);
+    CHECK_EQ(mock_prop_set(dev, "reset_stats", "true", NULL), true);
+    start = mock_clock_ns();
+    for (int i = 0; i < 100; i++) {
+        uint64_t wakeups = mock_ep_wakeups;
+        int64_t lag = i < 80 ? 10 * SCALE_US : i < 95 ? 100 * SCALE_US : 1000 * SCALE_US;
+
+        while (mock_ep_wakeups == wakeups) {
+            assert(mock_clock_step(INT64_MAX));
+        }
+        mock_clock_advance(lag);
+        CHECK_EQ(mock_packet_run(dev, p, 0), USB_RET_SUCCESS);
+        CHECK_EQ(p->actual_length, 64);
+    }
+    /* End the window on a whole number of periods */
+    mock_clock_advance(start + 100 * 10 * SCALE_MS - mock_clock_ns());
+
+    json = stats(dev);
+    CHECK_EQ(ep_stat(json, 0x81, "packets"), 100);
+    CHECK_EQ(ep_stat(json, 0x81, "bytes"), 100 * 64);
+    CHECK_EQ(ep_stat(json, 0x81, "packets_per_sec"), 100);
+    CHECK_EQ(ep_stat(json, 0x81, "bytes_per_sec"), 6400);
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.samples"), 100);
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.min"), 10000);
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.mean"), (80 * 10000 + 15 * 100000 + 5 * 1000000) / 100);
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.p50"), 16383);    /* [8192, 16384) */
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.p90"), 131071);   /* [65536, 131072) */
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.p99"), 1000000);  /* Clamped to max */
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.max"), 1000000);
+    g_free(json);
+
+    /* reset_stats restarts the window and empties the histogram */
+    CHECK_EQ(mock_prop_set(dev, "reset_stats", "true", NULL), true);
+    json = stats(dev);
+    CHECK_EQ(ep_stat(json, 0x81, "packets"), 0);
+    CHECK_EQ(ep_stat(json, 0x81, "packets_per_sec"), 0);
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.samples"), 0);
+    CHECK_EQ(ep_stat(json, 0x81, "latency_ns.p99"), 0);
+    g_free(json);
+
+    mock_packet_free(p);
+    mock_device_free(dev);
+}
+
+/* Pipelined bulk IN: a transfer already waiting is completed as the payload is generated */
+static void test_in_pipelined(void) {
+    static const char *const props[] = { "ep3_in_interval_us=1000", "ep3_in_pattern=2", "ep3_in_size=512", NULL };
+    USBDevice *dev = stats_device(props);
+    uint8_t buf[512];
+    USBPacket *p = mock_packet_new(dev, USB_TOKEN_IN, 3, buf, sizeof(buf));
+    char *json;
+
+    CHECK_EQ(mock_set_interface(dev, 0, 1), 0);
+    /* Line the window up with the generator */
+    CHECK_EQ(mock_packet_run(dev, p, SCALE_MS * 10), USB_RET_SUCCESS);
+    CHECK_EQ(mock_prop_set(dev, "reset_stats", "true", NULL), true);
+    for (int i = 0; i < 100; i++) {
+        CHECK_EQ(mock_packet_run(dev, p, SCALE_MS * 10), USB_RET_SUCCESS);
+    }
+
+    json = stats(dev);
+    CHECK_EQ(ep_stat(json, 0x83, "packets"), 100);
+    CHECK_EQ(ep_stat(json, 0x83, "packets_per_sec"), 1000);
+    CHECK_EQ(ep_stat(json, 0x83, "bytes_per_sec"), 512000);
+    CHECK_EQ(ep_stat(json, 0x83, "latency_ns.samples"), 100);
+    CHECK_EQ(ep_stat(json, 0x83, "latency_ns.max"), 0);
+    CHECK_EQ(ep_stat(json, 0x83, "latency_ns.p99"), 0);
+    g_free(json);
+
+    mock_packet_free(p);
+    mock_device_free(dev);
+}
+
+
+/* The stats digest as a number */
+static uint32_t digest(USBDevice *dev) {
+    char *json = stats(dev);
+    const char *p = strstr(json, "\"digest\": \"");
+    uint32_t d;
+
+    assert(p);
+    d = strtoul(p + strlen("\"digest\": \""), NULL, 16);
+    g_free(json);
+    return d;
+}
+
+/*
+ * Devices given the same seed and driven the same way must produce the
+ * same traffic, injected faults included. Three devices are polled side by
+ * side at the same virtual times, so their digests cover identical
+ * timelines; the one with another seed must see other jitter and faults
+ * and so another digest.
+ */
+static void test_seed_digest(void) {
+    static const char *const props[][9] = {
+        { "seed=42", "ep1_in_interval_us=1000", "ep1_in_latency_us=100", "ep1_in_jitter_us=500",
+          "ep1_in_pattern=2", "ep1_in_size=64", "ep1_in_fault_short_ppm=100000", "ep1_in_fault_ioerror_ppm=50000",
+          NULL },
+        { "seed=42", "ep1_in_interval_us=1000", "ep1_in_latency_us=100", "ep1_in_jitter_us=500",
+          "ep1_in_pattern=2", "ep1_in_size=64", "ep1_in_fault_short_ppm=100000", "ep1_in_fault_ioerror_ppm=50000",
+          NULL },
+        { "seed=7", "ep1_in_interval_us=1000", "ep1_in_latency_us=100", "ep1_in_jitter_us=500",
+          "ep1_in_pattern=2", "ep1_in_size=64", "ep1_in_fault_short_ppm=100000", "ep1_in_fault_ioerror_ppm=50000",
+          NULL },
+    };
+    USBDevice *dev[3];
+    USBPacket *p[3];
+    uint8_t buf[3][64];
+    int64_t got[3] = { 0 };
+    char *a, *b;
+
+    for (int i = 0; i < 3; i++) {
+        dev[i] = stats_device(props[i]);
+        p[i] = mock_packet_new(dev[i], USB_TOKEN_IN, 1, buf[i], sizeof(buf[i]));
+        CHECK_EQ(mock_set_interface(dev[i], 0, 1), 0);
+        CHECK_EQ(mock_prop_set(dev[i], "reset_stats", "true", NULL), true);
+    }
+    for (int t = 0; t < 2000; t++) {
+        for (int i = 0; i < 3; i++) {
+            if (mock_packet_run(dev[i], p[i], 0) == USB_RET_SUCCESS) {
+                got[i]++;
+            }
+        }
+        mock_clock_advance(50 * SCALE_US);
+    }
+
+    CHECK_EQ(got[0] > 0, true);
+    CHECK_EQ(got[1], got[0]);
+    CHECK_EQ(digest(dev[1]), digest(dev[0]));
+    a = stats(dev[0]);
+    b = stats(dev[1]);
+    CHECK_EQ(ep_stat(a, 0x81, "faults.short") > 0, true);
+    CHECK_EQ(ep_stat(a, 0x81, "faults.ioerror") > 0, true);
+    CHECK_EQ(ep_stat(b, 0x81, "faults.short"), ep_stat(a, 0x81, "faults.short"));
+    CHECK_EQ(ep_stat(b, 0x81, "faults.ioerror"), ep_stat(a, 0x81, "faults.ioerror"));
+    g_free(a);
+    g_free(b);
+    CHECK_EQ(digest(dev[2]) != digest(dev[0]), true);
+
+    /* reset_stats restarts the digest and the generators */
+    CHECK_EQ(mock_prop_set(dev[0], "reset_stats", "true", NULL), true);
+    CHECK_EQ(digest(dev[0]), 0);
+
+    for (int i = 0; i < 3; i++) {
+        mock_packet_free(p[i]);
+        mock_device_free(dev[i]);
+    }
+}
+
+/* One side of test_migration: a device with its bulk OUT transfer and control request */
+typedef struct MigSide {
+    USBDevice *dev;
+    USBPacket *out;
+    USBPacket ctl;
+    uint8_t buf[512];
+    uint32_t seq;
+    int ctl_deferred;
+} MigSide;
+
+#define MIG_CTRL_REQUEST (VendorDeviceRequest | 0x07) /* DUSB_VREQ_CTRL_READ, zero pattern, chunk 0 */
+
+static void mig_submit(MigSide *m, int t) {
+    if (!mock_packet_pending(m->out)) {
+        stl_le_p(m->buf + 4, m->seq++);
+        mock_packet_submit(m->dev, m->out);
+    }
+    if (t % 10 == 0 && !mock_packet_pending(&m->ctl)) {
+        usb_packet_cleanup(&m->ctl);
+        mock_control_submit(m->dev, &m->ctl, MIG_CTRL_REQUEST, 1, 0, 64, NULL);
+        m->ctl_deferred += mock_packet_pending(&m->ctl);
+    }
+}
+
+/*
+ * Save a device with a delayed bulk OUT transfer and a deferred control
+ * request in flight, load it into a new device and resubmit both there as
+ * the host controller would. Driven alongside a device that is never
+ * migrated, it must end with the same stats, digest included.
+ */
+static void test_migration(void) {
+    static const char *const props[] = { "seed=42", "ep3_out_pattern=1", "ep3_out_latency_us=300",
+                                         "ep3_out_jitter_us=200", NULL };
+    MigSide side[2] = { { 0 } }, *ref = &side[0], *mig = &side[1];
+    USBDevice *src;
+    uint8_t *state;
+    size_t len;
+    char *a, *b, deferred[32];
+
+    for (int i = 0; i < 2; i++) {
+        side[i].dev = stats_device(props);
+        side[i].buf[0] = 0x03;
+        side[i].buf[1] = 1;
+        side[i].out = mock_packet_new(side[i].dev, USB_TOKEN_OUT, 3, side[i].buf, sizeof(side[i].buf));
+        usb_packet_init(&side[i].ctl);
+        CHECK_EQ(mock_set_interface(side[i].dev, 0, 0), 0);
+        CHECK_EQ(mock_prop_set(side[i].dev, "ctrl_delay_us", "250", NULL), true);
+        CHECK_EQ(mock_prop_set(side[i].dev, "reset_stats", "true", NULL), true);
+    }
+    for (int t = 0; t < 1000; t++) {
+        for (int i = 0; i < 2; i++) {
+            mig_submit(&side[i], t);
+        }
+        if (t == 500) {
+            CHECK_EQ(mock_packet_pending(mig->out), true);
+            CHECK_EQ(mock_packet_pending(&mig->ctl), true);
+            src = mig->dev;
+            state = mock_vmstate_save(src, &len);
+            mig->dev = mock_device_new("usb-dusb", props, NULL);
+            CHECK_EQ(mock_vmstate_load(mig->dev, state, len), 0);
+            free(state);
+
+            /* The source side gives up its transfers; the destination controller resubmits them */
+            mock_packet_cancel(mig->out);
+            mock_packet_free(mig->out);
+            mock_packet_cancel(&mig->ctl);
+            usb_packet_cleanup(&mig->ctl);
+            mock_device_free(src);
+            mig->out = mock_packet_new(mig->dev, USB_TOKEN_OUT, 3, mig->buf, sizeof(mig->buf));
+            mock_packet_submit(mig->dev, mig->out);
+            mock_control_submit(mig->dev, &mig->ctl, MIG_CTRL_REQUEST, 1, 0, 64, NULL);
+            CHECK_EQ(mock_packet_pending(mig->out), true);
+            CHECK_EQ(mock_packet_pending(&mig->ctl), true);
+        }
+        mock_clock_advance(100 * SCALE_US);
+    }
+    mock_clock_advance(1 * SCALE_MS);
+
+    a = stats(ref->dev);
+    b = stats(mig->dev);
+    CHECK_EQ(strcmp(b, a), 0);
+    CHECK_EQ(ep_stat(b, 0x03, "packets"), mig->seq);
+    CHECK_EQ(ep_stat(b, 0x03, "lost"), 0);
+    CHECK_EQ(ep_stat(b, 0x03, "errors"), 0);
+    snprintf(deferred, sizeof(deferred), "\"deferred\": %d,", mig->ctl_deferred);
+    CHECK_EQ(strstr(b, deferred) != NULL, true);
+    CHECK_EQ(digest(mig->dev), digest(ref->dev));
+    g_free(a);
+    g_free(b);
+
+    for (int i = 0; i < 2; i++) {
+        usb_packet_cleanup(&side[i].ctl);
+        mock_packet_free(side[i].out);
+        mock_device_free(side[i].dev);
+    }
+}
+
+typedef struct MigCmdSide {
+    USBDevice *dev;
+    USBPacket *out;
+    USBPacket *in;
+    uint8_t cmd[16];
+    uint8_t resp[512];
+    uint32_t tag;
+    uint32_t hash;             /* FNV-1a of every response byte read */
+    uint64_t bytes;
+    bool in_busy;
+} MigCmdSide;
+
+#define MIG_CMD_READ_LEN 700    /* With the 32-byte response header, two 512-byte EP3 IN transfers */
+
+static void mig_cmd_fold(MigCmdSide *m) {
+    if (m->in->status != USB_RET_SUCCESS) {
+        return;
+    }
+    for (int i = 0; i < m->in->actual_length; i++) {
+        m->hash = (m->hash ^ m->resp[i]) * 16777619;
+    }
+    m->bytes += m->in->actual_length;
+}
+
+/* Collect a finished EP3 IN transfer and, if read is set, start the next */
+static void mig_cmd_read(MigCmdSide *m, bool read) {
+    if (m->in_busy && !mock_packet_pending(m->in)) {
+        mig_cmd_fold(m);
+        m->in_busy = false;
+    }
+    if (!m->in_busy && read) {
+        mock_packet_submit(m->dev, m->in);
+        m->in_busy = mock_packet_pending(m->in);
+        if (!m->in_busy) {
+            mig_cmd_fold(m);
+        }
+    }
+}
+
+/* One READ command on EP3 OUT unless the last is still in flight; responses are read slower than that */
+static void mig_cmd_submit(MigCmdSide *m, int t) {
+    if (!mock_packet_pending(m->out)) {
+        memset(m->cmd, 0, sizeof(m->cmd));
+        m->cmd[0] = 1; /* DUSB_CMD_READ */
+        stl_le_p(m->cmd + 4, m->tag);
+        stl_le_p(m->cmd + 8, MIG_CMD_READ_LEN);
+        mock_packet_submit(m->dev, m->out);
+        m->tag += m->out->status != USB_RET_NAK;
+    }
+    mig_cmd_read(m, t % 4 == 0);
+}
+
+/* Top-level counter of the cmd object in the stats JSON */
+static int64_t cmd_stat(const char *json, const char *name) {
+    char key[64];
+    const char *p = strstr(json, "\"cmd\": {");
+
+    snprintf(key, sizeof(key), "\"%s\": ", name);
+    p = p ? strstr(p, key) : NULL;
+    return p ? strtoll(p + strlen(key), NULL, 10) : -1;
+}
+
+/*
+ * The same for the command engine: the device is saved with commands
+ * queued, a response half sent and the OUT transfer of the latest command
+ * still delayed. The resubmitted OUT must not queue its command twice, and
+ * every response must arrive as on the device that was not migrated.
+ */
+static void test_migration_cmd(void) {
+    static const char *const props[] = { "seed=42", "cmd_engine=on", "cmd_depth=4", "ep3_out_latency_us=300",
+                                         "ep3_out_jitter_us=200", NULL };
+    MigCmdSide side[2] = { { 0 } }, *ref = &side[0], *mig = &side[1];
+    USBDevice *src;
+    uint8_t *state;
+    size_t len;
+    char *a, *b;
+
+    for (int i = 0; i < 2; i++) {
+        side[i].dev = stats_device(props);
+        side[i].hash = 2166136261;
+        side[i].out = mock_packet_new(side[i].dev, USB_TOKEN_OUT, 3, side[i].cmd, sizeof(side[i].cmd));
+        side[i].in = mock_packet_new(side[i].dev, USB_TOKEN_IN, 3, side[i].resp, sizeof(side[i].resp));
+        CHECK_EQ(mock_set_interface(side[i].dev, 0, 2), 0);
+        CHECK_EQ(mock_prop_set(side[i].dev, "reset_stats", "true", NULL), true);
+    }
+    for (int t = 0; t < 1000; t++) {
+        for (int i = 0; i < 2; i++) {
+            mig_cmd_submit(&side[i], t);
+        }
+        if (t == 505) {
+            a = stats(mig->dev);
+            CHECK_EQ(cmd_stat(a, "outstanding") > 1, true);
+            CHECK_EQ(mock_packet_pending(mig->out), true);
+            g_free(a);
+            src = mig->dev;
+            state = mock_vmstate_save(src, &len);
+            mig->dev = mock_device_new("usb-dusb", props, NULL);
+            CHECK_EQ(mock_vmstate_load(mig->dev, state, len), 0);
+            free(state);
+
+            mock_packet_cancel(mig->out);
+            mock_packet_free(mig->out);
+            mock_packet_cancel(mig->in);
+            mock_packet_free(mig->in);
+            mock_device_free(src);
+            mig->out = mock_packet_new(mig->dev, USB_TOKEN_OUT, 3, mig->cmd, sizeof(mig->cmd));
+            mig->in = mock_packet_new(mig->dev, USB_TOKEN_IN, 3, mig->resp, sizeof(mig->resp));
+            mock_packet_submit(mig->dev, mig->out);
+            CHECK_EQ(mock_packet_pending(mig->out), true);
+            if (mig->in_busy) {
+                mig->in_busy = false;
+                mig_cmd_read(mig, true);
+            }
+        }
+        mock_clock_advance(100 * SCALE_US);
+    }
+    for (int t = 0; t < 100; t++) {
+        for (int i = 0; i < 2; i++) {
+            mig_cmd_read(&side[i], true);
+        }
+        mock_clock_advance(100 * SCALE_US);
+    }
+
+    a = stats(ref->dev);
+    b = stats(mig->dev);
+    CHECK_EQ(strcmp(b, a), 0);
+    CHECK_EQ(cmd_stat(b, "commands"), mig->tag);
+    CHECK_EQ(cmd_stat(b, "responses"), mig->tag);
+    CHECK_EQ(cmd_stat(b, "outstanding"), 0);
+    CHECK_EQ(cmd_stat(b, "rejected"), 0);
+    CHECK_EQ(mig->bytes, (uint64_t)mig->tag * (32 + MIG_CMD_READ_LEN));
+    CHECK_EQ(mig->hash, ref->hash);
+    g_free(a);
+    g_free(b);
+
+    for (int i = 0; i < 2; i++) {
+        mock_packet_cancel(side[i].in);
+        mock_packet_free(side[i].out);
+        mock_packet_free(side[i].in);
+        mock_device_free(side[i].dev);
+    }
+}
+
+#define OFFLOAD_LEN 4096
+
+/*
+ * Offloaded commands on the harness's thread pool: CRC32C and COMPRESS
+ * results are checked against zlib and crc32c, and SHA256 fails cleanly
+ * because the harness has no hash backend.
+ */
+static void test_offload(void) {
+    static const char *const props[] = { "cmd_engine=on", NULL };
+    static const uint8_t opcodes[] = { 3, 5, 4 }; /* DUSB_CMD_CRC32C, DUSB_CMD_COMPRESS, DUSB_CMD_SHA256 */
+    USBDevice *dev = stats_device(props);
+    uint8_t *cmd = malloc(16 + OFFLOAD_LEN), *resp = malloc(64 * 1024), *data = cmd + 16;
+    uint8_t *inflated = malloc(OFFLOAD_LEN);
+    USBPacket *out = mock_packet_new(dev, USB_TOKEN_OUT, 3, cmd, 16 + OFFLOAD_LEN);
+    USBPacket *in = mock_packet_new(dev, USB_TOKEN_IN, 3, resp, 64 * 1024);
+    uLongf inflated_len = OFFLOAD_LEN;
+    char *json;
+
+    CHECK_EQ(mock_set_interface(dev, 0, 2), 0);
+    for (int i = 0; i < OFFLOAD_LEN; i++) {
+        data[i] = "offload "[i % 8];
+    }
+    for (int i = 0; i < ARRAY_SIZE(opcodes); i++) {
+        memset(cmd, 0, 16);
+        cmd[0] = opcodes[i];
+        stl_le_p(cmd + 4, opcodes[i]);
+        stl_le_p(cmd + 8, OFFLOAD_LEN);
+        CHECK_EQ(mock_packet_run(dev, out, SCALE_MS), USB_RET_SUCCESS);
+    }
+    for (int i = 0; i < ARRAY_SIZE(opcodes); i++) {
+        CHECK_EQ(mock_packet_run(dev, in, SCALE_MS), USB_RET_SUCCESS);
+        CHECK_EQ(in->actual_length, 32 + ldl_le_p(resp + 8));
+        CHECK_EQ(ldl_le_p(resp + 4), resp[0]);
+        switch (resp[0]) {
+            case 3:
+                CHECK_EQ(resp[1], 0);
+                CHECK_EQ(ldl_le_p(resp + 12), crc32c(0xffffffff, data, OFFLOAD_LEN));
+                break;
+            case 5:
+                CHECK_EQ(resp[1], 0);
+                CHECK_EQ(ldl_le_p(resp + 12), OFFLOAD_LEN);
+                CHECK_EQ(uncompress(inflated, &inflated_len, resp + 32, ldl_le_p(resp + 8)), Z_OK);
+                CHECK_EQ(inflated_len, OFFLOAD_LEN);
+                CHECK_EQ(memcmp(inflated, data, OFFLOAD_LEN), 0);
+                break;
+            default:
+                CHECK_EQ(resp[0], 4);
+                CHECK_EQ(resp[1], 3); /* DUSB_CMD_FAILED */
+                break;
+        }
+    }
+
+    json = stats(dev);
+    CHECK_EQ(cmd_stat(json, "responses"), 3);
+    CHECK_EQ(cmd_stat(json, "jobs"), 3);
+    CHECK_EQ(cmd_stat(json, "failed"), 1);
+    CHECK_EQ(cmd_stat(json, "in_flight"), 0);
+    CHECK_EQ(cmd_stat(json, "bytes"), 3 * OFFLOAD_LEN);
+    g_free(json);
+
+    mock_packet_free(out);
+    mock_packet_free(in);
+    mock_device_free(dev);
+    free(cmd);
+    free(resp);
+    free(inflated);
+}
+
+int main(void) {
+    test_out_rate();
+    test_in_latency();
+    test_in_pipelined();
+    test_seed_digest();
+    test_migration();
+    test_migration_cmd();
+    test_offload();
+    printf("dusb-stats-test: %d checks, %d failed\n", checks, failures);
+    return failures ? 1 : 0;
+}
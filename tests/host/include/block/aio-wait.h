@@ -0,0 +1,13 @@
+/* Host harness stand-in for block/aio-wait.h: waiting runs the queued pool jobs */
+#ifndef MOCK_AIO_WAIT_H
+#define MOCK_AIO_WAIT_H
+
+bool mock_thread_pool_poll(void);
+
+#define AIO_WAIT_WHILE_UNLOCKED(ctx, cond) do {         \
+        while ((cond) && mock_thread_pool_poll()) {     \
+        }                                               \
+        assert(!(cond));                                \
+    } while (0)
+
+#endif
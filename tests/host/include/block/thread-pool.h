@@ -0,0 +1,16 @@
+/*
+ * Host harness stand-in for block/thread-pool.h
+ *
+ * Jobs are queued and run on the calling thread, with their completion,
+ * the next time the harness polls the pool (every clock step).
+ */
+#ifndef MOCK_THREAD_POOL_H
+#define MOCK_THREAD_POOL_H
+
+typedef struct BlockAIOCB BlockAIOCB;
+typedef void BlockCompletionFunc(void *opaque, int ret);
+typedef int ThreadPoolFunc(void *opaque);
+
+BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg, BlockCompletionFunc *cb, void *opaque);
+
+#endif
@@ -0,0 +1,35 @@
+/* Host harness stand-in for chardev/char-fe.h: there is never a backend connected */
+#ifndef MOCK_CHAR_FE_H
+#define MOCK_CHAR_FE_H
+
+typedef enum {
+    CHR_EVENT_BREAK,
+    CHR_EVENT_OPENED,
+    CHR_EVENT_MUX_IN,
+    CHR_EVENT_MUX_OUT,
+    CHR_EVENT_CLOSED,
+} QEMUChrEvent;
+
+typedef struct Chardev Chardev;
+typedef struct GMainContext GMainContext;
+
+typedef struct CharBackend {
+    Chardev *chr;
+} CharBackend;
+
+typedef int IOCanReadHandler(void *opaque);
+typedef void IOReadHandler(void *opaque, const uint8_t *buf, int size);
+typedef void IOEventHandler(void *opaque, QEMUChrEvent event);
+typedef int BackendChangeHandler(void *opaque);
+typedef gboolean (*FEWatchFunc)(void *do_not_use, GIOCondition condition, void *data);
+
+bool qemu_chr_fe_backend_connected(CharBackend *be);
+void qemu_chr_fe_set_handlers(CharBackend *b, IOCanReadHandler *fd_can_read, IOReadHandler *fd_read,
+                              IOEventHandler *fd_event, BackendChangeHandler *be_change, void *opaque,
+                              GMainContext *context, bool set_open);
+int qemu_chr_fe_write(CharBackend *be, const uint8_t *buf, int len);
+guint qemu_chr_fe_add_watch(CharBackend *be, GIOCondition cond, FEWatchFunc func, void *user_data);
+void qemu_chr_fe_disconnect(CharBackend *be);
+void qemu_chr_fe_deinit(CharBackend *b, bool del);
+
+#endif
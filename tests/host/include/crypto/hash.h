@@ -0,0 +1,15 @@
+/* Host harness stand-in for crypto/hash.h; the harness has no hash backend */
+#ifndef MOCK_CRYPTO_HASH_H
+#define MOCK_CRYPTO_HASH_H
+
+typedef enum {
+    QCRYPTO_HASH_ALGO_MD5,
+    QCRYPTO_HASH_ALGO_SHA1,
+    QCRYPTO_HASH_ALGO_SHA224,
+    QCRYPTO_HASH_ALGO_SHA256,
+} QCryptoHashAlgo;
+
+int qcrypto_hash_bytes(QCryptoHashAlgo alg, const char *buf, size_t len, uint8_t **result, size_t *resultlen,
+                       Error **errp);
+
+#endif
@@ -0,0 +1,34 @@
+/* Host harness stand-in for hw/qdev-core.h */
+#ifndef MOCK_QDEV_CORE_H
+#define MOCK_QDEV_CORE_H
+
+#include "qemu/bitops.h"
+#include "qom/object.h"
+
+typedef struct VMStateDescription VMStateDescription;
+
+enum {
+    DEVICE_CATEGORY_USB,
+    DEVICE_CATEGORY_MISC,
+    DEVICE_CATEGORY_MAX,
+};
+
+typedef struct DeviceState {
+    Object parent_obj;
+    char *id;
+    bool realized;
+} DeviceState;
+
+typedef struct DeviceClass {
+    ObjectClass parent_class;
+    unsigned long categories[BITS_TO_LONGS(DEVICE_CATEGORY_MAX)];
+    const VMStateDescription *vmsd;
+} DeviceClass;
+
+#define DEVICE(obj) ((DeviceState *)(obj))
+#define DEVICE_CLASS(klass) ((DeviceClass *)(klass))
+
+void device_class_set_props_n(DeviceClass *dc, const Property *props, size_t n);
+#define device_class_set_props(dc, props) device_class_set_props_n((dc), (props), ARRAY_SIZE(props))
+
+#endif
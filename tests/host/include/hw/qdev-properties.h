@@ -0,0 +1,36 @@
+/* Host harness stand-in for hw/qdev-properties.h: defaults are applied before instance_init */
+#ifndef MOCK_QDEV_PROPERTIES_H
+#define MOCK_QDEV_PROPERTIES_H
+
+#include "hw/qdev-core.h"
+
+typedef enum {
+    MOCK_PROP_BOOL,
+    MOCK_PROP_UINT8,
+    MOCK_PROP_UINT32,
+    MOCK_PROP_STRING,
+    MOCK_PROP_CHR,
+} MockPropKind;
+
+struct Property {
+    const char *name;
+    MockPropKind kind;
+    size_t offset;
+    uint64_t defval;
+};
+
+#define MOCK_PROP(_name, _state, _field, _kind, _type, _def) {         \
+        .name = (_name),                                                \
+        .kind = (_kind),                                                \
+        .offset = offsetof(_state, _field) +                            \
+                  0 * sizeof(*(_type *)0 = ((_state *)0)->_field),      \
+        .defval = (_def),                                               \
+    }
+
+#define DEFINE_PROP_BOOL(n, s, f, d) MOCK_PROP(n, s, f, MOCK_PROP_BOOL, bool, d)
+#define DEFINE_PROP_UINT8(n, s, f, d) MOCK_PROP(n, s, f, MOCK_PROP_UINT8, uint8_t, d)
+#define DEFINE_PROP_UINT32(n, s, f, d) MOCK_PROP(n, s, f, MOCK_PROP_UINT32, uint32_t, d)
+#define DEFINE_PROP_STRING(n, s, f) MOCK_PROP(n, s, f, MOCK_PROP_STRING, char *, 0)
+#define DEFINE_PROP_CHR(n, s, f) MOCK_PROP(n, s, f, MOCK_PROP_CHR, CharBackend, 0)
+
+#endif
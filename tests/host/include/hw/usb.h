@@ -0,0 +1,231 @@
+/*
+ * Host harness stand-in for hw/usb.h
+ *
+ * The USB core structures with the fields dusb.c and mock.c touch, and
+ * the core entry points mock.c implements.
+ */
+#ifndef MOCK_USB_H
+#define MOCK_USB_H
+
+#include "hw/qdev-core.h"
+#include "qemu/iov.h"
+#include "qemu/queue.h"
+
+#define USB_TOKEN_SETUP 0x2d
+#define USB_TOKEN_IN    0x69
+#define USB_TOKEN_OUT   0xe1
+
+#define USB_RET_SUCCESS           (0)
+#define USB_RET_NODEV             (-1)
+#define USB_RET_NAK               (-2)
+#define USB_RET_STALL             (-3)
+#define USB_RET_BABBLE            (-4)
+#define USB_RET_IOERROR           (-5)
+#define USB_RET_ASYNC             (-6)
+#define USB_RET_ADD_TO_QUEUE      (-7)
+#define USB_RET_REMOVE_FROM_QUEUE (-8)
+
+#define USB_SPEED_LOW   0
+#define USB_SPEED_FULL  1
+#define USB_SPEED_HIGH  2
+#define USB_SPEED_SUPER 3
+
+#define USB_SPEED_MASK_LOW   (1 << USB_SPEED_LOW)
+#define USB_SPEED_MASK_FULL  (1 << USB_SPEED_FULL)
+#define USB_SPEED_MASK_HIGH  (1 << USB_SPEED_HIGH)
+#define USB_SPEED_MASK_SUPER (1 << USB_SPEED_SUPER)
+
+#define USB_DIR_OUT 0
+#define USB_DIR_IN  0x80
+
+#define USB_TYPE_MASK     (0x03 << 5)
+#define USB_TYPE_STANDARD (0x00 << 5)
+#define USB_TYPE_CLASS    (0x01 << 5)
+#define USB_TYPE_VENDOR   (0x02 << 5)
+
+#define USB_RECIP_MASK      0x1f
+#define USB_RECIP_DEVICE    0x00
+#define USB_RECIP_INTERFACE 0x01
+#define USB_RECIP_ENDPOINT  0x02
+
+#define DeviceRequest      ((USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_DEVICE) << 8)
+#define DeviceOutRequest   ((USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_DEVICE) << 8)
+#define InterfaceRequest   ((USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_INTERFACE) << 8)
+#define InterfaceOutRequest ((USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_INTERFACE) << 8)
+#define EndpointRequest    ((USB_DIR_IN | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT) << 8)
+#define EndpointOutRequest ((USB_DIR_OUT | USB_TYPE_STANDARD | USB_RECIP_ENDPOINT) << 8)
+#define VendorDeviceRequest ((USB_DIR_IN | USB_TYPE_VENDOR | USB_RECIP_DEVICE) << 8)
+#define VendorDeviceOutRequest ((USB_DIR_OUT | USB_TYPE_VENDOR | USB_RECIP_DEVICE) << 8)
+
+#define USB_REQ_GET_STATUS        0x00
+#define USB_REQ_CLEAR_FEATURE     0x01
+#define USB_REQ_SET_FEATURE       0x03
+#define USB_REQ_SET_ADDRESS       0x05
+#define USB_REQ_GET_DESCRIPTOR    0x06
+#define USB_REQ_GET_CONFIGURATION 0x08
+#define USB_REQ_SET_CONFIGURATION 0x09
+#define USB_REQ_GET_INTERFACE     0x0A
+#define USB_REQ_SET_INTERFACE     0x0B
+#define USB_REQ_SET_SEL           0x30
+#define USB_REQ_SET_ISOCH_DELAY   0x31
+
+#define USB_DEVICE_SELF_POWERED  0
+#define USB_DEVICE_REMOTE_WAKEUP 1
+
+#define USB_DT_DEVICE            0x01
+#define USB_DT_CONFIG            0x02
+#define USB_DT_STRING            0x03
+#define USB_DT_INTERFACE         0x04
+#define USB_DT_ENDPOINT          0x05
+#define USB_DT_BOS               0x0F
+#define USB_DT_DEVICE_CAPABILITY 0x10
+
+#define USB_DEV_CAP_USB2_EXT   0x02
+#define USB_DEV_CAP_SUPERSPEED 0x03
+
+#define USB_CFG_ATT_ONE       (1 << 7)
+#define USB_CFG_ATT_SELFPOWER (1 << 6)
+#define USB_CFG_ATT_WAKEUP    (1 << 5)
+
+#define USB_ENDPOINT_XFER_CONTROL 0
+#define USB_ENDPOINT_XFER_ISOC    1
+#define USB_ENDPOINT_XFER_BULK    2
+#define USB_ENDPOINT_XFER_INT     3
+#define USB_ENDPOINT_XFER_INVALID 255
+
+#define USB_MAX_ENDPOINTS  15
+#define USB_MAX_INTERFACES 16
+
+typedef struct USBPort USBPort;
+typedef struct USBDevice USBDevice;
+typedef struct USBPacket USBPacket;
+typedef struct USBCombinedPacket USBCombinedPacket;
+typedef struct USBEndpoint USBEndpoint;
+typedef struct USBDesc USBDesc;
+typedef struct USBDescID USBDescID;
+typedef struct USBDescDevice USBDescDevice;
+typedef struct USBDescConfig USBDescConfig;
+typedef struct USBDescIfaceAssoc USBDescIfaceAssoc;
+typedef struct USBDescIface USBDescIface;
+typedef struct USBDescEndpoint USBDescEndpoint;
+typedef struct USBDescOther USBDescOther;
+typedef struct USBDescMSOS USBDescMSOS;
+
+struct USBEndpoint {
+    uint8_t nr;
+    uint8_t pid;
+    uint8_t type;
+    uint8_t ifnum;
+    int max_packet_size;
+    int max_streams;
+    bool pipeline;
+    bool halted;
+    USBDevice *dev;
+    QTAILQ_HEAD(, USBPacket) queue;
+};
+
+struct USBDevice {
+    DeviceState qdev;
+    USBPort *port;
+    int speed;
+    int speedmask;
+    uint8_t addr;
+    bool attached;
+    int32_t remote_wakeup;
+    uint8_t data_buf[4096];    /* Control data stage, as in QEMU */
+    USBEndpoint ep_ctl;
+    USBEndpoint ep_in[USB_MAX_ENDPOINTS];
+    USBEndpoint ep_out[USB_MAX_ENDPOINTS];
+    const USBDesc *usb_desc;
+    const USBDescDevice *device;
+    int configuration;
+    int ninterfaces;
+    int altsetting[USB_MAX_INTERFACES];
+    const USBDescConfig *config;
+    const USBDescIface *ifaces[USB_MAX_INTERFACES];
+};
+
+typedef struct USBDeviceClass {
+    DeviceClass parent_class;
+    void (*realize)(USBDevice *dev, Error **errp);
+    void (*unrealize)(USBDevice *dev);
+    void (*cancel_packet)(USBDevice *dev, USBPacket *p);
+    void (*handle_attach)(USBDevice *dev);
+    void (*handle_reset)(USBDevice *dev);
+    void (*handle_control)(USBDevice *dev, USBPacket *p, int request, int value, int index, int length,
+                           uint8_t *data);
+    void (*handle_data)(USBDevice *dev, USBPacket *p);
+    void (*set_interface)(USBDevice *dev, int interface, int alt_old, int alt_new);
+    void (*flush_ep_queue)(USBDevice *dev, USBEndpoint *ep);
+    const char *product_desc;
+    const USBDesc *usb_desc;
+} USBDeviceClass;
+
+#define USB_DEVICE(obj) ((USBDevice *)(obj))
+#define USB_DEVICE_CLASS(klass) ((USBDeviceClass *)(klass))
+#define USB_DEVICE_GET_CLASS(obj) USB_DEVICE_CLASS(OBJECT(obj)->klass)
+#define TYPE_USB_DEVICE "usb-device"
+
+typedef struct USBPortOps {
+    void (*wakeup)(USBPort *port);
+    void (*complete)(USBPort *port, USBPacket *p);
+} USBPortOps;
+
+struct USBPort {
+    USBDevice *dev;
+    int speedmask;
+    USBPortOps *ops;
+};
+
+typedef enum USBPacketState {
+    USB_PACKET_UNDEFINED = 0,
+    USB_PACKET_SETUP,
+    USB_PACKET_QUEUED,
+    USB_PACKET_ASYNC,
+    USB_PACKET_COMPLETE,
+    USB_PACKET_CANCELED,
+} USBPacketState;
+
+struct USBPacket {
+    int pid;
+    uint64_t id;
+    USBEndpoint *ep;
+    unsigned int stream;
+    QEMUIOVector iov;
+    bool short_not_ok;
+    bool int_req;
+    int status;
+    int actual_length;
+    USBPacketState state;
+    USBCombinedPacket *combined;
+    QTAILQ_ENTRY(USBPacket) queue;
+};
+
+/* Never built by the harness, whose core does not combine queued packets */
+struct USBCombinedPacket {
+    USBPacket *first;
+    QEMUIOVector iov;
+};
+
+void usb_packet_init(USBPacket *p);
+void usb_packet_setup(USBPacket *p, int pid, USBEndpoint *ep, unsigned int stream, uint64_t id, bool short_not_ok,
+                      bool int_req);
+void usb_packet_addbuf(USBPacket *p, void *ptr, size_t len);
+void usb_packet_copy(USBPacket *p, void *ptr, size_t bytes);
+void usb_packet_cleanup(USBPacket *p);
+void usb_packet_complete(USBDevice *dev, USBPacket *p);
+void usb_generic_async_ctrl_complete(USBDevice *s, USBPacket *p);
+void usb_ep_combine_input_packets(USBEndpoint *ep);
+void usb_combined_input_packet_complete(USBDevice *dev, USBPacket *p);
+
+USBEndpoint *usb_ep_get(USBDevice *dev, int pid, int ep);
+void usb_ep_init(USBDevice *dev);
+void usb_ep_reset(USBDevice *dev);
+void usb_wakeup(USBEndpoint *ep, unsigned int stream);
+
+#include "migration/vmstate.h"
+
+extern const VMStateDescription vmstate_usb_device;
+#define VMSTATE_USB_DEVICE(_field, _state) VMSTATE_STRUCT(_field, _state, 1, vmstate_usb_device, USBDevice)
+
+#endif
@@ -0,0 +1,101 @@
+/*
+ * Host harness stand-in for hw/usb/desc.h
+ *
+ * dusb.c includes it as "../desc.h"; the Makefile copies dusb.c to
+ * build/hw/usb/dusb/ and this file to build/hw/usb/ to match.
+ */
+#ifndef MOCK_USB_DESC_H
+#define MOCK_USB_DESC_H
+
+#include "hw/usb.h"
+
+struct USBDescID {
+    uint16_t idVendor;
+    uint16_t idProduct;
+    uint16_t bcdDevice;
+    uint8_t iManufacturer;
+    uint8_t iProduct;
+    uint8_t iSerialNumber;
+};
+
+struct USBDescDevice {
+    uint16_t bcdUSB;
+    uint8_t bDeviceClass;
+    uint8_t bDeviceSubClass;
+    uint8_t bDeviceProtocol;
+    uint8_t bMaxPacketSize0;
+    uint8_t bNumConfigurations;
+    const USBDescConfig *confs;
+};
+
+struct USBDescConfig {
+    uint8_t bNumInterfaces;
+    uint8_t bConfigurationValue;
+    uint8_t iConfiguration;
+    uint8_t bmAttributes;
+    uint8_t bMaxPower;
+    uint8_t nif_groups;
+    const USBDescIfaceAssoc *if_groups;
+    uint8_t nif;
+    const USBDescIface *ifs;
+};
+
+struct USBDescIfaceAssoc {
+    uint8_t bFirstInterface;
+    uint8_t bInterfaceCount;
+    uint8_t bFunctionClass;
+    uint8_t bFunctionSubClass;
+    uint8_t bFunctionProtocol;
+    uint8_t iFunction;
+    uint8_t nif;
+    const USBDescIface *ifs;
+};
+
+struct USBDescIface {
+    uint8_t bInterfaceNumber;
+    uint8_t bAlternateSetting;
+    uint8_t bNumEndpoints;
+    uint8_t bInterfaceClass;
+    uint8_t bInterfaceSubClass;
+    uint8_t bInterfaceProtocol;
+    uint8_t iInterface;
+    uint8_t ndesc;
+    USBDescOther *descs;
+    USBDescEndpoint *eps;
+};
+
+struct USBDescEndpoint {
+    uint8_t bEndpointAddress;
+    uint8_t bmAttributes;
+    uint16_t wMaxPacketSize;
+    uint8_t bInterval;
+    uint8_t bRefresh;
+    uint8_t bSynchAddress;
+    uint8_t is_audio;
+    uint8_t *extra;
+    uint8_t bMaxBurst;
+    uint8_t bmAttributes_super;
+    uint16_t wBytesPerInterval;
+};
+
+struct USBDescOther {
+    uint8_t length;
+    const uint8_t *data;
+};
+
+struct USBDesc {
+    USBDescID id;
+    const USBDescDevice *full;
+    const USBDescDevice *high;
+    const USBDescDevice *super;
+    const char *const *str;
+    const USBDescMSOS *msos;
+};
+
+void usb_desc_init(USBDevice *dev);
+void usb_desc_attach(USBDevice *dev);
+void usb_desc_create_serial(USBDevice *dev);
+int usb_desc_handle_control(USBDevice *dev, USBPacket *p, int request, int value, int index, int length,
+                            uint8_t *data);
+
+#endif
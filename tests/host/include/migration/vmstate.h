@@ -0,0 +1,102 @@
+/*
+ * Host harness stand-in for migration/vmstate.h
+ *
+ * Field descriptions carry what mock.c needs to save and load them:
+ * plain memory, buffers behind a pointer, nested descriptions, timers and
+ * validators. As in QEMU, a field whose C type does not match its macro
+ * fails to compile.
+ */
+#ifndef MOCK_VMSTATE_H
+#define MOCK_VMSTATE_H
+
+#include "qemu/timer.h"
+
+typedef enum MockVMStateKind {
+    MOCK_VMS_DATA,             /* size bytes in place */
+    MOCK_VMS_VBUFFER,          /* uint8_t * of the uint32_t length at len_offset */
+    MOCK_VMS_VBUFFER_ALLOC,    /* Same, allocated on load */
+    MOCK_VMS_STRUCT,           /* num structs of size bytes in place */
+    MOCK_VMS_VARRAY_ALLOC,     /* Pointer to int32_t-counted structs at len_offset, allocated on load */
+    MOCK_VMS_TIMER,            /* QEMUTimer *: the pending expiry */
+    MOCK_VMS_VALIDATE,         /* Load fails unless field_exists returns true */
+} MockVMStateKind;
+
+typedef struct VMStateField {
+    const char *name;
+    MockVMStateKind kind;
+    size_t offset;
+    size_t size;
+    size_t num;
+    size_t len_offset;
+    const struct VMStateDescription *vmsd;
+    bool (*field_exists)(void *opaque, int version_id);
+} VMStateField;
+
+struct VMStateDescription {
+    const char *name;
+    int version_id;
+    int minimum_version_id;
+    int (*pre_load)(void *opaque);
+    int (*post_load)(void *opaque, int version_id);
+    int (*pre_save)(void *opaque);
+    bool (*needed)(void *opaque);
+    const VMStateField *fields;
+    const struct VMStateDescription * const *subsections;
+};
+
+/* sizeof(_s::_f), and a compile error unless it is _bytes */
+#define MOCK_VMS_SIZE(_s, _f, _bytes) \
+    ((_bytes) + 0 * sizeof(char[sizeof(((_s *)0)->_f) == (_bytes) ? 1 : -1]))
+#define MOCK_VMS_TYPE_CHECK(_s, _f, _type) \
+    (0 * sizeof((_type *){ &((_s *)0)->_f }))
+
+#define MOCK_VMSTATE_DATA(_f, _s, _type, _n) {                              \
+    .name = #_f, .kind = MOCK_VMS_DATA, .offset = offsetof(_s, _f),        \
+    .size = MOCK_VMS_SIZE(_s, _f, sizeof(_type) * (_n)), .num = 1,         \
+}
+#define MOCK_VMSTATE_SCALAR(_f, _s, _type) {                                \
+    .name = #_f, .kind = MOCK_VMS_DATA, .offset = offsetof(_s, _f),        \
+    .size = sizeof(_type) + MOCK_VMS_TYPE_CHECK(_s, _f, _type), .num = 1,  \
+}
+#define MOCK_VMSTATE_NESTED(_f, _s, _n, _vmsd, _type) {                     \
+    .name = #_f, .kind = MOCK_VMS_STRUCT, .offset = offsetof(_s, _f),      \
+    .size = sizeof(_type), .num = MOCK_VMS_SIZE(_s, _f, sizeof(_type) * (_n)) / sizeof(_type), \
+    .vmsd = &(_vmsd),                                                      \
+}
+
+#define VMSTATE_BOOL(f, s) MOCK_VMSTATE_SCALAR(f, s, bool)
+#define VMSTATE_UINT8(f, s) MOCK_VMSTATE_SCALAR(f, s, uint8_t)
+#define VMSTATE_UINT16(f, s) MOCK_VMSTATE_SCALAR(f, s, uint16_t)
+#define VMSTATE_UINT32(f, s) MOCK_VMSTATE_SCALAR(f, s, uint32_t)
+#define VMSTATE_UINT64(f, s) MOCK_VMSTATE_SCALAR(f, s, uint64_t)
+#define VMSTATE_INT32(f, s) MOCK_VMSTATE_SCALAR(f, s, int32_t)
+#define VMSTATE_INT64(f, s) MOCK_VMSTATE_SCALAR(f, s, int64_t)
+#define VMSTATE_UINT8_ARRAY(f, s, n) MOCK_VMSTATE_DATA(f, s, uint8_t, n)
+#define VMSTATE_UINT16_ARRAY(f, s, n) MOCK_VMSTATE_DATA(f, s, uint16_t, n)
+#define VMSTATE_UINT32_ARRAY(f, s, n) MOCK_VMSTATE_DATA(f, s, uint32_t, n)
+#define VMSTATE_UINT64_ARRAY(f, s, n) MOCK_VMSTATE_DATA(f, s, uint64_t, n)
+#define VMSTATE_INT32_ARRAY(f, s, n) MOCK_VMSTATE_DATA(f, s, int32_t, n)
+#define VMSTATE_INT64_ARRAY(f, s, n) MOCK_VMSTATE_DATA(f, s, int64_t, n)
+#define VMSTATE_UINT8_2DARRAY(f, s, n1, n2) MOCK_VMSTATE_DATA(f, s, uint8_t, (n1) * (n2))
+#define VMSTATE_VBUFFER_UINT32(f, s, v, t, l) {                             \
+    .name = #f, .kind = MOCK_VMS_VBUFFER, .offset = offsetof(s, f) + MOCK_VMS_TYPE_CHECK(s, f, uint8_t *), \
+    .len_offset = offsetof(s, l) + MOCK_VMS_TYPE_CHECK(s, l, uint32_t),    \
+}
+#define VMSTATE_VBUFFER_ALLOC_UINT32(f, s, v, t, l) {                       \
+    .name = #f, .kind = MOCK_VMS_VBUFFER_ALLOC, .offset = offsetof(s, f) + MOCK_VMS_TYPE_CHECK(s, f, uint8_t *), \
+    .len_offset = offsetof(s, l) + MOCK_VMS_TYPE_CHECK(s, l, uint32_t),    \
+}
+#define VMSTATE_STRUCT(f, s, v, d, t) MOCK_VMSTATE_NESTED(f, s, 1, d, t)
+#define VMSTATE_STRUCT_ARRAY(f, s, n, v, d, t) MOCK_VMSTATE_NESTED(f, s, n, d, t)
+#define VMSTATE_STRUCT_2DARRAY(f, s, n1, n2, v, d, t) MOCK_VMSTATE_NESTED(f, s, (n1) * (n2), d, t)
+#define VMSTATE_STRUCT_VARRAY_ALLOC(f, s, n, v, d, t) {                     \
+    .name = #f, .kind = MOCK_VMS_VARRAY_ALLOC, .offset = offsetof(s, f) + MOCK_VMS_TYPE_CHECK(s, f, t *), \
+    .size = sizeof(t), .len_offset = offsetof(s, n) + MOCK_VMS_TYPE_CHECK(s, n, int32_t), .vmsd = &(d), \
+}
+#define VMSTATE_TIMER_PTR(f, s) {                                           \
+    .name = #f, .kind = MOCK_VMS_TIMER, .offset = offsetof(s, f) + MOCK_VMS_TYPE_CHECK(s, f, QEMUTimer *), \
+}
+#define VMSTATE_VALIDATE(n, t) { .name = (n), .kind = MOCK_VMS_VALIDATE, .field_exists = (t) }
+#define VMSTATE_END_OF_LIST() { .name = NULL }
+
+#endif
@@ -0,0 +1,11 @@
+/* Host harness stand-in for qapi/error.h */
+#ifndef MOCK_QAPI_ERROR_H
+#define MOCK_QAPI_ERROR_H
+
+typedef struct Error Error;
+
+void error_setg(Error **errp, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+const char *error_get_pretty(const Error *err);
+void error_free(Error *err);
+
+#endif
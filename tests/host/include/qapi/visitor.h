@@ -0,0 +1,11 @@
+/* Host harness stand-in for qapi/visitor.h: scalar visits over one string value */
+#ifndef MOCK_QAPI_VISITOR_H
+#define MOCK_QAPI_VISITOR_H
+
+#include "qom/object.h"
+
+bool visit_type_bool(Visitor *v, const char *name, bool *obj, Error **errp);
+bool visit_type_uint8(Visitor *v, const char *name, uint8_t *obj, Error **errp);
+bool visit_type_uint32(Visitor *v, const char *name, uint32_t *obj, Error **errp);
+
+#endif
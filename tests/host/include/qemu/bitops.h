@@ -0,0 +1,41 @@
+/* Host harness stand-in for qemu/bitops.h */
+#ifndef MOCK_BITOPS_H
+#define MOCK_BITOPS_H
+
+#define BITS_PER_LONG (sizeof(unsigned long) * CHAR_BIT)
+#define BITS_TO_LONGS(nr) DIV_ROUND_UP(nr, BITS_PER_LONG)
+
+static inline void set_bit(long nr, unsigned long *addr) {
+    addr[nr / BITS_PER_LONG] |= 1UL << (nr % BITS_PER_LONG);
+}
+
+static inline void clear_bit(long nr, unsigned long *addr) {
+    addr[nr / BITS_PER_LONG] &= ~(1UL << (nr % BITS_PER_LONG));
+}
+
+static inline int test_bit(long nr, const unsigned long *addr) {
+    return 1UL & (addr[nr / BITS_PER_LONG] >> (nr % BITS_PER_LONG));
+}
+
+/* Word at a time, as util/bitops.c does, so bitmap scans cost what they do in QEMU */
+static inline unsigned long find_next_bit(const unsigned long *addr, unsigned long size, unsigned long offset) {
+    unsigned long i = offset / BITS_PER_LONG, word;
+
+    if (offset >= size) {
+        return size;
+    }
+    word = addr[i] & (~0UL << (offset % BITS_PER_LONG));
+    while (!word) {
+        if (++i * BITS_PER_LONG >= size) {
+            return size;
+        }
+        word = addr[i];
+    }
+    return MIN(i * BITS_PER_LONG + __builtin_ctzl(word), size);
+}
+
+static inline unsigned long find_first_bit(const unsigned long *addr, unsigned long size) {
+    return find_next_bit(addr, size, 0);
+}
+
+#endif
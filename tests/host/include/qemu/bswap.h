@@ -0,0 +1,19 @@
+/* Host harness stand-in for qemu/bswap.h; the harness only runs on little-endian hosts */
+#ifndef MOCK_BSWAP_H
+#define MOCK_BSWAP_H
+
+QEMU_BUILD_BUG_ON(__BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__);
+
+static inline uint16_t cpu_to_le16(uint16_t v) { return v; }
+static inline uint32_t cpu_to_le32(uint32_t v) { return v; }
+static inline uint64_t cpu_to_le64(uint64_t v) { return v; }
+static inline uint16_t le16_to_cpu(uint16_t v) { return v; }
+static inline uint32_t le32_to_cpu(uint32_t v) { return v; }
+static inline uint64_t le64_to_cpu(uint64_t v) { return v; }
+
+static inline int lduw_le_p(const void *p) { uint16_t v; memcpy(&v, p, 2); return v; }
+static inline int ldl_le_p(const void *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+static inline void stw_le_p(void *p, uint16_t v) { memcpy(p, &v, 2); }
+static inline void stl_le_p(void *p, uint32_t v) { memcpy(p, &v, 4); }
+
+#endif
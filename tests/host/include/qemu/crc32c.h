@@ -0,0 +1,7 @@
+/* Host harness stand-in for qemu/crc32c.h */
+#ifndef MOCK_CRC32C_H
+#define MOCK_CRC32C_H
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length);
+
+#endif
@@ -0,0 +1,13 @@
+/* Host harness stand-in for qemu/host-utils.h */
+#ifndef MOCK_HOST_UTILS_H
+#define MOCK_HOST_UTILS_H
+
+static inline int clz64(uint64_t v) {
+    return v ? __builtin_clzll(v) : 64;
+}
+
+static inline uint64_t muldiv64(uint64_t a, uint32_t b, uint32_t c) {
+    return (uint64_t)(((unsigned __int128)a * b) / c);
+}
+
+#endif
@@ -0,0 +1,15 @@
+/* Host harness stand-in for qemu/iov.h */
+#ifndef MOCK_IOV_H
+#define MOCK_IOV_H
+
+typedef struct QEMUIOVector {
+    struct iovec *iov;
+    int niov;
+    int nalloc;
+    size_t size;
+} QEMUIOVector;
+
+size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt, size_t offset, const void *buf, size_t bytes);
+size_t iov_to_buf(const struct iovec *iov, unsigned int iov_cnt, size_t offset, void *buf, size_t bytes);
+
+#endif
@@ -0,0 +1,9 @@
+/* Host harness stand-in for qemu/log.h; messages go to stderr when DUSB_HARNESS_LOG is set */
+#ifndef MOCK_LOG_H
+#define MOCK_LOG_H
+
+/* Like QEMU without a log file: arguments are evaluated, nothing is formatted */
+void qemu_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+bool qemu_log_enabled(void);
+
+#endif
@@ -0,0 +1,8 @@
+/* Host harness stand-in for qemu/module.h: types register before main() */
+#ifndef MOCK_MODULE_H
+#define MOCK_MODULE_H
+
+#define type_init(function) \
+    static void __attribute__((constructor)) do_qemu_init_ ## function(void) { function(); }
+
+#endif
@@ -0,0 +1,126 @@
+/*
+ * Host harness stand-in for QEMU's osdep.h
+ *
+ * Just enough of glib and of QEMU's utility headers to compile dusb.c
+ * outside a QEMU tree. The glib subset is implemented in mock.c on top of
+ * the C library, so every allocation the device makes can be counted.
+ */
+#ifndef MOCK_OSDEP_H
+#define MOCK_OSDEP_H
+
+#include <assert.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/* glib subset */
+typedef char gchar;
+typedef int gboolean;
+typedef void *gpointer;
+typedef unsigned int guint;
+typedef int gint;
+typedef size_t gsize;
+typedef ssize_t gssize;
+typedef uint8_t guint8;
+typedef uint16_t guint16;
+typedef uint32_t guint32;
+typedef uint64_t guint64;
+typedef int64_t gint64;
+
+#define TRUE 1
+#define FALSE 0
+#define G_SOURCE_REMOVE FALSE
+#define G_SOURCE_CONTINUE TRUE
+
+typedef enum { G_IO_IN = 1, G_IO_OUT = 4, G_IO_HUP = 16 } GIOCondition;
+
+#define GINT_TO_POINTER(i) ((gpointer)(intptr_t)(i))
+#define GPOINTER_TO_INT(p) ((gint)(intptr_t)(p))
+#define GSIZE_TO_POINTER(s) ((gpointer)(uintptr_t)(s))
+#define GPOINTER_TO_SIZE(p) ((gsize)(uintptr_t)(p))
+
+typedef struct GString {
+    gchar *str;
+    gsize len;
+    gsize allocated_len;
+} GString;
+
+typedef struct GPtrArray {
+    gpointer *pdata;
+    guint len;
+} GPtrArray;
+
+gpointer g_malloc(gsize n);
+gpointer g_malloc0(gsize n);
+gpointer g_realloc(gpointer p, gsize n);
+void g_free(gpointer p);
+gpointer g_memdup2(const void *mem, gsize n);
+gchar *g_strdup(const gchar *s);
+gchar *g_strdup_printf(const gchar *fmt, ...) __attribute__((format(printf, 1, 2)));
+gchar **g_strsplit(const gchar *s, const gchar *delim, gint max_tokens);
+void g_strfreev(gchar **v);
+gboolean g_str_has_prefix(const gchar *s, const gchar *prefix);
+guint64 g_ascii_strtoull(const gchar *s, gchar **end, guint base);
+gboolean g_source_remove(guint tag);
+
+GString *g_string_new(const gchar *init);
+GString *g_string_sized_new(gsize n);
+gchar *g_string_free(GString *s, gboolean free_segment);
+void g_string_append(GString *s, const gchar *val);
+void g_string_append_c(GString *s, gchar c);
+void g_string_append_len(GString *s, const gchar *val, gssize len);
+void g_string_append_printf(GString *s, const gchar *fmt, ...) __attribute__((format(printf, 2, 3)));
+void g_string_truncate(GString *s, gsize len);
+
+GPtrArray *g_ptr_array_new_with_free_func(void (*free_func)(gpointer));
+void g_ptr_array_add(GPtrArray *a, gpointer p);
+gpointer *g_ptr_array_free(GPtrArray *a, gboolean free_segment);
+
+#define g_new(T, n) ((T *)g_malloc(sizeof(T) * (n)))
+#define g_new0(T, n) ((T *)g_malloc0(sizeof(T) * (n)))
+
+static inline void g_autoptr_cleanup_generic_gfree(void *p) {
+    g_free(*(void **)p);
+}
+#define g_autofree __attribute__((cleanup(g_autoptr_cleanup_generic_gfree)))
+
+/* QEMU compiler and arithmetic helpers */
+#define QEMU_PACKED __attribute__((packed))
+#define QEMU_BUILD_BUG_ON(x) _Static_assert(!(x), "not expecting: " #x)
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define QEMU_ALIGN_DOWN(n, m) ((n) / (m) * (m))
+#define QEMU_ALIGN_UP(n, m) QEMU_ALIGN_DOWN((n) + (m) - 1, (m))
+#define ROUND_UP(n, d) (((n) + (d) - 1) & -(0 ? (n) : (d)))
+
+#define KiB (INT64_C(1) << 10)
+#define MiB (INT64_C(1) << 20)
+
+void *qemu_memalign(size_t alignment, size_t size);
+void qemu_vfree(void *ptr);
+#define qemu_real_host_page_size() ((uintptr_t)4096)
+
+#include "qapi/error.h"
+
+#endif
@@ -0,0 +1,54 @@
+/*
+ * Host harness stand-in for qemu/timer.h
+ *
+ * QEMU_CLOCK_VIRTUAL is a fake clock that only moves when the harness
+ * advances it (mock_clock_advance), firing the timers that fall due in
+ * deadline order. get_clock() and cpu_get_host_ticks() read the host.
+ */
+#ifndef MOCK_TIMER_H
+#define MOCK_TIMER_H
+
+typedef enum {
+    QEMU_CLOCK_REALTIME,
+    QEMU_CLOCK_VIRTUAL,
+    QEMU_CLOCK_HOST,
+    QEMU_CLOCK_VIRTUAL_RT,
+} QEMUClockType;
+
+#define SCALE_MS 1000000
+#define SCALE_US 1000
+#define SCALE_NS 1
+#define NANOSECONDS_PER_SECOND 1000000000LL
+
+typedef void QEMUTimerCB(void *opaque);
+
+typedef struct QEMUTimer {
+    int64_t expire_time;       /* In ns, -1 while not pending */
+    int scale;
+    QEMUTimerCB *cb;
+    void *opaque;
+    struct QEMUTimer *next;    /* All timers, for the dispatcher */
+    struct QEMUTimer **prev;
+} QEMUTimer;
+
+QEMUTimer *timer_new(QEMUClockType type, int scale, QEMUTimerCB *cb, void *opaque);
+void timer_mod(QEMUTimer *ts, int64_t expire_time);
+void timer_del(QEMUTimer *ts);
+void timer_free(QEMUTimer *ts);
+int64_t qemu_clock_get_ns(QEMUClockType type);
+int64_t get_clock(void);
+int64_t cpu_get_host_ticks(void);
+
+static inline QEMUTimer *timer_new_ns(QEMUClockType type, QEMUTimerCB *cb, void *opaque) {
+    return timer_new(type, SCALE_NS, cb, opaque);
+}
+
+static inline QEMUTimer *timer_new_ms(QEMUClockType type, QEMUTimerCB *cb, void *opaque) {
+    return timer_new(type, SCALE_MS, cb, opaque);
+}
+
+static inline int64_t qemu_clock_get_ms(QEMUClockType type) {
+    return qemu_clock_get_ns(type) / SCALE_MS;
+}
+
+#endif
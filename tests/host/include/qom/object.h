@@ -0,0 +1,75 @@
+/*
+ * Host harness stand-in for qom/object.h
+ *
+ * One level of types: a registered TypeInfo gets a class struct of
+ * MOCK_CLASS_SIZE bytes, and class properties are kept in a flat table
+ * that mock_prop_set() and mock_prop_get() look names up in.
+ */
+#ifndef MOCK_OBJECT_H
+#define MOCK_OBJECT_H
+
+typedef struct Visitor Visitor;
+typedef struct Object Object;
+typedef struct ObjectClass ObjectClass;
+typedef struct ObjectProperty ObjectProperty;
+typedef struct Property Property;
+
+typedef void (ObjectPropertyAccessor)(Object *obj, Visitor *v, const char *name, void *opaque, Error **errp);
+typedef void (ObjectPropertyRelease)(Object *obj, const char *name, void *opaque);
+
+struct ObjectProperty {
+    char *name;
+    const char *type;
+    ObjectPropertyAccessor *get;
+    ObjectPropertyAccessor *set;
+    char *(*get_str)(Object *obj, Error **errp);
+    void (*set_str)(Object *obj, const char *value, Error **errp);
+    bool (*get_bool)(Object *obj, Error **errp);
+    void (*set_bool)(Object *obj, bool value, Error **errp);
+    void *opaque;
+};
+
+struct ObjectClass {
+    const char *type;
+    ObjectProperty *props;
+    int nprops;
+    const Property *qdev_props;
+    size_t nqdev_props;
+};
+
+struct Object {
+    ObjectClass *klass;
+};
+
+typedef struct TypeInfo {
+    const char *name;
+    const char *parent;
+    size_t instance_size;
+    void (*instance_init)(Object *obj);
+    void (*instance_finalize)(Object *obj);
+    void (*class_init)(ObjectClass *klass, void *data);
+} TypeInfo;
+
+void type_register_static(const TypeInfo *info);
+
+ObjectProperty *object_class_property_add(ObjectClass *klass, const char *name, const char *type,
+                                          ObjectPropertyAccessor *get, ObjectPropertyAccessor *set,
+                                          ObjectPropertyRelease *release, void *opaque);
+ObjectProperty *object_class_property_add_str(ObjectClass *klass, const char *name,
+                                              char *(*get)(Object *, Error **),
+                                              void (*set)(Object *, const char *, Error **));
+ObjectProperty *object_class_property_add_bool(ObjectClass *klass, const char *name,
+                                               bool (*get)(Object *, Error **),
+                                               void (*set)(Object *, bool, Error **));
+void object_class_property_set_description(ObjectClass *klass, const char *name, const char *description);
+char *object_get_canonical_path(const Object *obj);
+
+#define OBJECT(obj) ((Object *)(obj))
+
+#define OBJECT_DECLARE_SIMPLE_TYPE(InstanceType, MODULE_OBJ_NAME)                   \
+    typedef struct InstanceType InstanceType;                                       \
+    static inline InstanceType *MODULE_OBJ_NAME(const void *obj) {                  \
+        return (InstanceType *)obj;                                                 \
+    }
+
+#endif
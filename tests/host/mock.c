@@ -0,0 +1,1690 @@
+/*
+ * mock.c - QEMU, glib and USB core stand-ins for the host harness
+ *
+ * The USB core parts follow hw/usb/core.c and hw/usb/desc.c closely enough
+ * that the device sees the same packet states, queue handling and
+ * endpoint resets it would under xHCI, minus packet combining. The glib
+ * subset counts what the device allocates; the harness's own bookkeeping
+ * uses the C library directly so it never shows up in those counts.
+ */
+#include "mock.h"
+
+#include "block/aio-wait.h"
+#include "block/thread-pool.h"
+#include "chardev/char-fe.h"
+#include "crypto/hash.h"
+#include "hw/qdev-properties.h"
+#include "hw/usb/desc.h"
+#include "migration/vmstate.h"
+#include "qapi/visitor.h"
+#include "qemu/crc32c.h"
+#include "qemu/iov.h"
+#include "qemu/log.h"
+#include "qemu/timer.h"
+
+uint64_t mock_allocs;
+uint64_t mock_alloc_bytes;
+uint64_t mock_ep_wakeups;
+uint64_t mock_port_wakeups;
+
+/* glib */
+
+static void *mock_count(void *p, size_t n) {
+    if (!p && n) {
+        fprintf(stderr, "mock: out of memory allocating %zu bytes\n", n);
+        abort();
+    }
+    mock_allocs++;
+    mock_alloc_bytes += n;
+    return p;
+}
+
+gpointer g_malloc(gsize n) {
+    return n ? mock_count(malloc(n), n) : NULL;
+}
+
+gpointer g_malloc0(gsize n) {
+    return n ? mock_count(calloc(1, n), n) : NULL;
+}
+
+gpointer g_realloc(gpointer p, gsize n) {
+    if (!n) {
+        free(p);
+        return NULL;
+    }
+    return mock_count(realloc(p, n), n);
+}
+
+void g_free(gpointer p) {
+    free(p);
+}
+
+gpointer g_memdup2(const void *mem, gsize n) {
+    void *p;
+
+    if (!mem || !n) {
+        return NULL;
+    }
+    p = g_malloc(n);
+    memcpy(p, mem, n);
+    return p;
+}
+
+gchar *g_strdup(const gchar *s) {
+    return s ? g_memdup2(s, strlen(s) + 1) : NULL;
+}
+
+gchar *g_strdup_printf(const gchar *fmt, ...) {
+    va_list ap;
+    char *s;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    s = g_malloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(s, n + 1, fmt, ap);
+    va_end(ap);
+    return s;
+}
+
+gchar **g_strsplit(const gchar *s, const gchar *delim, gint max_tokens) {
+    size_t dlen = strlen(delim), n = 0;
+    gchar **v = g_new0(gchar *, strlen(s) + 2);
+    const char *p = s, *q;
+
+    while ((max_tokens < 1 || n + 1 < max_tokens) && (q = strstr(p, delim))) {
+        v[n] = g_malloc(q - p + 1);
+        memcpy(v[n], p, q - p);
+        v[n++][q - p] = 0;
+        p = q + dlen;
+    }
+    if (*s) {
+        v[n] = g_strdup(p);
+    }
+    return v;
+}
+
+void g_strfreev(gchar **v) {
+    for (gchar **p = v; p && *p; p++) {
+        g_free(*p);
+    }
+    g_free(v);
+}
+
+gboolean g_str_has_prefix(const gchar *s, const gchar *prefix) {
+    return !strncmp(s, prefix, strlen(prefix));
+}
+
+guint64 g_ascii_strtoull(const gchar *s, gchar **end, guint base) {
+    return strtoull(s, end, base);
+}
+
+gboolean g_source_remove(guint tag) {
+    return TRUE;
+}
+
+static void g_string_reserve(GString *s, gsize len) {
+    gsize want = 64;
+
+    if (len + 1 <= s->allocated_len) {
+        return;
+    }
+    while (want < len + 1) {
+        want <<= 1;
+    }
+    s->str = g_realloc(s->str, want);
+    s->allocated_len = want;
+}
+
+GString *g_string_sized_new(gsize n) {
+    GString *s = g_new0(GString, 1);
+
+    g_string_reserve(s, n);
+    s->str[0] = 0;
+    return s;
+}
+
+GString *g_string_new(const gchar *init) {
+    GString *s = g_string_sized_new(init ? strlen(init) : 0);
+
+    if (init) {
+        g_string_append(s, init);
+    }
+    return s;
+}
+
+gchar *g_string_free(GString *s, gboolean free_segment) {
+    gchar *str = s->str;
+
+    if (free_segment) {
+        g_free(str);
+        str = NULL;
+    }
+    g_free(s);
+    return str;
+}
+
+void g_string_append_len(GString *s, const gchar *val, gssize len) {
+    if (len < 0) {
+        len = strlen(val);
+    }
+    g_string_reserve(s, s->len + len);
+    memcpy(s->str + s->len, val, len);
+    s->len += len;
+    s->str[s->len] = 0;
+}
+
+void g_string_append(GString *s, const gchar *val) {
+    g_string_append_len(s, val, -1);
+}
+
+void g_string_append_c(GString *s, gchar c) {
+    g_string_append_len(s, &c, 1);
+}
+
+void g_string_append_printf(GString *s, const gchar *fmt, ...) {
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    g_string_reserve(s, s->len + n);
+    va_start(ap, fmt);
+    vsnprintf(s->str + s->len, n + 1, fmt, ap);
+    va_end(ap);
+    s->len += n;
+}
+
+void g_string_truncate(GString *s, gsize len) {
+    if (len < s->len) {
+        s->len = len;
+        s->str[len] = 0;
+    }
+}
+
+typedef struct MockPtrArray {
+    GPtrArray a;
+    guint alloc;
+    void (*free_func)(gpointer);
+} MockPtrArray;
+
+GPtrArray *g_ptr_array_new_with_free_func(void (*free_func)(gpointer)) {
+    MockPtrArray *m = g_new0(MockPtrArray, 1);
+
+    m->free_func = free_func;
+    return &m->a;
+}
+
+void g_ptr_array_add(GPtrArray *a, gpointer p) {
+    MockPtrArray *m = container_of(a, MockPtrArray, a);
+
+    if (a->len == m->alloc) {
+        m->alloc = MAX(16, m->alloc * 2);
+        a->pdata = g_realloc(a->pdata, m->alloc * sizeof(gpointer));
+    }
+    a->pdata[a->len++] = p;
+}
+
+gpointer *g_ptr_array_free(GPtrArray *a, gboolean free_segment) {
+    MockPtrArray *m = container_of(a, MockPtrArray, a);
+    gpointer *pdata = a->pdata;
+
+    if (free_segment) {
+        for (guint i = 0; m->free_func && i < a->len; i++) {
+            m->free_func(pdata[i]);
+        }
+        g_free(pdata);
+        pdata = NULL;
+    }
+    g_free(m);
+    return pdata;
+}
+
+void *qemu_memalign(size_t alignment, size_t size) {
+    void *p = NULL;
+
+    if (posix_memalign(&p, MAX(alignment, sizeof(void *)), size)) {
+        p = NULL;
+    }
+    return mock_count(p, size);
+}
+
+void qemu_vfree(void *ptr) {
+    free(ptr);
+}
+
+/* Errors and logging */
+
+struct Error {
+    char *msg;
+};
+
+void error_setg(Error **errp, const char *fmt, ...) {
+    va_list ap;
+    Error *err;
+
+    if (!errp) {
+        return;
+    }
+    assert(!*errp);
+    err = calloc(1, sizeof(*err));
+    va_start(ap, fmt);
+    if (vasprintf(&err->msg, fmt, ap) < 0) {
+        err->msg = NULL;
+    }
+    va_end(ap);
+    *errp = err;
+}
+
+const char *error_get_pretty(const Error *err) {
+    return err->msg ? err->msg : "(no message)";
+}
+
+void error_free(Error *err) {
+    if (err) {
+        free(err->msg);
+        free(err);
+    }
+}
+
+static int mock_log = -1;
+
+bool qemu_log_enabled(void) {
+    if (mock_log < 0) {
+        mock_log = getenv("DUSB_HARNESS_LOG") != NULL;
+    }
+    return mock_log;
+}
+
+void qemu_log(const char *fmt, ...) {
+    va_list ap;
+
+    if (!qemu_log_enabled()) {
+        return;
+    }
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+/* Clocks and timers */
+
+static int64_t mock_now = NANOSECONDS_PER_SECOND;
+static QEMUTimer *mock_timers;
+
+int64_t mock_clock_ns(void) {
+    return mock_now;
+}
+
+int64_t qemu_clock_get_ns(QEMUClockType type) {
+    return type == QEMU_CLOCK_VIRTUAL ? mock_now : get_clock();
+}
+
+int64_t get_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+}
+
+int64_t cpu_get_host_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    uint32_t lo, hi;
+
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return (int64_t)hi << 32 | lo;
+#else
+    return get_clock();
+#endif
+}
+
+QEMUTimer *timer_new(QEMUClockType type, int scale, QEMUTimerCB *cb, void *opaque) {
+    QEMUTimer *ts = g_new0(QEMUTimer, 1);
+
+    assert(type == QEMU_CLOCK_VIRTUAL);
+    ts->expire_time = -1;
+    ts->scale = scale;
+    ts->cb = cb;
+    ts->opaque = opaque;
+    ts->next = mock_timers;
+    if (mock_timers) {
+        mock_timers->prev = &ts->next;
+    }
+    ts->prev = &mock_timers;
+    mock_timers = ts;
+    return ts;
+}
+
+void timer_mod(QEMUTimer *ts, int64_t expire_time) {
+    ts->expire_time = MAX(expire_time, 0) * ts->scale;
+}
+
+void timer_del(QEMUTimer *ts) {
+    ts->expire_time = -1;
+}
+
+void timer_free(QEMUTimer *ts) {
+    if (!ts) {
+        return;
+    }
+    *ts->prev = ts->next;
+    if (ts->next) {
+        ts->next->prev = ts->prev;
+    }
+    g_free(ts);
+}
+
+bool mock_clock_step(int64_t limit) {
+    bool ran = mock_thread_pool_poll();
+    QEMUTimer *first = NULL;
+
+    for (QEMUTimer *ts = mock_timers; ts; ts = ts->next) {
+        if (ts->expire_time >= 0 && (!first || ts->expire_time < first->expire_time)) {
+            first = ts;
+        }
+    }
+    if (!first || first->expire_time > limit) {
+        return ran;
+    }
+    mock_now = MAX(mock_now, first->expire_time);
+    first->expire_time = -1;
+    first->cb(first->opaque);
+    mock_thread_pool_poll();
+    return true;
+}
+
+void mock_clock_advance(int64_t ns) {
+    int64_t target = mock_now + ns;
+
+    while (mock_clock_step(target)) {
+    }
+    mock_now = MAX(mock_now, target);
+}
+
+/* Thread pool: jobs run on the harness thread when polled */
+
+typedef struct MockJob {
+    ThreadPoolFunc *func;
+    void *arg;
+    BlockCompletionFunc *cb;
+    void *opaque;
+    struct MockJob *next;
+} MockJob;
+
+static MockJob *mock_jobs, **mock_jobs_tail = &mock_jobs;
+
+BlockAIOCB *thread_pool_submit_aio(ThreadPoolFunc *func, void *arg, BlockCompletionFunc *cb, void *opaque) {
+    MockJob *job = calloc(1, sizeof(*job));
+
+    job->func = func;
+    job->arg = arg;
+    job->cb = cb;
+    job->opaque = opaque;
+    *mock_jobs_tail = job;
+    mock_jobs_tail = &job->next;
+    return (BlockAIOCB *)job;
+}
+
+bool mock_thread_pool_poll(void) {
+    MockJob *job = mock_jobs;
+
+    if (!job) {
+        return false;
+    }
+    mock_jobs = NULL;
+    mock_jobs_tail = &mock_jobs;
+    while (job) {
+        MockJob *next = job->next;
+        int ret = job->func(job->arg);
+
+        if (job->cb) {
+            job->cb(job->opaque, ret);
+        }
+        free(job);
+        job = next;
+    }
+    return true;
+}
+
+/* Hashing, CRC32C and I/O vectors */
+
+int qcrypto_hash_bytes(QCryptoHashAlgo alg, const char *buf, size_t len, uint8_t **result, size_t *resultlen,
+                       Error **errp) {
+    error_setg(errp, "No hash backend in the host harness");
+    return -1;
+}
+
+uint32_t crc32c(uint32_t crc, const uint8_t *data, unsigned int length) {
+    static uint32_t table[256];
+
+    if (!table[1]) {
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t c = i;
+
+            for (int k = 0; k < 8; k++) {
+                c = c & 1 ? c >> 1 ^ 0x82F63B78 : c >> 1;
+            }
+            table[i] = c;
+        }
+    }
+    while (length--) {
+        crc = table[(crc ^ *data++) & 0xff] ^ crc >> 8;
+    }
+    return crc;
+}
+
+size_t iov_from_buf(const struct iovec *iov, unsigned int iov_cnt, size_t offset, const void *buf, size_t bytes) {
+    size_t done = 0;
+
+    for (unsigned int i = 0; i < iov_cnt && done < bytes; i++) {
+        if (offset < iov[i].iov_len) {
+            size_t len = MIN(iov[i].iov_len - offset, bytes - done);
+
+            memcpy((uint8_t *)iov[i].iov_base + offset, (const uint8_t *)buf + done, len);
+            done += len;
+            offset = 0;
+        } else {
+            offset -= iov[i].iov_len;
+        }
+    }
+    return done;
+}
+
+size_t iov_to_buf(const struct iovec *iov, unsigned int iov_cnt, size_t offset, void *buf, size_t bytes) {
+    size_t done = 0;
+
+    for (unsigned int i = 0; i < iov_cnt && done < bytes; i++) {
+        if (offset < iov[i].iov_len) {
+            size_t len = MIN(iov[i].iov_len - offset, bytes - done);
+
+            memcpy((uint8_t *)buf + done, (const uint8_t *)iov[i].iov_base + offset, len);
+            done += len;
+            offset = 0;
+        } else {
+            offset -= iov[i].iov_len;
+        }
+    }
+    return done;
+}
+
+/* Character backends: never connected */
+
+bool qemu_chr_fe_backend_connected(CharBackend *be) {
+    return false;
+}
+
+void qemu_chr_fe_set_handlers(CharBackend *b, IOCanReadHandler *fd_can_read, IOReadHandler *fd_read,
+                              IOEventHandler *fd_event, BackendChangeHandler *be_change, void *opaque,
+                              GMainContext *context, bool set_open) {
+}
+
+int qemu_chr_fe_write(CharBackend *be, const uint8_t *buf, int len) {
+    return len;
+}
+
+guint qemu_chr_fe_add_watch(CharBackend *be, GIOCondition cond, FEWatchFunc func, void *user_data) {
+    return 0;
+}
+
+void qemu_chr_fe_disconnect(CharBackend *be) {
+}
+
+void qemu_chr_fe_deinit(CharBackend *b, bool del) {
+}
+
+/* QOM and qdev */
+
+#define MOCK_MAX_TYPES 8
+#define MOCK_MAX_PROPS 512
+
+typedef struct MockType {
+    const TypeInfo *info;
+    ObjectClass *klass;
+} MockType;
+
+static MockType mock_types[MOCK_MAX_TYPES];
+
+struct Visitor {
+    const char *in;            /* Value to parse on set, NULL on get */
+    char *out;                 /* g_malloc'd value produced on get */
+};
+
+void type_register_static(const TypeInfo *info) {
+    for (int i = 0; i < MOCK_MAX_TYPES; i++) {
+        if (!mock_types[i].info) {
+            mock_types[i].info = info;
+            return;
+        }
+    }
+    abort();
+}
+
+static ObjectProperty *mock_prop_new(ObjectClass *klass, const char *name, const char *type) {
+    ObjectProperty *op;
+
+    if (!klass->props) {
+        klass->props = calloc(MOCK_MAX_PROPS, sizeof(*klass->props));
+    }
+    assert(klass->nprops < MOCK_MAX_PROPS);
+    op = &klass->props[klass->nprops++];
+    op->name = strdup(name);
+    op->type = type;
+    return op;
+}
+
+ObjectProperty *object_class_property_add(ObjectClass *klass, const char *name, const char *type,
+                                          ObjectPropertyAccessor *get, ObjectPropertyAccessor *set,
+                                          ObjectPropertyRelease *release, void *opaque) {
+    ObjectProperty *op = mock_prop_new(klass, name, type);
+
+    op->get = get;
+    op->set = set;
+    op->opaque = opaque;
+    return op;
+}
+
+ObjectProperty *object_class_property_add_str(ObjectClass *klass, const char *name,
+                                              char *(*get)(Object *, Error **),
+                                              void (*set)(Object *, const char *, Error **)) {
+    ObjectProperty *op = mock_prop_new(klass, name, "string");
+
+    op->get_str = get;
+    op->set_str = set;
+    return op;
+}
+
+ObjectProperty *object_class_property_add_bool(ObjectClass *klass, const char *name,
+                                               bool (*get)(Object *, Error **),
+                                               void (*set)(Object *, bool, Error **)) {
+    ObjectProperty *op = mock_prop_new(klass, name, "bool");
+
+    op->get_bool = get;
+    op->set_bool = set;
+    return op;
+}
+
+void object_class_property_set_description(ObjectClass *klass, const char *name, const char *description) {
+}
+
+char *object_get_canonical_path(const Object *obj) {
+    return g_strdup_printf("/machine/peripheral/%s", ((DeviceState *)obj)->id);
+}
+
+void device_class_set_props_n(DeviceClass *dc, const Property *props, size_t n) {
+    dc->parent_class.qdev_props = props;
+    dc->parent_class.nqdev_props = n;
+}
+
+static bool mock_parse_bool(const char *s, bool *value) {
+    if (!strcmp(s, "on") || !strcmp(s, "true") || !strcmp(s, "yes") || !strcmp(s, "1")) {
+        *value = true;
+    } else if (!strcmp(s, "off") || !strcmp(s, "false") || !strcmp(s, "no") || !strcmp(s, "0")) {
+        *value = false;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static bool mock_parse_uint(const char *s, uint64_t max, uint64_t *value) {
+    char *end;
+
+    errno = 0;
+    *value = strtoull(s, &end, 0);
+    return *s && *s != '-' && !*end && !errno && *value <= max;
+}
+
+bool visit_type_bool(Visitor *v, const char *name, bool *obj, Error **errp) {
+    if (!v->in) {
+        v->out = g_strdup(*obj ? "true" : "false");
+    } else if (!mock_parse_bool(v->in, obj)) {
+        error_setg(errp, "Parameter '%s' expects 'on' or 'off'", name);
+        return false;
+    }
+    return true;
+}
+
+static bool mock_visit_uint(Visitor *v, const char *name, uint64_t max, uint64_t *value, Error **errp) {
+    if (!v->in) {
+        v->out = g_strdup_printf("%" PRIu64, *value);
+    } else if (!mock_parse_uint(v->in, max, value)) {
+        error_setg(errp, "Parameter '%s' expects an integer up to %" PRIu64, name, max);
+        return false;
+    }
+    return true;
+}
+
+bool visit_type_uint8(Visitor *v, const char *name, uint8_t *obj, Error **errp) {
+    uint64_t value = *obj;
+
+    if (!mock_visit_uint(v, name, UINT8_MAX, &value, errp)) {
+        return false;
+    }
+    *obj = value;
+    return true;
+}
+
+bool visit_type_uint32(Visitor *v, const char *name, uint32_t *obj, Error **errp) {
+    uint64_t value = *obj;
+
+    if (!mock_visit_uint(v, name, UINT32_MAX, &value, errp)) {
+        return false;
+    }
+    *obj = value;
+    return true;
+}
+
+static const Property *mock_qdev_prop(Object *obj, const char *name) {
+    for (size_t i = 0; i < obj->klass->nqdev_props; i++) {
+        if (!strcmp(obj->klass->qdev_props[i].name, name)) {
+            return &obj->klass->qdev_props[i];
+        }
+    }
+    return NULL;
+}
+
+static ObjectProperty *mock_class_prop(Object *obj, const char *name) {
+    for (int i = 0; i < obj->klass->nprops; i++) {
+        if (!strcmp(obj->klass->props[i].name, name)) {
+            return &obj->klass->props[i];
+        }
+    }
+    return NULL;
+}
+
+static bool mock_qdev_set(Object *obj, const Property *prop, const char *value, Error **errp) {
+    void *field = (uint8_t *)obj + prop->offset;
+    uint64_t u;
+    bool b;
+
+    if (DEVICE(obj)->realized) {
+        error_setg(errp, "Attempt to set property '%s' after it was realized", prop->name);
+        return false;
+    }
+    switch (prop->kind) {
+        case MOCK_PROP_BOOL:
+            if (!mock_parse_bool(value, &b)) {
+                break;
+            }
+            *(bool *)field = b;
+            return true;
+        case MOCK_PROP_UINT8:
+            if (!mock_parse_uint(value, UINT8_MAX, &u)) {
+                break;
+            }
+            *(uint8_t *)field = u;
+            return true;
+        case MOCK_PROP_UINT32:
+            if (!mock_parse_uint(value, UINT32_MAX, &u)) {
+                break;
+            }
+            *(uint32_t *)field = u;
+            return true;
+        case MOCK_PROP_STRING:
+            free(*(char **)field);
+            *(char **)field = strdup(value);
+            return true;
+        case MOCK_PROP_CHR:
+            error_setg(errp, "Property '%s': the host harness has no character devices", prop->name);
+            return false;
+    }
+    error_setg(errp, "Property '%s' cannot be set to '%s'", prop->name, value);
+    return false;
+}
+
+static char *mock_qdev_get(Object *obj, const Property *prop) {
+    void *field = (uint8_t *)obj + prop->offset;
+
+    switch (prop->kind) {
+        case MOCK_PROP_BOOL:
+            return g_strdup(*(bool *)field ? "true" : "false");
+        case MOCK_PROP_UINT8:
+            return g_strdup_printf("%u", *(uint8_t *)field);
+        case MOCK_PROP_UINT32:
+            return g_strdup_printf("%u", *(uint32_t *)field);
+        case MOCK_PROP_STRING:
+            return g_strdup(*(char **)field ? *(char **)field : "");
+        case MOCK_PROP_CHR:
+            break;
+    }
+    return g_strdup("");
+}
+
+bool mock_prop_set(USBDevice *dev, const char *name, const char *value, Error **errp) {
+    Object *obj = OBJECT(dev);
+    const Property *prop = mock_qdev_prop(obj, name);
+    ObjectProperty *op = mock_class_prop(obj, name);
+    Error *err = NULL;
+    bool b;
+
+    if (prop) {
+        return mock_qdev_set(obj, prop, value, errp);
+    }
+    if (!op) {
+        error_setg(errp, "Property '%s' not found", name);
+        return false;
+    }
+    if (op->set) {
+        Visitor v = { .in = value };
+
+        op->set(obj, &v, name, op->opaque, &err);
+    } else if (op->set_str) {
+        op->set_str(obj, value, &err);
+    } else if (op->set_bool) {
+        if (!mock_parse_bool(value, &b)) {
+            error_setg(errp, "Parameter '%s' expects 'on' or 'off'", name);
+            return false;
+        }
+        op->set_bool(obj, b, &err);
+    } else {
+        error_setg(errp, "Property '%s' is read-only", name);
+        return false;
+    }
+    if (err) {
+        if (errp) {
+            *errp = err;
+        } else {
+            error_free(err);
+        }
+        return false;
+    }
+    return true;
+}
+
+char *mock_prop_get(USBDevice *dev, const char *name, Error **errp) {
+    Object *obj = OBJECT(dev);
+    const Property *prop = mock_qdev_prop(obj, name);
+    ObjectProperty *op = mock_class_prop(obj, name);
+    Error *err = NULL;
+    char *value = NULL;
+
+    if (prop) {
+        return mock_qdev_get(obj, prop);
+    }
+    if (!op) {
+        error_setg(errp, "Property '%s' not found", name);
+        return NULL;
+    }
+    if (op->get) {
+        Visitor v = { 0 };
+
+        op->get(obj, &v, name, op->opaque, &err);
+        value = v.out;
+    } else if (op->get_str) {
+        value = op->get_str(obj, &err);
+    } else if (op->get_bool) {
+        bool b = op->get_bool(obj, &err);
+
+        value = err ? NULL : g_strdup(b ? "true" : "false");
+    } else {
+        error_setg(errp, "Property '%s' is write-only", name);
+        return NULL;
+    }
+    if (err) {
+        g_free(value);
+        if (errp) {
+            *errp = err;
+        } else {
+            error_free(err);
+        }
+        return NULL;
+    }
+    return value;
+}
+
+/* USB descriptors, after hw/usb/desc.c */
+
+static const USBDesc *mock_usb_desc(USBDevice *dev) {
+    return dev->usb_desc ? dev->usb_desc : USB_DEVICE_GET_CLASS(dev)->usb_desc;
+}
+
+static const USBDescIface *mock_desc_find_iface(USBDevice *dev, int nif, int alt) {
+    const USBDescConfig *conf = dev->config;
+
+    if (!conf) {
+        return NULL;
+    }
+    for (int g = 0; g < conf->nif_groups; g++) {
+        for (int i = 0; i < conf->if_groups[g].nif; i++) {
+            const USBDescIface *iface = &conf->if_groups[g].ifs[i];
+
+            if (iface->bInterfaceNumber == nif && iface->bAlternateSetting == alt) {
+                return iface;
+            }
+        }
+    }
+    for (int i = 0; i < conf->nif; i++) {
+        if (conf->ifs[i].bInterfaceNumber == nif && conf->ifs[i].bAlternateSetting == alt) {
+            return &conf->ifs[i];
+        }
+    }
+    return NULL;
+}
+
+static void mock_desc_ep_init(USBDevice *dev) {
+    usb_ep_reset(dev);
+    for (int i = 0; i < dev->ninterfaces; i++) {
+        const USBDescIface *iface = dev->ifaces[i];
+
+        for (int e = 0; iface && e < iface->bNumEndpoints; e++) {
+            const USBDescEndpoint *d = &iface->eps[e];
+            USBEndpoint *ep = usb_ep_get(dev, d->bEndpointAddress & USB_DIR_IN ? USB_TOKEN_IN : USB_TOKEN_OUT,
+                                         d->bEndpointAddress & 0x0f);
+            int raw = d->wMaxPacketSize;
+
+            ep->type = d->bmAttributes & 0x03;
+            ep->ifnum = iface->bInterfaceNumber;
+            ep->max_packet_size = (raw & 0x7ff) * (1 + ((raw >> 11) & 3));
+            ep->max_streams = ep->type == USB_ENDPOINT_XFER_BULK && (d->bmAttributes_super & 0x1f)
+                              ? 1 << (d->bmAttributes_super & 0x1f) : 0;
+        }
+    }
+}
+
+static int mock_desc_set_interface(USBDevice *dev, int index, int value) {
+    const USBDescIface *iface = mock_desc_find_iface(dev, index, value);
+    int old;
+
+    if (!iface) {
+        return -1;
+    }
+    old = dev->altsetting[index];
+    dev->altsetting[index] = value;
+    dev->ifaces[index] = iface;
+    mock_desc_ep_init(dev);
+    if (old != value && USB_DEVICE_GET_CLASS(dev)->set_interface) {
+        USB_DEVICE_GET_CLASS(dev)->set_interface(dev, index, old, value);
+    }
+    return 0;
+}
+
+static int mock_desc_set_config(USBDevice *dev, int value) {
+    int i;
+
+    dev->configuration = value;
+    dev->ninterfaces = 0;
+    dev->config = NULL;
+    if (value) {
+        for (i = 0; i < dev->device->bNumConfigurations; i++) {
+            if (dev->device->confs[i].bConfigurationValue == value) {
+                dev->config = &dev->device->confs[i];
+                dev->ninterfaces = dev->config->bNumInterfaces;
+                break;
+            }
+        }
+        if (i == dev->device->bNumConfigurations) {
+            return -1;
+        }
+    }
+    for (i = 0; i < dev->ninterfaces; i++) {
+        mock_desc_set_interface(dev, i, 0);
+    }
+    for (; i < USB_MAX_INTERFACES; i++) {
+        dev->altsetting[i] = 0;
+        dev->ifaces[i] = NULL;
+    }
+    return 0;
+}
+
+static void mock_desc_setdefaults(USBDevice *dev) {
+    const USBDesc *desc = mock_usb_desc(dev);
+
+    dev->device = dev->speed == USB_SPEED_SUPER ? desc->super : dev->speed == USB_SPEED_HIGH ? desc->high
+                                                                                            : desc->full;
+    mock_desc_set_config(dev, 0);
+}
+
+void usb_desc_init(USBDevice *dev) {
+    const USBDesc *desc = mock_usb_desc(dev);
+
+    dev->speed = USB_SPEED_FULL;
+    dev->speedmask = (desc->full ? USB_SPEED_MASK_FULL : 0) | (desc->high ? USB_SPEED_MASK_HIGH : 0) |
+                     (desc->super ? USB_SPEED_MASK_SUPER : 0);
+    mock_desc_setdefaults(dev);
+}
+
+void usb_desc_attach(USBDevice *dev) {
+    const USBDesc *desc = mock_usb_desc(dev);
+    int mask = dev->port->speedmask;
+
+    if (desc->super && (mask & USB_SPEED_MASK_SUPER)) {
+        dev->speed = USB_SPEED_SUPER;
+    } else if (desc->high && (mask & USB_SPEED_MASK_HIGH)) {
+        dev->speed = USB_SPEED_HIGH;
+    } else if (desc->full && (mask & USB_SPEED_MASK_FULL)) {
+        dev->speed = USB_SPEED_FULL;
+    } else {
+        return;
+    }
+    mock_desc_setdefaults(dev);
+}
+
+void usb_desc_create_serial(USBDevice *dev) {
+}
+
+int usb_desc_handle_control(USBDevice *dev, USBPacket *p, int request, int value, int index, int length,
+                            uint8_t *data) {
+    switch (request) {
+        case DeviceOutRequest | USB_REQ_SET_ADDRESS:
+            dev->addr = value;
+            return 0;
+        case DeviceRequest | USB_REQ_GET_CONFIGURATION:
+            data[0] = dev->config ? dev->config->bConfigurationValue : 0;
+            p->actual_length = 1;
+            return 0;
+        case DeviceOutRequest | USB_REQ_SET_CONFIGURATION:
+            return mock_desc_set_config(dev, value);
+        case DeviceRequest | USB_REQ_GET_STATUS:
+            data[0] = dev->remote_wakeup << USB_DEVICE_REMOTE_WAKEUP;
+            data[1] = 0;
+            p->actual_length = 2;
+            return 0;
+        case DeviceOutRequest | USB_REQ_CLEAR_FEATURE:
+        case DeviceOutRequest | USB_REQ_SET_FEATURE:
+            if (value != USB_DEVICE_REMOTE_WAKEUP) {
+                return -1;
+            }
+            dev->remote_wakeup = (request & 0xff) == USB_REQ_SET_FEATURE;
+            return 0;
+        case DeviceOutRequest | USB_REQ_SET_SEL:
+        case DeviceOutRequest | USB_REQ_SET_ISOCH_DELAY:
+            return dev->speed == USB_SPEED_SUPER ? 0 : -1;
+        case InterfaceRequest | USB_REQ_GET_INTERFACE:
+            if (index < 0 || index >= dev->ninterfaces) {
+                return -1;
+            }
+            data[0] = dev->altsetting[index];
+            p->actual_length = 1;
+            return 0;
+        case InterfaceOutRequest | USB_REQ_SET_INTERFACE:
+            return index < 0 || index >= dev->ninterfaces ? -1 : mock_desc_set_interface(dev, index, value);
+    }
+    return -1;
+}
+
+/* Migration, after migration/vmstate.c, into a flat byte stream */
+
+typedef struct MockStream {
+    uint8_t *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;
+} MockStream;
+
+static void mock_put(MockStream *f, const void *data, size_t n) {
+    if (f->len + n > f->cap) {
+        f->cap = MAX(f->cap * 2, f->len + n + 4096);
+        f->buf = realloc(f->buf, f->cap);
+        if (!f->buf) {
+            abort();
+        }
+    }
+    memcpy(f->buf + f->len, data, n);
+    f->len += n;
+}
+
+static bool mock_get(MockStream *f, void *data, size_t n) {
+    if (f->len - f->pos < n) {
+        return false;
+    }
+    memcpy(data, f->buf + f->pos, n);
+    f->pos += n;
+    return true;
+}
+
+static void mock_vmstate_save_desc(MockStream *f, const VMStateDescription *vmsd, void *opaque) {
+    int32_t version = vmsd->version_id;
+
+    if (vmsd->pre_save) {
+        vmsd->pre_save(opaque);
+    }
+    mock_put(f, &version, sizeof(version));
+    for (const VMStateField *field = vmsd->fields; field->name; field++) {
+        uint8_t *base = (uint8_t *)opaque + field->offset;
+
+        switch (field->kind) {
+            case MOCK_VMS_DATA:
+                mock_put(f, base, field->size);
+                break;
+            case MOCK_VMS_VBUFFER:
+            case MOCK_VMS_VBUFFER_ALLOC:
+                /* As in QEMU, the length is a field of its own sent earlier */
+                mock_put(f, *(uint8_t **)base, *(uint32_t *)((uint8_t *)opaque + field->len_offset));
+                break;
+            case MOCK_VMS_STRUCT:
+                for (size_t i = 0; i < field->num; i++) {
+                    mock_vmstate_save_desc(f, field->vmsd, base + i * field->size);
+                }
+                break;
+            case MOCK_VMS_VARRAY_ALLOC:
+                for (int32_t i = 0; i < *(int32_t *)((uint8_t *)opaque + field->len_offset); i++) {
+                    mock_vmstate_save_desc(f, field->vmsd, *(uint8_t **)base + i * field->size);
+                }
+                break;
+            case MOCK_VMS_TIMER:
+                mock_put(f, &(*(QEMUTimer **)base)->expire_time, sizeof(int64_t));
+                break;
+            case MOCK_VMS_VALIDATE:
+                break;
+        }
+    }
+    for (int i = 0; vmsd->subsections && vmsd->subsections[i]; i++) {
+        const VMStateDescription *sub = vmsd->subsections[i];
+        uint8_t namelen = strlen(sub->name);
+
+        if (sub->needed && !sub->needed(opaque)) {
+            continue;
+        }
+        mock_put(f, &namelen, 1);
+        mock_put(f, sub->name, namelen);
+        mock_vmstate_save_desc(f, sub, opaque);
+    }
+    mock_put(f, &(uint8_t){ 0 }, 1);
+}
+
+static int mock_vmstate_load_desc(MockStream *f, const VMStateDescription *vmsd, void *opaque) {
+    int32_t version;
+    int ret;
+
+    if (!mock_get(f, &version, sizeof(version)) || version < vmsd->minimum_version_id ||
+        version > vmsd->version_id) {
+        return -EINVAL;
+    }
+    if (vmsd->pre_load && (ret = vmsd->pre_load(opaque)) < 0) {
+        return ret;
+    }
+    for (const VMStateField *field = vmsd->fields; field->name; field++) {
+        uint8_t *base = (uint8_t *)opaque + field->offset;
+        uint32_t len = 0;
+        int32_t n;
+
+        if (field->kind == MOCK_VMS_VBUFFER || field->kind == MOCK_VMS_VBUFFER_ALLOC) {
+            len = *(uint32_t *)((uint8_t *)opaque + field->len_offset);
+        }
+        switch (field->kind) {
+            case MOCK_VMS_DATA:
+                if (!mock_get(f, base, field->size)) {
+                    return -EINVAL;
+                }
+                break;
+            case MOCK_VMS_VBUFFER_ALLOC:
+                *(uint8_t **)base = g_malloc(len);
+                /* fall through */
+            case MOCK_VMS_VBUFFER:
+                if (!mock_get(f, *(uint8_t **)base, len)) {
+                    return -EINVAL;
+                }
+                break;
+            case MOCK_VMS_STRUCT:
+                for (size_t i = 0; i < field->num; i++) {
+                    if ((ret = mock_vmstate_load_desc(f, field->vmsd, base + i * field->size)) < 0) {
+                        return ret;
+                    }
+                }
+                break;
+            case MOCK_VMS_VARRAY_ALLOC:
+                n = *(int32_t *)((uint8_t *)opaque + field->len_offset);
+                if (n < 0) {
+                    return -EINVAL;
+                }
+                *(uint8_t **)base = n ? g_malloc0(n * field->size) : NULL;
+                for (int32_t i = 0; i < n; i++) {
+                    if ((ret = mock_vmstate_load_desc(f, field->vmsd, *(uint8_t **)base + i * field->size)) < 0) {
+                        return ret;
+                    }
+                }
+                break;
+            case MOCK_VMS_TIMER:
+                if (!mock_get(f, &(*(QEMUTimer **)base)->expire_time, sizeof(int64_t))) {
+                    return -EINVAL;
+                }
+                break;
+            case MOCK_VMS_VALIDATE:
+                if (!field->field_exists(opaque, version)) {
+                    return -EINVAL;
+                }
+                break;
+        }
+    }
+    for (;;) {
+        const VMStateDescription *sub = NULL;
+        uint8_t namelen;
+        char name[256];
+
+        if (!mock_get(f, &namelen, 1)) {
+            return -EINVAL;
+        }
+        if (!namelen) {
+            break;
+        }
+        if (!mock_get(f, name, namelen)) {
+            return -EINVAL;
+        }
+        name[namelen] = '\0';
+        for (int i = 0; vmsd->subsections && vmsd->subsections[i]; i++) {
+            if (!strcmp(vmsd->subsections[i]->name, name)) {
+                sub = vmsd->subsections[i];
+            }
+        }
+        if (!sub) {
+            return -ENOENT;
+        }
+        if ((ret = mock_vmstate_load_desc(f, sub, opaque)) < 0) {
+            return ret;
+        }
+    }
+    return vmsd->post_load ? vmsd->post_load(opaque, version) : 0;
+}
+
+uint8_t *mock_vmstate_save(USBDevice *dev, size_t *len) {
+    MockStream f = { 0 };
+
+    mock_vmstate_save_desc(&f, DEVICE_CLASS(OBJECT(dev)->klass)->vmsd, dev);
+    *len = f.len;
+    return f.buf;
+}
+
+int mock_vmstate_load(USBDevice *dev, const uint8_t *buf, size_t len) {
+    MockStream f = { .buf = (uint8_t *)buf, .len = len };
+    int ret = mock_vmstate_load_desc(&f, DEVICE_CLASS(OBJECT(dev)->klass)->vmsd, dev);
+
+    return ret < 0 ? ret : f.pos == f.len ? 0 : -EINVAL;
+}
+
+/* Rebuild what the descriptors derive from the migrated configuration and alternate settings */
+static int mock_usb_device_post_load(void *opaque, int version_id) {
+    USBDevice *dev = opaque;
+
+    dev->config = NULL;
+    dev->ninterfaces = 0;
+    for (int i = 0; dev->configuration && i < dev->device->bNumConfigurations; i++) {
+        if (dev->device->confs[i].bConfigurationValue == dev->configuration) {
+            dev->config = &dev->device->confs[i];
+            dev->ninterfaces = dev->config->bNumInterfaces;
+        }
+    }
+    if (dev->configuration && !dev->config) {
+        return -EINVAL;
+    }
+    for (int i = 0; i < USB_MAX_INTERFACES; i++) {
+        dev->ifaces[i] = i < dev->ninterfaces ? mock_desc_find_iface(dev, i, dev->altsetting[i]) : NULL;
+        if (i < dev->ninterfaces && !dev->ifaces[i]) {
+            return -EINVAL;
+        }
+    }
+    mock_desc_ep_init(dev);
+    return 0;
+}
+
+const VMStateDescription vmstate_usb_device = {
+    .name = "USBDevice",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = mock_usb_device_post_load,
+    .fields = (const VMStateField[]) {
+        VMSTATE_UINT8(addr, USBDevice),
+        VMSTATE_INT32(remote_wakeup, USBDevice),
+        VMSTATE_INT32(configuration, USBDevice),
+        VMSTATE_INT32_ARRAY(altsetting, USBDevice, USB_MAX_INTERFACES),
+        VMSTATE_UINT8_ARRAY(data_buf, USBDevice, 4096),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+/* USB core, after hw/usb/core.c */
+
+USBEndpoint *usb_ep_get(USBDevice *dev, int pid, int ep) {
+    if (!dev) {
+        return NULL;
+    }
+    if (ep == 0) {
+        return &dev->ep_ctl;
+    }
+    assert(pid == USB_TOKEN_IN || pid == USB_TOKEN_OUT);
+    assert(ep > 0 && ep <= USB_MAX_ENDPOINTS);
+    return pid == USB_TOKEN_IN ? &dev->ep_in[ep - 1] : &dev->ep_out[ep - 1];
+}
+
+void usb_ep_reset(USBDevice *dev) {
+    dev->ep_ctl.nr = 0;
+    dev->ep_ctl.type = USB_ENDPOINT_XFER_CONTROL;
+    dev->ep_ctl.ifnum = 0;
+    dev->ep_ctl.max_packet_size = 64;
+    dev->ep_ctl.max_streams = 0;
+    dev->ep_ctl.dev = dev;
+    dev->ep_ctl.pipeline = false;
+    for (int ep = 0; ep < USB_MAX_ENDPOINTS; ep++) {
+        USBEndpoint *eps[2] = { &dev->ep_in[ep], &dev->ep_out[ep] };
+
+        for (int d = 0; d < 2; d++) {
+            eps[d]->nr = ep + 1;
+            eps[d]->pid = d ? USB_TOKEN_OUT : USB_TOKEN_IN;
+            eps[d]->type = USB_ENDPOINT_XFER_INVALID;
+            eps[d]->ifnum = 255;          /* USB_INTERFACE_INVALID */
+            eps[d]->max_packet_size = 0;
+            eps[d]->max_streams = 0;
+            eps[d]->dev = dev;
+            eps[d]->pipeline = false;
+        }
+    }
+}
+
+void usb_ep_init(USBDevice *dev) {
+    usb_ep_reset(dev);
+    QTAILQ_INIT(&dev->ep_ctl.queue);
+    for (int ep = 0; ep < USB_MAX_ENDPOINTS; ep++) {
+        QTAILQ_INIT(&dev->ep_in[ep].queue);
+        QTAILQ_INIT(&dev->ep_out[ep].queue);
+    }
+}
+
+void usb_packet_init(USBPacket *p) {
+    memset(p, 0, sizeof(*p));
+    p->iov.iov = calloc(1, sizeof(*p->iov.iov));
+    p->iov.nalloc = 1;
+}
+
+void usb_packet_setup(USBPacket *p, int pid, USBEndpoint *ep, unsigned int stream, uint64_t id, bool short_not_ok,
+                      bool int_req) {
+    assert(!p->ep || p->state == USB_PACKET_UNDEFINED || p->state == USB_PACKET_COMPLETE ||
+           p->state == USB_PACKET_CANCELED || p->state == USB_PACKET_SETUP);
+    p->id = id;
+    p->pid = pid;
+    p->ep = ep;
+    p->stream = stream;
+    p->status = USB_RET_SUCCESS;
+    p->actual_length = 0;
+    p->short_not_ok = short_not_ok;
+    p->int_req = int_req;
+    p->combined = NULL;
+    p->iov.niov = 0;
+    p->iov.size = 0;
+    p->state = USB_PACKET_SETUP;
+}
+
+void usb_packet_addbuf(USBPacket *p, void *ptr, size_t len) {
+    if (p->iov.niov == p->iov.nalloc) {
+        p->iov.nalloc *= 2;
+        p->iov.iov = realloc(p->iov.iov, p->iov.nalloc * sizeof(*p->iov.iov));
+    }
+    p->iov.iov[p->iov.niov].iov_base = ptr;
+    p->iov.iov[p->iov.niov++].iov_len = len;
+    p->iov.size += len;
+}
+
+void usb_packet_copy(USBPacket *p, void *ptr, size_t bytes) {
+    QEMUIOVector *iov = p->combined ? &p->combined->iov : &p->iov;
+
+    assert(p->actual_length >= 0);
+    assert(p->actual_length + bytes <= iov->size);
+    if (p->pid == USB_TOKEN_IN) {
+        iov_from_buf(iov->iov, iov->niov, p->actual_length, ptr, bytes);
+    } else {
+        iov_to_buf(iov->iov, iov->niov, p->actual_length, ptr, bytes);
+    }
+    p->actual_length += bytes;
+}
+
+void usb_packet_cleanup(USBPacket *p) {
+    assert(p->state != USB_PACKET_QUEUED && p->state != USB_PACKET_ASYNC);
+    free(p->iov.iov);
+    p->iov.iov = NULL;
+}
+
+static void mock_cancel_packet(USBPacket *p) {
+    bool callback = p->state == USB_PACKET_ASYNC;
+
+    assert(p->state == USB_PACKET_QUEUED || p->state == USB_PACKET_ASYNC);
+    p->state = USB_PACKET_CANCELED;
+    QTAILQ_REMOVE(&p->ep->queue, p, queue);
+    if (callback && USB_DEVICE_GET_CLASS(p->ep->dev)->cancel_packet) {
+        USB_DEVICE_GET_CLASS(p->ep->dev)->cancel_packet(p->ep->dev, p);
+    }
+}
+
+static void mock_process_one(USBPacket *p) {
+    p->status = USB_RET_SUCCESS;
+    USB_DEVICE_GET_CLASS(p->ep->dev)->handle_data(p->ep->dev, p);
+}
+
+static void mock_complete_one(USBDevice *dev, USBPacket *p) {
+    USBEndpoint *ep = p->ep;
+
+    assert(p->stream || QTAILQ_FIRST(&ep->queue) == p);
+    assert(p->status != USB_RET_ASYNC && p->status != USB_RET_NAK);
+    if (p->status != USB_RET_SUCCESS || (p->short_not_ok && p->actual_length < p->iov.size)) {
+        ep->halted = true;
+    }
+    p->state = USB_PACKET_COMPLETE;
+    QTAILQ_REMOVE(&ep->queue, p, queue);
+    dev->port->ops->complete(dev->port, p);
+}
+
+void usb_packet_complete(USBDevice *dev, USBPacket *p) {
+    USBEndpoint *ep = p->ep;
+
+    assert(p->state == USB_PACKET_ASYNC);
+    mock_complete_one(dev, p);
+    while (!QTAILQ_EMPTY(&ep->queue)) {
+        p = QTAILQ_FIRST(&ep->queue);
+        if (ep->halted) {
+            p->status = USB_RET_REMOVE_FROM_QUEUE;
+            dev->port->ops->complete(dev->port, p);
+            continue;
+        }
+        if (p->state == USB_PACKET_ASYNC) {
+            break;
+        }
+        assert(p->state == USB_PACKET_QUEUED);
+        mock_process_one(p);
+        if (p->status == USB_RET_ASYNC) {
+            p->state = USB_PACKET_ASYNC;
+            break;
+        }
+        mock_complete_one(ep->dev, p);
+    }
+}
+
+void usb_generic_async_ctrl_complete(USBDevice *s, USBPacket *p) {
+    usb_packet_complete(s, p);
+}
+
+/* No combining: each queued packet is handed over on its own */
+void usb_ep_combine_input_packets(USBEndpoint *ep) {
+    USBPacket *p, *next;
+
+    QTAILQ_FOREACH_SAFE(p, &ep->queue, queue, next) {
+        if (p->state != USB_PACKET_QUEUED) {
+            continue;
+        }
+        if (ep->halted) {
+            p->status = USB_RET_REMOVE_FROM_QUEUE;
+            ep->dev->port->ops->complete(ep->dev->port, p);
+            continue;
+        }
+        mock_process_one(p);
+        if (p->status == USB_RET_ASYNC) {
+            p->state = USB_PACKET_ASYNC;
+        } else {
+            mock_complete_one(ep->dev, p);
+        }
+    }
+}
+
+void usb_combined_input_packet_complete(USBDevice *dev, USBPacket *p) {
+    assert(!p->combined);
+    usb_packet_complete(dev, p);
+}
+
+void usb_wakeup(USBEndpoint *ep, unsigned int stream) {
+    USBDevice *dev = ep->dev;
+
+    if (dev->remote_wakeup && dev->port && dev->port->ops->wakeup) {
+        dev->port->ops->wakeup(dev->port);
+    }
+    mock_ep_wakeups++;
+}
+
+/* The controller side */
+
+static void mock_port_wakeup(USBPort *port) {
+    mock_port_wakeups++;
+}
+
+static void mock_port_complete(USBPort *port, USBPacket *p) {
+    if (p->status == USB_RET_REMOVE_FROM_QUEUE) {
+        mock_cancel_packet(p);
+    }
+}
+
+static USBPortOps mock_port_ops = {
+    .wakeup = mock_port_wakeup,
+    .complete = mock_port_complete,
+};
+
+/* usb_handle_packet() for a data endpoint */
+static void mock_handle_packet(USBDevice *dev, USBPacket *p) {
+    USBEndpoint *ep = p->ep;
+
+    if (!dev->attached) {
+        p->status = USB_RET_NODEV;
+        return;
+    }
+    assert(dev == ep->dev && p->state == USB_PACKET_SETUP);
+    if (ep->halted) {
+        assert(QTAILQ_EMPTY(&ep->queue));
+        ep->halted = false;
+    }
+    if (QTAILQ_EMPTY(&ep->queue) || ep->pipeline || p->stream) {
+        mock_process_one(p);
+        if (p->status == USB_RET_ASYNC) {
+            /* As in QEMU: controllers cannot take async isochronous or (device model) interrupt packets */
+            assert(ep->type != USB_ENDPOINT_XFER_ISOC && ep->type != USB_ENDPOINT_XFER_INT);
+            p->state = USB_PACKET_ASYNC;
+            QTAILQ_INSERT_TAIL(&ep->queue, p, queue);
+            return;
+        }
+        if (p->status != USB_RET_ADD_TO_QUEUE) {
+            assert(p->stream || !ep->pipeline || QTAILQ_EMPTY(&ep->queue));
+            if (p->status != USB_RET_NAK) {
+                p->state = USB_PACKET_COMPLETE;
+            }
+            return;
+        }
+    }
+    p->state = USB_PACKET_QUEUED;
+    QTAILQ_INSERT_TAIL(&ep->queue, p, queue);
+    p->status = USB_RET_ASYNC;
+}
+
+USBDevice *mock_device_new(const char *type, const char *const *props, Error **errp) {
+    static USBPort port = { .speedmask = USB_SPEED_MASK_LOW | USB_SPEED_MASK_FULL | USB_SPEED_MASK_HIGH |
+                                         USB_SPEED_MASK_SUPER,
+                            .ops = &mock_port_ops };
+    static int ndevs;
+    MockType *t = NULL;
+    USBDeviceClass *uc;
+    USBDevice *dev;
+    Object *obj;
+    Error *err = NULL;
+
+    for (int i = 0; i < MOCK_MAX_TYPES && mock_types[i].info; i++) {
+        if (!strcmp(mock_types[i].info->name, type)) {
+            t = &mock_types[i];
+        }
+    }
+    if (!t) {
+        error_setg(errp, "Unknown device type '%s'", type);
+        return NULL;
+    }
+    if (!t->klass) {
+        t->klass = calloc(1, sizeof(USBDeviceClass));
+        t->klass->type = t->info->name;
+        t->info->class_init(t->klass, NULL);
+    }
+    obj = calloc(1, t->info->instance_size);
+    obj->klass = t->klass;
+    for (size_t i = 0; i < t->klass->nqdev_props; i++) {
+        const Property *prop = &t->klass->qdev_props[i];
+        void *field = (uint8_t *)obj + prop->offset;
+
+        switch (prop->kind) {
+            case MOCK_PROP_BOOL:
+                *(bool *)field = prop->defval;
+                break;
+            case MOCK_PROP_UINT8:
+                *(uint8_t *)field = prop->defval;
+                break;
+            case MOCK_PROP_UINT32:
+                *(uint32_t *)field = prop->defval;
+                break;
+            default:
+                break;
+        }
+    }
+    if (t->info->instance_init) {
+        t->info->instance_init(obj);
+    }
+    dev = USB_DEVICE(obj);
+    uc = USB_DEVICE_GET_CLASS(dev);
+    if (asprintf(&dev->qdev.id, "dusb%d", ndevs++) < 0) {
+        abort();
+    }
+    for (int i = 0; props && props[i]; i++) {
+        const char *eq = strchr(props[i], '=');
+        char *name = eq ? strndup(props[i], eq - props[i]) : strdup(props[i]);
+        bool ok = mock_prop_set(dev, name, eq ? eq + 1 : "on", &err);
+
+        free(name);
+        if (!ok) {
+            goto fail;
+        }
+    }
+
+    usb_ep_init(dev);
+    dev->port = &port;
+    uc->realize(dev, &err);
+    if (err) {
+        goto fail;
+    }
+    dev->qdev.realized = true;
+    dev->attached = true;
+    if (uc->handle_attach) {
+        uc->handle_attach(dev);
+    }
+    if (uc->handle_reset) {
+        uc->handle_reset(dev);
+    }
+    dev->remote_wakeup = 0;
+    dev->addr = 0;
+    return dev;
+
+fail:
+    if (errp) {
+        *errp = err;
+    } else {
+        error_free(err);
+    }
+    free(dev->qdev.id);
+    free(dev);
+    return NULL;
+}
+
+void mock_device_free(USBDevice *dev) {
+    USBDeviceClass *uc = USB_DEVICE_GET_CLASS(dev);
+    ObjectClass *klass = OBJECT(dev)->klass;
+
+    dev->attached = false;
+    if (uc->unrealize) {
+        uc->unrealize(dev);
+    }
+    mock_thread_pool_poll();
+    for (size_t i = 0; i < klass->nqdev_props; i++) {
+        if (klass->qdev_props[i].kind == MOCK_PROP_STRING) {
+            free(*(char **)((uint8_t *)dev + klass->qdev_props[i].offset));
+        }
+    }
+    free(dev->qdev.id);
+    free(dev);
+}
+
+void mock_control_submit(USBDevice *dev, USBPacket *p, int request, int value, int index, int length,
+                         const uint8_t *data) {
+    assert(length >= 0 && length <= sizeof(dev->data_buf));
+    usb_packet_init(p);
+    usb_packet_setup(p, USB_TOKEN_SETUP, &dev->ep_ctl, 0, 0, false, false);
+    if (!(request >> 8 & USB_DIR_IN) && length) {
+        memcpy(dev->data_buf, data, length);
+    }
+    USB_DEVICE_GET_CLASS(dev)->handle_control(dev, p, request, value, index, length, dev->data_buf);
+    if (p->status == USB_RET_ASYNC) {
+        p->state = USB_PACKET_ASYNC;
+        QTAILQ_INSERT_TAIL(&dev->ep_ctl.queue, p, queue);
+    } else {
+        p->state = USB_PACKET_COMPLETE;
+    }
+}
+
+int mock_control(USBDevice *dev, int request, int value, int index, int length, uint8_t *data) {
+    USBPacket p;
+    int ret;
+
+    mock_control_submit(dev, &p, request, value, index, length, data);
+    while (p.state == USB_PACKET_ASYNC && mock_clock_step(INT64_MAX)) {
+    }
+    if (p.state == USB_PACKET_ASYNC) {
+        mock_cancel_packet(&p);
+        p.status = USB_RET_NAK;
+    }
+    ret = p.status == USB_RET_SUCCESS ? MIN(p.actual_length, length) : p.status;
+    if (ret > 0 && (request >> 8 & USB_DIR_IN)) {
+        memcpy(data, dev->data_buf, ret);
+    }
+    dev->ep_ctl.halted = false;
+    p.state = USB_PACKET_COMPLETE;
+    usb_packet_cleanup(&p);
+    return ret;
+}
+
+int mock_set_configuration(USBDevice *dev, int config) {
+    return mock_control(dev, DeviceOutRequest | USB_REQ_SET_CONFIGURATION, config, 0, 0, NULL);
+}
+
+int mock_set_interface(USBDevice *dev, int iface, int alt) {
+    return mock_control(dev, InterfaceOutRequest | USB_REQ_SET_INTERFACE, alt, iface, 0, NULL);
+}
+
+USBPacket *mock_packet_new(USBDevice *dev, int pid, int ep, void *buf, size_t len) {
+    USBPacket *p = malloc(sizeof(*p));
+
+    usb_packet_init(p);
+    usb_packet_setup(p, pid, usb_ep_get(dev, pid, ep), 0, 0, false, false);
+    usb_packet_addbuf(p, buf, len);
+    return p;
+}
+
+void mock_packet_submit(USBDevice *dev, USBPacket *p) {
+    static uint64_t id;
+    USBDeviceClass *uc = USB_DEVICE_GET_CLASS(dev);
+
+    p->id = ++id;
+    p->status = USB_RET_SUCCESS;
+    p->actual_length = 0;
+    p->state = USB_PACKET_SETUP;
+    mock_handle_packet(dev, p);
+    if (p->status == USB_RET_ASYNC && uc->flush_ep_queue) {
+        uc->flush_ep_queue(dev, p->ep);
+    }
+}
+
+bool mock_packet_pending(USBPacket *p) {
+    return p->state == USB_PACKET_ASYNC || p->state == USB_PACKET_QUEUED;
+}
+
+void mock_packet_cancel(USBPacket *p) {
+    if (mock_packet_pending(p)) {
+        mock_cancel_packet(p);
+        p->status = USB_RET_NAK;
+        p->actual_length = 0;
+    }
+}
+
+int mock_packet_run(USBDevice *dev, USBPacket *p, int64_t timeout_ns) {
+    int64_t deadline = mock_now + timeout_ns;
+
+    mock_packet_submit(dev, p);
+    while (mock_packet_pending(p) && mock_clock_step(deadline)) {
+    }
+    mock_packet_cancel(p);
+    return p->status;
+}
+
+void mock_packet_free(USBPacket *p) {
+    if (p) {
+        usb_packet_cleanup(p);
+        free(p);
+    }
+}
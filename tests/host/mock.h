@@ -0,0 +1,77 @@
+/*
+ * mock.h - the host harness's stand-in for QEMU around one USB device
+ *
+ * mock.c implements the QEMU and glib entry points dusb.c calls, plus the
+ * controller side declared here: it creates and realizes a device, issues
+ * control requests and data transfers the way the USB core does, and moves
+ * the fake virtual clock. Everything runs on one thread.
+ */
+#ifndef MOCK_H
+#define MOCK_H
+
+#include "qemu/osdep.h"
+#include "hw/usb.h"
+
+/* glib allocations made by the device, counted by the g_malloc family */
+extern uint64_t mock_allocs;
+extern uint64_t mock_alloc_bytes;
+
+/*
+ * Create, configure and realize a device of a registered type, attach it
+ * to a SuperSpeed port and reset it. props is a NULL-terminated list of
+ * "name=value" strings, qdev properties or writable QOM properties.
+ */
+USBDevice *mock_device_new(const char *type, const char *const *props, Error **errp);
+void mock_device_free(USBDevice *dev);
+
+/* QOM property access as qom-set / qom-get would do it; get returns a g_malloc'd string */
+bool mock_prop_set(USBDevice *dev, const char *name, const char *value, Error **errp);
+char *mock_prop_get(USBDevice *dev, const char *name, Error **errp);
+
+/*
+ * Run a control request with its data stage in data (wLength bytes).
+ * Deferred requests are waited for on the virtual clock. Returns the data
+ * stage length, or a negative USB_RET_* status.
+ */
+int mock_control(USBDevice *dev, int request, int value, int index, int length, uint8_t *data);
+int mock_set_configuration(USBDevice *dev, int config);
+/* Start a control request without waiting: p is left USB_PACKET_ASYNC if the device defers it */
+void mock_control_submit(USBDevice *dev, USBPacket *p, int request, int value, int index, int length,
+                         const uint8_t *data);
+int mock_set_interface(USBDevice *dev, int iface, int alt);
+
+/*
+ * A data transfer the harness owns, over a caller's buffer. mock_packet_run
+ * submits it like usb_handle_packet() and, if the device completes it
+ * asynchronously, runs the virtual clock until it completes or timeout_ns
+ * has passed, when it is cancelled. Returns the final USB_RET_* status;
+ * the packet's actual_length holds the bytes transferred.
+ */
+USBPacket *mock_packet_new(USBDevice *dev, int pid, int ep, void *buf, size_t len);
+int mock_packet_run(USBDevice *dev, USBPacket *p, int64_t timeout_ns);
+/* The steps of mock_packet_run, for transfers left in flight across a clock advance or migration */
+void mock_packet_submit(USBDevice *dev, USBPacket *p);
+bool mock_packet_pending(USBPacket *p);
+void mock_packet_cancel(USBPacket *p);
+void mock_packet_free(USBPacket *p);
+
+/* Endpoint wakeups (usb_wakeup) and port remote wakeups the device asked for */
+extern uint64_t mock_ep_wakeups;
+extern uint64_t mock_port_wakeups;
+
+/*
+ * Migration: save the device's vmsd into a malloc'd stream, and load one
+ * into a freshly created device of the same type and properties, as an
+ * incoming migration would. Load returns 0 or a negative errno.
+ */
+uint8_t *mock_vmstate_save(USBDevice *dev, size_t *len);
+int mock_vmstate_load(USBDevice *dev, const uint8_t *buf, size_t len);
+
+/* The fake QEMU_CLOCK_VIRTUAL */
+int64_t mock_clock_ns(void);
+/* Move the clock forward by ns, firing every timer that falls due on the way */
+void mock_clock_advance(int64_t ns);
+/* Run queued thread pool jobs and fire the earliest pending timer if it is due by limit; false if neither ran */
+bool mock_clock_step(int64_t limit);
+
+#endif
@@ -0,0 +1,749 @@
+/*
+ * Copyright (c) 2025 Darshan P. All rights reserved.
+ *
+ * This work is licensed under the terms of the MIT license.
+ * For a copy, see <https://opensource.org/licenses/MIT>.
+ */
+/**
+ * dusb-test: QTest throughput and latency suite for usb-dusb behind xHCI
+ *
+ * A small polled xHCI driver on top of libqos enumerates the device, selects
+ * the OUT and IN alternate settings and moves interrupt, isochronous and bulk
+ * traffic through the controller model, SuperSpeed bulk also on streams.
+ * Every run is made once per link speed. Each completion and payload is
+ * checked, then the host-side rate and the device's own stats counters are
+ * logged as test messages (visible with --tap or --verbose).
+ */
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/host-utils.h"
+#include "libqtest.h"
+#include "libqos/libqos-pc.h"
+#include "libqos/pci.h"
+#include "qapi/error.h"
+#include "qobject/qdict.h"
+#include "qobject/qjson.h"
+#include "qobject/qlist.h"
+
+/* Capability registers */
+#define XHCI_CAPLENGTH          0x00
+#define XHCI_HCSPARAMS1         0x04
+#define XHCI_HCCPARAMS1         0x10
+#define XHCI_DBOFF              0x14
+#define XHCI_RTSOFF             0x18
+
+/* Operational registers, relative to CAPLENGTH */
+#define XHCI_USBCMD             0x00
+#define XHCI_USBSTS             0x04
+#define XHCI_CRCR               0x18
+#define XHCI_DCBAAP             0x30
+#define XHCI_CONFIG             0x38
+#define XHCI_PORTSC(n)          (0x400 + 0x10 * ((n) - 1))
+
+/* Interrupter 0, relative to RTSOFF */
+#define XHCI_ERSTSZ             0x28
+#define XHCI_ERSTBA             0x30
+#define XHCI_ERDP               0x38
+
+#define USBCMD_RS               (1 << 0)
+#define USBCMD_HCRST            (1 << 1)
+#define USBSTS_HCH              (1 << 0)
+#define USBSTS_CNR              (1 << 11)
+#define HCCPARAMS1_CSZ          (1 << 2)
+#define PORTSC_CCS              (1 << 0)
+#define PORTSC_PED              (1 << 1)
+#define PORTSC_PR               (1 << 4)
+#define PORTSC_PP               (1 << 9)
+#define PORTSC_SPEED(v)         (((v) >> 10) & 0xf)
+#define ERDP_EHB                (1 << 3)
+
+/* Port speed IDs */
+#define XHCI_SPEED_FULL         1
+#define XHCI_SPEED_HIGH         3
+#define XHCI_SPEED_SUPER        4
+
+/* TRB types */
+#define TRB_NORMAL              1
+#define TRB_SETUP               2
+#define TRB_DATA                3
+#define TRB_STATUS              4
+#define TRB_ISOCH               5
+#define TRB_LINK                6
+#define TRB_ENABLE_SLOT         9
+#define TRB_ADDRESS_DEVICE      11
+#define TRB_CONFIGURE_EP        12
+#define TRB_EV_TRANSFER         32
+#define TRB_EV_COMMAND          33
+#define TRB_EV_PORT             34
+
+/* TRB control fields */
+#define TRB_C                   (1 << 0)
+#define TRB_LK_TC               (1 << 1)
+#define TRB_ISP                 (1 << 2)
+#define TRB_IOC                 (1 << 5)
+#define TRB_IDT                 (1 << 6)
+#define TRB_TRT_OUT             (2 << 16)
+#define TRB_TRT_IN              (3 << 16)
+#define TRB_DIR_IN              (1 << 16)
+#define TRB_SIA                 (1u << 31)
+#define TRB_TYPE(t)             ((t) << 10)
+#define TRB_GET_TYPE(c)         (((c) >> 10) & 0x3f)
+#define TRB_EV_EPID(c)          (((c) >> 16) & 0x1f)
+#define TRB_EV_SLOT(c)          ((c) >> 24)
+#define TRB_EV_CC(s)            ((s) >> 24)
+#define TRB_EV_RESIDUE(s)       ((s) & 0xffffff)
+
+#define CC_SUCCESS              1
+#define CC_SHORT_PACKET         13
+
+/* Endpoint context types */
+#define EP_CONTROL              4
+#define EP_IN                   4         /* Added to the transfer type for ISO/Bulk/Interrupt IN */
+#define EP_LSA                  (1 << 15)
+#define SCT_PRIMARY             (1 << 1)
+
+/* USB chapter 9 */
+#define USB_DIR_IN              0x80
+#define USB_XFER_ISOC           1
+#define USB_XFER_BULK           2
+#define USB_XFER_INT            3
+#define USB_REQ_GET_DESCRIPTOR  6
+#define USB_REQ_SET_CONFIG      9
+#define USB_REQ_GET_INTERFACE   10
+#define USB_REQ_SET_INTERFACE   11
+#define USB_DT_DEVICE           1
+#define USB_DT_CONFIG           2
+#define USB_DT_INTERFACE        4
+#define USB_DT_ENDPOINT         5
+#define USB_DT_SS_EP_COMP       0x30
+
+/* Device side, matching dusb.c */
+#define DUSB_VENDOR             0x0069
+#define DUSB_PRODUCT            0x0420
+#define DUSB_NUM_EPS            3
+#define DUSB_PATTERN_ZERO       1
+#define DUSB_HDR_LEN            16
+
+/* Driver sizing */
+#define RING_TRBS               256       /* One page per ring, the last TRB links back */
+#define EVENT_TRBS              256
+#define CTX_SIZE                (33 * 32) /* Input context: control, slot and 31 endpoints */
+#define UFRAME_NS               125000
+#define EVENT_TIMEOUT_UFRAMES   8000      /* One second of virtual time per event */
+#define TEST_BATCH              32        /* Must stay well below EVENT_TRBS */
+#define TEST_MAX_LEN            16384
+#define TEST_BULK_LEN           16384
+#define TEST_STREAMS            4         /* Stream IDs 1..4 */
+#define TEST_PSTREAMS           2         /* MaxPStreams: a linear array of 2 << 2 contexts */
+
+#define DCI(n, in)              ((n) * 2 + ((in) ? 1 : 0))
+
+typedef struct XHCITrb {
+    uint64_t param;
+    uint32_t status;
+    uint32_t control;
+} XHCITrb;
+
+typedef struct XHCIRing {
+    uint64_t addr;
+    uint32_t enq;
+    uint32_t cycle;
+} XHCIRing;
+
+/* Endpoint as described by the configuration descriptor */
+typedef struct DUSBTestEp {
+    uint8_t type;              /* USB_XFER_* */
+    uint16_t mps;              /* wMaxPacketSize, including the HS multiplier bits */
+    uint8_t interval;          /* bInterval */
+    uint8_t burst;             /* SuperSpeed companion bMaxBurst */
+    uint8_t max_streams;       /* Companion MaxStreams (log2 of the stream count), 0 = none */
+} DUSBTestEp;
+
+typedef struct DUSBTestSpeed {
+    const char *name;
+    const char *args;          /* Controller and device options */
+    int portsc_speed;          /* XHCI_SPEED_* the port must report */
+    uint16_t bcd_usb;          /* bcdUSB of the device descriptor at this speed */
+} DUSBTestSpeed;
+
+typedef struct DUSBTest {
+    const DUSBTestSpeed *speed;
+    QOSState *qs;
+    QTestState *qts;
+    QPCIDevice *pci;
+    QPCIBar bar;
+    uint32_t oper, rts, db;
+    int nports, port, slot;
+    XHCIRing cmd;
+    uint64_t events;
+    uint32_t evt_deq, evt_cycle;
+    uint64_t dcbaa, ictx, octx, ctrl_buf, data, stream_ctx;
+    XHCIRing ep_ring[32];      /* Indexed by DCI */
+    XHCIRing stream_ring[TEST_STREAMS + 1];
+    uint32_t enabled;          /* DCIs configured in the controller */
+    DUSBTestEp eps[2][DUSB_NUM_EPS + 1];
+    uint32_t out_seq[DUSB_NUM_EPS + 1];
+} DUSBTest;
+
+static uint32_t xhci_readl(DUSBTest *t, uint32_t off) {
+    return qpci_io_readl(t->pci, t->bar, off);
+}
+
+static void xhci_writel(DUSBTest *t, uint32_t off, uint32_t val) {
+    qpci_io_writel(t->pci, t->bar, off, val);
+}
+
+/* 64-bit registers take the low half first, the high half commits the write */
+static void xhci_writeq(DUSBTest *t, uint32_t off, uint64_t val) {
+    xhci_writel(t, off, val);
+    xhci_writel(t, off + 4, val >> 32);
+}
+
+static uint64_t dusb_alloc(DUSBTest *t, size_t size) {
+    uint64_t addr = guest_alloc(&t->qs->alloc, size);
+
+    qtest_memset(t->qts, addr, 0, size);
+    return addr;
+}
+
+static void trb_write(DUSBTest *t, uint64_t addr, uint64_t param, uint32_t status, uint32_t control) {
+    qtest_writeq(t->qts, addr, param);
+    qtest_writel(t->qts, addr + 8, status);
+    qtest_writel(t->qts, addr + 12, control);
+}
+
+/* Empty a ring, allocating it on first use */
+static void ring_reset(DUSBTest *t, XHCIRing *r) {
+    if (!r->addr) {
+        r->addr = dusb_alloc(t, RING_TRBS * 16);
+    } else {
+        qtest_memset(t->qts, r->addr, 0, RING_TRBS * 16);
+    }
+    r->enq = 0;
+    r->cycle = 1;
+}
+
+/* Queue one TRB and return its address; the link TRB at the end hands the cycle over */
+static uint64_t ring_push(DUSBTest *t, XHCIRing *r, uint64_t param, uint32_t status, uint32_t control) {
+    uint64_t addr = r->addr + r->enq * 16;
+
+    trb_write(t, addr, param, status, control | r->cycle);
+    if (++r->enq == RING_TRBS - 1) {
+        trb_write(t, r->addr + r->enq * 16, r->addr, 0, TRB_TYPE(TRB_LINK) | TRB_LK_TC | r->cycle);
+        r->enq = 0;
+        r->cycle ^= 1;
+    }
+    return addr;
+}
+
+/* Consume the next posted event, if any, and hand its slot back to the controller */
+static bool xhci_next_event(DUSBTest *t, XHCITrb *ev) {
+    uint64_t addr = t->events + t->evt_deq * 16;
+    uint32_t control = qtest_readl(t->qts, addr + 12);
+
+    if ((control & TRB_C) != t->evt_cycle) {
+        return false;
+    }
+    ev->param = qtest_readq(t->qts, addr);
+    ev->status = qtest_readl(t->qts, addr + 8);
+    ev->control = control;
+    if (++t->evt_deq == EVENT_TRBS) {
+        t->evt_deq = 0;
+        t->evt_cycle ^= 1;
+    }
+    xhci_writeq(t, t->rts + XHCI_ERDP, (t->events + t->evt_deq * 16) | ERDP_EHB);
+    return true;
+}
+
+/*
+ * Wait for the next command or transfer event. Port status changes are
+ * skipped. While nothing is posted the virtual clock moves one microframe,
+ * which runs the controller's periodic schedule and the device timers.
+ */
+static void xhci_wait_event(DUSBTest *t, XHCITrb *ev) {
+    for (int i = 0; i < EVENT_TIMEOUT_UFRAMES; i++) {
+        while (xhci_next_event(t, ev)) {
+            if (TRB_GET_TYPE(ev->control) != TRB_EV_PORT) {
+                return;
+            }
+        }
+        qtest_clock_step(t->qts, UFRAME_NS);
+    }
+    g_assert_not_reached();
+}
+
+static XHCITrb xhci_command(DUSBTest *t, uint64_t param, uint32_t control) {
+    uint64_t trb = ring_push(t, &t->cmd, param, 0, control);
+    XHCITrb ev;
+
+    xhci_writel(t, t->db, 0);
+    xhci_wait_event(t, &ev);
+    g_assert_cmpuint(TRB_GET_TYPE(ev.control), ==, TRB_EV_COMMAND);
+    g_assert_cmphex(ev.param, ==, trb);
+    g_assert_cmpuint(TRB_EV_CC(ev.status), ==, CC_SUCCESS);
+    return ev;
+}
+
+/* Reset the controller and bring it up with one command ring and one event ring segment */
+static void xhci_start(DUSBTest *t) {
+    uint32_t caplength;
+    uint64_t erst;
+
+    t->pci = qpci_device_find(t->qs->pcibus, QPCI_DEVFN(0x1d, 0));
+    g_assert(t->pci);
+    qpci_device_enable(t->pci);
+    t->bar = qpci_iomap(t->pci, 0, NULL);
+
+    caplength = xhci_readl(t, XHCI_CAPLENGTH) & 0xff;
+    t->nports = xhci_readl(t, XHCI_HCSPARAMS1) >> 24;
+    g_assert_cmpuint(xhci_readl(t, XHCI_HCCPARAMS1) & HCCPARAMS1_CSZ, ==, 0); /* 32-byte contexts */
+    t->oper = caplength;
+    t->rts = xhci_readl(t, XHCI_RTSOFF) & ~0x1f;
+    t->db = xhci_readl(t, XHCI_DBOFF) & ~0x3;
+
+    xhci_writel(t, t->oper + XHCI_USBCMD, USBCMD_HCRST);
+    g_assert_cmpuint(xhci_readl(t, t->oper + XHCI_USBCMD) & USBCMD_HCRST, ==, 0);
+    g_assert_cmpuint(xhci_readl(t, t->oper + XHCI_USBSTS) & USBSTS_CNR, ==, 0);
+
+    xhci_writel(t, t->oper + XHCI_CONFIG, 1);
+    t->dcbaa = dusb_alloc(t, 2 * 8);
+    xhci_writeq(t, t->oper + XHCI_DCBAAP, t->dcbaa);
+    ring_reset(t, &t->cmd);
+    xhci_writeq(t, t->oper + XHCI_CRCR, t->cmd.addr | 1);
+
+    t->events = dusb_alloc(t, EVENT_TRBS * 16);
+    erst = dusb_alloc(t, 16);
+    qtest_writeq(t->qts, erst, t->events);
+    qtest_writel(t->qts, erst + 8, EVENT_TRBS);
+    t->evt_deq = 0;
+    t->evt_cycle = 1;
+    xhci_writel(t, t->rts + XHCI_ERSTSZ, 1);
+    xhci_writeq(t, t->rts + XHCI_ERDP, t->events);
+    xhci_writeq(t, t->rts + XHCI_ERSTBA, erst);
+
+    xhci_writel(t, t->oper + XHCI_USBCMD, USBCMD_RS);
+    g_assert_cmpuint(xhci_readl(t, t->oper + XHCI_USBSTS) & USBSTS_HCH, ==, 0);
+}
+
+/* Find the port the device is connected to and reset it into the enabled state */
+static void xhci_reset_port(DUSBTest *t) {
+    uint32_t portsc;
+
+    for (int p = 1; p <= t->nports && !t->port; p++) {
+        if (xhci_readl(t, t->oper + XHCI_PORTSC(p)) & PORTSC_CCS) {
+            t->port = p;
+        }
+    }
+    g_assert_cmpint(t->port, >, 0);
+    xhci_writel(t, t->oper + XHCI_PORTSC(t->port), PORTSC_PP | PORTSC_PR);
+    portsc = xhci_readl(t, t->oper + XHCI_PORTSC(t->port));
+    g_assert(portsc & PORTSC_PED);
+    g_assert_cmpuint(PORTSC_SPEED(portsc), ==, t->speed->portsc_speed);
+}
+
+/* Slot context shared by Address Device and Configure Endpoint */
+static void ctx_write_slot(DUSBTest *t, int entries) {
+    qtest_writel(t->qts, t->ictx + 32, entries << 27 | t->speed->portsc_speed << 20);
+    qtest_writel(t->qts, t->ictx + 36, t->port << 16);
+}
+
+static void ctx_write_ep(DUSBTest *t, int dci, uint32_t dw0, uint32_t dw1, uint64_t dequeue, uint32_t dw4) {
+    uint64_t ctx = t->ictx + 32 * (dci + 1);
+
+    qtest_writel(t->qts, ctx, dw0);
+    qtest_writel(t->qts, ctx + 4, dw1);
+    qtest_writeq(t->qts, ctx + 8, dequeue);
+    qtest_writel(t->qts, ctx + 16, dw4);
+}
+
+static void xhci_address_device(DUSBTest *t) {
+    uint32_t mps0 = t->speed->portsc_speed == XHCI_SPEED_SUPER ? 512 : 64;
+    XHCITrb ev = xhci_command(t, 0, TRB_TYPE(TRB_ENABLE_SLOT));
+
+    t->slot = TRB_EV_SLOT(ev.control);
+    g_assert_cmpint(t->slot, ==, 1);
+    t->octx = dusb_alloc(t, CTX_SIZE);
+    t->ictx = dusb_alloc(t, CTX_SIZE);
+    qtest_writeq(t->qts, t->dcbaa + 8 * t->slot, t->octx);
+
+    ring_reset(t, &t->ep_ring[1]);
+    qtest_writel(t->qts, t->ictx + 4, 0x3);
+    ctx_write_slot(t, 1);
+    ctx_write_ep(t, 1, 0, 3 << 1 | EP_CONTROL << 3 | mps0 << 16, t->ep_ring[1].addr | 1, 8);
+    xhci_command(t, t->ictx, TRB_TYPE(TRB_ADDRESS_DEVICE) | t->slot << 24);
+}
+
+/* Run one control transfer on EP0, with the data stage going through ctrl_buf */
+static void dusb_control(DUSBTest *t, uint8_t type, uint8_t request, uint16_t value, uint16_t index, void *data,
+                         uint16_t length) {
+    XHCIRing *r = &t->ep_ring[1];
+    bool in = type & USB_DIR_IN;
+    uint64_t setup = type | (uint64_t)request << 8 | (uint64_t)value << 16 | (uint64_t)index << 32 |
+                     (uint64_t)length << 48;
+    XHCITrb ev;
+
+    ring_push(t, r, setup, 8, TRB_TYPE(TRB_SETUP) | TRB_IDT | (length ? (in ? TRB_TRT_IN : TRB_TRT_OUT) : 0));
+    if (length) {
+        if (!in) {
+            qtest_memwrite(t->qts, t->ctrl_buf, data, length);
+        }
+        ring_push(t, r, t->ctrl_buf, length, TRB_TYPE(TRB_DATA) | (in ? TRB_DIR_IN : 0));
+    }
+    ring_push(t, r, 0, 0, TRB_TYPE(TRB_STATUS) | TRB_IOC | (length && in ? 0 : TRB_DIR_IN));
+    xhci_writel(t, t->db + 4 * t->slot, 1);
+
+    xhci_wait_event(t, &ev);
+    g_assert_cmpuint(TRB_GET_TYPE(ev.control), ==, TRB_EV_TRANSFER);
+    g_assert_cmpuint(TRB_EV_EPID(ev.control), ==, 1);
+    g_assert(TRB_EV_CC(ev.status) == CC_SUCCESS || TRB_EV_CC(ev.status) == CC_SHORT_PACKET);
+    if (length && in) {
+        qtest_memread(t->qts, t->ctrl_buf, data, length);
+    }
+}
+
+/* Record the endpoints of interface 0 alts 0 and 1 from a configuration descriptor */
+static void dusb_parse_config(DUSBTest *t, const uint8_t *d, int len) {
+    DUSBTestEp *ep = NULL;
+    int alt = -1, alts = 0;
+
+    for (int i = 0; i + 2 <= len && d[i] >= 2; i += d[i]) {
+        switch (d[i + 1]) {
+            case USB_DT_INTERFACE:
+                alt = d[i + 2] == 0 ? d[i + 3] : -1;
+                alts += alt == 0 || alt == 1;
+                ep = NULL;
+                break;
+            case USB_DT_ENDPOINT:
+                ep = NULL;
+                if (alt == 0 || alt == 1) {
+                    int n = d[i + 2] & 0x0f;
+                    g_assert_cmpint(!!(d[i + 2] & USB_DIR_IN), ==, alt);
+                    g_assert_cmpint(n, >=, 1);
+                    g_assert_cmpint(n, <=, DUSB_NUM_EPS);
+                    ep = &t->eps[alt][n];
+                    ep->type = d[i + 3] & 3;
+                    ep->mps = lduw_le_p(d + i + 4);
+                    ep->interval = d[i + 6];
+                }
+                break;
+            case USB_DT_SS_EP_COMP:
+                if (ep) {
+                    ep->burst = d[i + 2];
+                    ep->max_streams = ep->type == USB_XFER_BULK ? d[i + 3] & 0x1f : 0;
+                }
+                break;
+        }
+    }
+    g_assert_cmpint(alts, ==, 2);
+    for (int in = 0; in < 2; in++) {
+        g_assert_cmpuint(t->eps[in][1].type, ==, USB_XFER_INT);
+        g_assert_cmpuint(t->eps[in][2].type, ==, USB_XFER_ISOC);
+        g_assert_cmpuint(t->eps[in][3].type, ==, USB_XFER_BULK);
+    }
+}
+
+/* Address the device, check its descriptors and select configuration 1 */
+static void dusb_enumerate(DUSBTest *t) {
+    uint8_t d[1024];
+    uint16_t total;
+
+    xhci_reset_port(t);
+    xhci_address_device(t);
+    t->ctrl_buf = dusb_alloc(t, sizeof(d));
+
+    dusb_control(t, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8, 0, d, 18);
+    g_assert_cmpuint(d[0], ==, 18);
+    g_assert_cmpuint(d[1], ==, USB_DT_DEVICE);
+    g_assert_cmphex(lduw_le_p(d + 2), ==, t->speed->bcd_usb);
+    g_assert_cmphex(lduw_le_p(d + 8), ==, DUSB_VENDOR);
+    g_assert_cmphex(lduw_le_p(d + 10), ==, DUSB_PRODUCT);
+
+    dusb_control(t, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, d, 9);
+    total = lduw_le_p(d + 2);
+    g_assert_cmpuint(total, <=, sizeof(d));
+    dusb_control(t, USB_DIR_IN, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIG << 8, 0, d, total);
+    dusb_parse_config(t, d, total);
+
+    dusb_control(t, 0x00, USB_REQ_SET_CONFIG, d[5], 0, NULL, 0);
+    g_test_message("%s: port %d, slot %d, %d-byte configuration", t->speed->name, t->port, t->slot, total);
+}
+
+/* xHCI Interval exponent in microframes for a periodic endpoint */
+static uint32_t dusb_ep_interval(DUSBTest *t, const DUSBTestEp *ep) {
+    if (ep->type == USB_XFER_BULK) {
+        return 0;
+    }
+    if (t->speed->portsc_speed != XHCI_SPEED_FULL) {
+        return ep->interval - 1;
+    }
+    /* Full speed counts frames: interrupt bInterval linearly, isochronous as 2^(bInterval-1) */
+    return 3 + (ep->type == USB_XFER_INT ? 31 - clz32(ep->interval) : ep->interval - 1);
+}
+
+/* Stream context array with one primary ring per stream ID */
+static uint64_t dusb_streams_init(DUSBTest *t) {
+    if (!t->stream_ctx) {
+        t->stream_ctx = dusb_alloc(t, 16 * (2 << TEST_PSTREAMS));
+    }
+    for (int s = 1; s <= TEST_STREAMS; s++) {
+        ring_reset(t, &t->stream_ring[s]);
+        qtest_writeq(t->qts, t->stream_ctx + 16 * s, t->stream_ring[s].addr | SCT_PRIMARY | 1);
+    }
+    return t->stream_ctx;
+}
+
+/*
+ * Configure the three endpoints of one direction in the controller, dropping
+ * those of the other direction. With streams, EP3 gets a stream array.
+ */
+static void dusb_configure_eps(DUSBTest *t, bool in, bool streams) {
+    uint32_t add = 1, drop = 0;
+
+    qtest_memset(t->qts, t->ictx, 0, CTX_SIZE);
+    for (int n = 1; n <= DUSB_NUM_EPS; n++) {
+        const DUSBTestEp *ep = &t->eps[in][n];
+        int dci = DCI(n, in);
+        bool periodic = ep->type != USB_XFER_BULK;
+        bool use_streams = streams && ep->type == USB_XFER_BULK;
+        uint32_t mps = ep->mps & 0x7ff;
+        uint32_t burst = t->speed->portsc_speed == XHCI_SPEED_SUPER ? ep->burst : (ep->mps >> 11) & 3;
+        uint32_t type = (in ? EP_IN : 0) + ep->type;
+        uint64_t dequeue;
+
+        add |= 1u << dci;
+        drop |= t->enabled & (1u << DCI(n, !in));
+        if (use_streams) {
+            g_assert_cmpuint(ep->max_streams, >, TEST_PSTREAMS);
+            dequeue = dusb_streams_init(t);
+        } else {
+            ring_reset(t, &t->ep_ring[dci]);
+            dequeue = t->ep_ring[dci].addr | 1;
+        }
+        ctx_write_ep(t, dci, dusb_ep_interval(t, ep) << 16 | (use_streams ? EP_LSA | TEST_PSTREAMS << 10 : 0),
+                     (ep->type == USB_XFER_ISOC ? 0 : 3 << 1) | type << 3 | burst << 8 | mps << 16, dequeue,
+                     mps | (periodic ? mps * (burst + 1) : 0) << 16);
+    }
+    qtest_writel(t->qts, t->ictx, drop);
+    qtest_writel(t->qts, t->ictx + 4, add);
+    ctx_write_slot(t, DCI(DUSB_NUM_EPS, true));
+    xhci_command(t, t->ictx, TRB_TYPE(TRB_CONFIGURE_EP) | t->slot << 24);
+    t->enabled = (t->enabled & ~drop) | (add & ~1u);
+}
+
+static void dusb_select_alt(DUSBTest *t, int alt, bool streams) {
+    uint8_t cur;
+
+    dusb_control(t, 0x01, USB_REQ_SET_INTERFACE, alt, 0, NULL, 0);
+    dusb_control(t, 0x81, USB_REQ_GET_INTERFACE, 0, 0, &cur, 1);
+    g_assert_cmpuint(cur, ==, alt);
+    dusb_configure_eps(t, alt == 1, streams);
+}
+
+static void dusb_set_ep(DUSBTest *t, int n, bool in, const char *field, int value) {
+    qtest_qmp_assert_success(t->qts,
+                             "{'execute': 'qom-set', 'arguments': {'path': 'dusb0', 'property': 'ep%d_%s_%s', "
+                             "'value': %d}}",
+                             n, in ? "in" : "out", field, value);
+}
+
+/* Parsed stats property */
+static QDict *dusb_stats(DUSBTest *t) {
+    QDict *rsp = qtest_qmp(t->qts, "{'execute': 'qom-get', 'arguments': {'path': 'dusb0', 'property': 'stats'}}");
+    QDict *stats;
+
+    g_assert(qdict_haskey(rsp, "return"));
+    stats = qobject_to(QDict, qobject_from_json(qdict_get_str(rsp, "return"), &error_abort));
+    qobject_unref(rsp);
+    g_assert(stats);
+    return stats;
+}
+
+static QDict *dusb_ep_stats(QDict *stats, int addr) {
+    QListEntry *entry;
+
+    QLIST_FOREACH_ENTRY(qdict_get_qlist(stats, "endpoints"), entry) {
+        QDict *ep = qobject_to(QDict, qlist_entry_obj(entry));
+        if (qdict_get_int(ep, "ep") == addr) {
+            return ep;
+        }
+    }
+    g_assert_not_reached();
+}
+
+/* Fill in the payload header the device expects for the next OUT sequence number */
+static void dusb_prepare_out(DUSBTest *t, int n, uint64_t buf) {
+    uint8_t hdr[DUSB_HDR_LEN] = {n, DUSB_PATTERN_ZERO};
+
+    stl_le_p(hdr + 4, t->out_seq[n]++);
+    qtest_memwrite(t->qts, buf, hdr, sizeof(hdr));
+}
+
+/* Check a batch of IN payloads: right header, consecutive sequence numbers, zero body */
+static void dusb_check_in(DUSBTest *t, int n, uint32_t len, int count, bool *first, uint32_t *seq) {
+    uint8_t *body = g_malloc(len);
+
+    for (int j = 0; j < count; j++) {
+        uint8_t hdr[DUSB_HDR_LEN];
+
+        qtest_memread(t->qts, t->data + j * len, hdr, sizeof(hdr));
+        g_assert_cmphex(hdr[0], ==, USB_DIR_IN | n);
+        g_assert_cmpuint(hdr[1], ==, DUSB_PATTERN_ZERO);
+        if (*first) {
+            *seq = ldl_le_p(hdr + 4);
+            *first = false;
+        }
+        g_assert_cmpuint(ldl_le_p(hdr + 4), ==, (*seq)++);
+    }
+    qtest_memread(t->qts, t->data, body, len);
+    for (uint32_t i = DUSB_HDR_LEN; i < len; i++) {
+        g_assert_cmpuint(body[i], ==, 0);
+    }
+    g_free(body);
+}
+
+/*
+ * Move count transfers of len bytes on EP n in batches, spreading each batch
+ * over the stream IDs in order when streams is set. Every completion and
+ * payload is checked, then the device counters must account for exactly the
+ * transfers made. A batch of one measures the per-packet round trip.
+ */
+static void dusb_run(DUSBTest *t, const char *kind, int n, bool in, uint32_t len, int count, int batch,
+                     bool streams) {
+    int dci = DCI(n, in);
+    int addr = (in ? USB_DIR_IN : 0) | n;
+    uint64_t td[TEST_BATCH];
+    int64_t busy_us = 1, worst_us = 0;
+    bool first = true;
+    uint32_t seq = 0;
+    QDict *stats, *ep, *lat;
+
+    g_assert_cmpint(batch, <=, TEST_BATCH);
+    g_assert_cmpint(len, <=, TEST_MAX_LEN);
+    g_assert_cmpint(count % batch, ==, 0);
+    g_assert(!streams || batch % TEST_STREAMS == 0);
+
+    dusb_set_ep(t, n, in, "interval_us", 0);
+    dusb_set_ep(t, n, in, "pattern", DUSB_PATTERN_ZERO);
+    if (in) {
+        dusb_set_ep(t, n, in, "size", len);
+    }
+    qtest_memset(t->qts, t->data, 0, (size_t)batch * len);
+    qtest_qmp_assert_success(t->qts, "{'execute': 'qom-set', 'arguments': {'path': 'dusb0', "
+                                     "'property': 'reset_stats', 'value': true}}");
+
+    for (int done = 0; done < count; done += batch) {
+        int64_t start = g_get_monotonic_time();
+        uint32_t control = TRB_IOC;
+
+        if (in) {
+            control |= TRB_ISP;
+        }
+        if (t->eps[in][n].type == USB_XFER_ISOC) {
+            control |= TRB_TYPE(TRB_ISOCH) | TRB_SIA;
+        } else {
+            control |= TRB_TYPE(TRB_NORMAL);
+        }
+        for (int j = 0; j < batch; j++) {
+            XHCIRing *r = streams ? &t->stream_ring[1 + j * TEST_STREAMS / batch] : &t->ep_ring[dci];
+            uint64_t buf = t->data + j * len;
+
+            if (in) {
+                qtest_memset(t->qts, buf, 0xff, DUSB_HDR_LEN);
+            } else {
+                dusb_prepare_out(t, n, buf);
+            }
+            td[j] = ring_push(t, r, buf, len, control);
+        }
+        /* Each ring is drained in doorbell order, so completions follow the queue order */
+        for (int s = streams ? 1 : 0; s <= (streams ? TEST_STREAMS : 0); s++) {
+            xhci_writel(t, t->db + 4 * t->slot, dci | s << 16);
+        }
+        for (int j = 0; j < batch; j++) {
+            XHCITrb ev;
+
+            xhci_wait_event(t, &ev);
+            g_assert_cmpuint(TRB_GET_TYPE(ev.control), ==, TRB_EV_TRANSFER);
+            g_assert_cmpuint(TRB_EV_EPID(ev.control), ==, dci);
+            g_assert_cmpuint(TRB_EV_CC(ev.status), ==, CC_SUCCESS);
+            g_assert_cmpuint(TRB_EV_RESIDUE(ev.status), ==, 0);
+            g_assert_cmphex(ev.param, ==, td[j]);
+        }
+        start = g_get_monotonic_time() - start;
+        busy_us += start;
+        worst_us = MAX(worst_us, start);
+        if (in) {
+            dusb_check_in(t, n, len, batch, &first, &seq);
+        }
+    }
+
+    stats = dusb_stats(t);
+    ep = dusb_ep_stats(stats, addr);
+    lat = qdict_get_qdict(ep, "latency_ns");
+    g_assert_cmpint(qdict_get_int(ep, "packets"), ==, count);
+    g_assert_cmpint(qdict_get_int(ep, "bytes"), ==, (int64_t)count * len);
+    g_assert_cmpint(qdict_get_int(ep, "errors"), ==, 0);
+    g_assert_cmpint(qdict_get_int(ep, "lost"), ==, 0);
+    g_test_message("%s %s EP 0x%02x: %d x %u B, batch %d: host %.0f B/s, %.0f packets/s, %.1f us/batch "
+                   "(worst %" PRId64 "); device %" PRId64 " B/s, %" PRId64 " packets/s, latency p50 %" PRId64
+                   " p99 %" PRId64 " max %" PRId64 " ns",
+                   t->speed->name, kind, addr, count, len, batch, (double)count * len * G_USEC_PER_SEC / busy_us,
+                   (double)count * G_USEC_PER_SEC / busy_us, (double)busy_us * batch / count, worst_us,
+                   qdict_get_int(ep, "bytes_per_sec"), qdict_get_int(ep, "packets_per_sec"),
+                   qdict_get_int(lat, "p50"), qdict_get_int(lat, "p99"), qdict_get_int(lat, "max"));
+    qobject_unref(stats);
+}
+
+/* All traffic of one alternate setting */
+static void dusb_run_alt(DUSBTest *t, int alt) {
+    bool in = alt == 1;
+    uint32_t int_len = MIN(t->eps[in][1].mps & 0x7ff, 1024);
+    uint32_t iso_len = MIN(t->eps[in][2].mps & 0x7ff, 1024);
+
+    dusb_select_alt(t, alt, false);
+    dusb_run(t, "interrupt", 1, in, int_len, 128, TEST_BATCH, false);
+    dusb_run(t, "isochronous", 2, in, iso_len, 128, TEST_BATCH, false);
+    dusb_run(t, "bulk", 3, in, TEST_BULK_LEN, 256, TEST_BATCH, false);
+    dusb_run(t, "bulk", 3, in, TEST_BULK_LEN, 64, 1, false);
+    if (t->eps[in][3].max_streams) {
+        dusb_configure_eps(t, in, true);
+        dusb_run(t, "bulk-streams", 3, in, TEST_BULK_LEN, 256, TEST_BATCH, true);
+    }
+}
+
+static void test_speed(const void *opaque) {
+    DUSBTest t = {.speed = opaque};
+
+    t.qs = qtest_pc_boot("%s -device usb-dusb,id=dusb0,bus=xhci.0", t.speed->args);
+    t.qts = t.qs->qts;
+    xhci_start(&t);
+    dusb_enumerate(&t);
+    t.data = dusb_alloc(&t, TEST_BATCH * TEST_MAX_LEN);
+    if (t.speed->portsc_speed == XHCI_SPEED_SUPER) {
+        g_assert_cmpuint(t.eps[1][3].max_streams, >, 0);
+    }
+    dusb_run_alt(&t, 0);
+    dusb_run_alt(&t, 1);
+    g_free(t.pci);
+    qtest_shutdown(t.qs);
+}
+
+/*
+ * Ports of qemu-xhci offer every speed, so the device runs SuperSpeed there;
+ * without USB 3 ports it falls back to high speed. Full speed needs the
+ * device locked to it with speed=full.
+ */
+static const DUSBTestSpeed dusb_speeds[] = {
+    {"super", "-device qemu-xhci,id=xhci,addr=1d.0", XHCI_SPEED_SUPER, 0x0300},
+    {"high", "-device qemu-xhci,id=xhci,addr=1d.0,p3=0", XHCI_SPEED_HIGH, 0x0200},
+    {"full", "-device qemu-xhci,id=xhci,addr=1d.0 -global usb-dusb.speed=full", XHCI_SPEED_FULL, 0x0110},
+};
+
+int main(int argc, char **argv) {
+    g_test_init(&argc, &argv, NULL);
+    for (int i = 0; i < ARRAY_SIZE(dusb_speeds); i++) {
+        char *path = g_strdup_printf("/dusb/xhci/%s", dusb_speeds[i].name);
+        qtest_add_data_func(path, &dusb_speeds[i], test_speed);
+        g_free(path);
+    }
+    return g_test_run();
+}